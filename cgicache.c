@@ -0,0 +1,260 @@
+/* cgicache.c
+ *
+ * CGI output kept a few seconds in the cache the forked children
+ * share, so a busy script runs once a while instead of once a request
+ *
+ * interface:
+ *     CCserve( prog, fd, host, rp, ttl, stale )
+ *                                   reply to this GET of prog (open on
+ *                                   fd, see exec_cgi()) from the
+ *                                   cache, or run prog, send what it
+ *                                   writes, and keep that for ttl
+ *                                   seconds, and stale more. 1 if the
+ *                                   reply is dealt with, 0 if the
+ *                                   caller is to run prog as usual
+ *
+ * details:
+ *      Entries live in shmcache.c (SMput()), keyed by vhost id, the
+ *      script's path, '?' and QUERY_STRING. The script is handed no
+ *      request header but what picked the vhost, Host:, so nothing
+ *      else can change what it writes. Only GETs take part.
+ *
+ *      The script writes to a pipe instead of the socket. What comes
+ *      out is sent on as it comes and copied aside; it is kept if the
+ *      script exits 0 having written at most CC_MAXOUT bytes. How long
+ *      comes from the headers the script wrote: no-store, no-cache,
+ *      private or a Set-Cookie: keep nothing; s-maxage, else max-age,
+ *      else Expires give the time, at most ttl; none of them: ttl.
+ *      stale-while-revalidate lowers the stale time. Output not kept
+ *      is stored as a pass for ttl seconds, so the requests after it
+ *      run the script at once rather than queue for a fill.
+ *
+ *      A stale hit is sent as it is. The child that can claim the key
+ *      (SMclaim()) then closes the connection and runs the script
+ *      again to refresh the entry. On a miss the child with the claim
+ *      runs the script; the rest look again every CC_POLL ms until
+ *      the entry shows up or the claim is let go, so a crowd on one
+ *      URL runs it once. The looks again are not counted as misses.
+ *      With no room in the claim table a miss runs the script anyway,
+ *      and a stale hit leaves the refresh to a later request.
+ */
+
+#define     _GNU_SOURCE             /* strptime(), timegm() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <unistd.h>
+#include    <signal.h>
+#include    <time.h>
+#include    <sys/types.h>
+#include    <sys/wait.h>
+#include    <sys/socket.h>
+#include    "reply.h"
+#include    "shmcache.h"
+#include    "wsng.h"
+#include    "cgicache.h"
+
+#define CC_MAXOUT   (1L << 20)      /* bytes of output kept, at most */
+#define CC_POLL     10              /* ms between looks, waiting */
+#define CC_LINE     512             /* header line read, at most */
+
+static int      refill(char *, int, unsigned, char *, struct reply *, int,
+                       int);
+static int      lifetime(char *, long, int, int *);
+static int      cache_control(char *, int *, int *, int *);
+
+int
+CCserve(char *prog, int fd, unsigned host, struct reply *rp, int ttl, int stale)
+{
+    char    *method = getenv("REQUEST_METHOD");
+    char    *query = getenv("QUERY_STRING");
+    char    key[MAX_RQ_LEN + LINELEN];
+    struct smhit *hit;
+    struct timespec pause = { 0, CC_POLL * 1000000L };
+
+    if ( method == NULL || strcmp(method, "GET") != 0
+      || snprintf(key, sizeof(key), "%s?%s", prog, query ? query : "")
+         >= (int) sizeof(key) )
+        return 0;
+
+    hit = SMlookup(host, key);
+    while ( hit == NULL )
+    {
+        if ( SMclaim(host, key) != 0 )  /* ours, or nobody's to wait on */
+            return refill(prog, fd, host, key, rp, ttl, stale);
+        nanosleep(&pause, NULL);    /* another child is running it */
+        hit = SMpeek(host, key);    /* one miss was enough */
+    }
+    if ( hit->data == NULL )
+    {                               /* a pass */
+        free(hit);
+        return 0;
+    }
+    header(rp, 200, "OK", NULL);    /* the copy lasts until we exit */
+    RPref(rp, hit->data, hit->len);
+    if ( hit->stale && SMclaim(host, key) == 1 )
+    {
+        RPflush(rp);
+        shutdown(rp->fd, SHUT_RDWR);    /* the client is done with us */
+        refill(prog, fd, host, key, NULL, ttl, stale);
+    }
+    return 1;
+}
+
+/*
+ * with key claimed: run prog, open on fd, sending its output to rp if
+ * not NULL, and store it. Returns 0 if prog could not be started
+ */
+static int
+refill(char *prog, int fd, unsigned host, char *key, struct reply *rp,
+       int ttl, int stale)
+{
+    extern char **environ;
+    char    buf[BUFSIZ], *out = NULL, *bigger, *argv[2];
+    long    len = 0, cap = 0;
+    int     p[2], status, keep = 1, life;
+    ssize_t n;
+    pid_t   pid;
+
+    signal(SIGCHLD, SIG_DFL);       /* the parent's reaper is not ours */
+    if ( pipe(p) == -1 )
+    {
+        SMunclaim(host, key);
+        return 0;
+    }
+    if ( (pid = fork()) == -1 )
+    {
+        close(p[0]);
+        close(p[1]);
+        SMunclaim(host, key);
+        return 0;
+    }
+    if ( pid == 0 )
+    {
+        close(p[0]);
+        dup2(p[1], 1);
+        dup2(p[1], 2);
+        argv[0] = prog;
+        argv[1] = NULL;
+        exec_cgi(fd, argv, environ);
+        perror(prog);
+        _exit(1);
+    }
+    close(p[1]);
+
+    if ( rp != NULL )
+    {
+        header(rp, 200, "OK", NULL);
+        if ( RPflush(rp) != 0 )
+            rp = NULL;              /* gone; still worth keeping */
+    }
+    while ( (n = read(p[0], buf, sizeof(buf))) > 0 )
+    {
+        if ( rp != NULL )
+        {
+            RPadd(rp, buf, n);
+            if ( RPflush(rp) != 0 )
+                rp = NULL;
+        }
+        if ( keep && len + n > CC_MAXOUT )
+            keep = 0;
+        else if ( keep && len + n > cap )
+        {
+            cap = cap ? cap * 2 : sizeof(buf) * 4;
+            if ( cap > CC_MAXOUT )
+                cap = CC_MAXOUT;
+            if ( (bigger = realloc(out, cap)) == NULL )
+                keep = 0;
+            out = bigger ? bigger : out;
+        }
+        if ( keep )
+        {
+            memcpy(out + len, buf, n);
+            len += n;
+        }
+    }
+    close(p[0]);
+
+    if ( waitpid(pid, &status, 0) == -1 || ! WIFEXITED(status)
+      || WEXITSTATUS(status) != 0 )
+        SMunclaim(host, key);       /* failed: let the next one try */
+    else if ( keep && (life = lifetime(out, len, ttl, &stale)) > 0 )
+        SMput(host, key, "", out, len, life, stale);
+    else
+        SMput(host, key, "", NULL, 0, ttl, 0);
+    free(out);
+    return 1;
+}
+
+/*
+ * seconds the output may be kept, from its headers: 0 not at all,
+ * else at most ttl. *stalep is lowered if it says to
+ */
+static int
+lifetime(char *out, long len, int ttl, int *stalep)
+{
+    char    line[CC_LINE], *p = out, *end = out + len, *eol;
+    int     age = -1, sage = -1, n;
+    long    expires = -1;
+    struct tm tm;
+
+    for ( ; p < end && (eol = memchr(p, '\n', end - p)) != NULL ; p = eol + 1 )
+    {
+        n = eol - p;
+        if ( n > 0 && p[n - 1] == '\r' )
+            n--;
+        if ( n == 0 )               /* end of the headers */
+        {
+            if ( sage >= 0 )
+                age = sage;
+            else if ( age < 0 && expires >= 0 )
+                age = expires - time(NULL) > 0 ? expires - time(NULL) : 0;
+            return age >= 0 && age < ttl ? age : ttl;
+        }
+        if ( n >= CC_LINE )
+            n = CC_LINE - 1;
+        memcpy(line, p, n);
+        line[n] = '\0';
+        if ( strncasecmp(line, "Set-Cookie:", 11) == 0 )
+            return 0;
+        if ( strncasecmp(line, "Cache-Control:", 14) == 0
+          && cache_control(line + 14, &age, &sage, stalep) != 0 )
+            return 0;
+        if ( strncasecmp(line, "Expires:", 8) == 0 )
+        {
+            memset(&tm, 0, sizeof(tm));
+            expires = strptime(line + 8 + strspn(line + 8, " \t"),
+                               "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL
+                      ? timegm(&tm) : 0;    /* bad dates are past */
+        }
+    }
+    return 0;                       /* no end to the headers */
+}
+
+/*
+ * the directives in one Cache-Control value; 1 if it says not to keep
+ */
+static int
+cache_control(char *v, int *agep, int *sagep, int *stalep)
+{
+    char    *tok, *save;
+    int     n;
+
+    for ( tok = strtok_r(v, ", \t", &save) ; tok != NULL
+        ; tok = strtok_r(NULL, ", \t", &save) )
+    {
+        if ( strcasecmp(tok, "no-store") == 0
+          || strncasecmp(tok, "no-cache", 8) == 0
+          || strncasecmp(tok, "private", 7) == 0 )
+            return 1;
+        if ( sscanf(tok, "max-age=%d", &n) == 1 )
+            *agep = n < 0 ? 0 : n;
+        else if ( sscanf(tok, "s-maxage=%d", &n) == 1 )
+            *sagep = n < 0 ? 0 : n;
+        else if ( sscanf(tok, "stale-while-revalidate=%d", &n) == 1
+               && n >= 0 && n < *stalep )
+            *stalep = n;
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef CGICACHE_H
+#define CGICACHE_H
+/*
+ * header for cgicache.c package
+ */
+
+struct reply;
+
+int     CCserve(char *, int, unsigned, struct reply *, int, int);
+
+#endif
@@ -0,0 +1,147 @@
+/* child.c
+ *
+ * the table of request-handling children the server has forked
+ *
+ * interface:
+ *     CHadd( pid, addr, data )  remember pid, serving client addr,
+ *                           with a pointer for the caller,
+ *                           0 ok, 1 no room
+ *     CHremove( pid, &addr, &data ) forget pid (safe in the SIGCHLD
+ *                           handler); returns 1 and its client addr
+ *                           and data if it was ours, else 0
+ *     CHcount()             returns how many are still running
+ *     CHsignal_all( sig )   send sig to every one of them, and to
+ *                           anything they started (see below)
+ *
+ * details:
+ *      An open-addressing hash on the pid, with linear probing.
+ *      CHremove() is called from the SIGCHLD handler, so it never
+ *      allocates or frees: a removal shifts later entries of the same
+ *      run back instead of leaving a tombstone. The handler can only
+ *      run while main() waits in ppoll(), so it never sees the table
+ *      half way through a CHadd().
+ *
+ *      The table doubles when it is half full; that happens in
+ *      CHadd(), in the main loop.
+ *
+ *      Each child leads its own process group, so CHsignal_all()
+ *      signals the group: a CGI's own children go too, and do not
+ *      keep the client's socket open after the request is stopped.
+ */
+
+#include    <stdlib.h>
+#include    <signal.h>
+#include    <sys/types.h>
+#include    "child.h"
+
+#define INITIAL_SLOTS   256
+
+struct chslot {
+    pid_t           pid;            /* 0 is an empty slot   */
+    unsigned        addr;           /* client it is serving */
+    void            *data;          /* caller's, eg. its timer */
+};
+
+static struct chslot *slots = NULL;
+static unsigned nslots = 0;
+static unsigned nused = 0;
+
+static unsigned find_slot(struct chslot *, unsigned, pid_t);
+static int      grow(void);
+
+int
+CHadd(pid_t pid, unsigned addr, void *data)
+{
+    unsigned    i;
+
+    if ( nused * 2 >= nslots && grow() != 0 )
+        return 1;
+    i = find_slot(slots, nslots, pid);
+    slots[i].pid  = pid;
+    slots[i].addr = addr;
+    slots[i].data = data;
+    __atomic_add_fetch(&nused, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+CHremove(pid_t pid, unsigned *addrp, void **datap)
+{
+    unsigned    i, j, home;
+
+    if ( nslots == 0 )
+        return 0;
+    i = find_slot(slots, nslots, pid);
+    if ( slots[i].pid != pid )
+        return 0;                   /* not ours, eg. an upgrade */
+    *addrp = slots[i].addr;
+    *datap = slots[i].data;
+
+    /* close the gap: pull back any later entry whose home */
+    /* slot is at or before the hole                       */
+    slots[i].pid = 0;
+    __atomic_sub_fetch(&nused, 1, __ATOMIC_RELAXED);
+    for ( j = (i + 1) & (nslots - 1) ; slots[j].pid != 0 ;
+          j = (j + 1) & (nslots - 1) )
+    {
+        home = ((unsigned) slots[j].pid * 2654435761u) & (nslots - 1);
+        if ( ((j - home) & (nslots - 1)) >= ((j - i) & (nslots - 1)) )
+        {
+            slots[i] = slots[j];
+            slots[j].pid = 0;
+            i = j;
+        }
+    }
+    return 1;
+}
+
+int
+CHcount()
+/*
+ * the count alone may be read from any thread; the table is the
+ * main thread's
+ */
+{
+    return __atomic_load_n(&nused, __ATOMIC_RELAXED);
+}
+
+void
+CHsignal_all(int sig)
+{
+    unsigned    i;
+
+    for ( i = 0 ; i < nslots ; i++ )
+        if ( slots[i].pid != 0 )
+            kill(-slots[i].pid, sig);
+}
+
+/*
+ * returns the slot holding pid, or the empty slot where it would go
+ */
+static unsigned
+find_slot(struct chslot *tab, unsigned n, pid_t pid)
+{
+    unsigned i = ((unsigned) pid * 2654435761u) & (n - 1);
+
+    while ( tab[i].pid != 0 && tab[i].pid != pid )
+        i = (i + 1) & (n - 1);
+    return i;
+}
+
+static int
+grow()
+{
+    unsigned    newn = nslots ? nslots * 2 : INITIAL_SLOTS;
+    struct chslot *newtab = calloc(newn, sizeof(struct chslot));
+    unsigned    i;
+
+    if ( newtab == NULL )
+        return 1;
+    for ( i = 0 ; i < nslots ; i++ )
+        if ( slots[i].pid != 0 )
+            newtab[find_slot(newtab, newn, slots[i].pid)] = slots[i];
+    free(slots);
+    slots  = newtab;
+    nslots = newn;
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef CHILD_H
+#define CHILD_H
+/*
+ * header for child.c package
+ */
+
+#include    <sys/types.h>
+
+int     CHadd(pid_t, unsigned, void *);
+int     CHremove(pid_t, unsigned *, void **);
+int     CHcount();
+void    CHsignal_all(int);
+
+#endif
@@ -0,0 +1,200 @@
+/* config.c
+ *
+ * the settings read from wsng.conf, kept as immutable snapshots
+ *
+ * interface:
+ *     CFnew( file )         returns an empty snapshot for file, or NULL
+ *     CFcurrent()           returns the snapshot new requests should
+ *                           use, with a reference held on it
+ *     CFrelease( c )        drops a reference; the last one frees c
+ *     CFinstall( c )        makes c current (c's reference is handed
+ *                           over) and drops the old current snapshot
+ *                           once no reader can still be picking it up
+ *     CFreader()            the calling thread will use CFcurrent();
+ *                           returns its slot, or -1 if there is none
+ *     CFquiet( slot )       the reader in slot is between requests
+ *     CFoffline( slot )     it will not use CFcurrent() until its next
+ *                           CFquiet(); call before a long sleep
+ *     CFreclaim()           drop the old snapshots that are safe now
+ *     CFhold( c )           take another reference on c
+ *     CFretire()            returns a new epoch, to stamp something
+ *                           other readers can no longer reach
+ *     CFgrace()             returns the oldest epoch any reader may
+ *                           still be in; what was stamped with it or
+ *                           an older one is safe to free
+ *
+ * details:
+ *      A snapshot is never changed once it is installed. Reloading
+ *      the config builds a whole new one and swaps the pointer, so a
+ *      request keeps whatever snapshot it started with while new
+ *      requests see the new one. The old one goes away when its last
+ *      reference is dropped.
+ *
+ *      In the forking server only the parent holds references: a
+ *      child has its own copy of the snapshot from the moment of the
+ *      fork, so the old one can be freed as soon as it is swapped out.
+ *
+ *      Event loop threads call CFcurrent() while the main thread may
+ *      be swapping the pointer. Taking a reference is a load and an
+ *      atomic add, and the snapshot must not be freed between the
+ *      two. Rather than lock every reader, the swapped-out snapshot
+ *      is put on a retired list, stamped with a new epoch number. Each
+ *      reader thread registers (CFreader()) and, at the top of its
+ *      loop, notes the epoch it has seen (CFquiet()); a thread about
+ *      to sleep marks itself offline. A retired snapshot is dropped
+ *      once every reader has seen its epoch or is offline: none of
+ *      them can still be in the middle of a CFcurrent() that found
+ *      it. This is quiescent-state reclamation; the readers never
+ *      write anything shared but their own slot. CFinstall() and
+ *      CFreclaim() are for the main thread only.
+ *
+ *      Other shared tables read by the loops (fcache.c) use the same
+ *      reader slots: CFretire() stamps what they unlink, and CFgrace()
+ *      says when it is safe to free.
+ */
+
+#include    <stdlib.h>
+#include    <string.h>
+#include    "vhost.h"
+#include    "proxy.h"
+#include    "config.h"
+
+#define CF_READERS  64
+#define CF_OFFLINE  (~0UL)
+
+static struct config *current = NULL;
+static struct config *retired = NULL;   /* swapped out, still referenced */
+static unsigned long epoch = 1;
+static unsigned long seen[CF_READERS];  /* epoch each reader last saw */
+static int      nreaders = 0;
+
+struct config *
+CFnew(char *file)
+{
+    struct config *c = calloc(1, sizeof(struct config));
+
+    if ( c == NULL )
+        return NULL;
+    if ( (c->file = strdup(file)) == NULL || (c->hosts = VHtable()) == NULL )
+    {
+        free(c->file);
+        free(c);
+        return NULL;
+    }
+    c->refs = 1;
+    return c;
+}
+
+struct config *
+CFcurrent()
+{
+    struct config *c = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+
+    if ( c != NULL )
+        __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQUIRE);
+    return c;
+}
+
+void
+CFrelease(struct config *c)
+{
+    if ( c == NULL || __atomic_sub_fetch(&c->refs, 1, __ATOMIC_RELEASE) > 0 )
+        return;
+    VHfree(c->hosts);
+    PXfree_groups(c->upstreams);
+    free(c->tls_cert);
+    free(c->tls_key);
+    free(c->tls_ciphers);
+    free(c->tls_suites);
+    free(c->access_log);
+    free(c->slow_log);
+    free(c->cpus);
+    free(c->preload);
+    free(c->preload_log);
+    free(c->file);
+    free(c);
+}
+
+void
+CFhold(struct config *c)
+{
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+CFinstall(struct config *c)
+{
+    struct config *old = current;
+
+    __atomic_store_n(&current, c, __ATOMIC_SEQ_CST);
+    if ( old == NULL )
+        return;
+    old->retired = CFretire();
+    old->nextretired = retired;
+    retired = old;
+    CFreclaim();
+}
+
+int
+CFreader()
+{
+    int     slot = __atomic_fetch_add(&nreaders, 1, __ATOMIC_SEQ_CST);
+
+    if ( slot >= CF_READERS )
+        return -1;
+    CFquiet(slot);
+    return slot;
+}
+
+void
+CFquiet(int slot)
+{
+    if ( slot >= 0 )
+        __atomic_store_n(&seen[slot], __atomic_load_n(&epoch, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+}
+
+void
+CFoffline(int slot)
+{
+    if ( slot >= 0 )
+        __atomic_store_n(&seen[slot], CF_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+void
+CFreclaim()
+{
+    struct config **cp, *c;
+    unsigned long oldest = CFgrace();
+
+    for ( cp = &retired ; (c = *cp) != NULL ; )
+    {
+        if ( c->retired <= oldest )
+        {
+            *cp = c->nextretired;
+            CFrelease(c);
+        }
+        else
+            cp = &c->nextretired;
+    }
+}
+
+unsigned long
+CFretire()
+{
+    return __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+unsigned long
+CFgrace()
+{
+    unsigned long oldest = CF_OFFLINE, e;
+    int     i, n = __atomic_load_n(&nreaders, __ATOMIC_SEQ_CST);
+
+    if ( n > CF_READERS )
+        n = CF_READERS;
+    for ( i = 0 ; i < n ; i++ )
+        if ( (e = __atomic_load_n(&seen[i], __ATOMIC_SEQ_CST)) < oldest )
+            oldest = e;
+    return oldest;
+}
@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+/*
+ * header for config.c package
+ */
+
+struct vhtable;
+struct pxgroup;
+
+struct config {
+    char            *file;          /* where it was read from   */
+    int             port;
+    int             index_cache;    /* dircache slots           */
+    long            shm_cache;      /* shmcache.c bytes, 0 = off */
+    int             cgi_ttl;        /* cgicache.c seconds, 0 = off */
+    int             cgi_stale;      /* and then sent stale for  */
+    int             drain_timeout;  /* seconds, on SIGTERM      */
+    int             max_conns;      /* children at once, 0 = no limit */
+    int             max_per_ip;     /* per client, 0 = no limit */
+    int             rate_limit;     /* requests/sec per client  */
+    int             rate_burst;     /* bucket size, 0 = rate    */
+    int             header_timeout; /* seconds to read request  */
+    int             send_timeout;   /* seconds a send may stall */
+    int             request_timeout; /* seconds for it all, 0 = none */
+    int             events;         /* 1: event loop, 0: fork each call */
+    int             fs_threads;     /* event loop's filesystem threads */
+    int             fs_queue;       /* their queue limit        */
+    int             loop_threads;   /* event loops, each a thread */
+    int             h2_streams;     /* per HTTP/2 connection, 0 = off */
+    int             tls_port;       /* HTTPS listener, 0 = none */
+    char            *tls_cert;      /* PEM chain, and key if no  */
+    char            *tls_key;       /*   tls_key                */
+    char            *tls_ciphers;   /* TLS 1.2 list, NULL = default */
+    char            *tls_suites;    /* TLS 1.3 list, NULL = default */
+    int             tls_cache;      /* shared sessions, 0 = off */
+    int             tls_tickets;    /* 1: resume by ticket too  */
+    struct pxgroup  *upstreams;     /* servers for proxy_pass   */
+    int             proxy_keepalive; /* idle ones kept per server */
+    int             proxy_fails;    /* failures in a row, then down */
+    int             proxy_fail_time; /* seconds it stays down    */
+    int             proxy_connect;  /* seconds to connect       */
+    char            *access_log;    /* a line per request, NULL = none */
+    char            *slow_log;      /* the slow ones, NULL = none */
+    int             slow_ms;        /* slow: this long or more  */
+    int             *cpus;          /* cpu_affinity, NULL = any */
+    int             ncpus;
+    int             cpu_steer;      /* 1: a socket per loop, by CPU */
+    int             busy_poll;      /* us, SO_BUSY_POLL; 0 = off */
+    char            *preload;       /* manifest to warm, NULL = none */
+    char            *preload_log;   /* log to rank, NULL = access_log */
+    int             preload_top;    /* warm its top N, 0 = none */
+    struct vhtable  *hosts;         /* vhosts, types, indexes   */
+    int             refs;           /* holders, see config.c    */
+    unsigned long   retired;        /* epoch it was swapped out */
+    struct config   *nextretired;
+};
+
+struct config   *CFnew(char *);
+struct config   *CFcurrent();
+void            CFrelease(struct config *);
+void            CFinstall(struct config *);
+int             CFreader(void);
+void            CFquiet(int);
+void            CFoffline(int);
+void            CFreclaim(void);
+void            CFhold(struct config *);
+unsigned long   CFretire(void);
+unsigned long   CFgrace(void);
+
+#endif
@@ -0,0 +1,262 @@
+/* cpu.c
+ *
+ * where the server runs: workers pinned to CPUs, their memory on
+ * those CPUs' NUMA nodes, calls steered to the CPU that took them,
+ * and busy polling
+ *
+ * interface:
+ *     CPparse( conf, list )     conf's cpu_affinity: "auto" (the CPUs
+ *                               we may run on now), or CPU numbers and
+ *                               ranges, "0-3,8"; 0 ok, -1 (said why)
+ *     CPpin( conf, i )          run the calling thread on the i'th of
+ *                               conf's CPUs (mod their number), with
+ *                               its memory from that CPU's node;
+ *                               returns the CPU, or -1 for no list
+ *     CPpin_all( conf )         let the calling thread, and what it
+ *                               starts, run on any of conf's CPUs
+ *     CPincoming( fd, conf )    in a forked child: run on the CPU that
+ *                               took fd's packets if it is one of
+ *                               conf's; returns it, or -1
+ *     CPsteer( socks, n, conf ) make a SO_REUSEPORT group, socks[0..n-1]
+ *                               in the order they joined it, send each
+ *                               call to socks[i] when loop i's CPU took
+ *                               it; 0 ok, -1 (said why)
+ *     CPbusy_poll( fd, us )     busy poll fd for up to us microseconds
+ *                               before sleeping; a listening socket's
+ *                               setting passes to what it accepts
+ *     CPepoll( epfd, us )       the same for an epoll set, where the
+ *                               kernel headers know how
+ *     CPnode( cpu )             returns cpu's NUMA node, or -1
+ *
+ * details:
+ *      On a machine with more than one socket, a loop thread that the
+ *      scheduler moves, or one on the far node from the NIC queue that
+ *      took its calls, pays for remote memory and for the cache lines
+ *      of every connection crossing over. "cpu_affinity" names the
+ *      CPUs to use. Loop i runs on the i'th of them, the fs threads
+ *      and CGIs on any of them. A forked child moves to the CPU that
+ *      took its connection's packets (SO_INCOMING_CPU), if that is one
+ *      of them, so the reply is made where the request came in.
+ *
+ *      A pinned thread asks for MPOL_LOCAL memory before it allocates
+ *      anything, so its connections and buffers are on its own node
+ *      however wsng was started (numactl --interleave, say); what it
+ *      touches first is then local. The caches all the loops share
+ *      (fcache.c, dircache.c, shmcache.c) stay where they are.
+ *
+ *      With "cpu_steer on", each loop listens on its own SO_REUSEPORT
+ *      socket, and a classic BPF program on the group picks the socket
+ *      by the CPU the SYN came in on: a jump table from each loop's
+ *      CPU to its socket, and the CPU mod n for the rest. Loop i's
+ *      socket is the i'th to join the group, so the sockets must be
+ *      made, and handed to a new binary, in order. Each socket also
+ *      gets SO_INCOMING_CPU, which since Linux 6.1 does the same
+ *      without the program, should attaching it fail.
+ *
+ *      "busy_poll US" sets SO_BUSY_POLL (and SO_PREFER_BUSY_POLL) on
+ *      the listening sockets, for their connections to inherit, and
+ *      the epoll sets' busy poll time where the kernel headers have
+ *      EPIOCSPARAMS (6.9). Raising SO_BUSY_POLL takes CAP_NET_ADMIN;
+ *      without it we say so once and go on without.
+ */
+
+#define     _GNU_SOURCE             /* sched_setaffinity() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <unistd.h>
+#include    <sched.h>
+#include    <dirent.h>
+#include    <sys/socket.h>
+#include    <sys/syscall.h>
+#include    <sys/ioctl.h>
+#include    <linux/filter.h>
+#include    <linux/mempolicy.h>
+#include    <linux/eventpoll.h>
+#include    "config.h"
+#include    "cpu.h"
+
+static void     pin(cpu_set_t *);
+
+int
+CPparse(struct config *conf, char *list)
+{
+    cpu_set_t set;
+    char    *p = list, *end;
+    long    lo, hi, i;
+    int     n = 0;
+
+    CPU_ZERO(&set);
+    if ( strcasecmp(list, "auto") == 0 )
+        sched_getaffinity(0, sizeof(set), &set);
+    else
+        while ( *p != '\0' )
+        {
+            lo = hi = strtol(p, &end, 10);
+            if ( end != p && *end == '-' )
+                hi = strtol(p = end + 1, &end, 10);
+            if ( end == p || lo < 0 || hi < lo || hi >= CP_MAX
+              || (*end != ',' && *end != '\0') )
+            {
+                fprintf(stderr, "cpu_affinity: bad list %s\n", list);
+                return -1;
+            }
+            for ( i = lo ; i <= hi ; i++ )
+                CPU_SET(i, &set);
+            p = *end == ',' ? end + 1 : end;
+        }
+    free(conf->cpus);
+    if ( (conf->cpus = malloc(CPU_COUNT(&set) * sizeof(int))) == NULL )
+        return -1;
+    for ( i = 0 ; i < CP_MAX ; i++ )
+        if ( CPU_ISSET(i, &set) )
+            conf->cpus[n++] = i;
+    conf->ncpus = n;
+    return 0;
+}
+
+int
+CPpin(struct config *conf, int i)
+{
+    cpu_set_t set;
+    int     cpu;
+
+    if ( conf->ncpus == 0 )
+        return -1;
+    cpu = conf->cpus[i % conf->ncpus];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pin(&set);
+    return cpu;
+}
+
+void
+CPpin_all(struct config *conf)
+{
+    cpu_set_t set;
+    int     i;
+
+    if ( conf->ncpus == 0 )
+        return;
+    CPU_ZERO(&set);
+    for ( i = 0 ; i < conf->ncpus ; i++ )
+        CPU_SET(conf->cpus[i], &set);
+    if ( sched_setaffinity(0, sizeof(set), &set) == -1 )
+        perror("cpu_affinity");
+}
+
+int
+CPincoming(int fd, struct config *conf)
+{
+    socklen_t len = sizeof(int);
+    int     cpu, i;
+
+    if ( conf->ncpus == 0
+      || getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 )
+        return -1;
+    for ( i = 0 ; i < conf->ncpus ; i++ )
+        if ( conf->cpus[i] == cpu )
+            return CPpin(conf, i);
+    return -1;
+}
+
+int
+CPsteer(int *socks, int n, struct config *conf)
+{
+    struct sock_filter code[2 * CP_MAX + 3];
+    struct sock_fprog prog;
+    int     i, k = 0, cpu;
+
+    if ( conf->ncpus < n )
+    {
+        fprintf(stderr, "cpu_steer: %d loops but %d CPUs in cpu_affinity\n",
+                n, conf->ncpus);
+        return -1;
+    }
+    code[k++] = (struct sock_filter)
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for ( i = 0 ; i < n ; i++ )
+    {
+        cpu = conf->cpus[i];
+        setsockopt(socks[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        code[k++] = (struct sock_filter)
+                    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1);
+        code[k++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[k++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[k++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+    prog.len = k;
+    prog.filter = code;
+    if ( setsockopt(socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                    sizeof(prog)) == -1 )
+    {
+        perror("cpu_steer");
+        return -1;
+    }
+    return 0;
+}
+
+void
+CPbusy_poll(int fd, int us)
+{
+    static int said = 0;
+    int     on = 1;
+
+    if ( us <= 0 )
+        return;
+    if ( setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1 )
+    {
+        if ( ! said++ )
+            perror("busy_poll");
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+}
+
+void
+CPepoll(int epfd, int us)
+{
+#ifdef EPIOCSPARAMS
+    struct epoll_params ep;
+
+    if ( us <= 0 )
+        return;
+    memset(&ep, 0, sizeof(ep));
+    ep.busy_poll_usecs = us;
+    ep.busy_poll_budget = 8;        /* the kernel's own default */
+    ep.prefer_busy_poll = 1;
+    if ( ioctl(epfd, EPIOCSPARAMS, &ep) == -1 )
+        perror("busy_poll: epoll");
+#endif
+}
+
+int
+CPnode(int cpu)
+{
+    char    dir[64];
+    struct dirent *d;
+    DIR     *dp;
+    int     node = -1;
+
+    snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ( cpu < 0 || (dp = opendir(dir)) == NULL )
+        return -1;
+    while ( node == -1 && (d = readdir(dp)) != NULL )
+        if ( strncmp(d->d_name, "node", 4) == 0 )
+            node = atoi(d->d_name + 4);
+    closedir(dp);
+    return node;
+}
+
+/*
+ * run the calling thread on set, with its memory from the local node
+ */
+static void
+pin(cpu_set_t *set)
+{
+    if ( sched_setaffinity(0, sizeof(cpu_set_t), set) == -1 )
+        perror("cpu_affinity");
+    else if ( syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 )
+        perror("cpu_affinity: set_mempolicy");
+}
@@ -0,0 +1,20 @@
+#ifndef CPU_H
+#define CPU_H
+/*
+ * header for cpu.c package
+ */
+
+#define CP_MAX      1024            /* CPU numbers below this   */
+
+struct config;
+
+int     CPparse(struct config *, char *);
+int     CPpin(struct config *, int);
+void    CPpin_all(struct config *);
+int     CPincoming(int, struct config *);
+int     CPsteer(int *, int, struct config *);
+void    CPbusy_poll(int, int);
+void    CPepoll(int, int);
+int     CPnode(int);
+
+#endif
@@ -0,0 +1,137 @@
+/* dircache.c
+ *
+ * remembers, per directory, which index name (if any) do_dir() found
+ *
+ * interface:
+ *     DCinit( nslots )              make the table, 0 ok, 1 no
+ *     DClookup( info, id, &which )  returns 1 and sets which on a hit
+ *     DCstore( info, id, which )    record the probe result
+ *
+ * details:
+ *      The table lives in a MAP_SHARED anonymous mapping made before
+ *      the server forks, so every child sees (and fills) the same
+ *      table and a result found once is reused by later requests.
+ *
+ *      A slot is keyed by the directory's device and inode plus the
+ *      id of the index list that was probed; "which" is the position
+ *      in that list that opened, or -1 for no index at all. The
+ *      directory's mtime is stored with it: adding, removing or
+ *      renaming an entry changes the mtime, so a stale slot simply
+ *      stops matching.
+ *
+ *      A directory modified less than a second ago is not stored.
+ *      Timestamps come from a coarse clock, so a second change in the
+ *      same tick would leave the mtime unchanged and the slot wrong.
+ *
+ *      The table is direct-mapped. Each slot has a sequence number
+ *      that is odd while a child is writing it; readers that see an
+ *      odd or changed number treat it as a miss, and a writer that
+ *      finds the slot busy just skips the store.
+ */
+
+#include    <stdio.h>
+#include    <time.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    "dircache.h"
+
+struct dcslot {
+    unsigned        seq;            /* odd while being written  */
+    unsigned        id;             /* index list that was probed */
+    dev_t           dev;
+    ino_t           ino;
+    time_t          mtime;
+    long            mtime_ns;
+    int             which;          /* list position, -1 for none */
+};
+
+static struct dcslot *table = NULL;
+static unsigned     nslots = 0;
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x,v)  __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static struct dcslot *slot_for(struct stat *, unsigned);
+
+int
+DCinit(int n)
+/*
+ * n == 0 leaves the cache off; every lookup then misses
+ */
+{
+    if ( n <= 0 )
+        return 0;
+    table = mmap(NULL, n * sizeof(struct dcslot), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if ( table == MAP_FAILED )
+    {
+        table = NULL;
+        return 1;
+    }
+    nslots = n;
+    return 0;
+}
+
+int
+DClookup(struct stat *info, unsigned id, int *whichp)
+{
+    struct dcslot *sp = slot_for(info, id);
+    unsigned    seq;
+    int         hit;
+
+    if ( sp == NULL )
+        return 0;
+
+    seq = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE);
+    if ( seq & 1 )
+        return 0;                   /* being written */
+
+    hit = seq != 0
+       && LOAD(sp->id) == id
+       && LOAD(sp->dev) == info->st_dev
+       && LOAD(sp->ino) == info->st_ino
+       && LOAD(sp->mtime) == info->st_mtim.tv_sec
+       && LOAD(sp->mtime_ns) == info->st_mtim.tv_nsec;
+    *whichp = LOAD(sp->which);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return hit && __atomic_load_n(&sp->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void
+DCstore(struct stat *info, unsigned id, int which)
+{
+    struct dcslot *sp = slot_for(info, id);
+    unsigned    seq;
+
+    if ( sp == NULL || time(NULL) - info->st_mtim.tv_sec < 1 )
+        return;                     /* off, or too new to trust */
+
+    seq = __atomic_load_n(&sp->seq, __ATOMIC_RELAXED);
+    if ( (seq & 1) || ! __atomic_compare_exchange_n(&sp->seq, &seq, seq + 1,
+                          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+        return;                     /* someone else is writing it */
+
+    STORE(sp->id, id);
+    STORE(sp->dev, info->st_dev);
+    STORE(sp->ino, info->st_ino);
+    STORE(sp->mtime, info->st_mtim.tv_sec);
+    STORE(sp->mtime_ns, info->st_mtim.tv_nsec);
+    STORE(sp->which, which);
+
+    __atomic_store_n(&sp->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static struct dcslot *
+slot_for(struct stat *info, unsigned id)
+{
+    unsigned long h;
+
+    if ( table == NULL )
+        return NULL;
+    h = (unsigned long) info->st_ino * 0x9E3779B97F4A7C15UL;
+    h ^= (unsigned long) info->st_dev + id;
+    h ^= h >> 29;
+    return &table[h % nslots];
+}
@@ -0,0 +1,13 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+/*
+ * header for dircache.c package
+ */
+
+struct stat;
+
+int     DCinit(int);
+int     DClookup(struct stat *, unsigned, int *);
+void    DCstore(struct stat *, unsigned, int);
+
+#endif
@@ -0,0 +1,1174 @@
+/* events.c
+ *
+ * the event loop server: one process serves many connections, with
+ * blocking filesystem work done by the threads in tpool.c
+ *
+ * interface:
+ *     EVnew( sock, pool, wheel )    returns a loop accepting on sock,
+ *                                   or NULL. pool may be NULL, and
+ *                                   the loop's deadlines go on wheel
+ *     EVwait( ev, mask, ms )        wait (with signal mask mask) at most
+ *                                   ms, -1 for no limit, then handle
+ *                                   whatever is ready
+ *     EVsockets( ev, socks, n )     accept from now on on socks, loop i
+ *                                   on socks[i % n]; n 0 stops accepting,
+ *                                   for a drain
+ *     EVcount( ev )                 returns the open connections
+ *     EVthreads( ev, n, tick )      run n loops in all: start n-1 more,
+ *                                   each on its own thread with its own
+ *                                   tick ms timer wheel, sharing ev's
+ *                                   socket and pool; returns how many
+ *                                   loops there are
+ *     EVstats( ev, fp )             print per-loop figures
+ *
+ * details:
+ *      Each connection is a small state machine driven by epoll (edge
+ *      triggered) and by jobs coming back from the pool:
+ *
+ *        C_READ   read until the blank line ends the headers; the
+ *                 request line and Host: are parsed here
+ *        C_OPEN   a TP_OPEN job opens and fstat()s the item, and for a
+ *                 directory probes the index names, off the loop. An
+ *                 item found in the file cache (fcache.c) skips this,
+ *                 and so does one another connection is opening
+ *        C_FILE   the file is mapped and sent a window at a time; a
+ *                 TP_FILL job faults in the next window while this
+ *                 one is sent, so the loop never waits on the disk
+ *        C_LIST   TP_SCAN jobs make the listing a buffer at a time
+ *                 (listing.c), each after the last one has been sent
+ *        C_SEND   just the queued reply (error pages) is left to send
+ *
+ *      The reply is sent with RPflush() on a non-blocking socket; when
+ *      it would block the connection waits for EPOLLOUT. A connection
+ *      with a job out is not touched by the loop, except that a fill
+ *      job (which only reads the mapping) lets sending go on.
+ *
+ *      A CGI is forked with the socket as its stdout (spawn_cgi() in
+ *      wsng.c) and the loop forgets the connection; from then on it is
+ *      a child like any in the forking server. With a log on, the
+ *      child copies the CGI's output from a pipe and logs the request
+ *      itself, bytes and all. A request under a
+ *      proxy_pass prefix goes the same way (spawn_proxy()), with what
+ *      was read past its head as the start of its body.
+ *
+ *      header_timeout runs from accept to the end of the headers, and
+ *      gets a 408; request_timeout runs from there to the last byte.
+ *      A connection closed while a job is out is only shut down; it
+ *      is freed when the job comes back. Freed connections wait on a
+ *      list until the end of the EVwait() round, since later events in
+ *      the same round may still name them.
+ *
+ *      A popular file that is not in the file cache yet (or has
+ *      just changed) draws many misses at once. Only the first starts
+ *      an open job: it goes in fills[], a table of the open jobs out
+ *      by vhost and item, and the misses after it, on any loop, wait
+ *      on its list. When the job is back, each of them is sent back
+ *      to its own loop with what was found: a hold on the cache entry,
+ *      or a dup() of the file for one too big to cache, or the 404.
+ *      Only a listing is opened again, since the directory stream
+ *      cannot be shared.
+ *
+ *      The per-connection limits (max_conns, ratelimit.c) are the same
+ *      as in the forking server, with open connections counting as
+ *      children.
+ *
+ *      With loop_threads, the loop that EVnew() made stays in the
+ *      main thread, where the signals are taken, and the others run
+ *      on threads of their own. All of them poll the one listening
+ *      socket with EPOLLEXCLUSIVE, so a new call wakes one loop, and
+ *      the connection stays with the loop that accepted it. Each loop
+ *      has its own epoll set, timer wheel and completion queue; only
+ *      the fs pool is shared. With cpu_affinity each loop runs on a
+ *      CPU of its own (cpu.c), pinned before its thread allocates
+ *      anything, and with cpu_steer each has its own socket of a
+ *      SO_REUSEPORT group, which the kernel picks by the CPU the call
+ *      came in on.
+ *
+ *      A listing is both disk work (getdents64 and an fstatat per
+ *      entry) and CPU work (rendering the rows). The disk part is a
+ *      TP_SCAN job for the pool, as ever. With more than one loop the
+ *      rendering is split off (LSload() on the pool, then EV_ROWS
+ *      jobs) and goes on the loop's own deque in sched.c, so a big
+ *      listing cannot hold up the other connections on its loop. A
+ *      loop runs a few of its jobs per round, between its other
+ *      connections' events, and a loop with nothing to do steals
+ *      jobs from the busy ones. With one loop the pool does both.
+ *
+ *      Everything a loop thread reads that is shared is read-only or
+ *      lock-free on the read side: the config snapshot (with its
+ *      vhosts and content types) is reclaimed in config.c only after
+ *      every loop has passed a quiet point; the index cache is a
+ *      seqlock; the file cache is read without locks and reclaimed
+ *      like the configs; other mappings are per thread (filemap.c).
+ *      The per-client
+ *      table in ratelimit.c has a lock. The child table and the
+ *      children's timers belong to the main thread, so a CGI found by
+ *      another loop is passed to the main loop to be started, and then
+ *      back to close the connection.
+ */
+
+#define     _GNU_SOURCE             /* accept4() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/socket.h>
+#include    <sys/epoll.h>
+#include    <netinet/in.h>
+#include    "rootfs.h"
+#include    "vhost.h"
+#include    "config.h"
+#include    "child.h"
+#include    "ratelimit.h"
+#include    "timerwheel.h"
+#include    "filemap.h"
+#include    "fcache.h"
+#include    "reply.h"
+#include    "listing.h"
+#include    "tpool.h"
+#include    "sched.h"
+#include    "scan.h"
+#include    "wsng.h"
+#include    "events.h"
+#include    "h2.h"
+#include    "proxy.h"
+#include    "trace.h"
+#include    "cpu.h"
+
+#define EV_MAXEVENTS 64
+#define EV_RUN      4               /* own deque jobs per round */
+#define EV_STEAL    4               /* jobs taken per wakeup    */
+#define EV_FILLS    256             /* chains in fills[]        */
+#define EV_ROWS     TP_NOPS         /* job op: deque, not pool  */
+
+enum { C_READ, C_OPEN, C_FILE, C_LIST, C_SEND, C_CLOSED };
+enum { K_404, K_403, K_FILE, K_LIST, K_CGI, K_PROXY, K_AGAIN };
+
+struct evloop {
+    int             epfd;
+    int             sock;           /* -1 when not accepting    */
+    struct tpool    *pool;          /* NULL: do the work inline */
+    struct tpqueue  *done;          /* our finished jobs        */
+    struct twheel   *wheel;
+    int             nconns;
+    struct conn     *closed;        /* to free after this round */
+
+    int             id;             /* deque number in sched    */
+    struct sched    *sched;         /* NULL: just the one loop  */
+    int             reader;         /* CFreader() slot, or -1   */
+    struct evloop   *main;          /* NULL for the main loop   */
+    struct evloop   *next;          /* the other loops, from main */
+    struct tpjob    ctl;            /* socket changes from main */
+    int             newsock;
+    int             asked, acked;
+    unsigned long   hits;           /* items found in fcache.c  */
+    unsigned long   joined;         /* items another conn opened */
+    unsigned long   timeouts;       /* conns closed by conn_expired */
+    int             cpu;            /* it runs on, or -1: any   */
+    int             node;           /* the cpu's NUMA node      */
+};
+
+struct conn {
+    int             fd;
+    unsigned        addr;
+    int             state;
+    int             busy;           /* a job is out             */
+    struct evloop   *ev;
+    struct config   *conf;
+    struct vhost    *vh;
+    struct twtimer  timer;
+    struct tpjob    job;
+
+    char            in[MAX_RQ_LEN]; /* the request as it arrives */
+    int             inlen;
+    int             readlen;        /* with any body after the head */
+    char            method[8];
+    char            item[MAX_RQ_LEN];
+    char            *query;         /* in item, or NULL         */
+    struct pxroute  *route;         /* K_PROXY: where it goes   */
+
+    int             kind;           /* what the open job found  */
+    int             ffd;
+    struct stat     info;
+    char            *name;          /* for the Content-Type     */
+
+    struct reply    rp;
+    struct trace    tr;             /* its phases, for the log  */
+    struct fmap     *map;
+    struct fcentry  *fc;            /* the map is the cache's   */
+    size_t          off;            /* queued up to here        */
+    size_t          filled;         /* faulted in up to here    */
+    size_t          filling;        /* the fill job runs to here */
+    int             bad_fill;
+    struct listing  *ls;
+    int             more;
+    struct conn     *nextclosed;
+    int             leading;        /* our open job is in fills[] */
+    struct conn     *waiters;       /* for it, from any loop    */
+    struct conn     *nextfill;      /* in fills[] or waiters    */
+};
+
+static char listen_tag, done_tag, steal_tag;    /* epoll data for the non-conns */
+static int  nopen = 0;              /* connections, all loops   */
+static struct conn *fills[EV_FILLS];    /* open jobs out, by item */
+static pthread_mutex_t fills_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void     accept_calls(struct evloop *);
+static void     conn_event(struct conn *, unsigned);
+static void     read_input(struct conn *);
+static void     parse_request(struct conn *);
+static void     advance(struct conn *);
+static void     start_reply(struct conn *);
+static void     start_job(struct conn *, int, void (*)(struct tpjob *));
+static void     job_done(struct tpjob *);
+static void     open_work(struct tpjob *);
+static void     open_item(struct conn *);
+static struct conn **fill_chain(struct conn *);
+static int      join_open(struct conn *);
+static void     end_open(struct conn *);
+static void     open_shared(struct tpjob *);
+static void     fill_work(struct tpjob *);
+static void     scan_work(struct tpjob *);
+static void     load_work(struct tpjob *);
+static void     conn_expired(struct twtimer *, void *);
+static void     close_conn(struct conn *);
+static void     run_cgi(struct conn *);
+static void     spawn_done(struct tpjob *);
+static void     cgi_done(struct tpjob *);
+static void     set_socket(struct evloop *, int);
+static void     socket_done(struct tpjob *);
+static struct evloop *new_loop(int, struct tpool *, struct twheel *);
+static void     pin_loop(struct evloop *);
+static void     *loop_thread(void *);
+
+struct evloop *
+EVnew(int sock, struct tpool *pool, struct twheel *wheel)
+{
+    struct evloop *ev = new_loop(sock, pool, wheel);
+
+    if ( ev != NULL )
+    {
+        ev->reader = -1;            /* the main thread installs configs */
+        pin_loop(ev);
+    }
+    return ev;
+}
+
+/*
+ * change the listening sockets of every loop. The other loops are
+ * asked through their completion queues, and we wait for each to
+ * answer, so the caller may close the old sockets when this returns
+ */
+void
+EVsockets(struct evloop *ev, int *socks, int n)
+{
+    struct evloop *o;
+    struct timespec ms = { 0, 1000000 };
+    int     i = 1;
+
+    set_socket(ev, n > 0 ? socks[0] : -1);
+    for ( o = ev->next ; o != NULL ; o = o->next, i++ )
+    {
+        o->newsock = n > 0 ? socks[i % n] : -1;
+        o->asked++;
+        TPpost(o->done, &o->ctl);
+    }
+    for ( o = ev->next ; o != NULL ; o = o->next )
+        while ( __atomic_load_n(&o->acked, __ATOMIC_ACQUIRE) != o->asked )
+            nanosleep(&ms, NULL);
+}
+
+int
+EVcount(struct evloop *ev)
+{
+    return __atomic_load_n(&nopen, __ATOMIC_RELAXED);
+}
+
+int
+EVthreads(struct evloop *ev, int n, long tick)
+{
+    struct evloop *o, **tail = &ev->next;
+    struct twheel *wheel;
+    struct epoll_event e;
+    pthread_t tid;
+    sigset_t all, old;
+    int     i;
+
+    if ( n < 2 || (ev->sched = SCnew(n)) == NULL )
+        return 1;
+    e.events = EPOLLIN | EPOLLEXCLUSIVE;
+    e.data.ptr = &steal_tag;
+    epoll_ctl(ev->epfd, EPOLL_CTL_ADD, SCwakefd(ev->sched), &e);
+
+    sigfillset(&all);               /* signals are for the main thread */
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for ( i = 1 ; i < n ; i++ )
+    {
+        if ( (wheel = TWnew(tick)) == NULL
+          || (o = new_loop(ev->sock, ev->pool, wheel)) == NULL )
+            break;
+        o->id = i;
+        o->sched = ev->sched;
+        o->main = ev;
+        o->ctl.done = socket_done;
+        o->ctl.arg = o;
+        epoll_ctl(o->epfd, EPOLL_CTL_ADD, SCwakefd(o->sched), &e);
+        if ( pthread_create(&tid, NULL, loop_thread, o) != 0 )
+        {
+            close(o->epfd);         /* so no call waits on it */
+            break;
+        }
+        pthread_detach(tid);
+        *tail = o;
+        tail = &o->next;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return i;
+}
+
+void
+EVstats(struct evloop *ev, FILE *fp)
+{
+    struct evloop *o;
+    int     i = 0;
+
+    fprintf(fp, "%d connection(s):", EVcount(ev));
+    for ( o = ev ; o != NULL ; o = o->next )
+        fprintf(fp, " loop %d: %d", i++,
+                __atomic_load_n(&o->nconns, __ATOMIC_RELAXED));
+    fprintf(fp, "\nfile cache hits:");
+    for ( o = ev, i = 0 ; o != NULL ; o = o->next )
+        fprintf(fp, " loop %d: %lu", i++,
+                __atomic_load_n(&o->hits, __ATOMIC_RELAXED));
+    fprintf(fp, "\nopens shared:");
+    for ( o = ev, i = 0 ; o != NULL ; o = o->next )
+        fprintf(fp, " loop %d: %lu", i++,
+                __atomic_load_n(&o->joined, __ATOMIC_RELAXED));
+    fprintf(fp, "\ntimed out:");
+    for ( o = ev, i = 0 ; o != NULL ; o = o->next )
+        fprintf(fp, " loop %d: %lu", i++,
+                __atomic_load_n(&o->timeouts, __ATOMIC_RELAXED));
+    fprintf(fp, "\n");
+    if ( ev->cpu != -1 )
+    {
+        fprintf(fp, "cpus:");
+        for ( o = ev, i = 0 ; o != NULL ; o = o->next )
+            fprintf(fp, " loop %d: %d (node %d)", i++, o->cpu, o->node);
+        fprintf(fp, "\n");
+    }
+    FCstats(fp);
+    if ( ev->sched != NULL )
+        SCstats(ev->sched, fp);
+}
+
+void
+EVwait(struct evloop *ev, sigset_t *mask, long maxms)
+{
+    struct epoll_event evs[EV_MAXEVENTS];
+    struct conn *c;
+    long    ms = TWtimeout(ev->wheel);
+    int     i, n;
+
+    if ( maxms >= 0 && (ms < 0 || ms > maxms) )
+        ms = maxms;
+    if ( ev->sched != NULL && SCwaiting(ev->sched, ev->id) > 0 )
+        ms = 0;                     /* our own jobs are waiting */
+    CFoffline(ev->reader);
+    n = epoll_pwait(ev->epfd, evs, EV_MAXEVENTS, ms, mask);
+    CFquiet(ev->reader);
+    if ( n == -1 && errno != EINTR )
+        perror("epoll_wait");
+
+    for ( i = 0 ; i < n ; i++ )
+    {
+        if ( evs[i].data.ptr == &listen_tag )
+            accept_calls(ev);
+        else if ( evs[i].data.ptr == &done_tag )
+            TPcomplete(ev->done);
+        else if ( evs[i].data.ptr == &steal_tag )
+            SCsteal(ev->sched, ev->id, EV_STEAL);
+        else
+            conn_event(evs[i].data.ptr, evs[i].events);
+    }
+    if ( ev->sched != NULL )
+        SCrun(ev->sched, ev->id, EV_RUN);
+    TWadvance(ev->wheel);
+
+    while ( (c = ev->closed) != NULL )
+    {
+        ev->closed = c->nextclosed;
+        free(c);
+    }
+}
+
+/*
+ * take every call that is waiting, applying the same limits as
+ * admit_call() in wsng.c
+ */
+static void
+accept_calls(struct evloop *ev)
+{
+    struct sockaddr_in caddr;
+    socklen_t clen;
+    struct epoll_event e;
+    struct conn *c;
+    int     fd, code;
+
+    while ( ev->sock != -1 )
+    {
+        clen = sizeof(caddr);
+        fd = accept4(ev->sock, (struct sockaddr *) &caddr, &clen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( fd == -1 )
+        {
+            if ( errno == ECONNABORTED || errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                perror("accept");
+            return;
+        }
+
+        c = calloc(1, sizeof(struct conn));
+        if ( c == NULL )
+        {
+            close(fd);
+            continue;
+        }
+        c->conf = CFcurrent();
+        if ( c->conf->max_conns > 0
+          && EVcount(ev) + CHcount() >= c->conf->max_conns )
+            code = 503;
+        else
+            code = RLadmit(caddr.sin_addr.s_addr);
+        if ( code != 0 )
+        {
+            refuse_call(fd, code);
+            CFrelease(c->conf);
+            free(c);
+            continue;
+        }
+
+        c->fd    = fd;
+        c->addr  = caddr.sin_addr.s_addr;
+        c->ev    = ev;
+        c->ffd   = -1;
+        c->state = C_READ;
+        TRstart(&c->tr, c->addr);
+        RPinit(&c->rp, fd);
+        c->rp.trace = &c->tr;
+        ev->nconns++;
+        __atomic_add_fetch(&nopen, 1, __ATOMIC_RELAXED);
+
+        e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        e.data.ptr = c;
+        if ( epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) == -1 )
+        {
+            perror("epoll: connection");
+            close_conn(c);
+            continue;
+        }
+        if ( c->conf->header_timeout > 0 )
+            TWadd(ev->wheel, &c->timer, c->conf->header_timeout * 1000L,
+                  conn_expired, c);
+    }
+}
+
+static void
+conn_event(struct conn *c, unsigned events)
+{
+    if ( c->state == C_CLOSED )
+        return;                     /* closed earlier this round */
+    if ( c->state == C_READ && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) )
+        read_input(c);
+    else if ( events & EPOLLOUT )
+        advance(c);
+    else if ( events & (EPOLLHUP | EPOLLERR) )
+        close_conn(c);
+}
+
+/*
+ * read what has come in; once the headers are complete, go on
+ */
+static void
+read_input(struct conn *c)
+{
+    char    *end;
+    int     n, from;
+
+    for ( ;; )
+    {
+        n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+        if ( n == -1 && errno == EINTR )
+            continue;
+        if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            return;                 /* wait for more */
+        if ( n <= 0 )
+        {
+            close_conn(c);          /* gone before asking */
+            return;
+        }
+        from = c->inlen > 3 ? c->inlen - 3 : 0;  /* only the new bytes */
+        c->inlen += n;
+        if ( (end = SNhead_end(c->in + from, c->in + c->inlen)) != NULL )
+        {
+            c->readlen = c->inlen;
+            c->inlen = end - c->in; /* the head; a body is proxy.c's */
+            break;
+        }
+        if ( c->inlen == sizeof(c->in) )
+        {
+            bad_request(&c->rp);    /* headers too big */
+            c->state = C_SEND;
+            advance(c);
+            return;
+        }
+    }
+    parse_request(c);
+}
+
+/*
+ * split the request line, find Host:, and hand the path to a job
+ */
+static void
+parse_request(struct conn *c)
+{
+    char    rq[MAX_RQ_LEN], arg[MAX_RQ_LEN], host[HOST_LEN];
+    char    *item;
+
+    TWcancel(&c->timer);
+    if ( c->conf->request_timeout > 0 )
+        TWadd(c->ev->wheel, &c->timer, c->conf->request_timeout * 1000L,
+              conn_expired, c);
+
+    TRmark(&c->tr, TR_HEAD);
+    parse_head(c->in, c->in + c->inlen, rq, sizeof(rq), host, sizeof(host));
+
+    c->state = C_SEND;
+    c->vh = VHlookup(c->conf->hosts, host[0] ? host : NULL);
+    if ( strcmp(rq, H2_PRI) == 0 )
+        H2refuse(&c->rp);           /* HTTP/2 is fork mode's */
+    else if ( split_request(rq, c->method, sizeof(c->method), arg, sizeof(arg)) != 2 )
+        bad_request(&c->rp);
+    else if ( (c->route = PXmatch(c->vh, arg)) != NULL )
+    {
+        c->kind = K_PROXY;          /* forked, as a CGI is */
+        start_reply(c);
+        return;
+    }
+    else if ( strcmp(c->method, "GET") != 0 && strcmp(c->method, "HEAD") != 0 )
+        cannot_do(&c->rp);          // only supports GET or HEAD
+    else
+    {
+        item = modify_argument(arg, MAX_RQ_LEN);
+        strcpy(c->item, item);
+        if ( (c->query = strrchr(c->item, '?')) != NULL )
+            *c->query++ = '\0';
+        if ( c->vh->pack != NULL )
+        {                           /* all in memory: no job */
+            TRmark(&c->tr, TR_HANDLER);
+            do_pack(c->item, c->in, c->in + c->inlen, c->vh, &c->rp);
+            advance(c);
+            return;
+        }
+        c->state = C_OPEN;
+        if ( (c->fc = FClookup(c->vh, c->item)) != NULL )
+        {
+            __atomic_add_fetch(&c->ev->hits, 1, __ATOMIC_RELAXED);
+            c->kind = K_FILE;
+            c->info = c->fc->info;
+            start_reply(c);
+            return;
+        }
+        if ( ! join_open(c) )
+            start_job(c, TP_OPEN, open_work);
+        return;
+    }
+    advance(c);
+}
+
+/*
+ * send what is queued, then move on to whatever comes next
+ */
+static void
+advance(struct conn *c)
+{
+    size_t  chunk;
+    int     rc;
+
+    while ( c->state != C_CLOSED )
+    {
+        if ( c->busy && c->job.op != TP_FILL )
+            return;                 /* the job owns the reply */
+        if ( (rc = RPflush(&c->rp)) == 1 )
+            return;                 /* wait for EPOLLOUT */
+        if ( rc == -1 )
+        {
+            close_conn(c);
+            return;
+        }
+
+        if ( c->state == C_FILE && c->off < c->map->len )
+        {
+            if ( ! c->busy && c->bad_fill )
+            {
+                fprintf(stderr, "%s: file shrank\n", c->item);
+                close_conn(c);
+                return;
+            }
+            if ( c->filled > c->off )           /* send what's in */
+            {
+                chunk = c->filled - c->off;
+                if ( chunk > FM_WINDOW )
+                    chunk = FM_WINDOW;
+                RPref(&c->rp, (char *) c->map->addr + c->off, chunk);
+                c->off += chunk;
+            }
+            if ( ! c->busy && c->filled < c->map->len )
+            {
+                c->filling = c->filled + FM_WINDOW;
+                if ( c->filling > c->map->len )
+                    c->filling = c->map->len;
+                start_job(c, TP_FILL, fill_work);   /* read ahead */
+            }
+            if ( RPpending(&c->rp) == 0 && c->busy )
+                return;             /* nothing to send until the fill */
+        }
+        else if ( c->state == C_LIST && c->more == 1 )
+        {
+            if ( c->ev->sched == NULL )
+                start_job(c, TP_SCAN, scan_work);
+            else if ( ! LSloaded(c->ls) )
+                start_job(c, TP_SCAN, load_work);
+            else
+                start_job(c, EV_ROWS, scan_work);   /* rows only now */
+            if ( c->busy )
+                return;
+        }
+        else if ( c->state == C_READ || c->state == C_OPEN )
+            return;
+        else
+        {
+            close_conn(c);          /* all sent */
+            return;
+        }
+    }
+}
+
+/*
+ * back in the loop after the open job: queue the start of the
+ * reply and set the state that finishes it
+ */
+static void
+start_reply(struct conn *c)
+{
+    TRmark(&c->tr, TR_HANDLER);
+    c->state = C_SEND;
+    switch ( c->kind )
+    {
+    case K_404:
+        do_404(c->item, &c->rp);
+        break;
+    case K_403:
+        do_403(c->item, &c->rp);
+        break;
+    case K_CGI:
+    case K_PROXY:
+        if ( c->ev->main != NULL )  /* children belong to the main loop */
+        {
+            c->busy = 1;
+            c->job.done = spawn_done;
+            TPpost(c->ev->main->done, &c->job);
+            return;
+        }
+        run_cgi(c);
+        close_conn(c);
+        return;
+    case K_LIST:
+        header(&c->rp, 200, "OK", "text/html");
+        RPprintf(&c->rp, "\r\n");
+        if ( (c->ls = LSopen(c->ffd)) == NULL )
+        {
+            close_conn(c);
+            return;
+        }
+        c->more = 1;
+        c->state = C_LIST;
+        break;
+    case K_FILE:
+        if ( ! S_ISREG(c->info.st_mode) )
+        {
+            do_403(c->item, &c->rp);    /* no fifos and devices here */
+            break;
+        }
+        header(&c->rp, 200, "OK", c->fc != NULL ? c->fc->type
+                                  : VHcontent_type(c->vh, file_type(c->name)));
+        RPprintf(&c->rp, "\r\n");
+        if ( c->info.st_size == 0 )
+            break;
+        if ( c->fc != NULL )
+            c->map = c->fc->map;
+        else if ( (c->map = FMopen(c->ffd, &c->info)) == NULL )
+        {
+            perror(c->item);
+            close_conn(c);
+            return;
+        }
+        c->state = C_FILE;
+        break;
+    }
+    if ( c->ffd != -1 )
+    {
+        close(c->ffd);              /* the map or listing has its own */
+        c->ffd = -1;
+    }
+    advance(c);
+}
+
+/*
+ * hand work() to the pool; if there is no pool or no room in its
+ * queue, do it here and now
+ */
+static void
+start_job(struct conn *c, int op, void (*work)(struct tpjob *))
+{
+    c->job.op   = op;
+    c->job.work = work;
+    c->job.done = job_done;
+    c->job.arg  = c;
+    c->busy = 1;
+    if ( op == EV_ROWS && c->ev->sched != NULL
+      && SCpush(c->ev->sched, c->ev->id, c->ev->done, &c->job) == 0 )
+        return;                     /* CPU work: our deque */
+    if ( op != EV_ROWS && c->ev->pool != NULL
+      && TPsubmit(c->ev->pool, c->ev->done, &c->job) == 0 )
+        return;
+    work(&c->job);
+    c->busy = 0;
+    if ( op == TP_FILL )
+        c->filled = c->filling;
+    if ( op == TP_OPEN )
+    {
+        end_open(c);
+        start_reply(c);
+    }
+}
+
+static void
+job_done(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    c->busy = 0;
+    if ( job->op == TP_FILL )
+        c->filled = c->filling;     /* sending may run up to here now */
+    if ( job->op == TP_OPEN )
+        end_open(c);                /* before close_conn() takes ffd */
+    if ( c->state == C_CLOSED )
+        close_conn(c);              /* closed while out: finish up */
+    else if ( job->op == TP_OPEN )
+        start_reply(c);
+    else
+        advance(c);
+}
+
+/*
+ * pool side: find out what the item is, and keep a file to send
+ * in the file cache
+ */
+static void
+open_work(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    open_item(c);
+    if ( c->kind == K_FILE && c->ffd != -1 )
+        c->fc = FCstore(c->vh, c->item,
+                        VHcontent_type(c->vh, file_type(c->name)),
+                        c->ffd, &c->info, c->conf);
+}
+
+/*
+ * open the item beneath the root and see what it is
+ */
+static void
+open_item(struct conn *c)
+{
+    struct stat finfo;
+    int     fd;
+
+    c->kind = K_FILE;
+    c->name = c->item;
+    if ( (c->ffd = open_served(c->vh->rootfd, c->item)) == -1 )
+    {
+        if ( errno == EACCES || errno == EXDEV || errno == ELOOP )
+            c->kind = K_403;
+        else
+            c->kind = K_404;
+        return;
+    }
+    if ( fstat(c->ffd, &c->info) == -1 )
+        c->kind = K_404;
+    else if ( no_access(&c->info) )
+        c->kind = K_403;
+    else if ( S_ISDIR(c->info.st_mode) )
+    {
+        if ( (c->name = find_index(c->ffd, &c->info, c->vh,
+                                   &fd, &finfo)) == NULL )
+        {
+            c->kind = K_LIST;
+            return;                 /* keep the directory open */
+        }
+        c->kind = ends_in_cgi(c->name) ? K_CGI : K_FILE;
+        close(c->ffd);
+        c->ffd = fd;
+        c->info = finfo;
+    }
+    else if ( ends_in_cgi(c->item) )
+    {
+        c->kind = K_CGI;            /* keep the fd, to run it by */
+        c->name = NULL;
+    }
+    if ( c->kind == K_CGI && ! cgi_runnable(c->ffd, &c->info) )
+        c->kind = K_403;
+}
+
+/*
+ * the fills[] chain for c's vhost and item
+ */
+static struct conn **
+fill_chain(struct conn *c)
+{
+    unsigned h = 2166136261u ^ c->vh->id;
+    char    *p;
+
+    for ( p = c->item ; *p ; p++ )
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    return &fills[h % EV_FILLS];
+}
+
+/*
+ * wait for an open job already out for the same item, if there is
+ * one; if not, the caller's job will be the one. 1 if we wait
+ */
+static int
+join_open(struct conn *c)
+{
+    struct conn **chain = fill_chain(c), *o;
+
+    pthread_mutex_lock(&fills_lock);
+    for ( o = *chain ; o != NULL ; o = o->nextfill )
+        if ( o->vh == c->vh && strcmp(o->item, c->item) == 0 )
+            break;
+    if ( o != NULL )
+    {
+        c->job.op = TP_OPEN;        /* as if our own were out */
+        c->busy = 1;
+        c->nextfill = o->waiters;
+        o->waiters = c;
+    }
+    else
+    {
+        c->leading = 1;
+        c->nextfill = *chain;
+        *chain = c;
+    }
+    pthread_mutex_unlock(&fills_lock);
+    return o != NULL;
+}
+
+/*
+ * our open job is back: leave fills[] and hand what it found to
+ * everyone who waited on it, on their own loops
+ */
+static void
+end_open(struct conn *c)
+{
+    struct conn **cp, *w, *next;
+
+    if ( ! c->leading )
+        return;
+    pthread_mutex_lock(&fills_lock);
+    for ( cp = fill_chain(c) ; *cp != c ; cp = &(*cp)->nextfill )
+        ;
+    *cp = c->nextfill;
+    w = c->waiters;
+    c->waiters = NULL;
+    c->leading = 0;
+    pthread_mutex_unlock(&fills_lock);
+
+    for ( ; w != NULL ; w = next )
+    {
+        next = w->nextfill;
+        w->kind = c->kind;
+        w->info = c->info;
+        w->name = c->name == c->item ? w->item : c->name;
+        if ( c->kind == K_FILE && c->fc != NULL )
+        {
+            FChold(c->fc);
+            w->fc = c->fc;
+        }
+        else if ( (c->kind == K_FILE || c->kind == K_CGI)
+               && (w->ffd = dup(c->ffd)) == -1 )
+            w->kind = K_AGAIN;
+        else if ( c->kind == K_LIST )
+            w->kind = K_AGAIN;      /* a stream of its own */
+        w->job.arg = w;
+        w->job.done = open_shared;
+        TPpost(w->ev->done, &w->job);
+    }
+}
+
+/*
+ * back on our loop with what another connection's open job found
+ */
+static void
+open_shared(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    c->busy = 0;
+    __atomic_add_fetch(&c->ev->joined, 1, __ATOMIC_RELAXED);
+    if ( c->state == C_CLOSED )
+        close_conn(c);
+    else if ( c->kind == K_AGAIN )
+        start_job(c, TP_OPEN, open_work);
+    else
+        start_reply(c);
+}
+
+/*
+ * pool side: take the page faults for the next window. The loop
+ * goes on sending up to filled meanwhile, so only the loop moves it
+ */
+static void
+fill_work(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+    size_t  len = c->filling - c->filled;
+
+    if ( FMtouch(c->map, c->filled, len) == -1 )
+        c->bad_fill = 1;
+    FMadvise(c->map, c->filled, len);
+}
+
+/*
+ * the next piece of a listing: on the pool, or on a deque once
+ * load_work() has done the disk part
+ */
+static void
+scan_work(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    if ( (c->more = LSfill(c->ls, &c->rp)) == -1 )
+        c->more = 0;                /* send what there is */
+}
+
+/*
+ * pool side: read and stat the listing's next batch
+ */
+static void
+load_work(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    if ( LSload(c->ls) == -1 )
+        c->more = 0;
+}
+
+static void
+conn_expired(struct twtimer *t, void *arg)
+{
+    struct conn *c = arg;
+    static char reply[] = "HTTP/1.0 408 Request Timeout\r\n"
+                          "Content-Type: text/plain\r\n\r\n"
+                          "Request headers took too long\r\n";
+
+    if ( c->state == C_READ && write(c->fd, reply, sizeof(reply) - 1) == -1 )
+        ;
+    __atomic_add_fetch(&c->ev->timeouts, 1, __ATOMIC_RELAXED);
+    close_conn(c);
+}
+
+/*
+ * done with c; if a job still has it, just cut the connection
+ * and let job_done() come back here
+ */
+static void
+close_conn(struct conn *c)
+{
+    struct evloop *ev = c->ev;
+
+    if ( c->busy )
+    {
+        if ( c->state != C_CLOSED )
+            shutdown(c->fd, SHUT_RDWR);
+        c->state = C_CLOSED;
+        return;
+    }
+    TWcancel(&c->timer);
+    if ( (c->tr.t[TR_HEAD].tv_sec != 0 || c->tr.t[TR_HEAD].tv_nsec != 0)
+      && ! (c->addr == 0
+            && (c->kind == K_PROXY || (c->kind == K_CGI && TRlogging()))) )
+    {                               /* a request came, and it is not */
+                                    /* a proxy or CGI child's to log */
+        TRmark(&c->tr, TR_LAST);
+        TRlog(&c->tr, c->in, c->in + c->inlen, c->rp.sent);
+    }
+    epoll_ctl(ev->epfd, EPOLL_CTL_DEL, c->fd, NULL);  /* a CGI may share it */
+    close(c->fd);
+    if ( c->ffd != -1 )
+        close(c->ffd);
+    if ( c->fc != NULL )
+        FCrelease(c->fc);
+    else if ( c->map != NULL )
+        FMrelease(c->map);
+    if ( c->ls != NULL )
+        LSclose(c->ls);
+    RPfree(&c->rp);
+    if ( c->addr != 0 )
+        RLrelease(c->addr);
+    CFrelease(c->conf);
+    ev->nconns--;
+    __atomic_sub_fetch(&nopen, 1, __ATOMIC_RELAXED);
+
+    c->state = C_CLOSED;
+    c->nextclosed = ev->closed;     /* freed at the end of EVwait() */
+    ev->closed = c;
+}
+
+/*
+ * send the header, then fork the CGI with the socket as its output;
+ * a proxied request is forked the same way, and answers for itself
+ */
+static void
+run_cgi(struct conn *c)
+{
+    char    cgi[MAX_RQ_LEN + LINELEN];
+
+    if ( c->kind == K_PROXY )
+    {
+        if ( spawn_proxy(c->route, c->fd, c->in, c->in + c->inlen,
+                         c->in + c->readlen, c->addr, &c->tr, c->conf) != -1 )
+            c->addr = 0;
+        return;
+    }
+    if ( c->name != NULL )              /* a directory's index */
+        snprintf(cgi, sizeof(cgi), "%s/%s", c->item, c->name);
+    header(&c->rp, 200, "OK", NULL);
+    if ( RPflush(&c->rp) == 0
+      && spawn_cgi(c->name ? cgi : c->item, c->ffd, &c->rp, c->vh, c->method,
+                   c->query, c->in, c->in + c->inlen, c->addr, c->conf) != -1 )
+        c->addr = 0;            /* the child has the limits now */
+}
+
+/*
+ * main loop side: start a CGI for another loop's connection, then
+ * send it back to be closed there
+ */
+static void
+spawn_done(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    run_cgi(c);                 /* fails if the loop has shut it */
+    job->done = cgi_done;
+    TPpost(c->ev->done, job);
+}
+
+static void
+cgi_done(struct tpjob *job)
+{
+    struct conn *c = job->arg;
+
+    c->busy = 0;
+    close_conn(c);
+}
+
+/*
+ * a loop's own half of EVsockets()
+ */
+static void
+set_socket(struct evloop *ev, int sock)
+{
+    struct epoll_event e;
+
+    if ( ev->sock != -1 )
+        epoll_ctl(ev->epfd, EPOLL_CTL_DEL, ev->sock, NULL);
+    ev->sock = sock;
+    if ( sock == -1 )
+        return;
+    e.events = EPOLLIN | EPOLLEXCLUSIVE;    /* one loop per new call */
+    e.data.ptr = &listen_tag;
+    if ( epoll_ctl(ev->epfd, EPOLL_CTL_ADD, sock, &e) == -1 )
+        perror("epoll: listening socket");
+}
+
+static void
+socket_done(struct tpjob *job)
+{
+    struct evloop *ev = job->arg;
+
+    set_socket(ev, ev->newsock);
+    __atomic_store_n(&ev->acked, ev->asked, __ATOMIC_RELEASE);
+}
+
+static struct evloop *
+new_loop(int sock, struct tpool *pool, struct twheel *wheel)
+{
+    struct evloop *ev = calloc(1, sizeof(struct evloop));
+    struct epoll_event e;
+
+    if ( ev == NULL )
+        return NULL;
+    ev->sock = -1;
+    ev->pool = pool;
+    ev->wheel = wheel;
+    if ( (ev->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+      || (ev->done = TPqueue()) == NULL )
+    {
+        if ( ev->epfd != -1 )
+            close(ev->epfd);
+        free(ev);
+        return NULL;
+    }
+    e.events = EPOLLIN;
+    e.data.ptr = &done_tag;
+    epoll_ctl(ev->epfd, EPOLL_CTL_ADD, TPqfd(ev->done), &e);
+    set_socket(ev, sock);
+    return ev;
+}
+
+/*
+ * run ev on its CPU from cpu_affinity, if there is a list, and busy
+ * poll its epoll set if busy_poll says to
+ */
+static void
+pin_loop(struct evloop *ev)
+{
+    struct config *conf = CFcurrent();
+
+    ev->cpu = CPpin(conf, ev->id);
+    ev->node = CPnode(ev->cpu);
+    CPepoll(ev->epfd, conf->busy_poll);
+    CFrelease(conf);
+}
+
+static void *
+loop_thread(void *arg)
+{
+    struct evloop *ev = arg;
+
+    ev->reader = CFreader();
+    pin_loop(ev);                   /* before we allocate anything */
+    for ( ;; )
+        EVwait(ev, NULL, -1);
+    return NULL;
+}
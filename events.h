@@ -0,0 +1,21 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+/*
+ * header for events.c package
+ */
+
+#include    <stdio.h>
+#include    <signal.h>
+
+struct evloop;
+struct tpool;
+struct twheel;
+
+struct evloop   *EVnew(int, struct tpool *, struct twheel *);
+void            EVwait(struct evloop *, sigset_t *, long);
+void            EVsockets(struct evloop *, int *, int);
+int             EVcount(struct evloop *);
+int             EVthreads(struct evloop *, int, long);
+void            EVstats(struct evloop *, FILE *);
+
+#endif
@@ -0,0 +1,399 @@
+/* fcache.c
+ *
+ * files recently served by the event loops, shared by all the loop
+ * threads, so a hot file is sent without opening it again
+ *
+ * interface:
+ *     FCinit()                      set up the table, 0 ok
+ *     FClookup( vh, path )          returns vh's entry for path with a
+ *                                   reference held, or NULL: not cached,
+ *                                   or not checked on disk lately
+ *     FCstore( vh, path, type, fd, info, conf )
+ *                                   path (normalized) opened as fd;
+ *                                   returns an entry for it with a
+ *                                   reference held, or NULL if it
+ *                                   cannot be cached
+ *     FChold( e )                   take another reference
+ *     FCrelease( e )                drop a reference
+ *     FCreclaim()                   free what was unlinked and is safe
+ *                                   now, and drop long-unused entries
+ *     FCstats( fp )                 print the table's figures
+ *
+ * details:
+ *      An entry is keyed by the vhost's id and the item after
+ *      modify_argument() has cleaned it up. It holds what the open
+ *      job found (the stat and Content-Type of the file to send, the
+ *      index page's for a directory) and a mapping of the file from
+ *      FMmap(). A hit skips the open job, the open() and fstat() and
+ *      the mmap() and goes straight to sending.
+ *
+ *      Files are not watched. An entry is trusted for FC_VALID
+ *      seconds after it was last found current; after that a lookup
+ *      misses, the open job runs again, and FCstore() either marks the
+ *      entry current (same device, inode, size and mtime) or replaces
+ *      it. So a changed file is seen within a second or two, and a
+ *      hot file costs one open a second instead of one per request.
+ *
+ *      The table is FC_SHARDS shards of FC_BUCKETS chains. A lookup
+ *      takes no lock and writes nothing shared but the entry's count:
+ *      it follows the chain with acquire loads. Writers (the open
+ *      jobs, and FCreclaim()) take the shard's mutex, fill an entry in
+ *      before linking it in at the head of its chain, and unlink with
+ *      one store, so a reader sees a chain either with the entry or
+ *      without it. The chain heads and the writers' fields are in
+ *      separate cache lines, and each shard starts on its own line,
+ *      so readers on different CPUs never write to a line another one
+ *      reads.
+ *
+ *      An unlinked entry may still be in use by a lookup that found
+ *      it a moment before. It is stamped with an epoch from config.c
+ *      and put on a retired list, and the table's reference is only
+ *      dropped once every loop has passed a quiet point since then
+ *      (CFgrace()), the same rule that frees old config snapshots. A
+ *      connection sending the file keeps its own reference, and the
+ *      last one unmaps it.
+ *
+ *      Each host's cache_size is its budget in bytes; a host without
+ *      one uses the default host's, and 0 turns the cache off. Files
+ *      of FM_BIG or more are streamed by filemap.c as before and never
+ *      cached. When a file does not fit, its shard is swept of entries
+ *      past FC_VALID first, and if there is still no room it is sent
+ *      uncached. FCreclaim() sweeps every shard once a second for
+ *      entries not used in FC_KEEP seconds; entries of a host from an
+ *      old config can never match again and go the same way.
+ *
+ *      Lookups must come from the event loop threads, which are
+ *      readers in config.c; FCreclaim() is for the main thread.
+ *      fcbench.c measures lookups from 1 to 64 threads.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    "vhost.h"
+#include    "config.h"
+#include    "filemap.h"
+#include    "fcache.h"
+
+#define FC_SHARD_BITS 6
+#define FC_SHARDS   (1 << FC_SHARD_BITS)
+#define FC_BUCKETS  256             /* chains per shard, a power of 2 */
+#define FC_VALID    1               /* seconds a hit goes unchecked */
+#define FC_KEEP     10              /* seconds an unused entry stays */
+
+struct shard {
+    struct fcentry  *bucket[FC_BUCKETS];    /* read without a lock */
+    pthread_mutex_t lock __attribute__((aligned(64)));  /* writers */
+    int             entries;
+    long            bytes;
+    unsigned long   stores, refreshed, evicted, refused;  /* metrics */
+} __attribute__((aligned(64)));
+
+static struct shard shards[FC_SHARDS];
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fcentry *retired = NULL;  /* unlinked, maybe still seen */
+static time_t   swept = 0;
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define PUBLISH(x,v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+static unsigned hash_of(unsigned, char *);
+static struct shard *shard_of(unsigned);
+static struct fcentry **find(struct shard *, unsigned, unsigned, char *);
+static int      same_file(struct fcentry *, struct stat *);
+static int      charge(struct vhost *, long);
+static long     budget(struct vhost *);
+static void     unlink_entry(struct shard *, struct fcentry **);
+static void     sweep(struct shard *, time_t);
+static void     destroy(struct fcentry *);
+
+int
+FCinit()
+{
+    int     i;
+
+    for ( i = 0 ; i < FC_SHARDS ; i++ )
+        if ( pthread_mutex_init(&shards[i].lock, NULL) != 0 )
+            return 1;
+    return 0;
+}
+
+struct fcentry *
+FClookup(struct vhost *vh, char *path)
+{
+    unsigned h;
+    struct fcentry *e;
+
+    if ( budget(vh) <= 0 )
+        return NULL;
+    h = hash_of(vh->id, path);
+    for ( e = LOAD(shard_of(h)->bucket[h % FC_BUCKETS]) ; e != NULL
+        ; e = LOAD(e->next) )
+        if ( e->hash == h && e->host == vh->id && strcmp(e->path, path) == 0 )
+        {
+            if ( time(NULL) - __atomic_load_n(&e->checked, __ATOMIC_RELAXED)
+                 > FC_VALID )
+                return NULL;        /* have the disk looked at again */
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            return e;
+        }
+    return NULL;
+}
+
+struct fcentry *
+FCstore(struct vhost *vh, char *path, char *type, int fd, struct stat *info,
+        struct config *conf)
+{
+    unsigned h = hash_of(vh->id, path);
+    struct shard *s = shard_of(h);
+    struct fcentry *e, **ep;
+    time_t  now = time(NULL);
+
+    if ( ! S_ISREG(info->st_mode) || info->st_size == 0
+      || info->st_size >= FM_BIG || info->st_size > budget(vh) )
+        return NULL;
+
+    pthread_mutex_lock(&s->lock);   /* the same file again? */
+    if ( (ep = find(s, h, vh->id, path)) != NULL && same_file(*ep, info) )
+    {
+        e = *ep;
+        __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        s->refreshed++;
+        pthread_mutex_unlock(&s->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    /* a new entry; the mapping is made without the lock held */
+    if ( (e = calloc(1, sizeof(struct fcentry) + strlen(path))) == NULL )
+        return NULL;
+    if ( (e->map = FMmap(fd, info)) == NULL )
+    {
+        free(e);
+        return NULL;
+    }
+    e->hash    = h;
+    e->host    = vh->id;
+    e->info    = *info;
+    e->type    = type;
+    e->checked = now;
+    e->refs    = 2;                 /* the table's and the caller's */
+    e->vh      = vh;
+    e->conf    = conf;
+    strcpy(e->path, path);
+    CFhold(conf);
+
+    pthread_mutex_lock(&s->lock);
+    if ( (ep = find(s, h, vh->id, path)) != NULL )
+        unlink_entry(s, ep);        /* changed on disk, or a racing store */
+    if ( ! charge(vh, info->st_size) )
+    {
+        sweep(s, now - FC_VALID);
+        if ( ! charge(vh, info->st_size) )
+        {
+            s->refused++;
+            pthread_mutex_unlock(&s->lock);
+            e->refs = 1;
+            return e;               /* the caller's alone */
+        }
+    }
+    e->next = s->bucket[h % FC_BUCKETS];
+    PUBLISH(s->bucket[h % FC_BUCKETS], e);
+    s->entries++;
+    s->bytes += info->st_size;
+    s->stores++;
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+void
+FChold(struct fcentry *e)
+{
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+FCrelease(struct fcentry *e)
+{
+    if ( e != NULL && __atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0 )
+        destroy(e);
+}
+
+void
+FCreclaim()
+{
+    struct fcentry **ep, *e, *safe = NULL;
+    unsigned long oldest = CFgrace();
+    time_t  now = time(NULL);
+    int     i;
+
+    pthread_mutex_lock(&retire_lock);
+    for ( ep = &retired ; (e = *ep) != NULL ; )
+        if ( e->retired <= oldest )
+        {
+            *ep = e->nextretired;
+            e->nextretired = safe;
+            safe = e;
+        }
+        else
+            ep = &e->nextretired;
+    pthread_mutex_unlock(&retire_lock);
+    while ( (e = safe) != NULL )
+    {
+        safe = e->nextretired;
+        FCrelease(e);               /* the table's reference */
+    }
+
+    if ( now == swept )
+        return;
+    swept = now;
+    for ( i = 0 ; i < FC_SHARDS ; i++ )
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        sweep(&shards[i], now - FC_KEEP);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+void
+FCstats(FILE *fp)
+{
+    struct shard *s;
+    unsigned long stores = 0, refreshed = 0, evicted = 0, refused = 0;
+    long    bytes = 0;
+    int     i, entries = 0;
+
+    for ( i = 0 ; i < FC_SHARDS ; i++ )
+    {
+        s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        entries   += s->entries;
+        bytes     += s->bytes;
+        stores    += s->stores;
+        refreshed += s->refreshed;
+        evicted   += s->evicted;
+        refused   += s->refused;
+        pthread_mutex_unlock(&s->lock);
+    }
+    fprintf(fp, "file cache: %d entries, %ld bytes; %lu stored, "
+            "%lu refreshed, %lu evicted, %lu refused\n",
+            entries, bytes, stores, refreshed, evicted, refused);
+}
+
+/*
+ * FNV-1a of the path, started from the host id; the top bits pick
+ * the shard and the bottom ones the chain
+ */
+static unsigned
+hash_of(unsigned host, char *path)
+{
+    unsigned h = 2166136261u ^ host;
+
+    for ( ; *path ; path++ )
+        h = (h ^ (unsigned char) *path) * 16777619u;
+    return h;
+}
+
+static struct shard *
+shard_of(unsigned h)
+{
+    return &shards[h >> (32 - FC_SHARD_BITS)];
+}
+
+/*
+ * writer side, with the lock held: the link that points at the
+ * entry for host and path, or NULL
+ */
+static struct fcentry **
+find(struct shard *s, unsigned h, unsigned host, char *path)
+{
+    struct fcentry **ep, *e;
+
+    for ( ep = &s->bucket[h % FC_BUCKETS] ; (e = *ep) != NULL ; ep = &e->next )
+        if ( e->hash == h && e->host == host && strcmp(e->path, path) == 0 )
+            return ep;
+    return NULL;
+}
+
+static int
+same_file(struct fcentry *e, struct stat *info)
+{
+    return e->info.st_ino == info->st_ino && e->info.st_dev == info->st_dev
+        && e->info.st_size == info->st_size
+        && e->info.st_mtim.tv_sec == info->st_mtim.tv_sec
+        && e->info.st_mtim.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+/*
+ * count len bytes against vh's budget; 0 if they don't fit
+ */
+static int
+charge(struct vhost *vh, long len)
+{
+    if ( __atomic_add_fetch(&vh->cache_used, len, __ATOMIC_RELAXED)
+         <= budget(vh) )
+        return 1;
+    __atomic_sub_fetch(&vh->cache_used, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static long
+budget(struct vhost *vh)
+{
+    if ( vh->cache_size == 0 && vh->parent != NULL )
+        return vh->parent->cache_size;
+    return vh->cache_size;
+}
+
+/*
+ * take *ep out of its chain and retire it. Readers in the chain
+ * still find their way on through its next pointer
+ */
+static void
+unlink_entry(struct shard *s, struct fcentry **ep)
+{
+    struct fcentry *e = *ep;
+
+    PUBLISH(*ep, e->next);
+    s->entries--;
+    s->bytes -= e->info.st_size;
+    s->evicted++;
+    __atomic_sub_fetch(&e->vh->cache_used, e->info.st_size, __ATOMIC_RELAXED);
+
+    e->retired = CFretire();        /* after the unlink, see config.c */
+    pthread_mutex_lock(&retire_lock);
+    e->nextretired = retired;
+    retired = e;
+    pthread_mutex_unlock(&retire_lock);
+}
+
+/*
+ * with the lock held: unlink the entries not found current since
+ * before
+ */
+static void
+sweep(struct shard *s, time_t before)
+{
+    struct fcentry **ep;
+    int     i;
+
+    for ( i = 0 ; i < FC_BUCKETS ; i++ )
+        for ( ep = &s->bucket[i] ; *ep != NULL ; )
+            if ( __atomic_load_n(&(*ep)->checked, __ATOMIC_RELAXED) < before )
+                unlink_entry(s, ep);
+            else
+                ep = &(*ep)->next;
+}
+
+static void
+destroy(struct fcentry *e)
+{
+    FMunmap(e->map);
+    CFrelease(e->conf);
+    free(e);
+}
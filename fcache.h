@@ -0,0 +1,40 @@
+#ifndef FCACHE_H
+#define FCACHE_H
+/*
+ * header for fcache.c package
+ */
+
+#include    <stdio.h>
+#include    <time.h>
+#include    <sys/stat.h>
+
+struct vhost;
+struct config;
+struct fmap;
+
+struct fcentry {
+    struct fcentry  *next;          /* hash chain               */
+    unsigned        hash;
+    unsigned        host;           /* vhost id                 */
+    struct stat     info;           /* of the file sent         */
+    char            *type;          /* its Content-Type         */
+    struct fmap     *map;           /* its bytes                */
+    time_t          checked;        /* last found current on disk */
+    int             refs;           /* the table's, and users'  */
+    struct vhost    *vh;            /* charged for the bytes    */
+    struct config   *conf;          /* keeps vh and type alive  */
+    unsigned long   retired;        /* epoch it was unlinked    */
+    struct fcentry  *nextretired;
+    char            path[1];        /* the normalized item      */
+};
+
+int             FCinit(void);
+struct fcentry  *FClookup(struct vhost *, char *);
+struct fcentry  *FCstore(struct vhost *, char *, char *, int, struct stat *,
+                         struct config *);
+void            FChold(struct fcentry *);
+void            FCrelease(struct fcentry *);
+void            FCreclaim(void);
+void            FCstats(FILE *);
+
+#endif
@@ -0,0 +1,168 @@
+/* fcbench.c
+ *
+ * how file cache lookups in fcache.c scale with the number of threads
+ *
+ * usage: fcbench [lookups per thread]
+ *
+ * details:
+ *      Caches one small file under FC_KEYS different paths, then has
+ *      1, 2, 4 ... 64 threads look paths up (FClookup() and
+ *      FCrelease(), what a hit costs a loop) as fast as they can, and
+ *      prints the total lookups per second three ways:
+ *
+ *        spread   each thread picks paths at random; the way the table
+ *                 is meant to be used
+ *        hot      every thread asks for the same path, so they all
+ *                 write the one entry's count
+ *        1 lock   spread, but with a single mutex around each lookup,
+ *                 as a table without sharding would need
+ *
+ *      Meanwhile the main thread marks every entry current again each
+ *      FC_REFILL ms, as the open jobs would, so none goes stale and
+ *      the readers share the table with a writer.
+ *
+ *      With as many CPUs as threads, spread should grow with the
+ *      threads while 1 lock stays flat or drops. Past the CPU count
+ *      the figures only show the cost of switching.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/stat.h>
+#include    "vhost.h"
+#include    "config.h"
+#include    "fcache.h"
+
+#define FC_KEYS     4096
+#define MAX_THREADS 64
+#define FC_REFILL   100             /* ms between refills       */
+
+enum { SPREAD, HOT, ONE_LOCK, NMODES };
+
+static struct vhost host;
+static char     keys[FC_KEYS][32];
+static long     iters;
+static int      mode;
+static int      running;
+static struct timespec finished;    /* when the last reader was done */
+static int      file;
+static struct stat info;
+static struct config *conf;
+static pthread_mutex_t one_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void     *reader(void *);
+static double   run(int);
+static void     fill(void);
+
+int
+main(int ac, char *av[])
+{
+    static char *names[] = { "spread", "hot", "1 lock" };
+    char    tmp[] = "/tmp/fcbenchXXXXXX";
+    char    page[4096];
+    int     n;
+
+    iters = ac > 1 ? atol(av[1]) : 1000000;
+    if ( (file = mkstemp(tmp)) == -1 )
+    {
+        perror(tmp);
+        return 1;
+    }
+    unlink(tmp);
+    memset(page, 'x', sizeof(page));
+    if ( write(file, page, sizeof(page)) != sizeof(page)
+      || fstat(file, &info) == -1
+      || (conf = CFnew("fcbench")) == NULL || FCinit() != 0 )
+    {
+        perror("setup");
+        return 1;
+    }
+    host.id = 1;
+    host.cache_size = (long) FC_KEYS * sizeof(page);
+
+    printf("%d CPU(s), %ld lookups per thread; million lookups/sec:\n",
+           (int) sysconf(_SC_NPROCESSORS_ONLN), iters);
+    printf("%7s %10s %10s %10s\n", "threads", names[0], names[1], names[2]);
+    for ( n = 1 ; n <= MAX_THREADS ; n *= 2 )
+    {
+        printf("%7d", n);
+        for ( mode = 0 ; mode < NMODES ; mode++ )
+            printf(" %10.2f", run(n));
+        printf("\n");
+    }
+    return 0;
+}
+
+/*
+ * store (or mark current) every key
+ */
+static void
+fill()
+{
+    int     i;
+
+    for ( i = 0 ; i < FC_KEYS ; i++ )
+    {
+        snprintf(keys[i], sizeof(keys[i]), "docs/%d/page%d.html", i % 64, i);
+        FCrelease(FCstore(&host, keys[i], "text/html", file, &info, conf));
+    }
+}
+
+/*
+ * n threads at once; returns millions of lookups a second
+ */
+static double
+run(int n)
+{
+    pthread_t tids[MAX_THREADS];
+    struct timespec t0, pause = { 0, FC_REFILL * 1000000L };
+    long    i;
+
+    fill();
+    running = n;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0 ; i < n ; i++ )
+        pthread_create(&tids[i], NULL, reader, (void *) (i + 1));
+    while ( __atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0 )
+    {
+        nanosleep(&pause, NULL);
+        fill();                     /* as the open jobs would */
+    }
+    for ( i = 0 ; i < n ; i++ )
+        pthread_join(tids[i], NULL);
+    return n * iters / ((finished.tv_sec - t0.tv_sec) * 1e6
+                        + (finished.tv_nsec - t0.tv_nsec) / 1e3);
+}
+
+static void *
+reader(void *arg)
+{
+    unsigned x = (unsigned long) arg * 2654435761u;
+    struct fcentry *e;
+    long    i, missed = 0;
+
+    for ( i = 0 ; i < iters ; i++ )
+    {
+        x ^= x << 13;               /* xorshift */
+        x ^= x >> 17;
+        x ^= x << 5;
+        if ( mode == ONE_LOCK )
+            pthread_mutex_lock(&one_lock);
+        e = FClookup(&host, keys[mode == HOT ? 0 : x % FC_KEYS]);
+        if ( e == NULL )
+            missed++;
+        FCrelease(e);
+        if ( mode == ONE_LOCK )
+            pthread_mutex_unlock(&one_lock);
+    }
+    if ( missed > 0 )
+        fprintf(stderr, "%ld lookups missed\n", missed);
+    if ( __atomic_sub_fetch(&running, 1, __ATOMIC_ACQ_REL) == 0 )
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+    return NULL;
+}
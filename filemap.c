@@ -0,0 +1,284 @@
+/* filemap.c
+ *
+ * read-only mappings of files being served, shared between requests
+ *
+ * interface:
+ *     FMopen( fd, info )            returns a mapping of the file fd is
+ *                                   open on, or NULL if it can't be mapped
+ *     FMrelease( m )                done with m
+ *     FMmap( fd, info )             returns a mapping of its own, not
+ *                                   shared through the table, or NULL
+ *     FMunmap( m )                  done with a mapping from FMmap()
+ *     FMadvise( m, off, len )       say which bytes are wanted next
+ *     FMcopy( m, off, buf, len )    copy bytes out of m, returns the
+ *                                   count, or -1 if the file shrank
+ *     FMtouch( m, off, len )        fault in those bytes now, 0 ok, -1
+ *                                   if the file shrank
+ *
+ * details:
+ *      A mapping is keyed by device, inode, size and mtime. A second
+ *      FMopen() of an unchanged file gets the same mapping back with
+ *      its count raised, so requests for one file share one mapping.
+ *      Up to FM_KEEP mappings nobody is using are kept for the next
+ *      request; past that the oldest is unmapped. A file that is
+ *      rewritten gets a new mtime, so the old mapping stops matching
+ *      and ages out.
+ *
+ *      Small files are mapped with MADV_WILLNEED so the whole file is
+ *      read in at once. Files of FM_BIG or more get MADV_SEQUENTIAL,
+ *      which reads ahead harder and drops pages behind us, and are
+ *      fetched a window at a time: FMadvise() asks for the window past
+ *      the one being used, so the disk runs ahead of the socket.
+ *
+ *      If the file is truncated while mapped, touching a page past the
+ *      new end raises SIGBUS. FMcopy() catches that with a handler that
+ *      siglongjmp()s back to the copy and returns -1. do_cat() hands
+ *      the pages to writev(), and there the kernel reports the bad page
+ *      as EFAULT instead. A SIGBUS outside FMcopy() and FMtouch() is a
+ *      real fault and still kills the process.
+ *
+ *      FMtouch() reads a byte of each page, so a thread that can
+ *      afford to wait for the disk takes the page faults, and the
+ *      event loop that sends the pages later does not.
+ *
+ *      The table of mappings is per thread: with several event loop
+ *      threads, each shares mappings among its own connections, and
+ *      FMopen() and FMrelease() take no lock. A mapping must be
+ *      released by the thread that opened it. FMadvise(), FMcopy()
+ *      and FMtouch() only read the mapping and may run anywhere.
+ *
+ *      FMmap() is for fcache.c, which shares its mappings between the
+ *      threads and counts their users itself. It is mapped and advised
+ *      just as FMopen() would, but stays out of the per-thread table.
+ */
+
+#define     _GNU_SOURCE             /* readahead() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <signal.h>
+#include    <setjmp.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <pthread.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    "filemap.h"
+
+#define FM_KEEP     16              /* idle mappings kept       */
+
+static __thread struct fmap *maps = NULL;  /* most recently used first */
+static __thread int nidle = 0;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+static __thread sigjmp_buf *copy_jmp = NULL;    /* set in FMcopy(), FMtouch() */
+
+static struct fmap *find_map(struct stat *);
+static void     trim_idle(void);
+static void     set_handler(void);
+static void     sigbus_handler(int);
+
+struct fmap *
+FMopen(int fd, struct stat *info)
+/*
+ * only non-empty regular files can be mapped; the caller
+ * reads anything else the ordinary way
+ */
+{
+    struct fmap *m;
+
+    if ( ! S_ISREG(info->st_mode) || info->st_size == 0 )
+        return NULL;
+
+    if ( (m = find_map(info)) != NULL )
+    {
+        if ( m->refs++ == 0 )
+            nidle--;
+        return m;
+    }
+    if ( (m = FMmap(fd, info)) == NULL )
+        return NULL;
+    m->next = maps;
+    maps = m;
+    return m;
+}
+
+struct fmap *
+FMmap(int fd, struct stat *info)
+{
+    struct fmap *m;
+    void        *addr;
+
+    if ( ! S_ISREG(info->st_mode) || info->st_size == 0 )
+        return NULL;
+
+    pthread_once(&handler_once, set_handler);
+
+    addr = mmap(NULL, info->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( addr == MAP_FAILED )
+        return NULL;
+    if ( (m = calloc(1, sizeof(struct fmap))) == NULL )
+    {
+        munmap(addr, info->st_size);
+        return NULL;
+    }
+
+    m->addr     = addr;
+    m->len      = info->st_size;
+    m->dev      = info->st_dev;
+    m->ino      = info->st_ino;
+    m->mtime    = info->st_mtim.tv_sec;
+    m->mtime_ns = info->st_mtim.tv_nsec;
+    m->refs     = 1;
+
+    if ( m->len >= FM_BIG )
+    {
+        madvise(m->addr, m->len, MADV_SEQUENTIAL);
+        readahead(fd, 0, FM_WINDOW);
+    }
+    else
+        madvise(m->addr, m->len, MADV_WILLNEED);
+    return m;
+}
+
+void
+FMunmap(struct fmap *m)
+{
+    munmap(m->addr, m->len);
+    free(m);
+}
+
+void
+FMrelease(struct fmap *m)
+{
+    if ( m != NULL && --m->refs == 0 )
+    {
+        nidle++;
+        trim_idle();
+    }
+}
+
+void
+FMadvise(struct fmap *m, size_t off, size_t len)
+/*
+ * the caller is about to use [off, off+len); for a big file,
+ * start reading the window after it
+ */
+{
+    size_t  next = off + len;
+    long    pg = sysconf(_SC_PAGESIZE);
+
+    if ( m->len < FM_BIG || next >= m->len )
+        return;
+    next &= ~(size_t) (pg - 1);     /* madvise wants it page aligned */
+    len = m->len - next < FM_WINDOW ? m->len - next : FM_WINDOW;
+    madvise((char *) m->addr + next, len, MADV_WILLNEED);
+}
+
+ssize_t
+FMcopy(struct fmap *m, size_t off, void *buf, size_t len)
+{
+    sigjmp_buf  env;
+
+    if ( off >= m->len )
+        return 0;
+    if ( len > m->len - off )
+        len = m->len - off;
+
+    if ( sigsetjmp(env, 1) != 0 )
+    {
+        copy_jmp = NULL;            /* the file shrank under us */
+        return -1;
+    }
+    copy_jmp = &env;
+    memcpy(buf, (char *) m->addr + off, len);
+    copy_jmp = NULL;
+    return len;
+}
+
+int
+FMtouch(struct fmap *m, size_t off, size_t len)
+{
+    sigjmp_buf  env;
+    volatile char sum = 0;
+    long    pg = sysconf(_SC_PAGESIZE);
+    size_t  end;
+
+    if ( off >= m->len )
+        return 0;
+    end = len > m->len - off ? m->len : off + len;
+
+    if ( sigsetjmp(env, 1) != 0 )
+    {
+        copy_jmp = NULL;
+        return -1;
+    }
+    copy_jmp = &env;
+    for ( off &= ~(size_t) (pg - 1) ; off < end ; off += pg )
+        sum += ((volatile char *) m->addr)[off];
+    copy_jmp = NULL;
+    return 0;
+}
+
+static struct fmap *
+find_map(struct stat *info)
+{
+    struct fmap *m, **mp;
+
+    for ( mp = &maps ; (m = *mp) != NULL ; mp = &m->next )
+        if ( m->ino == info->st_ino && m->dev == info->st_dev
+          && m->len == (size_t) info->st_size
+          && m->mtime == info->st_mtim.tv_sec
+          && m->mtime_ns == info->st_mtim.tv_nsec )
+        {
+            *mp = m->next;          /* move to the front */
+            m->next = maps;
+            maps = m;
+            return m;
+        }
+    return NULL;
+}
+
+static void
+set_handler()
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigbus_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/*
+ * unmap idle mappings from the back (least recently used)
+ * until only FM_KEEP are left
+ */
+static void
+trim_idle()
+{
+    struct fmap *m, **mp, **last;
+
+    while ( nidle > FM_KEEP )
+    {
+        last = NULL;
+        for ( mp = &maps ; (m = *mp) != NULL ; mp = &m->next )
+            if ( m->refs == 0 )
+                last = mp;
+        m = *last;
+        *last = m->next;
+        FMunmap(m);
+        nidle--;
+    }
+}
+
+static void
+sigbus_handler(int s)
+{
+    if ( copy_jmp != NULL )
+        siglongjmp(*copy_jmp, 1);
+    signal(SIGBUS, SIG_DFL);        /* not ours: die as usual */
+    raise(SIGBUS);
+}
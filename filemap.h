@@ -0,0 +1,33 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+/*
+ * header for filemap.c package
+ */
+
+#include    <sys/types.h>
+
+#define FM_WINDOW   (1L << 20)      /* read ahead this much     */
+#define FM_BIG      (4L << 20)      /* stream files this big    */
+
+struct stat;
+
+struct fmap {
+    void            *addr;          /* the file's bytes         */
+    size_t          len;
+    dev_t           dev;            /* what was mapped, to share */
+    ino_t           ino;
+    time_t          mtime;
+    long            mtime_ns;
+    int             refs;           /* 0 when idle              */
+    struct fmap     *next;
+};
+
+struct fmap     *FMopen(int, struct stat *);
+void            FMrelease(struct fmap *);
+struct fmap     *FMmap(int, struct stat *);
+void            FMunmap(struct fmap *);
+void            FMadvise(struct fmap *, size_t, size_t);
+ssize_t         FMcopy(struct fmap *, size_t, void *, size_t);
+int             FMtouch(struct fmap *, size_t, size_t);
+
+#endif
@@ -0,0 +1,982 @@
+/* h2.c
+ *
+ * HTTP/2 without TLS (h2c) for the forking server: the child that
+ * took the connection runs it, and each request on it is served by
+ * a child of its own
+ *
+ * interface:
+ *     H2wants( rq, head, end )      H2_PRIOR if the request line rq is
+ *                                   the start of the HTTP/2 preface,
+ *                                   H2_UPGRADE if the head head..end
+ *                                   asks to upgrade to h2c, else 0
+ *     H2serve( fd, how, head, end, len, addr, conf )
+ *                                   speak HTTP/2 on fd, from client
+ *                                   addr, until the client is done.
+ *                                   head..end is the HTTP/1 head that
+ *                                   asked for it; the len bytes read
+ *                                   from fd start at head
+ *     H2refuse( rp )                queue a GOAWAY asking for HTTP/1.1,
+ *                                   for a client that starts HTTP/2
+ *                                   where it is not served
+ *
+ * details:
+ *      A connection carries up to http2_streams requests at once.
+ *      Each is made back into an HTTP/1 head ("GET /path HTTP/2.0",
+ *      the fields, and :authority as Host:) and given to process_rq()
+ *      in a child forked for it, with the write end of a pipe as its
+ *      socket. So do_cat(), do_ls(), do_exec(), do_pack() and the
+ *      error pages run just as they do for HTTP/1, CGIs included,
+ *      and a slow one holds up no other stream. The connection child
+ *      reads the pipes, turns the status line and header lines of
+ *      each reply into a HEADERS frame (hpack.c), leaving out those
+ *      that only mean something to HTTP/1, and sends the rest as
+ *      DATA frames.
+ *
+ *      Flow control: a pipe is read only while its stream has room
+ *      for a frame in its buffer, so a client that stops reading a
+ *      stream leaves that stream's child blocked in write(), and
+ *      nothing piles up here. DATA goes out only within the stream's
+ *      window and the connection's. Only GET and HEAD are served, so
+ *      request bodies are dropped and the connection window is given
+ *      back as they come. The socket is TCP_NODELAY: a round's last
+ *      frame is usually short, and Nagle would hold it until the ACK
+ *      of the one before, which a delayed ACK puts off ~40ms, a stall
+ *      per window update.
+ *
+ *      Priority: a client can rank streams by RFC 9218 urgency (the
+ *      priority field, or PRIORITY_UPDATE) and by RFC 7540 weight
+ *      (HEADERS or PRIORITY); dependencies are not followed. Each
+ *      round sends one DATA frame from the most urgent stream that
+ *      has bytes and window, and among equals stride scheduling
+ *      shares the bytes in proportion to weight.
+ *
+ *      The connection ends when the client closes it or sends GOAWAY
+ *      and its streams are done, on a protocol error (GOAWAY with the
+ *      code), or after header_timeout seconds with no stream open.
+ *      Children of streams still open are killed. request_timeout
+ *      counts from the start of the connection, as for HTTP/1.
+ */
+
+#define     _GNU_SOURCE             /* pipe2() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <ctype.h>
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <poll.h>
+#include    <signal.h>
+#include    <stdint.h>
+#include    <unistd.h>
+#include    <sys/types.h>
+#include    <sys/wait.h>
+#include    <sys/socket.h>
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    "reply.h"
+#include    "trace.h"
+#include    "hpack.h"
+#include    "vhost.h"
+#include    "config.h"
+#include    "scan.h"
+#include    "wsng.h"
+#include    "h2.h"
+
+#define H2_PREFACE  H2_PRI "\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME    16384           /* largest frame either way */
+#define H2_BLOCK    (4 * H2_FRAME)  /* one request's header block */
+#define H2_WINDOW   65535           /* windows at the start     */
+#define H2_MAXWIN   0x7fffffffL
+#define H2_WEIGHT   16              /* RFC 7540's default       */
+#define H2_URGENCY  3               /* RFC 9218's default       */
+#define H2_STRIDE   (1L << 16)
+#define H2_TOKEN    "abcdefghijklmnopqrstuvwxyz0123456789!#$%&'*+-.^_`|~"
+
+enum { F_DATA, F_HEADERS, F_PRIORITY, F_RST_STREAM, F_SETTINGS,
+       F_PUSH_PROMISE, F_PING, F_GOAWAY, F_WINDOW_UPDATE, F_CONTINUATION,
+       F_PRIORITY_UPDATE = 0x10 };
+
+#define FL_END_STREAM   0x01
+#define FL_ACK          0x01
+#define FL_END_HEADERS  0x04
+#define FL_PADDED       0x08
+#define FL_PRIORITY     0x20
+
+enum { E_NONE, E_PROTOCOL, E_INTERNAL, E_FLOW, E_SETTINGS_TIMEOUT,
+       E_CLOSED, E_FRAME_SIZE, E_REFUSED, E_CANCEL, E_COMPRESSION,
+       E_CONNECT, E_CALM, E_SECURITY, E_HTTP_1_1 };
+
+enum { S_TABLE = 1, S_PUSH, S_STREAMS, S_WINDOW, S_FRAME };
+
+struct h2stream {
+    uint32_t        id;             /* 0: a free slot           */
+    pid_t           pid;            /* the child making the reply */
+    int             pfd;            /* its output; -1 at the end */
+    int             body;           /* 1 once HEADERS are sent  */
+    int             headonly;       /* HEAD: the body is dropped */
+    long            window;         /* bytes the client will take */
+    int             weight;         /* 1..256                   */
+    int             urgency;        /* 0..7, lower goes first   */
+    unsigned long   pass;           /* stride scheduling        */
+    char            *buf;           /* read from pfd, not sent  */
+    int             len;
+};
+
+struct h2conn {
+    int             fd;
+    unsigned        addr;           /* the client, for the log  */
+    struct config   *conf;
+    struct reply    out;            /* frames, sent as made     */
+    struct h2stream *streams;
+    int             nmax, nopen;
+    uint32_t        lastid;         /* highest the client opened */
+    long            window;         /* the connection's         */
+    long            initial;        /* the client's for streams */
+    unsigned long   vtime;          /* pass of the last sent    */
+    int             pre;            /* preface bytes matched    */
+    int             goaway;         /* the client is done       */
+    int             dead;           /* stop now                 */
+    struct hpack    dec;
+    unsigned char   in[2 * (H2_FRAME + 9)];
+    int             inlen;
+    unsigned char   block[H2_BLOCK];    /* header block so far  */
+    int             blen;
+    uint32_t        bid;            /* its stream; 0 if none    */
+    int             bweight;
+};
+
+static void     step(struct h2conn *);
+static int      parse_input(struct h2conn *);
+static void     frame(struct h2conn *, int, int, uint32_t, unsigned char *,
+                      int);
+static int      settings(struct h2conn *, unsigned char *, int);
+static void     add_block(struct h2conn *, int, unsigned char *, int);
+static void     end_headers(struct h2conn *);
+static int      request_head(char *, int, char *, int, int *, int *);
+static void     open_stream(struct h2conn *, uint32_t, char *, int, int,
+                            int, int);
+static void     run_stream(struct h2conn *, char *, int, int);
+static void     fill(struct h2conn *, struct h2stream *);
+static void     send_head(struct h2conn *, struct h2stream *, char *);
+static struct h2stream *pick(struct h2conn *);
+static void     send_data(struct h2conn *, struct h2stream *);
+static void     close_stream(struct h2conn *, struct h2stream *, int);
+static struct h2stream *find(struct h2conn *, uint32_t);
+static void     send_frame(struct h2conn *, int, int, uint32_t, void *, int);
+static void     reset(struct h2conn *, uint32_t, int);
+static void     goaway(struct h2conn *, int);
+static int      urgency(char *, int);
+static int      hop_by_hop(char *);
+static int      unbase64(char *, unsigned char *, int);
+static uint32_t get32(unsigned char *);
+static void     put32(unsigned char *, uint32_t);
+
+int
+H2wants(char *rq, char *head, char *end)
+{
+    char    up[LINELEN], set[LINELEN], *tok, *save;
+    unsigned char raw[LINELEN];
+    int     n = strlen(rq);
+
+    if ( strcmp(rq, H2_PRI) == 0 )
+        return H2_PRIOR;
+    if ( n < 9 || strcmp(rq + n - 9, " HTTP/1.1") != 0
+      || (strncmp(rq, "GET ", 4) != 0 && strncmp(rq, "HEAD ", 5) != 0) )
+        return 0;
+    head_field(head, end, "HTTP2-Settings", set, sizeof(set));
+    if ( (n = unbase64(set, raw, sizeof(raw))) < 0 || n % 6 != 0 )
+        return 0;
+    head_field(head, end, "Upgrade", up, sizeof(up));
+    for ( tok = strtok_r(up, ", \t", &save) ; tok != NULL
+        ; tok = strtok_r(NULL, ", \t", &save) )
+        if ( strcasecmp(tok, "h2c") == 0 )
+            return H2_UPGRADE;
+    return 0;
+}
+
+void
+H2serve(int fd, int how, char *head, char *end, int len, unsigned addr,
+        struct config *conf)
+{
+    struct h2conn *c = calloc(1, sizeof(struct h2conn));
+    char    val[LINELEN];
+    unsigned char set[LINELEN], ours[6];
+    int     i, n, on = 1;
+
+    if ( c == NULL || HPinit(&c->dec, HP_TABLE) != 0 )
+        return;
+    c->nmax = conf->h2_streams < H2_MAXSTREAMS ? conf->h2_streams
+                                               : H2_MAXSTREAMS;
+    if ( (c->streams = calloc(c->nmax, sizeof(struct h2stream))) == NULL )
+        return;
+    c->fd = fd;
+    c->addr = addr;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c->conf = conf;
+    c->window = c->initial = H2_WINDOW;
+    RPinit(&c->out, fd);
+    signal(SIGCHLD, SIG_DFL);       /* the stream children are ours */
+
+    if ( how == H2_UPGRADE )
+    {
+        RPprintf(&c->out, "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        head_field(head, end, "HTTP2-Settings", val, sizeof(val));
+        n = unbase64(val, set, sizeof(set));
+        settings(c, set, n);
+    }
+    else
+        c->pre = strlen(H2_PRI "\r\n\r\n");     /* read as the head */
+    ours[0] = 0;
+    ours[1] = S_STREAMS;
+    put32(ours + 2, c->nmax);
+    send_frame(c, F_SETTINGS, 0, 0, ours, sizeof(ours));
+
+    if ( how == H2_UPGRADE && ! c->dead )
+    {                               /* the request is stream 1 */
+        c->lastid = 1;
+        open_stream(c, 1, head, end - head, strncmp(head, "HEAD ", 5) == 0,
+                    H2_WEIGHT, H2_URGENCY);
+    }
+    c->inlen = len - (end - head);  /* what came after the head */
+    memcpy(c->in, end, c->inlen);
+    parse_input(c);
+
+    while ( ! c->dead && ! (c->goaway && c->nopen == 0) )
+        step(c);
+
+    for ( i = 0 ; i < c->nmax ; i++ )
+    {
+        if ( c->streams[i].id != 0 )
+            close_stream(c, &c->streams[i], -1);
+        free(c->streams[i].buf);
+    }
+    free(c->streams);
+    HPfree(&c->dec);
+    RPfree(&c->out);
+    free(c);
+}
+
+void
+H2refuse(struct reply *rp)
+{
+    static unsigned char frames[] = {
+        0, 0, 0, F_SETTINGS, 0, 0, 0, 0, 0,
+        0, 0, 8, F_GOAWAY, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, E_HTTP_1_1,
+    };
+
+    RPadd(rp, (char *) frames, sizeof(frames));
+}
+
+/*
+ * wait for the client or a stream's child, deal with what came, and
+ * send one DATA frame
+ */
+static void
+step(struct h2conn *c)
+{
+    struct pollfd pfds[H2_MAXSTREAMS + 1];
+    int     slot[H2_MAXSTREAMS + 1];
+    uint32_t ids[H2_MAXSTREAMS + 1];
+    struct h2stream *s;
+    int     i, n = 1, wait, ready;
+
+    pfds[0].fd = c->fd;
+    pfds[0].events = POLLIN;
+    for ( i = 0 ; i < c->nmax ; i++ )
+    {
+        s = &c->streams[i];
+        if ( s->id != 0 && s->pfd != -1 && s->len < H2_FRAME )
+        {
+            pfds[n].fd = s->pfd;
+            pfds[n].events = POLLIN;
+            slot[n] = i;
+            ids[n++] = s->id;
+        }
+    }
+    if ( pick(c) != NULL )
+        wait = 0;
+    else if ( c->nopen > 0 || c->conf->header_timeout <= 0 )
+        wait = -1;
+    else
+        wait = c->conf->header_timeout * 1000;
+
+    if ( (ready = poll(pfds, n, wait)) == -1 )
+    {
+        c->dead = errno != EINTR;
+        return;
+    }
+    if ( ready == 0 && wait > 0 )
+    {
+        goaway(c, E_NONE);          /* idle too long */
+        return;
+    }
+    if ( pfds[0].revents )
+    {
+        ready = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+        if ( ready <= 0 && ! (ready == -1 && errno == EINTR) )
+        {
+            c->dead = 1;            /* the client is gone */
+            return;
+        }
+        c->inlen += ready > 0 ? ready : 0;
+        if ( parse_input(c) != 0 )
+            return;
+    }
+    for ( i = 1 ; i < n ; i++ )
+    {
+        s = &c->streams[slot[i]];   /* may have been reset since */
+        if ( pfds[i].revents && s->id == ids[i] && s->pfd == pfds[i].fd )
+            fill(c, s);
+    }
+    if ( ! c->dead && (s = pick(c)) != NULL )
+        send_data(c, s);
+    while ( waitpid(-1, NULL, WNOHANG) > 0 )
+        ;
+}
+
+/*
+ * check the preface, then act on each whole frame in c->in
+ * returns -1 if the connection is to end
+ */
+static int
+parse_input(struct h2conn *c)
+{
+    unsigned char *p = c->in, *end = c->in + c->inlen;
+    int     want = strlen(H2_PREFACE), len;
+
+    for ( ; c->pre < want && p < end ; p++, c->pre++ )
+        if ( *p != H2_PREFACE[c->pre] )
+        {
+            c->dead = 1;            /* not HTTP/2 after all */
+            return -1;
+        }
+    while ( ! c->dead && c->pre == want && end - p >= 9 )
+    {
+        len = p[0] << 16 | p[1] << 8 | p[2];
+        if ( len > H2_FRAME )
+            goaway(c, E_FRAME_SIZE);
+        else if ( end - p < 9 + len )
+            break;
+        else
+        {
+            frame(c, p[3], p[4], get32(p + 5) & H2_MAXWIN, p + 9, len);
+            p += 9 + len;
+        }
+    }
+    memmove(c->in, p, end - p);
+    c->inlen = end - p;
+    return c->dead ? -1 : 0;
+}
+
+static void
+frame(struct h2conn *c, int type, int flags, uint32_t id, unsigned char *p,
+      int len)
+{
+    struct h2stream *s = id != 0 ? find(c, id) : NULL;
+    unsigned char win[4];
+    char    field[LINELEN];
+    long    inc;
+    int     err = E_NONE;
+
+    if ( c->bid != 0 && type != F_CONTINUATION )
+        type = -1;                  /* a header block was cut into */
+    switch ( type )
+    {
+    case -1:
+    case F_PUSH_PROMISE:
+        err = E_PROTOCOL;
+        break;
+    case F_DATA:
+        if ( id == 0 )
+            err = E_PROTOCOL;
+        else if ( len > 0 )
+        {                           /* dropped; the room is free again */
+            put32(win, len);
+            send_frame(c, F_WINDOW_UPDATE, 0, 0, win, 4);
+        }
+        break;
+    case F_HEADERS:
+        c->bweight = H2_WEIGHT;
+        if ( flags & FL_PADDED )
+        {
+            if ( len < 1 || p[0] >= len )
+            {
+                err = E_PROTOCOL;
+                break;
+            }
+            len -= p[0] + 1;
+            p++;
+        }
+        if ( flags & FL_PRIORITY )
+        {
+            if ( len < 5 )
+            {
+                err = E_PROTOCOL;
+                break;
+            }
+            c->bweight = p[4] + 1;
+            p += 5;
+            len -= 5;
+        }
+        if ( id == 0 || id % 2 == 0 )
+            err = E_PROTOCOL;
+        else
+        {
+            c->bid = id;
+            c->blen = 0;
+            add_block(c, flags, p, len);
+        }
+        break;
+    case F_CONTINUATION:
+        if ( id == 0 || id != c->bid )
+            err = E_PROTOCOL;
+        else
+            add_block(c, flags, p, len);
+        break;
+    case F_PRIORITY:
+        if ( id == 0 )
+            err = E_PROTOCOL;
+        else if ( len != 5 )
+            reset(c, id, E_FRAME_SIZE);
+        else if ( s != NULL )
+            s->weight = p[4] + 1;
+        break;
+    case F_RST_STREAM:
+        if ( id == 0 || len != 4 )
+            err = id == 0 ? E_PROTOCOL : E_FRAME_SIZE;
+        else if ( s != NULL )
+            close_stream(c, s, -1);
+        break;
+    case F_SETTINGS:
+        if ( id != 0 )
+            err = E_PROTOCOL;
+        else if ( len % 6 != 0 || ((flags & FL_ACK) && len != 0) )
+            err = E_FRAME_SIZE;
+        else if ( ! (flags & FL_ACK) && settings(c, p, len) == 0 )
+            send_frame(c, F_SETTINGS, FL_ACK, 0, NULL, 0);
+        break;
+    case F_PING:
+        if ( id != 0 || len != 8 )
+            err = id != 0 ? E_PROTOCOL : E_FRAME_SIZE;
+        else if ( ! (flags & FL_ACK) )
+            send_frame(c, F_PING, FL_ACK, 0, p, 8);
+        break;
+    case F_GOAWAY:
+        c->goaway = 1;              /* finish what is open */
+        break;
+    case F_WINDOW_UPDATE:
+        if ( len != 4 )
+        {
+            err = E_FRAME_SIZE;
+            break;
+        }
+        inc = get32(p) & H2_MAXWIN;
+        if ( id == 0 && (inc == 0 || c->window + inc > H2_MAXWIN) )
+            err = inc == 0 ? E_PROTOCOL : E_FLOW;
+        else if ( id == 0 )
+            c->window += inc;
+        else if ( s != NULL && (inc == 0 || s->window + inc > H2_MAXWIN) )
+            close_stream(c, s, inc == 0 ? E_PROTOCOL : E_FLOW);
+        else if ( s != NULL )
+            s->window += inc;
+        break;
+    case F_PRIORITY_UPDATE:
+        if ( id != 0 || len < 4 )
+            err = E_PROTOCOL;
+        else if ( (s = find(c, get32(p) & H2_MAXWIN)) != NULL
+               && len - 4 < (int) sizeof(field) )
+        {
+            memcpy(field, p + 4, len - 4);
+            field[len - 4] = '\0';
+            s->urgency = urgency(field, s->urgency);
+        }
+        break;
+    }                               /* others are ignored */
+    if ( err != E_NONE )
+        goaway(c, err);
+}
+
+/*
+ * the client's SETTINGS; -1 if one is out of range
+ */
+static int
+settings(struct h2conn *c, unsigned char *p, int len)
+{
+    uint32_t v;
+    int     i, id;
+
+    for ( ; len >= 6 ; p += 6, len -= 6 )
+    {
+        id = p[0] << 8 | p[1];
+        v = get32(p + 2);
+        if ( (id == S_PUSH && v > 1)
+          || (id == S_FRAME && (v < H2_FRAME || v > 0xffffff)) )
+        {
+            goaway(c, E_PROTOCOL);
+            return -1;
+        }
+        if ( id == S_WINDOW && v > H2_MAXWIN )
+        {
+            goaway(c, E_FLOW);
+            return -1;
+        }
+        if ( id == S_WINDOW )
+        {                           /* open streams move by as much */
+            for ( i = 0 ; i < c->nmax ; i++ )
+                c->streams[i].window += (long) v - c->initial;
+            c->initial = v;
+        }
+    }                               /* the rest do not bind us */
+    return 0;
+}
+
+static void
+add_block(struct h2conn *c, int flags, unsigned char *p, int len)
+{
+    if ( len > H2_BLOCK - c->blen )
+    {
+        goaway(c, E_CALM);
+        return;
+    }
+    memcpy(c->block + c->blen, p, len);
+    c->blen += len;
+    if ( flags & FL_END_HEADERS )
+        end_headers(c);
+}
+
+/*
+ * a whole header block: decode it, so the table stays in step, and
+ * start the request if it is a new stream we can take
+ */
+static void
+end_headers(struct h2conn *c)
+{
+    char    lines[MAX_RQ_LEN], head[MAX_RQ_LEN];
+    uint32_t id = c->bid;
+    int     n, len, headonly, urg;
+
+    c->bid = 0;
+    if ( (n = HPdecode(&c->dec, c->block, c->blen, lines, sizeof(lines)))
+         == -1 )
+    {
+        goaway(c, E_COMPRESSION);
+        return;
+    }
+    if ( id <= c->lastid || c->goaway )
+        return;                     /* trailers, or a stream gone */
+    c->lastid = id;
+    if ( n == -2 || (len = request_head(lines, n, head, sizeof(head),
+                                        &headonly, &urg)) == -1 )
+        reset(c, id, E_PROTOCOL);
+    else if ( c->nopen == c->nmax )
+        reset(c, id, E_REFUSED);
+    else
+        open_stream(c, id, head, len, headonly, c->bweight, urg);
+}
+
+/*
+ * the decoded fields (n bytes of lines) as an HTTP/1 head in head:
+ * the request line from :method and :path, the other fields, and
+ * :authority as Host: last, so that it wins. Returns its length, or
+ * -1 if a pseudo-field is missing or it is too long
+ */
+static int
+request_head(char *lines, int n, char *head, int room, int *headonlyp,
+             int *urgp)
+{
+    char    rest[MAX_RQ_LEN], *line, *eol, *v;
+    char    *method = NULL, *path = NULL, *auth = NULL;
+    int     len = 0, m;
+
+    *urgp = H2_URGENCY;
+    for ( line = lines ; line < lines + n ; line = eol + 2 )
+    {
+        eol = SNany(line, lines + n, "\r");     /* HPdecode() made them */
+        *eol = '\0';
+        v = strchr(line + 1, ':');
+        *v = '\0';
+        v += 2;
+        if ( strcmp(line, ":method") == 0 )
+            method = v;
+        else if ( strcmp(line, ":path") == 0 )
+            path = v;
+        else if ( strcmp(line, ":authority") == 0 )
+            auth = v;
+        else if ( line[0] != ':' )
+        {
+            if ( strcmp(line, "priority") == 0 )
+                *urgp = urgency(v, *urgp);
+            m = snprintf(rest + len, sizeof(rest) - len, "%s: %s\r\n",
+                         line, v);
+            if ( m >= (int) sizeof(rest) - len )
+                return -1;
+            len += m;
+        }
+    }
+    if ( method == NULL || path == NULL || path[0] != '/' )
+        return -1;
+    *headonlyp = strcmp(method, "HEAD") == 0;
+    m = snprintf(head, room, "%s %s HTTP/2.0\r\n%.*s%s%s%s\r\n", method,
+                 path, len, rest, auth ? "host: " : "", auth ? auth : "",
+                 auth ? "\r\n" : "");
+    return m < room ? m : -1;
+}
+
+static void
+open_stream(struct h2conn *c, uint32_t id, char *head, int len,
+            int headonly, int weight, int urg)
+{
+    struct h2stream *s = find(c, 0);    /* a free slot */
+    int     p[2];
+
+    if ( s->buf == NULL && (s->buf = malloc(H2_FRAME + 1)) == NULL )
+    {
+        reset(c, id, E_INTERNAL);
+        return;
+    }
+    if ( pipe2(p, O_CLOEXEC) == -1 )
+    {
+        reset(c, id, E_REFUSED);
+        return;
+    }
+    fflush(stdout);                 /* or the child says it again */
+    if ( (s->pid = fork()) == 0 )
+    {
+        close(c->fd);
+        close(p[0]);
+        run_stream(c, head, len, p[1]);
+    }
+    close(p[1]);
+    if ( s->pid == -1 )
+    {
+        close(p[0]);
+        reset(c, id, E_REFUSED);
+        return;
+    }
+    s->id = id;
+    s->pfd = p[0];
+    s->body = 0;
+    s->headonly = headonly;
+    s->window = c->initial;
+    s->weight = weight;
+    s->urgency = urg;
+    s->pass = c->vtime;             /* no credit for time not open */
+    s->len = 0;
+    c->nopen++;
+}
+
+/*
+ * in the stream's child: serve the request as handle_call() serves
+ * one from a socket, writing the reply on fd
+ */
+static void
+run_stream(struct h2conn *c, char *head, int len, int fd)
+{
+    char    rq[MAX_RQ_LEN], host[HOST_LEN];
+    struct vhost *vh;
+    struct reply rp;
+    struct trace tr;
+
+    TRstart(&tr, c->addr);          /* from the stream's start  */
+    TRmark(&tr, TR_HEAD);
+    parse_head(head, head + len, rq, sizeof(rq), host, sizeof(host));
+    vh = VHlookup(c->conf->hosts, host[0] ? host : NULL);
+    if ( vh->rootfd != -1 && fchdir(vh->rootfd) == -1 )
+        exit(1);
+    RPinit(&rp, fd);
+    rp.trace = &tr;
+    process_rq(rq, head, head + len, head + len, vh, &rp);
+    RPflush(&rp);
+    TRmark(&tr, TR_LAST);
+    TRlog(&tr, head, head + len, rp.sent);
+    exit(0);
+}
+
+/*
+ * read what the stream's child wrote; when the head is all in, send
+ * it as HEADERS
+ */
+static void
+fill(struct h2conn *c, struct h2stream *s)
+{
+    int     n = read(s->pfd, s->buf + s->len, H2_FRAME - s->len);
+    char    *end;
+
+    if ( n == -1 && (errno == EINTR || errno == EAGAIN) )
+        return;
+    if ( n <= 0 )
+    {
+        close(s->pfd);
+        s->pfd = -1;
+        if ( ! s->body && s->len == 0 )
+            close_stream(c, s, E_INTERNAL);     /* no reply at all */
+        else if ( ! s->body )
+            send_head(c, s, s->buf + s->len);   /* all head */
+        return;
+    }
+    s->len += n;
+    if ( s->body )
+        return;
+    if ( (end = SNhead_end(s->buf, s->buf + s->len)) != NULL )
+        send_head(c, s, end);
+    else if ( s->len == H2_FRAME )
+        close_stream(c, s, E_INTERNAL);         /* no end to the head */
+}
+
+/*
+ * the reply's head, s->buf..end, as a HEADERS frame: ":status" from
+ * the status line, then each field with its name in lower case
+ */
+static void
+send_head(struct h2conn *c, struct h2stream *s, char *end)
+{
+    unsigned char blk[H2_FRAME];
+    char    status[4], name[LINELEN], *line, *eol, *v, keep = *end;
+    int     n, m, i, rest = s->buf + s->len - end;
+
+    *end = '\0';                    /* buf has a byte to spare */
+    if ( sscanf(s->buf, "HTTP/%*s %3[0-9]", status) != 1
+      || strlen(status) != 3 )
+    {
+        close_stream(c, s, E_INTERNAL);
+        return;
+    }
+    n = HPencode(blk, sizeof(blk), ":status", status);
+    for ( line = s->buf ; line != NULL ; line = eol )
+    {
+        if ( (eol = strchr(line, '\n')) != NULL )
+            *eol++ = '\0';
+        if ( (v = strchr(line, '\r')) != NULL )
+            *v = '\0';
+        if ( line == s->buf || (v = strchr(line, ':')) == NULL
+          || v == line || v - line >= (int) sizeof(name) )
+            continue;               /* the status line, or no field */
+        for ( i = 0 ; line + i < v ; i++ )
+            name[i] = tolower((unsigned char) line[i]);
+        name[i] = '\0';
+        if ( strspn(name, H2_TOKEN) != (size_t) i || hop_by_hop(name) )
+            continue;               /* not a name, or HTTP/1's own */
+        for ( v++ ; *v == ' ' || *v == '\t' ; v++ )
+            ;
+        if ( (m = HPencode(blk + n, sizeof(blk) - n, name, v)) == -1 )
+        {
+            close_stream(c, s, E_INTERNAL);
+            return;
+        }
+        n += m;
+    }
+    *end = keep;
+
+    send_frame(c, F_HEADERS,
+               FL_END_HEADERS | (s->headonly ? FL_END_STREAM : 0),
+               s->id, blk, n);
+    memmove(s->buf, end, rest);
+    s->len = rest;
+    s->body = 1;
+    if ( s->headonly )
+        close_stream(c, s, -1);
+}
+
+/*
+ * the stream to send DATA for next: the most urgent that has bytes
+ * and window, or has ended; among those the one that has had least
+ * for its weight
+ */
+static struct h2stream *
+pick(struct h2conn *c)
+{
+    struct h2stream *s, *best = NULL;
+    int     i;
+
+    for ( i = 0 ; i < c->nmax ; i++ )
+    {
+        s = &c->streams[i];
+        if ( s->id == 0 || ! s->body
+          || ! ((s->len > 0 && s->window > 0 && c->window > 0)
+             || (s->len == 0 && s->pfd == -1)) )
+            continue;
+        if ( best == NULL || s->urgency < best->urgency
+          || (s->urgency == best->urgency && s->pass < best->pass) )
+            best = s;
+    }
+    return best;
+}
+
+/*
+ * one DATA frame of what the stream has, within the windows; the last
+ * one ends the stream
+ */
+static void
+send_data(struct h2conn *c, struct h2stream *s)
+{
+    long    n = s->len;
+    int     fin;
+
+    if ( n > s->window )
+        n = s->window;
+    if ( n > c->window )
+        n = c->window;
+    if ( n < 0 )
+        n = 0;                      /* a window cut below 0 */
+    fin = s->pfd == -1 && n == s->len;
+    send_frame(c, F_DATA, fin ? FL_END_STREAM : 0, s->id, s->buf, n);
+    s->window -= n;
+    c->window -= n;
+    s->len -= n;
+    memmove(s->buf, s->buf + n, s->len);
+    c->vtime = s->pass;
+    s->pass += (n + 1) * H2_STRIDE / s->weight;
+    if ( fin )
+        close_stream(c, s, -1);
+}
+
+/*
+ * forget the stream: stop its child if it has not finished, and tell
+ * the client with RST_STREAM code, unless that is -1
+ */
+static void
+close_stream(struct h2conn *c, struct h2stream *s, int code)
+{
+    if ( s->pfd != -1 )
+    {
+        close(s->pfd);
+        s->pfd = -1;
+        kill(s->pid, SIGKILL);
+    }
+    if ( code != -1 )
+        reset(c, s->id, code);
+    s->id = 0;
+    s->len = 0;
+    c->nopen--;
+}
+
+/*
+ * the open stream id, or a free slot for id 0
+ */
+static struct h2stream *
+find(struct h2conn *c, uint32_t id)
+{
+    int     i;
+
+    for ( i = 0 ; i < c->nmax ; i++ )
+        if ( c->streams[i].id == id )
+            return &c->streams[i];
+    return NULL;
+}
+
+static void
+send_frame(struct h2conn *c, int type, int flags, uint32_t id, void *data,
+           int len)
+{
+    unsigned char hd[9];
+
+    if ( c->dead )
+        return;
+    hd[0] = len >> 16;
+    hd[1] = len >> 8;
+    hd[2] = len;
+    hd[3] = type;
+    hd[4] = flags;
+    put32(hd + 5, id);
+    RPadd(&c->out, (char *) hd, sizeof(hd));
+    if ( len > 0 )
+        RPref(&c->out, data, len);
+    if ( RPflush(&c->out) != 0 )
+        c->dead = 1;                /* gone, or stalled too long */
+}
+
+static void
+reset(struct h2conn *c, uint32_t id, int code)
+{
+    unsigned char b[4];
+
+    put32(b, code);
+    send_frame(c, F_RST_STREAM, 0, id, b, sizeof(b));
+}
+
+/*
+ * end the connection, telling the client why
+ */
+static void
+goaway(struct h2conn *c, int code)
+{
+    unsigned char b[8];
+
+    put32(b, c->lastid);
+    put32(b + 4, code);
+    send_frame(c, F_GOAWAY, 0, 0, b, sizeof(b));
+    c->dead = 1;
+}
+
+/*
+ * the u= of an RFC 9218 priority value, or u if it has none
+ */
+static int
+urgency(char *v, int u)
+{
+    char    *p;
+
+    for ( p = v ; (p = strstr(p, "u=")) != NULL ; p += 2 )
+        if ( (p == v || p[-1] == ' ' || p[-1] == ',')
+          && p[2] >= '0' && p[2] <= '7' && strchr(" ,;", p[3]) != NULL )
+            return p[2] - '0';
+    return u;
+}
+
+static int
+hop_by_hop(char *name)
+{
+    static char *names[] = { "connection", "keep-alive", "proxy-connection",
+                             "transfer-encoding", "upgrade", NULL };
+    int     i;
+
+    for ( i = 0 ; names[i] != NULL ; i++ )
+        if ( strcmp(name, names[i]) == 0 )
+            return 1;
+    return 0;
+}
+
+/*
+ * base64url, as HTTP2-Settings has it; returns the bytes, or -1
+ */
+static int
+unbase64(char *s, unsigned char *out, int room)
+{
+    static char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                           "abcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned bits = 0;
+    int     nbits = 0, n = 0;
+    char    *d;
+
+    for ( ; *s != '\0' && *s != '=' ; s++ )
+    {
+        if ( (d = strchr(digits, *s)) == NULL )
+            return -1;
+        bits = bits << 6 | (d - digits);
+        if ( (nbits += 6) >= 8 )
+        {
+            if ( n == room )
+                return -1;
+            nbits -= 8;
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+static uint32_t
+get32(unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
@@ -0,0 +1,19 @@
+#ifndef H2_H
+#define H2_H
+/*
+ * header for h2.c package
+ */
+
+#define H2_PRI          "PRI * HTTP/2.0"    /* how the preface starts */
+#define H2_PRIOR        1           /* H2wants(): the preface   */
+#define H2_UPGRADE      2           /*   an Upgrade: h2c        */
+#define H2_MAXSTREAMS   256         /* http2_streams, at most   */
+
+struct config;
+struct reply;
+
+int     H2wants(char *, char *, char *);
+void    H2serve(int, int, char *, char *, int, unsigned, struct config *);
+void    H2refuse(struct reply *);
+
+#endif
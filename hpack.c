@@ -0,0 +1,494 @@
+/* hpack.c
+ *
+ * HPACK, the header compression of HTTP/2 (RFC 7541), for h2.c
+ *
+ * interface:
+ *     HPinit( hp, limit )           start a decoder whose dynamic table
+ *                                   holds at most limit bytes; 0 ok,
+ *                                   -1 no memory
+ *     HPdecode( hp, blk, len, out, room )
+ *                                   decode the header block blk into
+ *                                   "name: value\r\n" lines in out
+ *                                   (room bytes); returns their length,
+ *                                   -1 if the block is bad (the
+ *                                   connection cannot go on), -2 if
+ *                                   the lines do not fit or a field
+ *                                   has a CR, LF or NUL in it
+ *     HPencode( out, room, name, value )
+ *                                   add one field to a block being made
+ *                                   at out; returns the bytes, or -1 if
+ *                                   there is no room
+ *     HPfree( hp )                  release the decoder's table
+ *
+ * details:
+ *      A header block refers to the static table of 61 common fields
+ *      and to a dynamic table the sender fills as it goes, so the
+ *      decoder has to read every block on the connection, in order,
+ *      even those whose stream it will refuse. The dynamic table is a
+ *      ring, newest first; each entry is one allocation holding the
+ *      name and value, and counts their lengths plus 32 bytes. Adding
+ *      an entry pushes the oldest out until it fits.
+ *
+ *      Strings may be Huffman coded. The code in RFC 7541 appendix B
+ *      is canonical: within a length the codes count up in symbol
+ *      order, so the length of each code (hufflen[]) is all that is
+ *      stored. HPinit() builds, per length, the first code and where
+ *      its symbols start, and a string is then decoded a bit at a
+ *      time. Up to 7 bits of padding, all ones, may end it.
+ *
+ *      The encoder only writes literals that are not indexed and not
+ *      Huffman coded, naming a static entry where there is one. That
+ *      keeps no state, so whatever table size the peer asks for
+ *      suits it. The replies wsng makes have few headers, and their
+ *      values mostly change from one response to the next.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdint.h>
+#include    "hpack.h"
+
+#define HP_MAXINT   (1u << 28)      /* largest integer taken    */
+#define HP_EOS      256             /* Huffman end of string    */
+
+struct hpstatic {
+    char    *name, *value;
+};
+
+static struct hpstatic statics[] = {
+    { NULL, NULL },                 /* indexes count from 1     */
+    { ":authority", "" },           { ":method", "GET" },
+    { ":method", "POST" },          { ":path", "/" },
+    { ":path", "/index.html" },     { ":scheme", "http" },
+    { ":scheme", "https" },         { ":status", "200" },
+    { ":status", "204" },           { ":status", "206" },
+    { ":status", "304" },           { ":status", "400" },
+    { ":status", "404" },           { ":status", "500" },
+    { "accept-charset", "" },       { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },      { "accept-ranges", "" },
+    { "accept", "" },               { "access-control-allow-origin", "" },
+    { "age", "" },                  { "allow", "" },
+    { "authorization", "" },        { "cache-control", "" },
+    { "content-disposition", "" },  { "content-encoding", "" },
+    { "content-language", "" },     { "content-length", "" },
+    { "content-location", "" },     { "content-range", "" },
+    { "content-type", "" },         { "cookie", "" },
+    { "date", "" },                 { "etag", "" },
+    { "expect", "" },               { "expires", "" },
+    { "from", "" },                 { "host", "" },
+    { "if-match", "" },             { "if-modified-since", "" },
+    { "if-none-match", "" },        { "if-range", "" },
+    { "if-unmodified-since", "" },  { "last-modified", "" },
+    { "link", "" },                 { "location", "" },
+    { "max-forwards", "" },         { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },  { "range", "" },
+    { "referer", "" },              { "refresh", "" },
+    { "retry-after", "" },          { "server", "" },
+    { "set-cookie", "" },           { "strict-transport-security", "" },
+    { "transfer-encoding", "" },    { "user-agent", "" },
+    { "vary", "" },                 { "via", "" },
+    { "www-authenticate", "" },
+};
+#define HP_NSTATIC  61
+
+/* bits in the Huffman code of each byte, and of EOS */
+static const uint8_t hufflen[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static uint32_t huff_first[31];     /* first code of each length */
+static int      huff_count[31];     /* codes of each length     */
+static int      huff_base[31];      /* their place in huff_syms */
+static uint16_t huff_syms[257];     /* by length, then symbol   */
+
+static void     huff_init(void);
+static int      get_int(unsigned char **, unsigned char *, int, uint32_t *);
+static char     *get_string(unsigned char **, unsigned char *, size_t *);
+static char     *huff_decode(unsigned char *, size_t, size_t *);
+static int      field(struct hpack *, uint32_t, char **, size_t *,
+                      char **, size_t *);
+static int      insert(struct hpack *, char *, size_t, char *, size_t);
+static void     evict(struct hpack *, size_t);
+static int      put_line(char *, size_t, size_t *, char *, size_t,
+                         char *, size_t);
+static int      put_int(unsigned char *, size_t, int, uint32_t, int);
+static int      put_string(unsigned char *, size_t, char *);
+
+int
+HPinit(struct hpack *hp, size_t limit)
+{
+    memset(hp, 0, sizeof(struct hpack));
+    hp->cap = limit / 32 + 1;       /* the most entries that fit */
+    if ( (hp->ring = calloc(hp->cap, sizeof(struct hpfield))) == NULL )
+        return -1;
+    hp->max = hp->limit = limit;
+    if ( huff_count[5] == 0 )
+        huff_init();
+    return 0;
+}
+
+void
+HPfree(struct hpack *hp)
+{
+    hp->max = 0;
+    evict(hp, 0);
+    free(hp->ring);
+    hp->ring = NULL;
+}
+
+int
+HPdecode(struct hpack *hp, unsigned char *blk, size_t len, char *out,
+         size_t room)
+{
+    unsigned char *p = blk, *end = blk + len;
+    char    *name, *value, *nbuf, *vbuf;
+    size_t  nlen, vlen, used = 0;
+    uint32_t n;
+    int     bad = 0, index, fields = 0;
+
+    while ( p < end )
+    {
+        nbuf = vbuf = NULL;
+        if ( *p & 0x80 )            /* indexed field */
+        {
+            if ( get_int(&p, end, 7, &n) != 0
+              || n == 0 || field(hp, n, &name, &nlen, &value, &vlen) != 0 )
+                return -1;
+            bad |= put_line(out, room, &used, name, nlen, value, vlen);
+            fields++;
+            continue;
+        }
+        if ( (*p & 0xe0) == 0x20 )  /* dynamic table size update */
+        {
+            if ( fields > 0 || get_int(&p, end, 5, &n) != 0
+              || n > hp->limit )
+                return -1;
+            hp->max = n;
+            evict(hp, 0);
+            continue;
+        }
+        index = (*p & 0xc0) == 0x40;    /* with incremental indexing */
+        if ( get_int(&p, end, index ? 6 : 4, &n) != 0 )
+            return -1;
+        if ( n == 0 )
+        {
+            if ( (name = nbuf = get_string(&p, end, &nlen)) == NULL )
+                return -1;
+        }
+        else if ( field(hp, n, &name, &nlen, &value, &vlen) != 0 )
+            return -1;
+        if ( (value = vbuf = get_string(&p, end, &vlen)) == NULL )
+        {
+            free(nbuf);
+            return -1;
+        }
+        bad |= put_line(out, room, &used, name, nlen, value, vlen);
+        fields++;
+        if ( index && insert(hp, name, nlen, value, vlen) != 0 )
+            bad = 1;
+        free(nbuf);
+        free(vbuf);
+    }
+    return bad ? -2 : (int) used;
+}
+
+/*
+ * one field, without indexing: an indexed name where the static table
+ * has it, else a literal one
+ */
+int
+HPencode(unsigned char *out, size_t room, char *name, char *value)
+{
+    int     i, n, m;
+
+    for ( i = 1 ; i <= HP_NSTATIC ; i++ )
+        if ( strcmp(statics[i].name, name) == 0 )
+            break;
+    if ( i <= HP_NSTATIC && strcmp(statics[i].value, value) == 0 )
+        return put_int(out, room, 7, i, 0x80);
+    if ( i <= HP_NSTATIC )
+        n = put_int(out, room, 4, i, 0x00);
+    else if ( room > 0 )
+    {
+        out[0] = 0x00;
+        if ( (n = put_string(out + 1, room - 1, name)) != -1 )
+            n++;
+    }
+    else
+        n = -1;
+    if ( n == -1 || (m = put_string(out + n, room - n, value)) == -1 )
+        return -1;
+    return n + m;
+}
+
+/*
+ * the canonical code: each length's first code follows on from the
+ * last code of the length before
+ */
+static void
+huff_init()
+{
+    uint32_t code = 0;
+    int     len, sym, at = 0;
+
+    for ( len = 1 ; len <= 30 ; len++ )
+    {
+        huff_first[len] = code;
+        huff_base[len] = at;
+        for ( sym = 0 ; sym <= HP_EOS ; sym++ )
+            if ( hufflen[sym] == len )
+            {
+                huff_syms[at++] = sym;
+                code++;
+            }
+        huff_count[len] = at - huff_base[len];
+        code <<= 1;
+    }
+}
+
+/*
+ * an integer with an n-bit prefix; 0 ok, -1 bad or too big
+ */
+static int
+get_int(unsigned char **pp, unsigned char *end, int n, uint32_t *vp)
+{
+    unsigned char *p = *pp;
+    uint32_t mask = (1u << n) - 1, v;
+    int     shift = 0;
+
+    if ( p >= end )
+        return -1;
+    if ( (v = *p++ & mask) == mask )
+    {
+        do
+        {
+            if ( p >= end || shift > 21 )
+                return -1;
+            v += (uint32_t) (*p & 0x7f) << shift;
+            shift += 7;
+        } while ( *p++ & 0x80 );
+    }
+    if ( v > HP_MAXINT )
+        return -1;
+    *pp = p;
+    *vp = v;
+    return 0;
+}
+
+/*
+ * a string literal, decoded into a new NUL-ended allocation
+ */
+static char *
+get_string(unsigned char **pp, unsigned char *end, size_t *lenp)
+{
+    int     huff = (*pp < end) && (**pp & 0x80);
+    uint32_t len;
+    char    *s;
+
+    if ( get_int(pp, end, 7, &len) != 0 || len > (size_t) (end - *pp) )
+        return NULL;
+    if ( huff )
+        s = huff_decode(*pp, len, lenp);
+    else if ( (s = malloc(len + 1)) != NULL )
+    {
+        memcpy(s, *pp, len);
+        s[len] = '\0';
+        *lenp = len;
+    }
+    *pp += len;
+    return s;
+}
+
+static char *
+huff_decode(unsigned char *in, size_t len, size_t *lenp)
+{
+    char    *s = malloc(len * 8 / 5 + 1);   /* codes are 5 bits or more */
+    uint32_t code = 0;
+    size_t  i, n = 0;
+    int     bits = 0, sym;
+
+    if ( s == NULL )
+        return NULL;
+    for ( i = 0 ; i < len * 8 && bits < 30 ; i++ )
+    {
+        code = (code << 1) | ((in[i / 8] >> (7 - i % 8)) & 1);
+        bits++;
+        if ( code - huff_first[bits] >= (uint32_t) huff_count[bits] )
+            continue;
+        if ( (sym = huff_syms[huff_base[bits] + code - huff_first[bits]])
+             == HP_EOS )
+            break;
+        s[n++] = sym;
+        code = bits = 0;
+    }
+    /* EOS, or padding that is long or not all ones */
+    if ( i < len * 8 || bits > 7 || code != (1u << bits) - 1 )
+    {
+        free(s);
+        return NULL;
+    }
+    s[n] = '\0';
+    *lenp = n;
+    return s;
+}
+
+/*
+ * the name and value at index n of the static, then dynamic table
+ */
+static int
+field(struct hpack *hp, uint32_t n, char **namep, size_t *nlenp,
+      char **valuep, size_t *vlenp)
+{
+    struct hpfield *f;
+
+    if ( n <= HP_NSTATIC )
+    {
+        *namep = statics[n].name;
+        *nlenp = strlen(*namep);
+        *valuep = statics[n].value;
+        *vlenp = strlen(*valuep);
+        return 0;
+    }
+    if ( (n -= HP_NSTATIC + 1) >= (uint32_t) hp->count )
+        return -1;
+    f = &hp->ring[(hp->first + n) % hp->cap];
+    *namep = f->name;
+    *nlenp = f->nlen;
+    *valuep = f->value;
+    *vlenp = f->vlen;
+    return 0;
+}
+
+/*
+ * add a field as the newest entry. name may be an entry that is about
+ * to be pushed out, so it is copied first
+ */
+static int
+insert(struct hpack *hp, char *name, size_t nlen, char *value, size_t vlen)
+{
+    size_t  need = nlen + vlen + 32;
+    struct hpfield *f;
+    char    *s;
+
+    if ( need > hp->max )
+    {
+        evict(hp, hp->max + 1);     /* it empties the table */
+        return 0;
+    }
+    if ( (s = malloc(nlen + vlen + 2)) == NULL )
+        return -1;
+    memcpy(s, name, nlen);
+    s[nlen] = '\0';
+    memcpy(s + nlen + 1, value, vlen);
+    s[nlen + 1 + vlen] = '\0';
+    evict(hp, need);
+
+    hp->first = (hp->first + hp->cap - 1) % hp->cap;
+    f = &hp->ring[hp->first];
+    f->name = s;
+    f->nlen = nlen;
+    f->value = s + nlen + 1;
+    f->vlen = vlen;
+    hp->count++;
+    hp->size += need;
+    return 0;
+}
+
+/*
+ * drop the oldest entries until need more bytes fit in max
+ */
+static void
+evict(struct hpack *hp, size_t need)
+{
+    struct hpfield *f;
+
+    while ( hp->count > 0 && hp->size + need > hp->max )
+    {
+        f = &hp->ring[(hp->first + hp->count - 1) % hp->cap];
+        hp->size -= f->nlen + f->vlen + 32;
+        free(f->name);
+        f->name = f->value = NULL;
+        hp->count--;
+    }
+}
+
+/*
+ * "name: value\r\n" at out + *usedp; 1 if it does not fit or cannot
+ * be a line of a request head
+ */
+static int
+put_line(char *out, size_t room, size_t *usedp, char *name, size_t nlen,
+         char *value, size_t vlen)
+{
+    size_t  used = *usedp;
+
+    if ( memchr(name, '\r', nlen) || memchr(name, '\n', nlen)
+      || memchr(name, '\0', nlen) || memchr(value, '\r', vlen)
+      || memchr(value, '\n', vlen) || memchr(value, '\0', vlen)
+      || room - used < nlen + vlen + 4 )
+        return 1;
+    memcpy(out + used, name, nlen);
+    memcpy(out + used + nlen, ": ", 2);
+    memcpy(out + used + nlen + 2, value, vlen);
+    memcpy(out + used + nlen + 2 + vlen, "\r\n", 2);
+    *usedp = used + nlen + vlen + 4;
+    return 0;
+}
+
+/*
+ * v with an n-bit prefix, the first byte's other bits set to flags
+ */
+static int
+put_int(unsigned char *out, size_t room, int n, uint32_t v, int flags)
+{
+    uint32_t mask = (1u << n) - 1;
+    size_t  i = 0;
+
+    if ( room == 0 )
+        return -1;
+    if ( v < mask )
+    {
+        out[0] = flags | v;
+        return 1;
+    }
+    out[i++] = flags | mask;
+    for ( v -= mask ; v >= 0x80 ; v >>= 7 )
+    {
+        if ( i == room )
+            return -1;
+        out[i++] = (v & 0x7f) | 0x80;
+    }
+    if ( i == room )
+        return -1;
+    out[i++] = v;
+    return i;
+}
+
+static int
+put_string(unsigned char *out, size_t room, char *s)
+{
+    size_t  len = strlen(s);
+    int     n = put_int(out, room, 7, len, 0x00);
+
+    if ( n == -1 || room - n < len )
+        return -1;
+    memcpy(out + n, s, len);
+    return n + len;
+}
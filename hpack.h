@@ -0,0 +1,30 @@
+#ifndef HPACK_H
+#define HPACK_H
+/*
+ * header for hpack.c package
+ */
+
+#include    <stddef.h>
+
+#define HP_TABLE    4096            /* dynamic table, by default */
+
+struct hpfield {                    /* one dynamic table entry  */
+    char            *name;          /* value follows it in the  */
+    char            *value;         /* same allocation          */
+    size_t          nlen, vlen;
+};
+
+struct hpack {                      /* a decoder's state        */
+    struct hpfield  *ring;          /* newest at first          */
+    int             cap, first, count;
+    size_t          size;           /* as RFC 7541 counts it    */
+    size_t          max;            /* now, after size updates  */
+    size_t          limit;          /* what we told the peer    */
+};
+
+int     HPinit(struct hpack *, size_t);
+int     HPdecode(struct hpack *, unsigned char *, size_t, char *, size_t);
+int     HPencode(unsigned char *, size_t, char *, char *);
+void    HPfree(struct hpack *);
+
+#endif
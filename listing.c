@@ -0,0 +1,236 @@
+/* listing.c
+ *
+ * makes an HTML directory listing a piece at a time
+ *
+ * interface:
+ *     LSopen( dirfd )               returns a listing of the open
+ *                                   directory, or NULL
+ *     LSfill( ls, r )               queue the next piece on reply r:
+ *                                   1 more to come, 0 done, -1 error
+ *     LSload( ls )                  read and stat the next batch, if
+ *                                   LSfill() will want one: 0 or -1
+ *     LSloaded( ls )                1 if LSfill() can go on without
+ *                                   touching the disk
+ *     LSclose( ls )                 free the listing
+ *
+ * details:
+ *      A listing is a producer that can stop and start. Entries are
+ *      read straight from the kernel with getdents64(), LS_DENTS bytes
+ *      at a time, and rendered as table rows into a buffer of LS_BUF
+ *      bytes that belongs to the listing. When the next row does not
+ *      fit, LSfill() queues the buffer on the reply by reference and
+ *      returns; where it stopped (in the getdents batch) is kept.
+ *
+ *      The caller sends the reply before calling LSfill() again, since
+ *      the buffer is reused. A blocking server just loops on LSfill()
+ *      and RPflush(); a non-blocking one waits for the socket between
+ *      the two. Either way a directory of any size is listed in the
+ *      same two buffers.
+ *
+ *      Each entry is fstatat()ed relative to the directory, without
+ *      following symlinks, for its time and size. That is done for a
+ *      whole getdents batch at once by LSload(), and a piece stops at
+ *      the end of a batch, so the disk work and the rendering can be
+ *      run apart: an event loop sends LSload() to its fs pool and
+ *      renders on its own thread. LSfill() calls LSload() itself
+ *      when it has to, so a blocking caller need not know.
+ */
+
+#define     _GNU_SOURCE
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/syscall.h>
+#include    "reply.h"
+#include    "listing.h"
+
+#define LS_DENTS    32768           /* getdents64() batch       */
+#define LS_BUF      65536           /* rendered rows per piece  */
+#define LS_ENTS     (LS_DENTS / 24) /* a dirent64 takes 24 at least */
+
+struct dirent64 {                   /* what getdents64() returns */
+    ino_t           d_ino;
+    off_t           d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+struct lsstat {                     /* what fstatat() said      */
+    char            ok, dir;
+    time_t          mtime;
+    off_t           size;
+};
+
+enum { LS_HEAD, LS_ROWS, LS_TAIL, LS_DONE };
+
+struct listing {
+    int             dirfd;          /* our own dup              */
+    int             state;
+    int             eof;            /* getdents64() said 0      */
+    int             dpos, dlen;     /* place in dents           */
+    int             dnum;           /* entry number at dpos     */
+    char            dents[LS_DENTS];
+    struct lsstat   st[LS_ENTS];    /* one per entry in dents   */
+    int             olen;
+    char            out[LS_BUF];
+};
+
+char    *table_time(time_t);        /* from web-time.c */
+
+static int      put_row(struct listing *, char *, struct lsstat *);
+
+struct listing *
+LSopen(int dirfd)
+{
+    struct listing *ls = malloc(sizeof(struct listing));
+
+    if ( ls == NULL )
+        return NULL;
+    if ( (ls->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0)) == -1 )
+    {
+        free(ls);
+        return NULL;
+    }
+    lseek(ls->dirfd, 0, SEEK_SET);  /* the dup shares the position */
+    ls->state = LS_HEAD;
+    ls->eof = 0;
+    ls->dpos = ls->dlen = ls->dnum = 0;
+    return ls;
+}
+
+int
+LSfill(struct listing *ls, struct reply *r)
+{
+    struct dirent64 *dp;
+
+    ls->olen = 0;
+    if ( LSload(ls) == -1 )
+        return -1;
+    if ( ls->state == LS_HEAD )
+    {
+        ls->olen = snprintf(ls->out, LS_BUF,
+                    "<table>\n<tbody>\n<tr><th>Name</th>"
+                    "<th>Last Modified</th><th>Size</th></tr>\n");
+        ls->state = LS_ROWS;
+    }
+
+    while ( ls->state == LS_ROWS )
+    {
+        if ( ls->dpos >= ls->dlen )             /* batch used up */
+        {
+            if ( ls->eof )
+            {
+                ls->state = LS_TAIL;
+                break;
+            }
+            if ( ls->olen > 0 )
+                break;                          /* load it next time */
+            if ( LSload(ls) == -1 )
+                return -1;
+            continue;
+        }
+        dp = (struct dirent64 *) (ls->dents + ls->dpos);
+        if ( put_row(ls, dp->d_name, &ls->st[ls->dnum]) == -1 )
+            break;                              /* buffer full */
+        ls->dpos += dp->d_reclen;
+        ls->dnum++;
+    }
+
+    if ( ls->state == LS_TAIL && LS_BUF - ls->olen > 32 )
+    {
+        ls->olen += snprintf(ls->out + ls->olen, LS_BUF - ls->olen,
+                             "</tbody></table>\n");
+        ls->state = LS_DONE;
+    }
+
+    if ( RPref(r, ls->out, ls->olen) == -1 )
+        return -1;
+    return ls->state != LS_DONE;
+}
+
+int
+LSload(struct listing *ls)
+{
+    struct dirent64 *dp;
+    struct lsstat *sp;
+    struct stat info;
+    int     n, pos;
+
+    if ( LSloaded(ls) )
+        return 0;
+    n = syscall(SYS_getdents64, ls->dirfd, ls->dents, LS_DENTS);
+    if ( n == -1 )
+    {
+        fprintf(stderr, "Couldn't read directory\n");
+        return -1;
+    }
+    if ( n == 0 )
+    {
+        ls->eof = 1;
+        return 0;
+    }
+    for ( pos = 0, sp = ls->st ; pos < n ; pos += dp->d_reclen, sp++ )
+    {
+        dp = (struct dirent64 *) (ls->dents + pos);
+        sp->ok = fstatat(ls->dirfd, dp->d_name, &info,
+                         AT_SYMLINK_NOFOLLOW) == 0;
+        if ( ! sp->ok )
+        {
+            fprintf(stderr, "error with %s\n", dp->d_name);
+            continue;
+        }
+        sp->dir   = S_ISDIR(info.st_mode);
+        sp->mtime = info.st_mtime;
+        sp->size  = info.st_size;
+    }
+    ls->dpos = ls->dnum = 0;
+    ls->dlen = n;
+    return 0;
+}
+
+int
+LSloaded(struct listing *ls)
+{
+    return ls->eof || ls->dpos < ls->dlen;
+}
+
+void
+LSclose(struct listing *ls)
+{
+    close(ls->dirfd);
+    free(ls);
+}
+
+/*
+ * render one table row: name (linked, with a trailing '/' for
+ * a directory), last modified time, and size.
+ * returns -1 if it does not fit in what is left of the buffer
+ */
+static int
+put_row(struct listing *ls, char *name, struct lsstat *sp)
+{
+    int     n;
+    int     room = LS_BUF - ls->olen;
+
+    if ( ! sp->ok )
+        return 0;                   /* skip it; LSload() said so */
+    n = snprintf(ls->out + ls->olen, room,
+                 "<tr><td><a href='%s%s'>%s</a></td>"
+                 "<td>%s</td><td>%d</td></tr>",
+                 name, sp->dir ? "/" : "", name,
+                 table_time(sp->mtime), (int) sp->size);
+    if ( n >= room )
+    {
+        if ( ls->olen == 0 )        /* can't fit even alone: skip */
+            return 0;
+        return -1;
+    }
+    ls->olen += n;
+    return 0;
+}
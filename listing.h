@@ -0,0 +1,16 @@
+#ifndef LISTING_H
+#define LISTING_H
+/*
+ * header for listing.c package
+ */
+
+struct listing;
+struct reply;
+
+struct listing  *LSopen(int);
+int             LSfill(struct listing *, struct reply *);
+int             LSload(struct listing *);
+int             LSloaded(struct listing *);
+void            LSclose(struct listing *);
+
+#endif
@@ -0,0 +1,241 @@
+/* pack.c
+ *
+ * a whole site packed into one read-only file by wsng-pack, mapped
+ * once and served from memory
+ *
+ * interface:
+ *     PKopen( file )                map a bundle and check it; returns
+ *                                   it, or NULL
+ *     PKclose( pk )                 unmap it
+ *     PKlookup( pk, path )          returns the entry for a normalized
+ *                                   item ("." for the root), or NULL
+ *     PKchild( pk, dir, name )      returns name in the directory
+ *                                   entry dir, or NULL
+ *     PKstr( pk, off )              returns the string at off
+ *     PKbytes( pk, e, gzip, &len )  returns e's bytes, gzip'd if gzip
+ *                                   and there is such a copy
+ *     PKlist( pk, dir, r )          queue the listing of dir on r, in
+ *                                   the same HTML as listing.c
+ *     PKhash( path )                the index's hash of a path
+ *
+ * details:
+ *      A bundle is built from a server_root by wsngpack.c. It holds
+ *      the bytes of every file (and a gzip'd copy where that is
+ *      smaller), then the tables: a header (struct pkhead), the
+ *      entries sorted by path, a power-of-2 array of hash chains
+ *      through them, each directory's entries in name order, and the
+ *      strings (paths, Content-Types and ETags). pack.h describes
+ *      all of it, and both sides include it.
+ *
+ *      PKopen() maps the file MAP_POPULATE and checks every offset in
+ *      it once, so nothing after that can point outside the mapping.
+ *      Chains must run to higher entries, so none can loop.
+ *      A lookup is a hash and a short chain with no system call, and
+ *      the reply points straight into the mapping.
+ *
+ *      The file must not change while it is mapped: build a new one
+ *      beside it, rename it over the old, and reload. The old mapping
+ *      goes with the old config.
+ */
+
+#define     _GNU_SOURCE
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    "reply.h"
+#include    "pack.h"
+
+#define PK_PATH     4096            /* longest path looked up   */
+
+struct pack {
+    char            *base;
+    uint64_t        size;
+    struct pkhead   *head;
+    struct pkentry  *entries;
+    uint32_t        *buckets;
+    uint32_t        *children;
+};
+
+char    *table_time(time_t);        /* from web-time.c */
+
+static int      check(struct pack *);
+
+struct pack *
+PKopen(char *file)
+{
+    struct pack *pk = calloc(1, sizeof(struct pack));
+    struct stat info;
+    int     fd;
+
+    if ( pk == NULL )
+        return NULL;
+    if ( (fd = open(file, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &info) == -1
+      || info.st_size < (off_t) sizeof(struct pkhead) )
+    {
+        if ( fd != -1 )
+            close(fd);
+        free(pk);
+        return NULL;
+    }
+    pk->size = info.st_size;
+    pk->base = mmap(NULL, pk->size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                    fd, 0);
+    close(fd);                      /* the mapping keeps it */
+    if ( pk->base == MAP_FAILED )
+    {
+        free(pk);
+        return NULL;
+    }
+    if ( check(pk) != 0 )
+    {
+        fprintf(stderr, "%s: not a good bundle\n", file);
+        PKclose(pk);
+        return NULL;
+    }
+    return pk;
+}
+
+void
+PKclose(struct pack *pk)
+{
+    if ( pk == NULL )
+        return;
+    munmap(pk->base, pk->size);
+    free(pk);
+}
+
+struct pkentry *
+PKlookup(struct pack *pk, char *path)
+{
+    uint32_t h = PKhash(path), i;
+    struct pkentry *e;
+
+    for ( i = pk->buckets[h & (pk->head->nbuckets - 1)] ; i != PK_NONE
+        ; i = e->next )
+    {
+        e = &pk->entries[i];
+        if ( e->hash == h && strcmp(pk->base + e->path, path) == 0 )
+            return e;
+    }
+    return NULL;
+}
+
+struct pkentry *
+PKchild(struct pack *pk, struct pkentry *dir, char *name)
+{
+    char    path[PK_PATH];
+    char    *dpath = pk->base + dir->path;
+    int     n;
+
+    if ( strcmp(dpath, ".") == 0 )
+        n = snprintf(path, sizeof(path), "%s", name);
+    else
+        n = snprintf(path, sizeof(path), "%s/%s", dpath, name);
+    return n < (int) sizeof(path) ? PKlookup(pk, path) : NULL;
+}
+
+char *
+PKstr(struct pack *pk, uint64_t off)
+{
+    return pk->base + off;
+}
+
+char *
+PKbytes(struct pack *pk, struct pkentry *e, int gzip, uint64_t *lenp)
+{
+    if ( gzip && e->gzlen > 0 )
+    {
+        *lenp = e->gzlen;
+        return pk->base + e->gzoff;
+    }
+    *lenp = e->len;
+    return pk->base + e->off;
+}
+
+void
+PKlist(struct pack *pk, struct pkentry *dir, struct reply *r)
+{
+    struct pkentry *e;
+    char    *name;
+    uint32_t i;
+
+    RPprintf(r, "<table>\n<tbody>\n<tr><th>Name</th>"
+                "<th>Last Modified</th><th>Size</th></tr>\n");
+    for ( i = 0 ; i < dir->nkids ; i++ )
+    {
+        e = &pk->entries[pk->children[dir->kids + i]];
+        if ( (name = strrchr(pk->base + e->path, '/')) == NULL )
+            name = pk->base + e->path;
+        else
+            name++;
+        RPprintf(r, "<tr><td><a href='%s%s'>%s</a></td>"
+                    "<td>%s</td><td>%d</td></tr>",
+                 name, e->dir ? "/" : "", name,
+                 table_time(e->mtime), (int) e->len);
+    }
+    RPprintf(r, "</tbody></table>\n");
+}
+
+/*
+ * FNV-1a
+ */
+uint32_t
+PKhash(char *path)
+{
+    uint32_t h = 2166136261u;
+
+    for ( ; *path ; path++ )
+        h = (h ^ (unsigned char) *path) * 16777619u;
+    return h;
+}
+
+/*
+ * 0 if every table and offset lies inside the file, the strings end
+ * inside it, and each chain and child list names real entries
+ */
+static int
+check(struct pack *pk)
+{
+    struct pkhead *hd = (struct pkhead *) pk->base;
+    struct pkentry *e;
+    uint64_t size = pk->size;
+    uint32_t i;
+
+    if ( memcmp(hd->magic, PK_MAGIC, sizeof(hd->magic)) != 0
+      || hd->size != size || pk->base[size - 1] != '\0'
+      || hd->nbuckets == 0 || (hd->nbuckets & (hd->nbuckets - 1)) != 0
+      || hd->entries > size || hd->buckets > size || hd->children > size
+      || (size - hd->entries) / sizeof(struct pkentry) < hd->nentries
+      || (size - hd->buckets) / sizeof(uint32_t) < hd->nbuckets
+      || (size - hd->children) / sizeof(uint32_t) < hd->nchildren
+      || hd->entries % 8 != 0 || hd->buckets % 4 != 0 || hd->children % 4 != 0 )
+        return 1;
+    pk->head = hd;
+    pk->entries = (struct pkentry *) (pk->base + hd->entries);
+    pk->buckets = (uint32_t *) (pk->base + hd->buckets);
+    pk->children = (uint32_t *) (pk->base + hd->children);
+
+    for ( i = 0 ; i < hd->nbuckets ; i++ )
+        if ( pk->buckets[i] != PK_NONE && pk->buckets[i] >= hd->nentries )
+            return 1;
+    for ( i = 0 ; i < hd->nchildren ; i++ )
+        if ( pk->children[i] >= hd->nentries )
+            return 1;
+    for ( i = 0 ; i < hd->nentries ; i++ )
+    {
+        e = &pk->entries[i];
+        if ( (e->next != PK_NONE && (e->next >= hd->nentries || e->next <= i))
+          || e->path >= size || e->type >= size || e->etag >= size
+          || (! e->dir && (e->off > size || e->len > size - e->off))
+          || e->gzoff > size || e->gzlen > size - e->gzoff
+          || e->kids > hd->nchildren || e->nkids > hd->nchildren - e->kids )
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef PACK_H
+#define PACK_H
+/*
+ * header for pack.c package, and the bundle format wsngpack.c writes
+ */
+
+#include    <stdint.h>
+
+#define PK_MAGIC    "wsngpk1"       /* 8 bytes with the NUL     */
+#define PK_NONE     0xffffffffu     /* end of a chain           */
+#define PK_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+struct reply;
+
+struct pkhead {                     /* at offset 0              */
+    char            magic[8];
+    uint32_t        nentries;
+    uint32_t        nbuckets;       /* a power of 2             */
+    uint32_t        nchildren;
+    uint32_t        pad;
+    uint64_t        entries;        /* offsets of the tables    */
+    uint64_t        buckets;
+    uint64_t        children;
+    uint64_t        size;           /* of the whole file        */
+};
+
+struct pkentry {                    /* sorted by path           */
+    uint32_t        hash;           /* PKhash() of the path     */
+    uint32_t        next;           /* in its bucket's chain    */
+    uint64_t        path;           /* offsets of NUL-ended strings */
+    uint64_t        type;           /* "": by the vhost's types */
+    uint64_t        etag;           /* quoted                   */
+    uint64_t        off, len;       /* the bytes; a dir's st_size */
+    uint64_t        gzoff, gzlen;   /* gzip'd copy, gzlen 0: none */
+    int64_t         mtime;
+    uint32_t        dir;            /* 1 for a directory        */
+    uint32_t        kids, nkids;    /* its entries, in children[] */
+    uint32_t        pad;
+};
+
+struct pack;
+
+struct pack     *PKopen(char *);
+void            PKclose(struct pack *);
+struct pkentry  *PKlookup(struct pack *, char *);
+struct pkentry  *PKchild(struct pack *, struct pkentry *, char *);
+char            *PKstr(struct pack *, uint64_t);
+char            *PKbytes(struct pack *, struct pkentry *, int, uint64_t *);
+void            PKlist(struct pack *, struct pkentry *, struct reply *);
+uint32_t        PKhash(char *);
+
+#endif
@@ -0,0 +1,453 @@
+/* preload.c
+ *
+ * warms the caches after a start: the files a manifest names, or the
+ * ones the access log asked for most, read in the background
+ *
+ * interface:
+ *     PLstart( conf )       start warming what conf's preload and
+ *                           preload_top name, off to one side: a thread
+ *                           in events mode, a child in fork mode.
+ *                           Returns at once; 0, or -1 (said why)
+ *     PLstats( fp )         print how far it has got
+ *
+ * details:
+ *      After a restart the first minutes of traffic find the page
+ *      cache cold and wsng's own caches empty, and p99 shows it.
+ *      "preload FILE" names a manifest: a path per line, or a host and
+ *      a path, as a client would ask for them; '#' starts a comment.
+ *      "preload_top N" takes the N paths asked for most (GETs and
+ *      HEADs answered 200 or 304, less any query) in the log named by
+ *      "preload_log FILE", the access_log by default. The log has no
+ *      Host, so they are the default host's. Both may be given; the
+ *      manifest goes first.
+ *
+ *      Each path is cleaned up with modify_argument() and opened
+ *      beneath its host's root as a request would be. A directory
+ *      stands for its index page, found by find_index(), which also
+ *      fills the index cache. The file is read into the page cache
+ *      with readahead(), then stored where a request looks first: the
+ *      file cache (fcache.c) in events mode, the cache the children
+ *      share (shmcache.c, with shm_cache) in fork mode. CGIs are not
+ *      run, and a packed host (pack.c) is in memory already. wsng
+ *      compresses nothing on the fly, so there is nothing to
+ *      compress ahead; wsng-pack -z does that for a bundle.
+ *
+ *      None of it holds up the first accept(). startup() calls
+ *      PLstart() before the listening sockets are made. In fork mode
+ *      the warming is a child, so the parent stays single threaded and
+ *      the child holds no socket; it dies with the parent. In events
+ *      mode it is a thread with every signal blocked. Either way it
+ *      runs at nice 10 in the idle I/O class, so a request's reads go
+ *      ahead of its own. The counts are in shared memory, for SIGUSR1
+ *      to print in either mode.
+ *
+ *      Both of wsng's caches check a file again after a second or so
+ *      and let entries nobody asks for go, so on a quiet site what
+ *      stays warm is the page cache. That is what saves the disk
+ *      reads; the caches save the open() and the copy for the first
+ *      requests.
+ */
+
+#define     _GNU_SOURCE             /* readahead(), gettid() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/mman.h>
+#include    <sys/prctl.h>
+#include    <sys/resource.h>
+#include    <sys/stat.h>
+#include    <sys/syscall.h>
+#include    <linux/ioprio.h>
+#include    "rootfs.h"
+#include    "vhost.h"
+#include    "config.h"
+#include    "fcache.h"
+#include    "shmcache.h"
+#include    "wsng.h"
+#include    "preload.h"
+
+#define PL_LINE     4096
+#define PL_PATHS    (1 << 20)       /* different paths counted  */
+
+#define ADD(x,n)    __atomic_add_fetch(&pc->x, (n), __ATOMIC_RELAXED)
+#define LOAD(x)     __atomic_load_n(&pc->x, __ATOMIC_RELAXED)
+
+enum { PL_WAITING, PL_LISTING, PL_WARMING, PL_DONE };
+
+struct plcounts {                   /* shared, for PLstats()    */
+    int             state;
+    int             total;          /* paths on the list        */
+    int             warmed;
+    int             missing;        /* not there, or not a file */
+    int             skipped;        /* CGIs, listings, packs    */
+    long            bytes;          /* read into the page cache */
+    long            ms;             /* it took, once done       */
+};
+
+struct plitem {
+    char            *host;          /* NULL: the default host   */
+    char            *path;
+    long            count;          /* times in the log         */
+};
+
+static struct plcounts *pc;
+static struct plitem *items;
+static int      nitems, maxitems;
+static int      *slots;             /* read_log()'s index of items */
+static int      nslots;
+
+static void     *warm_all(void *);
+static void     read_manifest(char *);
+static void     read_log(char *, int);
+static int      count(char *, int);
+static int      add(char *, char *);
+static void     warm(struct config *, struct plitem *);
+static void     warm_file(struct config *, struct vhost *, char *, char *,
+                          int, struct stat *);
+static int      by_count(const void *, const void *);
+
+int
+PLstart(struct config *conf)
+{
+    pthread_t tid;
+    sigset_t all, old;
+    pid_t   parent = getpid(), pid;
+    int     rc;
+
+    if ( conf->preload == NULL && conf->preload_top <= 0 )
+        return 0;
+    pc = mmap(NULL, sizeof(struct plcounts), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( pc == MAP_FAILED )
+    {
+        pc = NULL;
+        perror("preload");
+        return -1;
+    }
+    if ( conf->events )
+    {
+        CFhold(conf);               /* until the warming is done */
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        rc = pthread_create(&tid, NULL, warm_all, conf);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if ( rc != 0 )
+        {
+            errno = rc;
+            perror("preload");
+            CFrelease(conf);
+            return -1;
+        }
+        pthread_detach(tid);
+        return 0;
+    }
+    if ( (pid = fork()) == -1 )
+    {
+        perror("preload: fork");
+        return -1;
+    }
+    if ( pid == 0 )
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if ( getppid() == parent )  /* not gone already */
+            warm_all(conf);
+        _exit(0);
+    }
+    return 0;
+}
+
+void
+PLstats(FILE *fp)
+{
+    static char *states[] = { "waiting", "reading its list", "warming",
+                              "done" };
+    int     state;
+
+    if ( pc == NULL )
+        return;
+    state = __atomic_load_n(&pc->state, __ATOMIC_ACQUIRE);
+    fprintf(fp, "preload: %s, %d of %d warmed, %d missing, %d skipped, "
+            "%ld KB read", states[state], LOAD(warmed), LOAD(total),
+            LOAD(missing), LOAD(skipped), LOAD(bytes) / 1024);
+    if ( state == PL_DONE )
+        fprintf(fp, " in %ld ms", pc->ms);
+    fprintf(fp, "\n");
+}
+
+/*
+ * the thread, or the child: make the list, then warm each item on it
+ */
+static void *
+warm_all(void *arg)
+{
+    struct config *conf = arg;
+    struct timespec t0, t1;
+    int     i;
+
+    setpriority(PRIO_PROCESS, gettid(), 10);    /* just this thread */
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, gettid(),
+            IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    __atomic_store_n(&pc->state, PL_LISTING, __ATOMIC_RELEASE);
+    if ( conf->preload != NULL )
+        read_manifest(conf->preload);
+    if ( conf->preload_top > 0 )
+        read_log(conf->preload_log ? conf->preload_log : conf->access_log,
+                 conf->preload_top);
+    pc->total = nitems;
+    __atomic_store_n(&pc->state, PL_WARMING, __ATOMIC_RELEASE);
+
+    for ( i = 0 ; i < nitems ; i++ )
+    {
+        warm(conf, &items[i]);
+        free(items[i].host);
+        free(items[i].path);
+    }
+    free(items);
+    items = NULL;
+    nitems = maxitems = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pc->ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec)
+             / 1000000;
+    __atomic_store_n(&pc->state, PL_DONE, __ATOMIC_RELEASE);
+    if ( conf->events )
+        CFrelease(conf);
+    return NULL;
+}
+
+/*
+ * "path" or "host path" a line, in file
+ */
+static void
+read_manifest(char *file)
+{
+    FILE    *fp = fopen(file, "r");
+    char    line[PL_LINE], a[PL_LINE], b[PL_LINE], *p;
+    int     n;
+
+    if ( fp == NULL )
+    {
+        perror(file);
+        return;
+    }
+    while ( fgets(line, sizeof(line), fp) != NULL && nitems < PL_MAX )
+    {
+        if ( (p = strchr(line, '#')) != NULL )
+            *p = '\0';
+        if ( (n = sscanf(line, "%s %s", a, b)) == 1 )
+            add(NULL, a);
+        else if ( n == 2 )
+            add(a, b);
+    }
+    fclose(fp);
+}
+
+/*
+ * the n paths asked for most in the log file: count them all, then
+ * keep the top n
+ */
+static void
+read_log(char *file, int n)
+{
+    FILE    *fp;
+    char    line[PL_LINE], method[16], path[PL_LINE], *q;
+    int     first = nitems, status, i;
+
+    if ( file == NULL )
+    {
+        fprintf(stderr, "preload_log: no file, and no access_log\n");
+        return;
+    }
+    if ( (fp = fopen(file, "r")) == NULL )
+    {
+        perror(file);
+        return;
+    }
+    nslots = 4096;
+    if ( (slots = malloc(nslots * sizeof(int))) == NULL )
+    {
+        fclose(fp);
+        return;
+    }
+    memset(slots, -1, nslots * sizeof(int));
+    while ( fgets(line, sizeof(line), fp) != NULL )
+    {
+        if ( sscanf(line, "%*s %*s %*s [%*[^]]] \"%15s %4095s", method,
+                    path) != 2
+          || (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+          || (q = strchr(strchr(line, '"') + 1, '"')) == NULL
+          || sscanf(q + 1, "%d", &status) != 1
+          || (status != 200 && status != 304) )
+            continue;
+        if ( (q = strchr(path, '?')) != NULL )
+            *q = '\0';
+        count(path, first);
+    }
+    fclose(fp);
+    free(slots);
+    slots = NULL;
+
+    qsort(items + first, nitems - first, sizeof(struct plitem), by_count);
+    for ( i = first + n ; i < nitems ; i++ )
+        free(items[i].path);
+    if ( nitems > first + n )
+        nitems = first + n;
+}
+
+/*
+ * one more request for path; the log's items start at first
+ */
+static int
+count(char *path, int first)
+{
+    unsigned h = 2166136261u;
+    int     i, *old, nold, k;
+    char    *p;
+
+    for ( p = path ; *p ; p++ )     /* FNV-1a */
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    for ( i = h & (nslots - 1) ; slots[i] != -1 ; i = (i + 1) & (nslots - 1) )
+        if ( strcmp(items[slots[i]].path, path) == 0 )
+            return ++items[slots[i]].count;
+    if ( nitems - first >= PL_PATHS || add(NULL, path) == -1 )
+        return 0;
+    slots[i] = nitems - 1;
+    items[nitems - 1].count = 1;
+
+    if ( (nitems - first) * 2 < nslots )
+        return 1;
+    old = slots;                    /* half full: double it */
+    nold = nslots;
+    if ( (slots = malloc(2 * nold * sizeof(int))) == NULL )
+    {
+        slots = old;
+        return 1;
+    }
+    nslots = 2 * nold;
+    memset(slots, -1, nslots * sizeof(int));
+    for ( k = 0 ; k < nold ; k++ )
+    {
+        if ( old[k] == -1 )
+            continue;
+        for ( h = 2166136261u, p = items[old[k]].path ; *p ; p++ )
+            h = (h ^ (unsigned char) *p) * 16777619u;
+        for ( i = h & (nslots - 1) ; slots[i] != -1 ; i = (i + 1) & (nslots - 1) )
+            ;
+        slots[i] = old[k];
+    }
+    free(old);
+    return 1;
+}
+
+static int
+add(char *host, char *path)
+{
+    struct plitem *it;
+
+    if ( nitems == maxitems )
+    {
+        maxitems = maxitems ? maxitems * 2 : 256;
+        if ( (it = realloc(items, maxitems * sizeof(struct plitem))) == NULL )
+        {
+            maxitems = nitems;
+            return -1;
+        }
+        items = it;
+    }
+    it = &items[nitems];
+    it->host = host ? strdup(host) : NULL;
+    it->path = strdup(path);
+    it->count = 0;
+    if ( it->path == NULL )
+        return -1;
+    nitems++;
+    return 0;
+}
+
+/*
+ * open it as a request would, and warm the file it comes to
+ */
+static void
+warm(struct config *conf, struct plitem *it)
+{
+    char    arg[MAX_RQ_LEN], *item, *q, *name;
+    struct vhost *vh = VHlookup(conf->hosts, it->host);
+    struct stat info, finfo;
+    int     fd, ifd;
+
+    snprintf(arg, sizeof(arg), "%s", it->path);
+    if ( (q = strchr(arg, '?')) != NULL )
+        *q = '\0';
+    item = modify_argument(arg, MAX_RQ_LEN);
+    if ( vh->pack != NULL || ends_in_cgi(item) )
+    {
+        ADD(skipped, 1);
+        return;
+    }
+    if ( (fd = RFopen(vh->rootfd, item, O_RDONLY | O_NONBLOCK)) == -1 )
+    {
+        ADD(missing, 1);
+        return;
+    }
+    if ( fstat(fd, &info) == -1 || no_access(&info) )
+        ADD(missing, 1);
+    else if ( S_ISDIR(info.st_mode) )
+    {
+        if ( (name = find_index(fd, &info, vh, &ifd, &finfo)) == NULL )
+            ADD(skipped, 1);        /* a listing */
+        else if ( ends_in_cgi(name) )
+        {
+            ADD(skipped, 1);        /* an index.cgi is run, not kept */
+            close(ifd);
+        }
+        else
+        {
+            warm_file(conf, vh, item, name, ifd, &finfo);
+            close(ifd);
+        }
+    }
+    else if ( S_ISREG(info.st_mode) )
+        warm_file(conf, vh, item, item, fd, &info);
+    else
+        ADD(missing, 1);
+    close(fd);
+}
+
+/*
+ * read fd, the file item comes to, into the page cache, and store it
+ * where this mode's requests look first; name gives its type
+ */
+static void
+warm_file(struct config *conf, struct vhost *vh, char *item, char *name,
+          int fd, struct stat *info)
+{
+    char    *type = VHcontent_type(vh, file_type(name));
+
+    readahead(fd, 0, info->st_size);
+    ADD(bytes, info->st_size);
+    if ( conf->events )
+        FCrelease(FCstore(vh, item, type, fd, info, conf));
+    else
+        free(SMstore(vh->id, item, type, fd, info));
+    ADD(warmed, 1);
+}
+
+static int
+by_count(const void *a, const void *b)
+{
+    long    x = ((struct plitem *) a)->count, y = ((struct plitem *) b)->count;
+
+    return x > y ? -1 : x < y;
+}
@@ -0,0 +1,16 @@
+#ifndef PRELOAD_H
+#define PRELOAD_H
+/*
+ * header for preload.c package
+ */
+
+#include    <stdio.h>
+
+#define PL_MAX      100000          /* items warmed, at most    */
+
+struct config;
+
+int     PLstart(struct config *);
+void    PLstats(FILE *);
+
+#endif
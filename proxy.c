@@ -0,0 +1,1247 @@
+/* proxy.c
+ *
+ * passes requests under configured path prefixes to upstream HTTP
+ * servers, keeping their connections open between requests
+ *
+ * interface:
+ *     PXupstream( &groups, name, server )
+ *                                   add server (host:port) to upstream
+ *                                   name, made if new; the host is
+ *                                   looked up now. 0 ok, 1 bad (said why)
+ *     PXbalance( groups, name, how )
+ *                                   "roundrobin" (the default) or
+ *                                   "leastconn"; 0 ok, 1 bad
+ *     PXroute( &routes, groups, prefix, name )
+ *                                   send paths starting with prefix to
+ *                                   upstream name; 0 ok, 1 bad
+ *     PXmatch( vh, path )           the longest route for path on vh,
+ *                                   else on the default host, or NULL
+ *     PXinit( conf )                the shared figures, and the keeper
+ *                                   of idle connections if conf has
+ *                                   upstreams; before the children.
+ *                                   0 ok, -1 no
+ *     PXsocket()                    the fd a child talks to the keeper
+ *                                   on, to leave open; -1 if none
+ *     PXpass( route, rp, head, end, last, conf )
+ *                                   forward the request head..end (and
+ *                                   end..last, the body read with it)
+ *                                   from the client on rp's fd, and
+ *                                   send the answer there, counted in
+ *                                   rp->sent. 0 when the client has
+ *                                   had an answer, else the status the
+ *                                   caller is to answer with on rp
+ *     PXstats( fp )                 print each server's figures
+ *     PXfree_groups( g )            for config.c
+ *     PXfree_routes( r )            for vhost.c
+ *
+ * details:
+ *      A proxied request is a child like any other; in events mode
+ *      it is forked as a CGI is. The child picks a server, gets a
+ *      connection to it, and sends the request as HTTP/1.1, with the
+ *      hop-by-hop fields left out and X-Forwarded-For added. The body
+ *      (by Content-Length; a chunked request gets a 411) follows. The
+ *      answer's head is passed on with Connection: close, since the
+ *      client's connection ends with the reply. Bodies go both ways
+ *      by splice() through a pipe, so they are not copied through
+ *      user space. A chunked answer is decoded on the way, as the
+ *      client is not kept open.
+ *
+ *      A child lives for one request, so a pool of connections in it
+ *      would be no use. The keeper is a process forked by PXinit()
+ *      that holds them between children. When an answer leaves the
+ *      connection fit to use again (it had a length or a last chunk,
+ *      and no "Connection: close"), the child sends the socket to the
+ *      keeper over a unix datagram socket (SCM_RIGHTS). That is one end
+ *      of a socket pair made before the keeper is forked, with no name:
+ *      only the server and its children hold the other end (CGIs do
+ *      not, it is close-on-exec), so no other process can take or
+ *      park a connection. The next child going to that server asks
+ *      for one, sending the keeper one end of a socket pair of its own
+ *      to answer on, and gets it back that way or is told to connect. The keeper holds up to
+ *      proxy_keepalive per server, and polls them all, so one the
+ *      server closes is dropped at once. One idle PX_IDLE seconds is
+ *      closed. The keeper exits with the server. If it is not there,
+ *      children just connect each time.
+ *
+ *      A kept connection may be closed by the server just as it is
+ *      used. A request that gets nothing back on one is sent again on
+ *      a new connection, if the whole body is still in hand and the
+ *      server cannot have acted on it: a GET, HEAD or OPTIONS, or one
+ *      of which no byte was written.
+ *
+ *      Each server has a slot in shared memory: requests on it now,
+ *      failures in a row, and the time it is down until. Round robin
+ *      takes the next server by a counter in the slot of the group's
+ *      first server. leastconn takes the one with the fewest requests
+ *      on it, starting at that counter, so ties take turns. The health
+ *      checks are passive. A connect that fails or takes more than
+ *      proxy_connect_timeout counts a failure, and so does a server
+ *      that closes, or sends nothing for send_timeout. proxy_fails of
+ *      them in a row take a server out for proxy_fail_time seconds.
+ *      After a failure the request goes to another server, unless
+ *      some of it may have been acted on: a body that could not be
+ *      kept whole, or a method other than GET, HEAD or OPTIONS once
+ *      sent. With
+ *      every server out the client gets a 502.
+ *
+ *      In events mode PXpass() runs in a child forked from a process
+ *      with threads. It uses no stdio, and glibc's malloc() is safe
+ *      after fork(). The keeper uses neither.
+ */
+
+#define     _GNU_SOURCE             /* splice(), pipe2() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <signal.h>
+#include    <poll.h>
+#include    <sys/types.h>
+#include    <sys/socket.h>
+#include    <sys/uio.h>
+#include    <sys/mman.h>
+#include    <sys/time.h>
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    <arpa/inet.h>
+#include    "socklib.h"
+#include    "config.h"
+#include    "vhost.h"
+#include    "reply.h"
+#include    "trace.h"
+#include    "proxy.h"
+
+#define PX_SLOTS    256             /* servers with figures     */
+#define PX_POOL     256             /* idle connections, in all */
+#define PX_IDLE     30              /* seconds one is kept idle */
+#define PX_ASK      100             /* ms to wait for the keeper */
+#define PX_HEAD     8192            /* a head, either way       */
+#define PX_BUF      16384
+#define PX_SPLICE   65536
+
+struct pxslot {
+    unsigned long   key;            /* address and port, 0: free */
+    int             active;         /* requests on it now       */
+    int             fails;          /* in a row                 */
+    time_t          down;           /* left out until then      */
+    unsigned long   rr;             /* turns, if it leads a group */
+    unsigned long   requests, reused, errors;
+};
+
+enum { PX_TAKE, PX_PARK, PX_GOT, PX_NONE };
+
+struct pxmsg {                      /* to and from the keeper   */
+    int             op;
+    unsigned long   key;
+    int             keep;           /* PX_PARK: idle ones to keep */
+};
+
+struct pxin {                       /* reads from the upstream  */
+    int             fd;
+    int             pos, len;
+    char            buf[PX_BUF];
+};
+
+enum { TRY_OK, TRY_UNSENT, TRY_STALE, TRY_SLOW, TRY_BAD, TRY_GONE };
+                                    /* exchange()'s */
+
+static struct pxslot *slots = NULL;
+static pid_t        keeper = 0;
+static int          ksock = -1;     /* ours, to talk to it      */
+static int          pipefd[2] = { -1, -1 };     /* for splice() */
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x,v)  __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x,n)    __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+
+static struct pxgroup *find_group(struct pxgroup *, char *);
+static unsigned long key_of(struct pxserver *);
+static struct pxslot *slot_of(unsigned long);
+static int      pick(struct pxgroup *, int);
+static void     failed(struct pxslot *, struct config *);
+static int      make_request(char *, char *, int, char *, char *, int,
+                             long *, int *, int *, int *);
+static int      exchange(struct pxin *, int, struct reply *, char *, int,
+                         char *, long, long, int, int *);
+static int      read_head(struct pxin *);
+static int      parse_reply(char *, int, char *, int, int *, long *, int *,
+                            int *);
+static int      is_field(char *, char *, char *);
+static long     dechunk(struct pxin *, int);
+static int      get_line(struct pxin *, char *, int);
+static int      fill(struct pxin *);
+static long     copy_n(struct pxin *, int, long);
+static long     pump(int, int, long);
+static int      write_all(int, char *, long);
+static int      add(char *, int *, int, char *, int);
+static int      start_keeper(void);
+static void     keep(int, pid_t);
+static int      take(unsigned long);
+static void     park(int, unsigned long, int);
+static int      send_fd(int, struct pxmsg *, int);
+static int      recv_fd(int, struct pxmsg *, int *);
+
+int
+PXupstream(struct pxgroup **groups, char *name, char *server)
+{
+    struct pxgroup *g = find_group(*groups, name);
+    struct pxserver *s;
+    char    host[sizeof(s->name)], *colon;
+    int     port = 80;
+
+    if ( server == NULL || strlen(server) >= sizeof(host) )
+    {
+        fprintf(stderr, "upstream %s: needs a host:port\n", name);
+        return 1;
+    }
+    if ( g == NULL )
+    {
+        if ( (g = calloc(1, sizeof(struct pxgroup))) == NULL
+          || (g->name = strdup(name)) == NULL )
+        {
+            free(g);
+            perror("upstream");
+            return 1;
+        }
+        g->next = *groups;
+        *groups = g;
+    }
+    if ( g->n == PX_MAXSERVERS )
+    {
+        fprintf(stderr, "upstream %s: more than %d servers\n", name,
+                PX_MAXSERVERS);
+        return 1;
+    }
+    strcpy(host, server);
+    if ( (colon = strrchr(host, ':')) != NULL )
+    {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    s = &g->servers[g->n];
+    if ( port <= 0 || port > 65535 || resolve_server(host, port, &s->sa) == -1 )
+    {
+        fprintf(stderr, "upstream %s: cannot find %s\n", name, server);
+        return 1;
+    }
+    strcpy(s->name, server);
+    g->n++;
+    return 0;
+}
+
+int
+PXbalance(struct pxgroup *groups, char *name, char *how)
+{
+    struct pxgroup *g = find_group(groups, name);
+
+    if ( g == NULL || how == NULL )
+    {
+        fprintf(stderr, "proxy_balance: no upstream %s\n", name);
+        return 1;
+    }
+    if ( strcasecmp(how, "leastconn") == 0 )
+        g->leastconn = 1;
+    else if ( strcasecmp(how, "roundrobin") == 0 )
+        g->leastconn = 0;
+    else
+    {
+        fprintf(stderr, "proxy_balance: %s is not roundrobin or leastconn\n",
+                how);
+        return 1;
+    }
+    return 0;
+}
+
+int
+PXroute(struct pxroute **routes, struct pxgroup *groups, char *prefix,
+        char *name)
+{
+    struct pxgroup *g = name ? find_group(groups, name) : NULL;
+    struct pxroute *r;
+
+    if ( g == NULL )
+    {
+        fprintf(stderr, "proxy_pass %s: no upstream %s (it must come "
+                        "first)\n", prefix, name ? name : "named");
+        return 1;
+    }
+    if ( (r = calloc(1, sizeof(struct pxroute))) == NULL
+      || (r->prefix = strdup(prefix)) == NULL )
+    {
+        free(r);
+        perror("proxy_pass");
+        return 1;
+    }
+    r->len = strlen(prefix);
+    r->group = g;
+    r->next = *routes;
+    *routes = r;
+    return 0;
+}
+
+struct pxroute *
+PXmatch(struct vhost *vh, char *path)
+{
+    struct pxroute *r, *best = NULL;
+
+    for ( ; vh != NULL && best == NULL ; vh = vh->parent )
+        for ( r = vh->proxy ; r != NULL ; r = r->next )
+            if ( strncmp(path, r->prefix, r->len) == 0
+              && (best == NULL || r->len > best->len) )
+                best = r;
+    return best;
+}
+
+int
+PXinit(struct config *conf)
+{
+    if ( conf->upstreams == NULL )
+        return 0;
+    if ( slots == NULL )
+    {
+        slots = mmap(NULL, PX_SLOTS * sizeof(struct pxslot),
+                     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if ( slots == MAP_FAILED )
+        {
+            slots = NULL;
+            return -1;
+        }
+    }
+    if ( keeper != 0 || conf->proxy_keepalive <= 0 )
+        return 0;
+    return start_keeper();
+}
+
+int
+PXsocket()
+{
+    return ksock;
+}
+
+int
+PXpass(struct pxroute *r, struct reply *rp, char *head, char *end, char *last,
+       struct config *conf)
+{
+    static struct pxin up;
+    struct pxgroup *g = r->group;
+    struct pxserver *s;
+    struct pxslot *st;
+    struct timeval tv;
+    char    out[PX_HEAD];
+    long    body, have = last - end;
+    int     olen, expect, headonly, safe, whole, on = 1;
+    int     i, ufd, reused, rc, keepit, tried = 0, fresh = 0, code = 502;
+
+    signal(SIGPIPE, SIG_IGN);       /* a peer gone is an error return */
+    olen = make_request(head, end, rp->fd, g->servers[0].name, out, sizeof(out),
+                        &body, &expect, &headonly, &safe);
+    if ( olen == -1 )
+        return 400;
+    if ( body < 0 )
+        return 411;                 /* chunked: not taken */
+    if ( have > body )
+        have = body;
+    whole = (have == body);
+    if ( expect && ! whole
+      && write_all(rp->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) == -1 )
+        return 0;
+
+    while ( (i = pick(g, tried)) != -1 )
+    {
+        s = &g->servers[i];
+        st = slot_of(key_of(s));
+        reused = ! fresh && (ufd = take(key_of(s))) != -1;
+        fresh = 0;
+        if ( ! reused
+          && (ufd = connect_to_addr(&s->sa, conf->proxy_connect * 1000)) == -1 )
+        {
+            failed(st, conf);       /* nothing sent: on to the next */
+            tried |= 1 << i;
+            continue;
+        }
+        tv.tv_sec = conf->send_timeout;
+        tv.tv_usec = 0;
+        setsockopt(ufd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(ufd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(ufd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        ADD(st->active, 1);
+        ADD(st->requests, 1);
+        if ( reused )
+            ADD(st->reused, 1);
+        rc = exchange(&up, ufd, rp, out, olen, end, have, body, headonly,
+                      &keepit);
+        ADD(st->active, -1);
+        if ( rc == TRY_OK )
+        {
+            STORE(st->fails, 0);
+            if ( keepit )
+                park(ufd, key_of(s), conf->proxy_keepalive);
+            else
+                close(ufd);
+            return 0;
+        }
+        close(ufd);
+        if ( rc == TRY_GONE )
+            return 502;
+        if ( (rc == TRY_UNSENT || rc == TRY_STALE) && reused )
+        {
+            if ( ! whole || (rc == TRY_STALE && ! safe) )
+                return 502;         /* it may have been acted on */
+            fresh = 1;              /* once more, on a new connection */
+            continue;
+        }
+        failed(st, conf);
+        code = (rc == TRY_SLOW) ? 504 : 502;
+        if ( rc == TRY_BAD || ! whole || ! safe )
+            return code;
+        tried |= 1 << i;
+    }
+    return code;
+}
+
+void
+PXstats(FILE *fp)
+{
+    struct in_addr a;
+    time_t  now = time(NULL);
+    int     i;
+
+    if ( slots == NULL )
+        return;
+    for ( i = 0 ; i < PX_SLOTS ; i++ )
+    {
+        if ( slots[i].key == 0 )
+            continue;
+        a.s_addr = slots[i].key >> 16;
+        fprintf(fp, "proxy %s:%lu: %lu requests, %lu on kept connections, "
+                    "%lu errors, %d now%s\n", inet_ntoa(a),
+                    slots[i].key & 0xffff, slots[i].requests,
+                    slots[i].reused, slots[i].errors, slots[i].active,
+                    slots[i].down > now ? ", down" : "");
+    }
+}
+
+void
+PXfree_groups(struct pxgroup *g)
+{
+    struct pxgroup *next;
+
+    for ( ; g != NULL ; g = next )
+    {
+        next = g->next;
+        free(g->name);
+        free(g);
+    }
+}
+
+void
+PXfree_routes(struct pxroute *r)
+{
+    struct pxroute *next;
+
+    for ( ; r != NULL ; r = next )
+    {
+        next = r->next;
+        free(r->prefix);
+        free(r);
+    }
+}
+
+static struct pxgroup *
+find_group(struct pxgroup *g, char *name)
+{
+    for ( ; g != NULL && strcmp(g->name, name) != 0 ; g = g->next )
+        ;
+    return g;
+}
+
+static unsigned long
+key_of(struct pxserver *s)
+{
+    return ((unsigned long) s->sa.sin_addr.s_addr << 16)
+           | ntohs(s->sa.sin_port);
+}
+
+/*
+ * a server's shared slot, taken on first use; without the shared
+ * memory (or with it full) the figures just are not kept
+ */
+static struct pxslot *
+slot_of(unsigned long key)
+{
+    static struct pxslot none;
+    unsigned long k, h = (key * 0x9E3779B97F4A7C15UL) >> 32;
+    int     j;
+    struct pxslot *st;
+
+    for ( j = 0 ; slots != NULL && j < PX_SLOTS ; j++ )
+    {
+        st = &slots[(h + j) % PX_SLOTS];
+        k = 0;
+        if ( __atomic_compare_exchange_n(&st->key, &k, key, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+          || k == key )
+            return st;
+    }
+    return &none;
+}
+
+/*
+ * the next server of g to try, not in tried and not down; -1 if none
+ */
+static int
+pick(struct pxgroup *g, int tried)
+{
+    unsigned long start = ADD(slot_of(key_of(&g->servers[0]))->rr, 1);
+    time_t  now = time(NULL);
+    int     i, j, best = -1, load = 0;
+    struct pxslot *st;
+
+    for ( j = 0 ; j < g->n ; j++ )
+    {
+        i = (start + j) % g->n;
+        st = slot_of(key_of(&g->servers[i]));
+        if ( (tried & (1 << i)) || LOAD(st->down) > now )
+            continue;
+        if ( ! g->leastconn )
+            return i;
+        if ( best == -1 || LOAD(st->active) < load )
+        {
+            best = i;
+            load = LOAD(st->active);
+        }
+    }
+    return best;
+}
+
+static void
+failed(struct pxslot *st, struct config *conf)
+{
+    ADD(st->errors, 1);
+    if ( conf->proxy_fails > 0 && ADD(st->fails, 1) >= conf->proxy_fails )
+    {
+        STORE(st->down, time(NULL) + conf->proxy_fail_time);
+        STORE(st->fails, 0);
+    }
+}
+
+/*
+ * the request head..end as it goes upstream, into out (size room):
+ * the request line as HTTP/1.1, the fields but the hop-by-hop ones,
+ * Host: (host, if it had none) and X-Forwarded-For:. *body is the
+ * Content-Length, or -1 for a chunked body; *expect if it waits for
+ * a 100; *headonly for HEAD, *safe for GET, HEAD and OPTIONS. Returns the
+ * length, or -1 if it is bad or too big
+ */
+static int
+make_request(char *head, char *end, int cfd, char *host, char *out, int room,
+             long *body, int *expect, int *headonly, int *safe)
+{
+    static char *drop[] = { "connection", "keep-alive", "proxy-connection",
+                            "te", "trailer", "upgrade", "http2-settings",
+                            "expect", "x-forwarded-for", NULL };
+    struct sockaddr_in peer;
+    socklen_t plen = sizeof(peer);
+    char    *line, *eol, *colon, *val, *sp, *xff = NULL;
+    int     len = 0, nlen, xlen = 0, hashost = 0, i;
+
+    *body = 0;
+    *expect = *headonly = *safe = 0;
+    if ( (eol = memchr(head, '\n', end - head)) == NULL
+      || (sp = memchr(head, ' ', eol - head)) == NULL )
+        return -1;
+    *headonly = (sp - head == 4 && strncmp(head, "HEAD", 4) == 0);
+    *safe = *headonly || (sp - head == 3 && strncmp(head, "GET", 3) == 0)
+         || (sp - head == 7 && strncmp(head, "OPTIONS", 7) == 0);
+    val = memchr(sp + 1, ' ', eol - sp - 1);    /* the version, if any */
+    if ( add(out, &len, room, head, (val ? val : eol) - head) == -1
+      || add(out, &len, room, " HTTP/1.1\r\n", 11) == -1 )
+        return -1;
+
+    for ( line = eol + 1 ; line < end ; line = eol + 1 )
+    {
+        if ( (eol = memchr(line, '\n', end - line)) == NULL )
+            eol = end;
+        nlen = eol - line;
+        if ( nlen > 0 && line[nlen - 1] == '\r' )
+            nlen--;
+        if ( nlen == 0 )
+            break;
+        if ( (colon = memchr(line, ':', nlen)) == NULL || line[0] == ' '
+          || line[0] == '\t' )
+            continue;
+        for ( val = colon + 1 ; val < line + nlen && (*val == ' ' || *val == '\t') ; val++ )
+            ;
+        if ( colon - line == 14 && strncasecmp(line, "content-length", 14) == 0 )
+            *body = atol(val);
+        if ( colon - line == 17 && strncasecmp(line, "transfer-encoding", 17) == 0 )
+            *body = -1;
+        if ( colon - line == 6 && strncasecmp(line, "expect", 6) == 0 )
+            *expect = 1;
+        if ( colon - line == 4 && strncasecmp(line, "host", 4) == 0 )
+            hashost = 1;
+        if ( colon - line == 15 && strncasecmp(line, "x-forwarded-for", 15) == 0 )
+        {
+            xff = val;
+            xlen = line + nlen - val;
+        }
+        for ( i = 0 ; drop[i] != NULL ; i++ )
+            if ( colon - line == strlen(drop[i])
+              && strncasecmp(line, drop[i], colon - line) == 0 )
+                break;
+        if ( drop[i] == NULL
+          && (add(out, &len, room, line, nlen) == -1
+           || add(out, &len, room, "\r\n", 2) == -1) )
+            return -1;
+    }
+    if ( *body < -1 )
+        *body = 0;
+    if ( ! hashost && (add(out, &len, room, "Host: ", 6) == -1
+                    || add(out, &len, room, host, strlen(host)) == -1
+                    || add(out, &len, room, "\r\n", 2) == -1) )
+        return -1;
+    if ( getpeername(cfd, (struct sockaddr *) &peer, &plen) == 0
+      && peer.sin_family == AF_INET )
+    {
+        val = inet_ntoa(peer.sin_addr);
+        if ( add(out, &len, room, "X-Forwarded-For: ", 17) == -1
+          || (xff != NULL && (add(out, &len, room, xff, xlen) == -1
+                           || add(out, &len, room, ", ", 2) == -1))
+          || add(out, &len, room, val, strlen(val)) == -1
+          || add(out, &len, room, "\r\n", 2) == -1 )
+            return -1;
+    }
+    if ( add(out, &len, room, "\r\n", 2) == -1 )
+        return -1;
+    return len;
+}
+
+/*
+ * one try on ufd: send the request (out, then the body: have bytes
+ * at part, the rest of body from the client), read the answer's
+ * head, and pass the answer to the client on rp's fd, counted in
+ * rp->sent. TRY_OK once the client has the head, with *keep set if
+ * ufd can be used again; TRY_UNSENT if ufd took none of the request;
+ * TRY_STALE if ufd gave nothing back;
+ * TRY_SLOW if it said nothing in time; TRY_BAD for an answer that is
+ * not HTTP; TRY_GONE if the body could not be passed on
+ */
+static int
+exchange(struct pxin *up, int ufd, struct reply *rp, char *out, int olen,
+         char *part, long have, long body, int headonly, int *keep)
+{
+    struct iovec iov[2];
+    char    reply[PX_HEAD + 32];
+    int     n, rlen, status, chunked, closes;
+    long    clen, left, moved;
+
+    *keep = 0;
+    iov[0].iov_base = out;
+    iov[0].iov_len = olen;
+    iov[1].iov_base = part;
+    iov[1].iov_len = have;
+    for ( left = olen + have ; left > 0 ; left -= n )
+    {
+        if ( (n = writev(ufd, iov, 2)) <= 0 )
+        {
+            if ( n == -1 && errno == EINTR )
+            {
+                n = 0;
+                continue;
+            }
+            return left == olen + have ? TRY_UNSENT : TRY_STALE;
+        }
+        if ( n >= iov[0].iov_len )  /* move past what went */
+        {
+            iov[1].iov_base = (char *) iov[1].iov_base + (n - iov[0].iov_len);
+            iov[1].iov_len -= n - iov[0].iov_len;
+            iov[0].iov_len = 0;
+        }
+        else
+        {
+            iov[0].iov_base = (char *) iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+    if ( body > have && pump(rp->fd, ufd, body - have) == -1 )
+        return TRY_GONE;
+
+    up->fd = ufd;
+    up->pos = up->len = 0;
+    do                              /* a 100 Continue is not the answer */
+    {
+        if ( (n = read_head(up)) == 0 )
+            return TRY_STALE;
+        if ( n == -1 )
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? TRY_SLOW
+                                                             : TRY_STALE;
+        if ( n == -2 )
+            return TRY_BAD;
+        status = parse_reply(up->buf + up->pos, n, reply, sizeof(reply),
+                             &rlen, &clen, &chunked, &closes);
+        if ( status == -1 )
+            return TRY_BAD;
+        up->pos += n;
+    }
+    while ( status / 100 == 1 );
+
+    TRfirst(rp->trace, reply, rlen);
+    if ( write_all(rp->fd, reply, rlen) == -1 )
+        return TRY_OK;              /* the client is gone */
+    rp->sent += rlen;
+    if ( headonly || status == 204 || status == 304 )
+        moved = 0;
+    else if ( chunked )
+        moved = dechunk(up, rp->fd);
+    else if ( clen >= 0 )
+        moved = copy_n(up, rp->fd, clen);
+    else
+    {
+        moved = copy_n(up, rp->fd, -1);     /* to the end: not kept */
+        closes = 1;
+    }
+    if ( moved > 0 )
+        rp->sent += moved;
+    *keep = (moved >= 0 && ! closes && up->pos == up->len);
+    return TRY_OK;
+}
+
+/*
+ * read until up has a whole head at up->pos; returns its length, 0
+ * if the server closed before a byte, -1 for an error (errno) or a
+ * close part way, -2 for a head too big
+ */
+static int
+read_head(struct pxin *up)
+{
+    char    *p, *q;
+    int     n;
+
+    for ( ;; )
+    {
+        p = up->buf + up->pos;
+        if ( (q = memmem(p, up->len - up->pos, "\r\n\r\n", 4)) != NULL )
+            return q + 4 - p;
+        if ( (q = memmem(p, up->len - up->pos, "\n\n", 2)) != NULL )
+            return q + 2 - p;
+        if ( up->len - up->pos >= PX_HEAD )
+            return -2;
+        if ( (n = fill(up)) == 0 )
+        {
+            errno = ECONNRESET;
+            return (up->len == up->pos) ? 0 : -1;
+        }
+        if ( n < 0 )
+            return -1;
+    }
+}
+
+/*
+ * the answer's head buf (n bytes) as the client is to get it, into
+ * reply (room bytes, *rlen used): the hop-by-hop fields out and
+ * Connection: close in. *clen is its Content-Length or -1, *chunked
+ * if it is sent in chunks, *closes if the server will close after
+ * it. Returns the status, or -1 if it is not HTTP/1.x
+ */
+static int
+parse_reply(char *buf, int n, char *reply, int room, int *rlen, long *clen,
+            int *chunked, int *closes)
+{
+    static char *drop[] = { "connection", "keep-alive", "proxy-connection",
+                            "transfer-encoding", "trailer", "upgrade", NULL };
+    char    *line, *eol, *colon, *val, *end = buf + n;
+    int     status, pass, len, i;
+
+    if ( n < 12 || strncmp(buf, "HTTP/1.", 7) != 0
+      || (status = atoi(buf + 9)) < 100 || status > 999 )
+        return -1;
+    *clen = -1;
+    *chunked = 0;
+    *closes = (buf[7] == '0');      /* 1.0 closes, unless it says not */
+    *rlen = 0;
+    for ( pass = 0 ; pass < 2 ; pass++ )    /* see it all, then copy */
+    {
+        for ( line = buf ; line < end ; line = eol + 1 )
+        {
+            if ( (eol = memchr(line, '\n', end - line)) == NULL )
+                eol = end;
+            len = eol - line;
+            if ( len > 0 && line[len - 1] == '\r' )
+                len--;
+            if ( len == 0 )
+                break;
+            colon = (line == buf) ? NULL : memchr(line, ':', len);
+            if ( colon != NULL )
+            {
+                for ( val = colon + 1 ; val < line + len && *val == ' ' ; val++ )
+                    ;
+                if ( pass == 0 && is_field(line, colon, "transfer-encoding") )
+                    *chunked = (strncasecmp(val, "chunked", 7) == 0
+                                || memmem(val, line + len - val, "chunked", 7));
+                if ( pass == 0 && is_field(line, colon, "content-length") )
+                    *clen = atol(val);
+                if ( pass == 0 && is_field(line, colon, "connection") )
+                {
+                    if ( strncasecmp(val, "close", 5) == 0 )
+                        *closes = 1;
+                    else if ( strncasecmp(val, "keep-alive", 10) == 0 )
+                        *closes = 0;
+                }
+                for ( i = 0 ; drop[i] != NULL ; i++ )
+                    if ( is_field(line, colon, drop[i]) )
+                        break;
+                if ( drop[i] != NULL || (*chunked
+                                 && is_field(line, colon, "content-length")) )
+                    continue;
+            }
+            if ( pass == 1 && (add(reply, rlen, room, line, len) == -1
+                            || add(reply, rlen, room, "\r\n", 2) == -1) )
+                return -1;
+        }
+    }
+    if ( *chunked )
+        *clen = -1;
+    if ( add(reply, rlen, room, "Connection: close\r\n\r\n", 21) == -1 )
+        return -1;
+    return status;
+}
+
+/*
+ * is the field at line (its colon at colon) the one named name
+ */
+static int
+is_field(char *line, char *colon, char *name)
+{
+    return colon - line == (int) strlen(name)
+           && strncasecmp(line, name, colon - line) == 0;
+}
+
+/*
+ * pass a chunked body from up to fd as plain bytes; returns how many
+ * when the last chunk and the trailer are read, -1 if they are not
+ */
+static long
+dechunk(struct pxin *up, int fd)
+{
+    char    line[256], *p;
+    long    size, done = 0;
+    int     n;
+
+    for ( ;; )
+    {
+        if ( get_line(up, line, sizeof(line)) <= 0 )
+            return -1;
+        size = strtol(line, &p, 16);
+        if ( p == line || size < 0 || (*p != '\0' && *p != ';' && *p != ' ') )
+            return -1;
+        if ( size == 0 )
+            break;
+        if ( copy_n(up, fd, size) == -1 || get_line(up, line, sizeof(line)) != 0 )
+            return -1;
+        done += size;
+    }
+    while ( (n = get_line(up, line, sizeof(line))) > 0 )
+        ;                           /* a trailer: not passed on */
+    return (n == 0) ? done : -1;
+}
+
+/*
+ * the next line from up, without its end, into line (size room);
+ * returns its length, or -1 at the end or for one too long
+ */
+static int
+get_line(struct pxin *up, char *line, int room)
+{
+    char    *p, *nl;
+    int     n;
+
+    for ( ;; )
+    {
+        p = up->buf + up->pos;
+        if ( (nl = memchr(p, '\n', up->len - up->pos)) != NULL )
+        {
+            n = nl - p;
+            up->pos += n + 1;
+            if ( n > 0 && p[n - 1] == '\r' )
+                n--;
+            if ( n >= room )
+                return -1;
+            memcpy(line, p, n);
+            line[n] = '\0';
+            return n;
+        }
+        if ( fill(up) <= 0 )
+            return -1;
+    }
+}
+
+/*
+ * read more into up, after moving what is unread to the front;
+ * returns what read() did, or -1 if there is no room
+ */
+static int
+fill(struct pxin *up)
+{
+    int     n;
+
+    if ( up->pos > 0 )
+    {
+        memmove(up->buf, up->buf + up->pos, up->len - up->pos);
+        up->len -= up->pos;
+        up->pos = 0;
+    }
+    if ( up->len == PX_BUF )
+        return -1;
+    while ( (n = read(up->fd, up->buf + up->len, PX_BUF - up->len)) == -1
+            && errno == EINTR )
+        ;
+    if ( n > 0 )
+        up->len += n;
+    return n;
+}
+
+/*
+ * pass n bytes from up to fd (n < 0: up to the end), what is read
+ * already first; returns how many, or -1 if either side failed or
+ * it ended early
+ */
+static long
+copy_n(struct pxin *up, int fd, long n)
+{
+    long    k, done = 0;
+
+    while ( n != 0 && up->pos < up->len )
+    {
+        k = up->len - up->pos;
+        if ( n > 0 && k > n )
+            k = n;
+        if ( write_all(fd, up->buf + up->pos, k) == -1 )
+            return -1;
+        up->pos += k;
+        done += k;
+        if ( n > 0 )
+            n -= k;
+    }
+    if ( n == 0 )
+        return done;
+    return ( (k = pump(up->fd, fd, n)) == -1 ) ? -1 : done + k;
+}
+
+/*
+ * move n bytes (n < 0: to the end) from one fd to the other, by
+ * splice() through a pipe, or by read() and write() where one of
+ * them cannot be spliced; returns how many, or -1 if not
+ */
+static long
+pump(int from, int to, long n)
+{
+    char    buf[PX_BUF];
+    long    want, got, put, k, done = 0;
+
+    if ( pipefd[0] == -1 && pipe2(pipefd, O_CLOEXEC) == -1 )
+        pipefd[0] = -2;             /* no pipe: copy */
+    while ( n != 0 )
+    {
+        want = (n < 0 || n > PX_SPLICE) ? PX_SPLICE : n;
+        got = -1;
+        errno = EINVAL;
+        if ( pipefd[0] >= 0 )
+            got = splice(from, NULL, pipefd[1], NULL, want,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+        if ( got == -1 && errno == EINVAL )
+        {
+            got = read(from, buf, want < PX_BUF ? want : PX_BUF);
+            if ( got > 0 && write_all(to, buf, got) == -1 )
+                return -1;
+        }
+        else
+            for ( put = 0 ; put < got ; put += k )
+            {
+                k = splice(pipefd[0], NULL, to, NULL, got - put,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+                if ( k == -1 && errno == EINVAL )   /* to takes no splice */
+                {
+                    k = read(pipefd[0], buf, got - put < PX_BUF ? got - put
+                                                                : PX_BUF);
+                    if ( k > 0 && write_all(to, buf, k) == -1 )
+                        return -1;
+                }
+                if ( k == -1 && errno == EINTR )
+                    k = 0;
+                else if ( k <= 0 )
+                    return -1;
+            }
+        if ( got == -1 && errno == EINTR )
+            continue;
+        if ( got == 0 )
+            return (n < 0) ? done : -1;
+        if ( got < 0 )
+            return -1;
+        done += got;
+        if ( n > 0 )
+            n -= got;
+    }
+    return done;
+}
+
+static int
+write_all(int fd, char *buf, long len)
+{
+    long    n;
+
+    for ( ; len > 0 ; buf += n, len -= n )
+        if ( (n = write(fd, buf, len)) <= 0 )
+        {
+            if ( n == -1 && errno == EINTR )
+                n = 0;
+            else
+                return -1;
+        }
+    return 0;
+}
+
+/*
+ * put n bytes of s at out + *len, if they fit in room
+ */
+static int
+add(char *out, int *len, int room, char *s, int n)
+{
+    if ( *len + n > room )
+        return -1;
+    memcpy(out + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+/*
+ * the keeper: fork it off with one end of an unnamed socket pair;
+ * the other, ksock, goes to our children and no one else
+ */
+static int
+start_keeper()
+{
+    pid_t   pid, parent = getpid();
+    int     k[2];
+
+    if ( socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, k) == -1 )
+        return -1;
+    if ( (pid = fork()) == -1 )
+    {
+        close(k[0]);
+        close(k[1]);
+        return -1;
+    }
+    if ( pid == 0 )
+    {
+        close(k[1]);
+        keep(k[0], parent);
+    }
+    close(k[0]);
+    ksock = k[1];
+    keeper = pid;
+    return 0;
+}
+
+/*
+ * the keeper's loop: answer TAKEs and PARKs on s, and drop kept
+ * connections the servers close or that sit idle too long. A TAKE
+ * comes with the socket to answer on. It goes when parent does
+ */
+static void
+keep(int s, pid_t parent)
+{
+    static struct { int fd; unsigned long key; time_t since; } idle[PX_POOL];
+    static struct pollfd pfd[PX_POOL + 1];
+    struct pxmsg m;
+    sigset_t none;
+    time_t  now;
+    int     n = 0, i, fd, up, have, max;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGHUP, SIG_IGN);        /* those are for the server */
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    if ( (max = sysconf(_SC_OPEN_MAX)) < 0 || max > 65536 )
+        max = 65536;
+    for ( fd = 3 ; fd < max ; fd++ )    /* listeners and the like */
+        if ( fd != s )
+            close(fd);
+
+    for ( ;; )
+    {
+        pfd[0].fd = s;
+        pfd[0].events = POLLIN;
+        for ( i = 0 ; i < n ; i++ )
+        {
+            pfd[i + 1].fd = idle[i].fd;
+            pfd[i + 1].events = POLLIN;
+        }
+        if ( poll(pfd, n + 1, 1000) == -1 && errno != EINTR )
+            _exit(1);
+        if ( getppid() != parent )
+            _exit(0);
+        now = time(NULL);
+        for ( i = n - 1 ; i >= 0 ; i-- )    /* closed, or too old */
+            if ( pfd[i + 1].revents != 0 || now - idle[i].since > PX_IDLE )
+            {
+                close(idle[i].fd);
+                idle[i] = idle[--n];
+            }
+        if ( ! (pfd[0].revents & POLLIN) )
+            continue;
+        while ( recv_fd(s, &m, &fd) == 0 )
+        {
+            if ( m.op == PX_PARK && fd != -1 )
+            {
+                for ( i = have = 0 ; i < n ; i++ )
+                    have += (idle[i].key == m.key);
+                if ( have < m.keep && n < PX_POOL )
+                {
+                    idle[n].fd = fd;
+                    idle[n].key = m.key;
+                    idle[n++].since = now;
+                }
+                else
+                    close(fd);
+            }
+            else if ( m.op == PX_TAKE && fd != -1 )
+            {
+                up = -1;
+                for ( i = n - 1 ; i >= 0 && up == -1 ; i-- )    /* newest */
+                    if ( idle[i].key == m.key )
+                    {
+                        up = idle[i].fd;
+                        idle[i] = idle[--n];
+                    }
+                m.op = (up == -1) ? PX_NONE : PX_GOT;
+                send_fd(fd, &m, up);
+                close(fd);
+                if ( up != -1 )
+                    close(up);
+            }
+            else if ( fd != -1 )
+                close(fd);
+        }
+    }
+}
+
+/*
+ * a kept connection to the server key from the keeper, or -1. The
+ * answer comes back on a socket pair of this TAKE's own
+ */
+static int
+take(unsigned long key)
+{
+    struct pxmsg m;
+    struct pollfd pfd;
+    int     r[2], fd = -1;
+
+    m.op = PX_TAKE;
+    m.key = key;
+    m.keep = 0;
+    if ( ksock == -1
+      || socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, r) == -1 )
+        return -1;
+    if ( send_fd(ksock, &m, r[1]) == 0 )
+    {
+        pfd.fd = r[0];
+        pfd.events = POLLIN;
+        if ( poll(&pfd, 1, PX_ASK) == 1 && recv_fd(r[0], &m, &fd) == 0
+          && fd != -1 && (m.op != PX_GOT || m.key != key) )
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    close(r[0]);
+    close(r[1]);
+    return fd;
+}
+
+/*
+ * give fd, a connection to the server key, to the keeper
+ */
+static void
+park(int fd, unsigned long key, int keep)
+{
+    struct pxmsg m;
+
+    m.op = PX_PARK;
+    m.key = key;
+    m.keep = keep;
+    if ( ksock != -1 )
+        send_fd(ksock, &m, fd);
+    close(fd);
+}
+
+/*
+ * send m, with fd if it is not -1, to s's peer
+ */
+static int
+send_fd(int s, struct pxmsg *m, int fd)
+{
+    union {
+        struct cmsghdr  h;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } c;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = m;
+    iov.iov_len = sizeof(*m);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if ( fd != -1 )
+    {
+        memset(&c, 0, sizeof(c));
+        msg.msg_control = c.buf;
+        msg.msg_controllen = sizeof(c.buf);
+        c.h.cmsg_level = SOL_SOCKET;
+        c.h.cmsg_type = SCM_RIGHTS;
+        c.h.cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(&c.h), &fd, sizeof(int));
+    }
+    return (sendmsg(s, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*m)) ? 0 : -1;
+}
+
+/*
+ * the next message on s into m, and the fd with it into *fd (or -1);
+ * 0 ok, -1 if none
+ */
+static int
+recv_fd(int s, struct pxmsg *m, int *fd)
+{
+    union {
+        struct cmsghdr  h;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } c;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *h;
+
+    *fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = m;
+    iov.iov_len = sizeof(*m);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = c.buf;
+    msg.msg_controllen = sizeof(c.buf);
+    if ( recvmsg(s, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != sizeof(*m) )
+        return -1;
+    for ( h = CMSG_FIRSTHDR(&msg) ; h != NULL ; h = CMSG_NXTHDR(&msg, h) )
+        if ( h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS )
+            memcpy(fd, CMSG_DATA(h), sizeof(int));
+    return 0;
+}
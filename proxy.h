@@ -0,0 +1,52 @@
+#ifndef PROXY_H
+#define PROXY_H
+/*
+ * header for proxy.c package
+ */
+
+#include    <stdio.h>
+#include    <netinet/in.h>
+
+#define PX_MAXSERVERS   16          /* per upstream             */
+#define PX_KEEPALIVE    16          /* idle, per server, by default */
+#define PX_FAILS        3           /* in a row, then it is down */
+#define PX_FAILTIME     10          /* seconds it is down for   */
+#define PX_CONNECT      3           /* seconds to connect       */
+
+struct config;
+struct vhost;
+struct reply;
+
+struct pxserver {
+    char                name[64];   /* host:port, as configured */
+    struct sockaddr_in  sa;         /* resolved when read       */
+};
+
+struct pxgroup {                    /* an "upstream"            */
+    char                *name;
+    int                 leastconn;  /* 0: round robin           */
+    int                 n;
+    struct pxserver     servers[PX_MAXSERVERS];
+    struct pxgroup      *next;
+};
+
+struct pxroute {                    /* a "proxy_pass"           */
+    char                *prefix;
+    int                 len;
+    struct pxgroup      *group;
+    struct pxroute      *next;
+};
+
+int     PXupstream(struct pxgroup **, char *, char *);
+int     PXbalance(struct pxgroup *, char *, char *);
+int     PXroute(struct pxroute **, struct pxgroup *, char *, char *);
+struct pxroute *PXmatch(struct vhost *, char *);
+int     PXinit(struct config *);
+int     PXsocket(void);
+int     PXpass(struct pxroute *, struct reply *, char *, char *, char *,
+               struct config *);
+void    PXstats(FILE *);
+void    PXfree_groups(struct pxgroup *);
+void    PXfree_routes(struct pxroute *);
+
+#endif
@@ -0,0 +1,182 @@
+/* ratelimit.c
+ *
+ * per-client admission control: concurrent connections and a
+ * token bucket of requests, kept in a small hash on the address
+ *
+ * interface:
+ *     RLinit( max_per_ip, rate, burst )
+ *                           set the limits, 0 ok, 1 no memory
+ *                           (a limit of 0 means no limit)
+ *     RLadmit( addr )       returns 0 and counts the connection if
+ *                           addr may have one more, else the HTTP
+ *                           status to refuse it with (503 or 429)
+ *     RLrelease( addr )     a connection from addr has finished
+ *                           (safe in the SIGCHLD handler)
+ *
+ * details:
+ *      The table is a fixed array of RL_SLOTS small entries with
+ *      linear probing, so its size does not depend on how many
+ *      addresses have ever connected. An entry with no connections
+ *      open and a full bucket says nothing a new entry would not,
+ *      so a probe reuses the first such slot it passes; nothing is
+ *      ever deleted. A probe gives up after RL_PROBES slots, and the
+ *      client is then let in untracked rather than refused.
+ *
+ *      Tokens are counted in thousandths of a request and refilled
+ *      from the monotonic clock when the client next calls.
+ *
+ *      RLrelease() runs in the SIGCHLD handler. That is only let in
+ *      while main() waits in ppoll(), never during an RLadmit().
+ *
+ *      With several event loop threads, calls come from all of them,
+ *      so the table has a mutex. The handler may take it too: it runs
+ *      in the main thread only while that thread waits, and so never
+ *      holds the lock already; at worst it waits for a loop thread's
+ *      short RLadmit() to finish.
+ */
+
+#include    <stdlib.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    "ratelimit.h"
+
+#define RL_SLOTS    4096            /* a power of two           */
+#define RL_PROBES   32
+
+struct client {
+    unsigned        addr;           /* IPv4, network order; 0 = empty */
+    int             active;         /* connections being served */
+    long            tokens;         /* thousandths of a request */
+    long            stamp;          /* ms when tokens was right */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client *table = NULL;
+static int      max_per_ip = 0;
+static long     rate = 0;           /* requests per second      */
+static long     burst = 0;
+
+static long     now_ms(void);
+static void     refill(struct client *, long);
+static int      idle(struct client *, long);
+static struct client *find(unsigned, int);
+
+int
+RLinit(int per_ip, int r, int b)
+{
+    int     rv;
+
+    pthread_mutex_lock(&lock);
+    max_per_ip = per_ip;
+    rate  = r;
+    burst = b > 0 ? b : r;
+    if ( table == NULL )
+        table = calloc(RL_SLOTS, sizeof(struct client));
+    rv = table == NULL;
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+int
+RLadmit(unsigned addr)
+{
+    struct client *cp;
+    int     code = 0;
+
+    pthread_mutex_lock(&lock);
+    if ( (max_per_ip != 0 || rate != 0) && (cp = find(addr, 1)) != NULL )
+    {                               /* no room to track: let it in */
+        if ( rate > 0 )
+            refill(cp, now_ms());
+        if ( rate > 0 && cp->tokens < 1000 )
+            code = 429;             /* Too Many Requests */
+        else if ( max_per_ip > 0 && cp->active >= max_per_ip )
+            code = 503;
+        else
+        {
+            cp->tokens -= (rate > 0) ? 1000 : 0;
+            cp->active++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return code;
+}
+
+void
+RLrelease(unsigned addr)
+{
+    struct client *cp;
+
+    pthread_mutex_lock(&lock);
+    if ( (cp = find(addr, 0)) != NULL && cp->active > 0 )
+        cp->active--;
+    pthread_mutex_unlock(&lock);
+}
+
+static long
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void
+refill(struct client *cp, long now)
+{
+    cp->tokens += (now - cp->stamp) * rate;     /* ms * req/s = 1/1000s */
+    if ( cp->tokens > burst * 1000 )
+        cp->tokens = burst * 1000;
+    cp->stamp = now;
+}
+
+/*
+ * true if the entry can be handed to another address
+ */
+static int
+idle(struct client *cp, long now)
+{
+    return cp->active == 0
+        && ( rate == 0 || cp->tokens + (now - cp->stamp) * rate >= burst * 1000 );
+}
+
+/*
+ * returns the entry for addr; if it is not there and make is set,
+ * returns a fresh one (a reused or empty slot), else NULL
+ */
+static struct client *
+find(unsigned addr, int make)
+{
+    unsigned    i = (addr * 2654435761u) & (RL_SLOTS - 1);
+    struct client *spare = NULL;
+    long        now = 0;
+    int         n;
+
+    if ( table == NULL )
+        return NULL;
+    if ( make )
+        now = now_ms();
+
+    for ( n = 0 ; n < RL_PROBES ; n++, i = (i + 1) & (RL_SLOTS - 1) )
+    {
+        if ( table[i].addr == addr )
+            return &table[i];
+        if ( table[i].addr == 0 )
+        {
+            if ( spare == NULL )
+                spare = &table[i];
+            break;                  /* end of the run: not here */
+        }
+        if ( make && spare == NULL && idle(&table[i], now) )
+            spare = &table[i];
+    }
+    if ( ! make || spare == NULL )
+        return NULL;
+
+    spare->addr   = addr;
+    spare->active = 0;
+    spare->tokens = burst * 1000;
+    spare->stamp  = now;
+    return spare;
+}
@@ -0,0 +1,11 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+/*
+ * header for ratelimit.c package
+ */
+
+int     RLinit(int, int, int);
+int     RLadmit(unsigned);
+void    RLrelease(unsigned);
+
+#endif
@@ -0,0 +1,216 @@
+/* reply.c
+ *
+ * builds a response as a list of pieces and sends it with writev()
+ *
+ * interface:
+ *     RPinit( r, fd )               start an empty reply to fd
+ *     RPprintf( r, fmt, ... )       add formatted text, 0 ok, -1 no memory
+ *     RPadd( r, buf, len )          add a copy of len bytes
+ *     RPref( r, buf, len )          add len bytes by reference; they
+ *                                   must stay put until they are sent
+ *     RPflush( r )                  send what is queued: 0 all sent,
+ *                                   1 the socket is full, -1 error
+ *     RPpending( r )                returns the bytes not yet sent
+ *     RPfree( r )                   release the reply's memory
+ *
+ * details:
+ *      Text made by the server (status line, headers, listings and
+ *      error pages) is copied into one growing buffer owned by the
+ *      reply. Bytes that already exist somewhere else, such as a
+ *      mapped file, are queued by pointer and never copied. Each
+ *      piece remembers which it is; owned pieces keep an offset, not
+ *      a pointer, so the buffer can move when it grows.
+ *
+ *      RPflush() hands up to RP_IOV pieces to each writev(), so a
+ *      header and the start of a file go out in one system call. A
+ *      short write just moves the mark of what has been sent. On a
+ *      non-blocking socket EAGAIN returns 1 with the mark kept, and
+ *      the next RPflush() carries on from there. When everything is
+ *      out the reply is emptied, so the same reply can be used for
+ *      the next response on the connection. The first bytes to go
+ *      out are shown to trace.c, which marks the time and takes the
+ *      status from them.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdarg.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <sys/uio.h>
+#include    "trace.h"
+#include    "reply.h"
+
+#define RP_IOV      64              /* pieces per writev()      */
+#define RP_MINBUF   1024
+
+static int      add_seg(struct reply *, char *, size_t, size_t);
+static int      grow_buf(struct reply *, size_t);
+
+void
+RPinit(struct reply *r, int fd)
+{
+    memset(r, 0, sizeof(struct reply));
+    r->fd = fd;
+}
+
+int
+RPprintf(struct reply *r, char *fmt, ...)
+{
+    va_list ap;
+    int     n;
+    size_t  room = r->cap - r->len;
+
+    va_start(ap, fmt);
+    n = vsnprintf(r->buf ? r->buf + r->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if ( n < 0 )
+        return -1;
+    if ( (size_t) n >= room )       /* did not fit: grow and redo */
+    {
+        if ( grow_buf(r, n + 1) == -1 )
+            return -1;
+        va_start(ap, fmt);
+        vsnprintf(r->buf + r->len, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    r->len += n;
+    return add_seg(r, NULL, r->len - n, n);
+}
+
+int
+RPadd(struct reply *r, char *buf, size_t len)
+{
+    if ( r->cap - r->len < len && grow_buf(r, len) == -1 )
+        return -1;
+    memcpy(r->buf + r->len, buf, len);
+    r->len += len;
+    return add_seg(r, NULL, r->len - len, len);
+}
+
+int
+RPref(struct reply *r, char *buf, size_t len)
+{
+    return len == 0 ? 0 : add_seg(r, buf, 0, len);
+}
+
+int
+RPflush(struct reply *r)
+{
+    struct iovec    iov[RP_IOV];
+    struct rpseg    *sp;
+    ssize_t n;
+    int     i, cnt;
+
+    while ( r->first < r->nseg )
+    {
+        for ( cnt = 0, i = r->first ; i < r->nseg && cnt < RP_IOV ; i++ )
+        {
+            sp = &r->segs[i];
+            iov[cnt].iov_base = (sp->base ? sp->base : r->buf) + sp->off;
+            iov[cnt].iov_len  = sp->len;
+            if ( cnt == 0 )         /* skip what went last time */
+            {
+                iov[0].iov_base = (char *) iov[0].iov_base + r->done;
+                iov[0].iov_len -= r->done;
+            }
+            cnt++;
+        }
+
+        n = writev(r->fd, iov, cnt);
+        if ( n == -1 && errno == EINTR )
+            continue;
+        if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            return 1;
+        if ( n <= 0 )
+            return -1;
+
+        if ( r->sent == 0 )         /* the status line, for the log */
+            TRfirst(r->trace, iov[0].iov_base, iov[0].iov_len);
+        r->sent += n;
+        n += r->done;               /* count from the piece's start */
+        while ( r->first < r->nseg && (size_t) n >= r->segs[r->first].len )
+            n -= r->segs[r->first++].len;
+        r->done = n;
+    }
+    r->nseg = r->first = 0;         /* all out: start over empty */
+    r->len = r->done = 0;
+    return 0;
+}
+
+size_t
+RPpending(struct reply *r)
+{
+    size_t  left = 0;
+    int     i;
+
+    for ( i = r->first ; i < r->nseg ; i++ )
+        left += r->segs[i].len;
+    return left - r->done;
+}
+
+void
+RPfree(struct reply *r)
+{
+    free(r->buf);
+    free(r->segs);
+    r->buf = NULL;
+    r->segs = NULL;
+    r->cap = r->len = 0;
+    r->nseg = r->maxseg = r->first = 0;
+    r->done = 0;
+}
+
+/*
+ * queue a piece; owned bytes (base NULL) right after the
+ * last owned piece just make that piece longer
+ */
+static int
+add_seg(struct reply *r, char *base, size_t off, size_t len)
+{
+    struct rpseg *sp, *newsegs;
+    int     newmax;
+
+    if ( r->nseg > r->first )
+    {
+        sp = &r->segs[r->nseg - 1];
+        if ( base == NULL && sp->base == NULL && sp->off + sp->len == off )
+        {
+            sp->len += len;
+            return 0;
+        }
+    }
+    if ( r->nseg == r->maxseg )
+    {
+        newmax = r->maxseg ? r->maxseg * 2 : 8;
+        newsegs = realloc(r->segs, newmax * sizeof(struct rpseg));
+        if ( newsegs == NULL )
+            return -1;
+        r->segs = newsegs;
+        r->maxseg = newmax;
+    }
+    sp = &r->segs[r->nseg++];
+    sp->base = base;
+    sp->off  = off;
+    sp->len  = len;
+    return 0;
+}
+
+/*
+ * make room for at least need more bytes
+ */
+static int
+grow_buf(struct reply *r, size_t need)
+{
+    size_t  newcap = r->cap ? r->cap : RP_MINBUF;
+    char    *newbuf;
+
+    while ( newcap - r->len < need )
+        newcap *= 2;
+    if ( (newbuf = realloc(r->buf, newcap)) == NULL )
+        return -1;
+    r->buf = newbuf;
+    r->cap = newcap;
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef REPLY_H
+#define REPLY_H
+/*
+ * header for reply.c package
+ */
+
+#include    <sys/types.h>
+
+struct trace;
+
+struct rpseg {                      /* one piece of the reply   */
+    char            *base;          /* NULL: in the reply's buf */
+    size_t          off;
+    size_t          len;
+};
+
+struct reply {
+    int             fd;
+    char            *buf;           /* bytes the reply owns     */
+    size_t          len, cap;
+    struct rpseg    *segs;          /* pieces, in order         */
+    int             nseg, maxseg;
+    int             first;          /* first piece not all sent */
+    size_t          done;           /* bytes of it already sent */
+    size_t          sent;           /* total, for the log       */
+    struct trace    *trace;         /* marked at the first byte, */
+                                    /*   or NULL; see trace.c   */
+};
+
+void    RPinit(struct reply *, int);
+int     RPprintf(struct reply *, char *, ...)
+            __attribute__((format(printf, 2, 3)));
+int     RPadd(struct reply *, char *, size_t);
+int     RPref(struct reply *, char *, size_t);
+int     RPflush(struct reply *);
+size_t  RPpending(struct reply *);
+void    RPfree(struct reply *);
+
+#endif
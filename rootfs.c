@@ -0,0 +1,70 @@
+/* rootfs.c
+ *
+ * open request paths beneath a document root that is held open as an fd
+ *
+ * interface:
+ *     RFopenroot( dir )             returns O_PATH fd for dir, -1 on error
+ *     RFopen( rootfd, path, flags ) returns fd for path beneath rootfd,
+ *                                   -1 with errno set on error
+ *
+ * details:
+ *      RFopen() resolves with openat2() and RESOLVE_BENEATH plus
+ *      RESOLVE_NO_MAGICLINKS, so "..", absolute symlinks and /proc
+ *      style magic links cannot carry a lookup outside the root. An
+ *      escape attempt fails with EXDEV (or ELOOP for magic links).
+ *      The whole path is walked once by the kernel; callers fstat()
+ *      the returned fd instead of stat()ing the path again.
+ *
+ *      Kernels before 5.6 do not have openat2() and return ENOSYS.
+ *      The first ENOSYS is remembered and later calls go straight to
+ *      openat(). That fallback still never sees "..", because
+ *      modify_argument() strips those, but symlinks are followed.
+ */
+
+#define     _GNU_SOURCE             /* O_PATH */
+#include    <stdio.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <errno.h>
+#include    <string.h>
+#include    <sys/syscall.h>
+#include    <linux/openat2.h>
+#include    "rootfs.h"
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+static int have_openat2 = 1;        /* cleared on first ENOSYS */
+
+int
+RFopenroot(char *dir)
+/*
+ * open dir as a path-only handle to resolve requests against
+ */
+{
+    return open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+int
+RFopen(int rootfd, char *path, int flags)
+/*
+ * open path, which must stay beneath rootfd, with open flags
+ */
+{
+    struct open_how how;
+    int     fd;
+
+    if ( have_openat2 )
+    {
+        memset(&how, 0, sizeof(how));
+        how.flags   = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(how));
+        if ( fd != -1 || errno != ENOSYS )
+            return fd;
+        have_openat2 = 0;           /* old kernel: never try again */
+    }
+    return openat(rootfd, path, flags | O_CLOEXEC);
+}
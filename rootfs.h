@@ -0,0 +1,10 @@
+#ifndef ROOTFS_H
+#define ROOTFS_H
+/*
+ * header for rootfs.c package
+ */
+
+int     RFopenroot(char *);
+int     RFopen(int, char *, int);
+
+#endif
@@ -0,0 +1,195 @@
+/* scan.c
+ *
+ * delimiter search for the request parser, with SIMD kernels
+ *
+ * interface:
+ *     SNinit()                  pick the best kernel this CPU has,
+ *                               returns its name
+ *     SNselect( name )          use kernel name ("avx2", "sse4.2" or
+ *                               "scalar") instead; 0 ok, -1 if this
+ *                               CPU or build does not have it
+ *     SNkernel()                name of the kernel in use
+ *     SNany( p, end, set )      returns the first byte in p..end-1
+ *                               that is in set (a string of at most
+ *                               SN_MAXSET chars), or NULL
+ *     SNhead_end( p, end )      returns the byte past the blank line
+ *                               that ends a request head in p..end-1
+ *                               ("\r\n\r\n" or "\n\n"), or NULL
+ *
+ * details:
+ *      Parsing a request is mostly looking for the next delimiter:
+ *      the line end, the ':' after a header name, the space between
+ *      method and target. SNany() does that search 32 bytes at a
+ *      time with AVX2 (one compare per set char, OR'd, then one
+ *      movemask), or 16 at a time with the SSE4.2 string compare
+ *      (PCMPESTRI, "equal any"), or a byte at a time. The vector
+ *      loops never read past end: the last few bytes go through the
+ *      scalar loop, so a head at the end of a page cannot fault.
+ *
+ *      The kernels are compiled with per-function target attributes,
+ *      so the rest of the server is built for the baseline CPU and
+ *      the choice is made at run time with __builtin_cpu_supports().
+ *      Until SNinit() runs, the scalar kernel is used. A forked
+ *      child keeps the parent's choice.
+ *
+ *      scanbench.c measures the kernels on typical browser heads.
+ */
+
+#include    <string.h>
+#include    "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SN_X86
+#include    <immintrin.h>
+#endif
+
+typedef char *(*anyfn)(char *, char *, char *, int);
+
+static char     *any_scalar(char *, char *, char *, int);
+#ifdef SN_X86
+static char     *any_sse42(char *, char *, char *, int);
+static char     *any_avx2(char *, char *, char *, int);
+#endif
+
+static struct kernel {
+    char    *name;
+    anyfn   fn;
+} kernels[] = {
+#ifdef SN_X86
+    { "avx2",   any_avx2 },
+    { "sse4.2", any_sse42 },
+#endif
+    { "scalar", any_scalar },
+};
+#define NKERNELS    (sizeof(kernels) / sizeof(kernels[0]))
+
+static struct kernel *current = &kernels[NKERNELS - 1];
+
+static int      supported(struct kernel *);
+
+char *
+SNinit()
+{
+    unsigned i;
+
+    for ( i = 0 ; i < NKERNELS ; i++ )
+        if ( supported(&kernels[i]) )
+            break;
+    current = &kernels[i];
+    return current->name;
+}
+
+int
+SNselect(char *name)
+{
+    unsigned i;
+
+    for ( i = 0 ; i < NKERNELS ; i++ )
+        if ( strcmp(kernels[i].name, name) == 0 && supported(&kernels[i]) )
+        {
+            current = &kernels[i];
+            return 0;
+        }
+    return -1;
+}
+
+char *
+SNkernel()
+{
+    return current->name;
+}
+
+char *
+SNany(char *p, char *end, char *set)
+{
+    int     n = strlen(set);
+
+    if ( n > SN_MAXSET )
+        n = SN_MAXSET;
+    return current->fn(p, end, set, n);
+}
+
+char *
+SNhead_end(char *p, char *end)
+{
+    while ( (p = SNany(p, end, "\n")) != NULL )
+    {
+        if ( p + 1 < end && p[1] == '\n' )
+            return p + 2;
+        if ( p + 2 < end && p[1] == '\r' && p[2] == '\n' )
+            return p + 3;
+        p++;
+    }
+    return NULL;
+}
+
+static int
+supported(struct kernel *k)
+{
+#ifdef SN_X86
+    __builtin_cpu_init();
+    if ( k->fn == any_avx2 )
+        return __builtin_cpu_supports("avx2");
+    if ( k->fn == any_sse42 )
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return 1;
+}
+
+static char *
+any_scalar(char *p, char *end, char *set, int n)
+{
+    int     i;
+
+    for ( ; p < end ; p++ )
+        for ( i = 0 ; i < n ; i++ )
+            if ( *p == set[i] )
+                return p;
+    return NULL;
+}
+
+#ifdef SN_X86
+__attribute__((target("sse4.2")))
+static char *
+any_sse42(char *p, char *end, char *set, int n)
+{
+    char    buf[16] = { 0 };
+    __m128i needles, block;
+    int     i;
+
+    memcpy(buf, set, n);
+    needles = _mm_loadu_si128((__m128i *) buf);
+    for ( ; end - p >= 16 ; p += 16 )
+    {
+        block = _mm_loadu_si128((__m128i *) p);
+        i = _mm_cmpestri(needles, n, block, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY
+                         | _SIDD_LEAST_SIGNIFICANT);
+        if ( i < 16 )
+            return p + i;
+    }
+    return any_scalar(p, end, set, n);
+}
+
+__attribute__((target("avx2")))
+static char *
+any_avx2(char *p, char *end, char *set, int n)
+{
+    __m256i needles[SN_MAXSET], block, hits;
+    unsigned mask;
+    int     i;
+
+    for ( i = 0 ; i < n ; i++ )
+        needles[i] = _mm256_set1_epi8(set[i]);
+    for ( ; end - p >= 32 ; p += 32 )
+    {
+        block = _mm256_loadu_si256((__m256i *) p);
+        hits = _mm256_cmpeq_epi8(block, needles[0]);
+        for ( i = 1 ; i < n ; i++ )
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[i]));
+        if ( (mask = _mm256_movemask_epi8(hits)) != 0 )
+            return p + __builtin_ctz(mask);
+    }
+    return any_sse42(p, end, set, n);       /* the last 0..31 bytes */
+}
+#endif
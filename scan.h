@@ -0,0 +1,15 @@
+#ifndef SCAN_H
+#define SCAN_H
+/*
+ * header for scan.c package
+ */
+
+#define SN_MAXSET   16              /* chars in an SNany() set  */
+
+char    *SNinit(void);
+int     SNselect(char *);
+char    *SNkernel(void);
+char    *SNany(char *, char *, char *);
+char    *SNhead_end(char *, char *);
+
+#endif
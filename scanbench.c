@@ -0,0 +1,150 @@
+/* scanbench.c
+ *
+ * how fast the request scanning kernels in scan.c are
+ *
+ * usage: scanbench [iterations]
+ *
+ * details:
+ *      Parses a few typical browser request heads the way wsng does:
+ *      find the blank line that ends the head, then each line end
+ *      and the ':' on each header line, and the blanks in the
+ *      request line. Runs that with each kernel this CPU has and
+ *      prints the bytes handled per TSC cycle (per ns elsewhere).
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <time.h>
+#include    "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include    <x86intrin.h>
+#define UNIT    "cycle"
+#define now()   __rdtsc()
+#else
+#define UNIT    "ns"
+static unsigned long long
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static char *heads[] = {
+    "GET /static/css/site.css?v=20260412 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"128\", \"Not;A=Brand\";v=\"24\", "
+        "\"Google Chrome\";v=\"128\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/128.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: https://www.example.com/docs/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=5f2b9c0e8d7a4b1c9e3f6a2d8b7c4e1f; theme=dark; "
+        "_ga=GA1.1.1234567890.1712345678\r\n"
+    "\r\n",
+
+    "GET /docs/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:130.0) "
+        "Gecko/20100101 Firefox/130.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,image/png,image/svg+xml,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n",
+
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+#define NHEADS  (sizeof(heads) / sizeof(heads[0]))
+
+static long     parse(char *, int);
+
+int
+main(int ac, char *av[])
+{
+    static char *names[] = { "scalar", "sse4.2", "avx2" };
+    char    *bufs[NHEADS];
+    int     lens[NHEADS];
+    long    iters = ac > 1 ? atol(av[1]) : 200000;
+    long    i, bytes, check, first = -1;
+    unsigned long long t0, t1;
+    unsigned k, h;
+
+    for ( h = 0 ; h < NHEADS ; h++ )    /* off the string table */
+    {
+        lens[h] = strlen(heads[h]);
+        bufs[h] = malloc(lens[h]);
+        memcpy(bufs[h], heads[h], lens[h]);
+    }
+    printf("%-8s %12s %10s\n", "kernel", "bytes/" UNIT, "check");
+    for ( k = 0 ; k < sizeof(names) / sizeof(names[0]) ; k++ )
+    {
+        if ( SNselect(names[k]) != 0 )
+        {
+            printf("%-8s %12s\n", names[k], "n/a");
+            continue;
+        }
+        bytes = check = 0;
+        t0 = now();
+        for ( i = 0 ; i < iters ; i++ )
+            for ( h = 0 ; h < NHEADS ; h++ )
+            {
+                check += parse(bufs[h], lens[h]);
+                bytes += lens[h];
+            }
+        t1 = now();
+        if ( first == -1 )
+            first = check;
+        printf("%-8s %12.2f %10s\n", names[k], (double) bytes / (t1 - t0),
+               check == first ? "ok" : "MISMATCH");
+    }
+    return 0;
+}
+
+/*
+ * the searches parse_head() and split_request() in wsng.c make;
+ * returns a sum of the offsets found, to compare the kernels
+ */
+static long
+parse(char *buf, int len)
+{
+    char    *end = SNhead_end(buf, buf + len);
+    char    *line, *eol, *p;
+    long    sum = 0;
+
+    if ( end == NULL )
+        return -1;
+    eol = SNany(buf, end, "\n");
+    for ( p = buf ; (p = SNany(p, eol, " \t")) != NULL ; p++ )
+        sum += p - buf;
+    for ( line = eol + 1 ; line < end ; line = eol + 1 )
+    {
+        eol = SNany(line, end, "\n");
+        if ( (p = SNany(line, eol, ":")) != NULL )
+            sum += p - buf;
+    }
+    return sum;
+}
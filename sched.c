@@ -0,0 +1,234 @@
+/* sched.c
+ *
+ * work-stealing queues of CPU work for the event loop threads
+ *
+ * interface:
+ *     SCnew( nqueues )              returns a scheduler with one deque
+ *                                   per loop thread, or NULL
+ *     SCwakefd( s )                 an eventfd, readable when some
+ *                                   queue has work to spare; poll it
+ *                                   with EPOLLEXCLUSIVE
+ *     SCpush( s, self, q, job )     queue job on deque self; its done()
+ *                                   will run in the thread owning q.
+ *                                   0 ok, -1 deque full
+ *     SCrun( s, self, max )         run up to max jobs from deque self,
+ *                                   newest first; returns how many
+ *     SCsteal( s, self, max )       run up to max jobs taken from the
+ *                                   other deques; returns how many
+ *     SCwaiting( s, self )          returns the jobs left on deque self
+ *     SCstats( s, fp )              print per-deque figures
+ *
+ * details:
+ *      Each loop thread owns one deque (Chase and Lev's, on a fixed
+ *      array). The owner pushes and pops at the bottom with no lock.
+ *      Any other thread may take from the top, and owner and thief
+ *      settle a race for the last job with one compare-and-swap on
+ *      top. So the owner's own work costs it no shared writes unless
+ *      somebody is stealing.
+ *
+ *      The jobs are struct tpjob, as for tpool.c. A job run by its
+ *      owner has done() called at once. A stolen job is run by the
+ *      thief, then put on the owner's completion queue (TPpost()), so
+ *      done() still runs where the connection lives.
+ *
+ *      The owner runs a few of its jobs per trip round its loop, so
+ *      a connection that makes a lot of work only gets its turn with
+ *      the rest. When it pushes a job with others already waiting it
+ *      bumps the wake eventfd, and a loop thread with nothing to do
+ *      comes and takes some of them.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <stdint.h>
+#include    <sys/eventfd.h>
+#include    "tpool.h"
+#include    "sched.h"
+
+#define SC_SIZE     256             /* jobs per deque, a power of 2 */
+
+struct deque {
+    long            top;            /* thieves take here        */
+    long            bottom;         /* the owner works here     */
+    struct tpjob    *jobs[SC_SIZE];
+    unsigned long   ran, stolen, full;  /* metrics              */
+} __attribute__((aligned(64)));
+
+struct sched {
+    int             nq;
+    int             wakefd;
+    struct deque    *q;
+};
+
+static struct tpjob *take(struct deque *);
+static struct tpjob *steal(struct deque *);
+
+struct sched *
+SCnew(int nq)
+{
+    struct sched *s = calloc(1, sizeof(struct sched));
+
+    if ( s == NULL )
+        return NULL;
+    if ( posix_memalign((void **) &s->q, 64, nq * sizeof(struct deque)) != 0 )
+    {
+        free(s);
+        return NULL;
+    }
+    if ( (s->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 )
+    {
+        free(s->q);
+        free(s);
+        return NULL;
+    }
+    memset(s->q, 0, nq * sizeof(struct deque));
+    s->nq = nq;
+    return s;
+}
+
+int
+SCwakefd(struct sched *s)
+{
+    return s->wakefd;
+}
+
+int
+SCpush(struct sched *s, int self, struct tpqueue *q, struct tpjob *job)
+{
+    struct deque *d = &s->q[self];
+    long    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long    t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+
+    if ( b - t >= SC_SIZE )
+    {
+        __atomic_add_fetch(&d->full, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    job->queue = q;
+    __atomic_store_n(&d->jobs[b & (SC_SIZE - 1)], job, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    if ( b > t && write(s->wakefd, &one, sizeof(one)) == -1 )
+        ;                           /* counter full: already readable */
+    return 0;
+}
+
+int
+SCrun(struct sched *s, int self, int max)
+{
+    struct deque *d = &s->q[self];
+    struct tpjob *job;
+    int     n;
+
+    for ( n = 0 ; n < max && (job = take(d)) != NULL ; n++ )
+    {
+        job->work(job);
+        __atomic_add_fetch(&d->ran, 1, __ATOMIC_RELAXED);
+        job->done(job);
+    }
+    return n;
+}
+
+int
+SCsteal(struct sched *s, int self, int max)
+{
+    struct tpjob *job;
+    uint64_t n;
+    int     i, victim, count = 0;
+
+    if ( read(s->wakefd, &n, sizeof(n)) == -1 )
+        ;                           /* someone else got the wakeup */
+    for ( i = 1 ; i < s->nq && count < max ; i++ )
+    {
+        victim = (self + i) % s->nq;
+        while ( count < max && (job = steal(&s->q[victim])) != NULL )
+        {
+            job->work(job);
+            __atomic_add_fetch(&s->q[self].stolen, 1, __ATOMIC_RELAXED);
+            TPpost(job->queue, job);
+            count++;
+        }
+    }
+    return count;
+}
+
+int
+SCwaiting(struct sched *s, int self)
+{
+    struct deque *d = &s->q[self];
+    long    n = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED)
+              - __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    return n > 0 ? n : 0;
+}
+
+void
+SCstats(struct sched *s, FILE *fp)
+{
+    struct deque *d;
+    int     i;
+
+    fprintf(fp, "loop  waiting      ran   stolen     full\n");
+    for ( i = 0 ; i < s->nq ; i++ )
+    {
+        d = &s->q[i];
+        fprintf(fp, "%4d %8d %8lu %8lu %8lu\n", i, SCwaiting(s, i),
+                __atomic_load_n(&d->ran, __ATOMIC_RELAXED),
+                __atomic_load_n(&d->stolen, __ATOMIC_RELAXED),
+                __atomic_load_n(&d->full, __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * owner side: pop the newest job. bottom is lowered first, so a
+ * thief either sees it and backs off, or has already moved top
+ * past the job; only for the last job do the two have to race
+ */
+static struct tpjob *
+take(struct deque *d)
+{
+    long    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long    t;
+    struct tpjob *job;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if ( t > b )
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;                /* empty */
+    }
+    job = __atomic_load_n(&d->jobs[b & (SC_SIZE - 1)], __ATOMIC_RELAXED);
+    if ( t == b )
+    {
+        if ( ! __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) )
+            job = NULL;             /* a thief got it */
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+/*
+ * thief side: take the oldest job, if nobody beats us to it
+ */
+static struct tpjob *
+steal(struct deque *d)
+{
+    long    t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long    b;
+    struct tpjob *job;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if ( t >= b )
+        return NULL;
+    job = __atomic_load_n(&d->jobs[t & (SC_SIZE - 1)], __ATOMIC_RELAXED);
+    if ( ! __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) )
+        return NULL;                /* lost to the owner or a thief */
+    return job;
+}
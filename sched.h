@@ -0,0 +1,21 @@
+#ifndef SCHED_H
+#define SCHED_H
+/*
+ * header for sched.c package
+ */
+
+#include    <stdio.h>
+
+struct sched;
+struct tpqueue;
+struct tpjob;
+
+struct sched    *SCnew(int);
+int             SCwakefd(struct sched *);
+int             SCpush(struct sched *, int, struct tpqueue *, struct tpjob *);
+int             SCrun(struct sched *, int, int);
+int             SCsteal(struct sched *, int, int);
+int             SCwaiting(struct sched *, int);
+void            SCstats(struct sched *, FILE *);
+
+#endif
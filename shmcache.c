@@ -0,0 +1,687 @@
+/* shmcache.c
+ *
+ * small files kept in shared memory, so every child of the forking
+ * server can send one that another child has already read
+ *
+ * interface:
+ *     SMinit( bytes )               make a cache of that many bytes,
+ *                                   before any fork; 0 ok, 1 no. 0
+ *                                   bytes leaves it off
+ *     SMlookup( host, path )        returns a private copy of the file
+ *                                   (and its Content-Type) stored for
+ *                                   path under vhost id host, or NULL:
+ *                                   not there, or not checked lately.
+ *                                   hit->stale is set on one past its
+ *                                   time but within its stale time
+ *     SMpeek( host, path )          SMlookup() without counting a hit
+ *                                   or miss, for a caller looking again
+ *     SMstore( host, path, type, fd, info )
+ *                                   keep the regular file open on fd
+ *                                   for the next child that wants it;
+ *                                   returns the bytes read, a private
+ *                                   copy to send and free(), or NULL
+ *                                   if it was not kept. Drops our claim
+ *     SMkeeps( path, type, info )   1 if SMstore() would keep the file
+ *                                   info describes
+ *     SMput( host, key, type, data, len, ttl, stale )
+ *                                   keep len bytes under key for ttl
+ *                                   seconds, and stale more after that.
+ *                                   NULL data stores a "pass": a hit
+ *                                   with no data. Drops our claim
+ *     SMclaim( host, key )          1: the caller is to make key's
+ *                                   entry; 0: a live process is at it;
+ *                                   -1: no room to say so, the caller
+ *                                   may make it, uncoordinated
+ *     SMunclaim( host, key )        give the claim up unfilled
+ *     SMstats( fp )                 print the shared figures
+ *
+ * details:
+ *      A forked child starts with nothing but what the parent had at
+ *      the fork, so anything a child learns is gone when it exits. A
+ *      cache per child would be no use, and one per process in a
+ *      pre-forked server would hold a copy of the same hot files in
+ *      every process. This one is a memfd mapped MAP_SHARED by
+ *      startup() before the first fork: one copy, seen by all the
+ *      children, with one set of hit and miss counts.
+ *
+ *      The segment holds a header, a direct-mapped index of slots
+ *      (one per SM_AVG bytes) and an arena. An entry is keyed by
+ *      vhost id and the path after modify_argument(); its record in
+ *      the arena holds the path, the Content-Type and the bytes.
+ *
+ *      The arena is a ring, written at head and freed at tail, so
+ *      allocating is a pointer bump and eviction is oldest first.
+ *      Room for a new record is made by retiring records from the
+ *      tail; a record's slot is cleared before its bytes can be
+ *      written over. A record whose slot has moved on is just left
+ *      to be passed over.
+ *
+ *      Readers take no lock. Each slot has a sequence number, odd
+ *      while a writer has it, as in dircache.c. A reader notes it,
+ *      copies the record out, and keeps the copy only if the number
+ *      has not moved; the copy is what gets sent, so a writer can
+ *      reuse the space as soon as the slot is cleared. Writers (the
+ *      stores, and the evictions they cause) take one mutex in the
+ *      segment. It is process-shared and robust: a child killed while
+ *      it held the lock leaves the next writer EOWNERDEAD, and that
+ *      writer empties the cache rather than trust what was half
+ *      written. So nothing slow is done under it: SMstore() reads the
+ *      file into private memory first, and holds the lock only to
+ *      make room, copy the bytes in and link the record. A child
+ *      killed in the middle of a read from a slow disk costs nothing.
+ *
+ *      Files are not watched. Like fcache.c an entry is trusted for
+ *      SM_VALID seconds after it was last found current, then a miss
+ *      sends the child to the disk, and SMstore() marks it current
+ *      again if the device, inode, size and mtime are unchanged, or
+ *      stores the new bytes. Files larger than SM_MAXFILE or an
+ *      eighth of the arena are not kept. A hit is sent without an
+ *      open() or fstat(), so for up to SM_VALID seconds a file that
+ *      was deleted, or made unreadable, is still sent as it was. That
+ *      is the price of skipping the path walk; fcache.c pays the same.
+ *
+ *      SMput() entries (CGI output, see cgicache.c) are not checked
+ *      against anything; they last as long as the caller says. So
+ *      that a crowd asking for a missing key does not all go and make
+ *      it, the maker first takes a claim, a pid in a small table in
+ *      the segment, and the others wait for the entry instead. A
+ *      crowd missing one file does the same (store_cat() in wsng.c),
+ *      so a cold popular file is read once, not once per child. A
+ *      claim goes in the first free place of SM_PROBE from its key's
+ *      hash, and is found by the full hash, so two keys that meet
+ *      both get one. With all SM_PROBE places held by other keys
+ *      the caller is told it goes uncoordinated. A claim dies with
+ *      its process, or after SM_CLAIMTIME seconds.
+ */
+
+#define     _GNU_SOURCE             /* memfd_create() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <time.h>
+#include    <signal.h>
+#include    <pthread.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    "shmcache.h"
+
+#define SM_AVG      8192            /* arena bytes per slot     */
+#define SM_MINSLOTS 64
+#define SM_VALID    1               /* seconds a hit goes unchecked */
+#define SM_MAXFILE  (1L << 20)
+#define SM_MAXTYPE  255             /* Content-Type length      */
+#define SM_CLAIMS   64              /* keys being made at once  */
+#define SM_CLAIMTIME 60             /* seconds a claim can last */
+#define SM_PROBE    8               /* places a claim may go in */
+#define ALIGN(n)    (((n) + 7) & ~7L)
+
+struct smclaim {
+    unsigned        host;
+    unsigned long   hash;
+    pid_t           pid;            /* 0: free                  */
+    time_t          since;
+};
+
+struct smhead {
+    pthread_mutex_t lock;           /* writers; robust          */
+    unsigned        nslots;
+    long            size;           /* arena bytes              */
+    long            head, tail;     /* write here, free from here */
+    long            used;
+    struct smclaim  claims[SM_CLAIMS];
+    unsigned long   hits, stalehits, misses, stores, refreshed, evicted,
+                    resets;
+};
+
+struct smslot {
+    unsigned        seq;            /* odd while being written  */
+    unsigned        host;           /* vhost id                 */
+    unsigned long   hash;           /* of the path              */
+    long            off;            /* record in the arena, -1 none */
+    long            len;            /* bytes, -1 for a pass     */
+    time_t          fresh;          /* a hit until then         */
+    time_t          stale;          /* a stale hit until then   */
+    dev_t           dev;            /* what was read            */
+    ino_t           ino;
+    time_t          mtime;
+    long            mtime_ns;
+};
+
+struct smrec {                      /* then path, type, bytes   */
+    long            size;           /* in the arena, all of it  */
+    int             slot;           /* owner, -1 for none       */
+    int             pathlen;
+    int             typelen;
+};
+
+static struct smhead *hd = NULL;
+static struct smslot *slots;
+static char         *arena;
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x,v)  __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define COUNT(x)    __atomic_add_fetch(&hd->x, 1, __ATOMIC_RELAXED)
+
+static unsigned long hash_of(unsigned, char *);
+static long     rec_size(int, int, long);
+static int      fits(char *, char *, long);
+static char     *rec_bytes(long);
+static struct smhit *copy_out(struct smslot *, unsigned, unsigned long, char *);
+static int      same_file(struct smslot *, unsigned, unsigned long, char *,
+                          struct stat *);
+static int      lock(void);
+static struct smclaim *claim_of(unsigned, unsigned long);
+static int      live(struct smclaim *, time_t);
+static long     make_rec(char *, char *, long);
+static void     link_rec(int, long, unsigned, unsigned long, long, time_t,
+                         time_t, struct stat *);
+static long     alloc(long);
+static void     evict(void);
+static void     clear_slot(struct smslot *);
+
+int
+SMinit(long bytes)
+{
+    long        nslots = SM_MINSLOTS, total;
+    void        *base = MAP_FAILED;
+    pthread_mutexattr_t attr;
+    int         fd, i;
+
+    if ( bytes <= 0 )
+        return 0;
+    bytes = ALIGN(bytes);
+    while ( nslots < bytes / SM_AVG )
+        nslots *= 2;
+    total = ALIGN(sizeof(struct smhead)) + nslots * sizeof(struct smslot)
+          + bytes;
+
+    if ( (fd = memfd_create("wsng-cache", MFD_CLOEXEC)) != -1 )
+    {
+        if ( ftruncate(fd, total) == 0 )
+            base = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);                  /* the mapping keeps it */
+    }
+    else                            /* no memfd: anonymous is as good */
+        base = mmap(NULL, total, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if ( base == MAP_FAILED )
+        return 1;
+
+    hd = base;
+    slots = (struct smslot *) ((char *) base + ALIGN(sizeof(struct smhead)));
+    arena = (char *) (slots + nslots);
+    hd->nslots = nslots;
+    hd->size = bytes;
+    for ( i = 0 ; i < nslots ; i++ )
+        slots[i].off = -1;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if ( pthread_mutex_init(&hd->lock, &attr) != 0 )
+    {
+        munmap(base, total);
+        hd = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+struct smhit *
+SMlookup(unsigned host, char *path)
+{
+    struct smhit *hit;
+
+    if ( hd == NULL )
+        return NULL;
+    if ( (hit = SMpeek(host, path)) == NULL )
+        COUNT(misses);
+    else if ( hit->stale )
+        COUNT(stalehits);
+    else
+        COUNT(hits);
+    return hit;
+}
+
+struct smhit *
+SMpeek(unsigned host, char *path)
+{
+    unsigned long h;
+
+    if ( hd == NULL )
+        return NULL;
+    h = hash_of(host, path);
+    return copy_out(&slots[h & (hd->nslots - 1)], host, h, path);
+}
+
+char *
+SMstore(unsigned host, char *path, char *type, int fd, struct stat *info)
+{
+    unsigned long h;
+    struct smslot *sp;
+    struct smclaim *c;
+    char    *data;
+    long    len = info->st_size, off, got;
+    time_t  now;
+    int     i;
+    ssize_t n;
+
+    if ( ! SMkeeps(path, type, info) || (data = malloc(len)) == NULL )
+        return NULL;
+    for ( got = 0 ; got < len ; got += n )  /* before the lock */
+        if ( (n = pread(fd, data + got, len - got, got)) <= 0 )
+        {
+            free(data);             /* shrank; the caller copes */
+            return NULL;
+        }
+    h = hash_of(host, path);
+    i = h & (hd->nslots - 1);
+    sp = &slots[i];
+
+    if ( lock() != 0 )
+        return data;
+    now = time(NULL);
+    if ( same_file(sp, host, h, path, info) )
+    {                               /* just say it is still current */
+        STORE(sp->stale, now + SM_VALID);
+        STORE(sp->fresh, now + SM_VALID);
+        COUNT(refreshed);
+    }
+    else
+    {
+        off = make_rec(path, type, len);
+        memcpy(rec_bytes(off), data, len);
+        link_rec(i, off, host, h, len, now + SM_VALID, now + SM_VALID, info);
+    }
+    if ( (c = claim_of(host, h)) != NULL )
+        c->pid = 0;
+    pthread_mutex_unlock(&hd->lock);
+    return data;
+}
+
+int
+SMkeeps(char *path, char *type, struct stat *info)
+{
+    return hd != NULL && S_ISREG(info->st_mode) && info->st_size > 0
+        && fits(path, type, info->st_size);
+}
+
+void
+SMput(unsigned host, char *key, char *type, char *data, long len, int ttl,
+      int stale)
+{
+    unsigned long h;
+    struct smclaim *c;
+    long    off;
+    time_t  now = time(NULL);
+    int     i;
+
+    if ( hd == NULL )
+        return;
+    if ( data != NULL && ! fits(key, type, len) )
+        data = NULL;                /* too big: pass on it instead */
+    if ( data == NULL )
+        len = 0;
+    h = hash_of(host, key);
+    i = h & (hd->nslots - 1);
+    if ( lock() != 0 )
+        return;
+    if ( fits(key, type, len) )
+    {
+        off = make_rec(key, type, len);
+        if ( len > 0 )
+            memcpy(rec_bytes(off), data, len);
+        link_rec(i, off, host, h, data == NULL ? -1 : len, now + ttl,
+                 now + ttl + stale, NULL);
+    }
+    if ( (c = claim_of(host, h)) != NULL )
+        c->pid = 0;
+    pthread_mutex_unlock(&hd->lock);
+}
+
+int
+SMclaim(unsigned host, char *key)
+{
+    unsigned long h;
+    struct smclaim *c, *room = NULL;
+    time_t  now = time(NULL);
+    int     i, mine = -1;
+
+    if ( hd == NULL )
+        return 1;
+    h = hash_of(host, key);
+    if ( lock() != 0 )
+        return 1;
+    for ( i = 0 ; i < SM_PROBE && mine == -1 ; i++ )
+    {
+        c = &hd->claims[(h + i) % SM_CLAIMS];
+        if ( live(c, now) && c->host == host && c->hash == h )
+            mine = c->pid == getpid();  /* already claimed */
+        else if ( room == NULL && ! live(c, now) )
+            room = c;               /* free, or its holder is gone */
+    }
+    if ( mine == -1 && room != NULL )
+    {
+        room->host = host;
+        room->hash = h;
+        room->pid = getpid();
+        room->since = now;
+        mine = 1;
+    }
+    pthread_mutex_unlock(&hd->lock);
+    return mine;
+}
+
+void
+SMunclaim(unsigned host, char *key)
+{
+    struct smclaim *c;
+
+    if ( hd == NULL || lock() != 0 )
+        return;
+    if ( (c = claim_of(host, hash_of(host, key))) != NULL )
+        c->pid = 0;
+    pthread_mutex_unlock(&hd->lock);
+}
+
+void
+SMstats(FILE *fp)
+{
+    if ( hd == NULL )
+        return;
+    fprintf(fp, "shm cache: %ld of %ld bytes, %u slots; %lu hits, %lu stale, "
+            "%lu misses, %lu stored, %lu refreshed, %lu evicted, %lu resets\n",
+            LOAD(hd->used), hd->size, hd->nslots, LOAD(hd->hits),
+            LOAD(hd->stalehits), LOAD(hd->misses), LOAD(hd->stores), LOAD(hd->refreshed),
+            LOAD(hd->evicted), LOAD(hd->resets));
+}
+
+/*
+ * FNV-1a of the path, started from the host id
+ */
+static unsigned long
+hash_of(unsigned host, char *path)
+{
+    unsigned long h = 14695981039346656037UL ^ host;
+
+    for ( ; *path ; path++ )
+        h = (h ^ (unsigned char) *path) * 1099511628211UL;
+    return h;
+}
+
+static long
+rec_size(int plen, int tlen, long len)
+{
+    return ALIGN(sizeof(struct smrec) + plen + 1 + tlen + 1 + len);
+}
+
+/*
+ * where the record at off keeps its bytes, after the path and type
+ */
+static char *
+rec_bytes(long off)
+{
+    struct smrec *r = (struct smrec *) (arena + off);
+
+    return (char *) (r + 1) + r->pathlen + 1 + r->typelen + 1;
+}
+
+/*
+ * may len bytes be kept under path? Not past SM_MAXFILE or an eighth
+ * of the arena, nor with a very long path or type
+ */
+static int
+fits(char *path, char *type, long len)
+{
+    return len <= SM_MAXFILE && len <= hd->size / 8
+        && strlen(type) <= SM_MAXTYPE
+        && rec_size(strlen(path), strlen(type), len) <= hd->size / 2;
+}
+
+/*
+ * reader side: copy the slot's record out, if it is path's and
+ * current, and no writer touched the slot meanwhile
+ */
+static struct smhit *
+copy_out(struct smslot *sp, unsigned host, unsigned long h, char *path)
+{
+    struct smrec *r;
+    struct smhit *hit;
+    unsigned seq = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE);
+    int     plen = strlen(path), tlen, pass;
+    long    off = LOAD(sp->off), len = LOAD(sp->len);
+    time_t  now = time(NULL), fresh = LOAD(sp->fresh);
+
+    if ( (seq & 1) || off < 0 || off >= hd->size || LOAD(sp->host) != host
+      || LOAD(sp->hash) != h || now > LOAD(sp->stale) )
+        return NULL;
+    if ( (pass = len == -1) )
+        len = 0;
+
+    /* what we read may be changing under us: check before using it */
+    r = (struct smrec *) (arena + off);
+    tlen = LOAD(r->typelen);
+    if ( LOAD(r->pathlen) != plen || tlen < 0 || tlen > SM_MAXTYPE
+      || len < 0 || off + rec_size(plen, tlen, len) > hd->size
+      || memcmp(r + 1, path, plen) != 0 )
+        return NULL;
+    if ( (hit = malloc(sizeof(struct smhit) + tlen + 1 + len)) == NULL )
+        return NULL;
+    hit->type = (char *) (hit + 1);
+    hit->data = pass ? NULL : hit->type + tlen + 1;
+    hit->len  = len;
+    hit->stale = now > fresh;
+    memcpy(hit->type, (char *) (r + 1) + plen + 1, tlen);
+    hit->type[tlen] = '\0';
+    memcpy(hit->type + tlen + 1, (char *) (r + 1) + plen + 1 + tlen + 1, len);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ( __atomic_load_n(&sp->seq, __ATOMIC_RELAXED) != seq )
+    {
+        free(hit);                  /* a writer had it */
+        return NULL;
+    }
+    return hit;
+}
+
+/*
+ * with the lock held: is the slot path's entry, read from the file
+ * info describes?
+ */
+static int
+same_file(struct smslot *sp, unsigned host, unsigned long h, char *path,
+          struct stat *info)
+{
+    struct smrec *r;
+
+    if ( sp->off == -1 || sp->host != host || sp->hash != h || sp->len == -1 )
+        return 0;
+    r = (struct smrec *) (arena + sp->off);
+    return r->pathlen == (int) strlen(path) && strcmp((char *) (r + 1), path) == 0
+        && sp->dev == info->st_dev && sp->ino == info->st_ino
+        && sp->len == info->st_size && sp->mtime == info->st_mtim.tv_sec
+        && sp->mtime_ns == info->st_mtim.tv_nsec;
+}
+
+/*
+ * take the writers' lock. If its last holder died with it, what it
+ * was writing cannot be trusted: empty the cache and go on
+ */
+static int
+lock()
+{
+    int     rc = pthread_mutex_lock(&hd->lock);
+    unsigned i;
+
+    if ( rc != EOWNERDEAD )
+        return rc;
+    for ( i = 0 ; i < hd->nslots ; i++ )
+        clear_slot(&slots[i]);
+    for ( i = 0 ; i < SM_CLAIMS ; i++ )
+        hd->claims[i].pid = 0;
+    hd->head = hd->tail = hd->used = 0;
+    COUNT(resets);
+    return pthread_mutex_consistent(&hd->lock);
+}
+
+/*
+ * with the lock held: our claim on the key, or NULL
+ */
+static struct smclaim *
+claim_of(unsigned host, unsigned long h)
+{
+    struct smclaim *c;
+    int     i;
+
+    for ( i = 0 ; i < SM_PROBE ; i++ )
+    {
+        c = &hd->claims[(h + i) % SM_CLAIMS];
+        if ( c->pid == getpid() && c->host == host && c->hash == h )
+            return c;
+    }
+    return NULL;
+}
+
+/*
+ * with the lock held: is the claim held, by a process still there,
+ * and not for too long?
+ */
+static int
+live(struct smclaim *c, time_t now)
+{
+    return c->pid != 0 && now - c->since < SM_CLAIMTIME
+        && (c->pid == getpid() || kill(c->pid, 0) == 0 || errno == EPERM);
+}
+
+/*
+ * with the lock held: returns the offset of a new record for path,
+ * owned by no slot yet; its len bytes are for the caller to fill
+ */
+static long
+make_rec(char *path, char *type, long len)
+{
+    int     plen = strlen(path), tlen = strlen(type);
+    long    off = alloc(rec_size(plen, tlen, len));
+    struct smrec *r = (struct smrec *) (arena + off);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);    /* cleared slots first */
+    r->size = rec_size(plen, tlen, len);
+    r->slot = -1;                   /* nobody's until it is whole */
+    r->pathlen = plen;
+    r->typelen = tlen;
+    memcpy(r + 1, path, plen + 1);
+    memcpy((char *) (r + 1) + plen + 1, type, tlen + 1);
+    return off;
+}
+
+/*
+ * with the lock held: point slot i at the filled record at off.
+ * info is the file it was read from, NULL for SMput() data
+ */
+static void
+link_rec(int i, long off, unsigned host, unsigned long h, long len,
+         time_t fresh, time_t stale, struct stat *info)
+{
+    struct smslot *sp = &slots[i];
+    unsigned odd = LOAD(sp->seq) | 1;   /* readers keep off while we write */
+
+    STORE(sp->seq, odd);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    STORE(sp->host, host);
+    STORE(sp->hash, h);
+    STORE(sp->len, len);
+    STORE(sp->fresh, fresh);
+    STORE(sp->stale, stale);
+    STORE(sp->dev, info ? info->st_dev : 0);
+    STORE(sp->ino, info ? info->st_ino : 0);
+    STORE(sp->mtime, info ? info->st_mtim.tv_sec : 0);
+    STORE(sp->mtime_ns, info ? info->st_mtim.tv_nsec : 0);
+    STORE(sp->off, off);
+    ((struct smrec *) (arena + off))->slot = i;
+    __atomic_store_n(&sp->seq, odd + 1, __ATOMIC_RELEASE);
+    COUNT(stores);
+}
+
+/*
+ * with the lock held: returns the offset of need free bytes at the
+ * head of the ring, retiring the oldest records to make room
+ */
+static long
+alloc(long need)
+{
+    struct smrec *pad;
+    long    off;
+
+    for ( ;; )
+    {
+        if ( hd->used == 0 )
+            hd->head = hd->tail = 0;
+        if ( hd->head > hd->tail || hd->used == 0 )
+        {                           /* free from head to the end */
+            if ( hd->size - hd->head >= need )
+                break;
+            if ( hd->size - hd->head >= (long) sizeof(struct smrec) )
+            {
+                pad = (struct smrec *) (arena + hd->head);
+                pad->size = hd->size - hd->head;
+                pad->slot = -1;
+            }
+            hd->used += hd->size - hd->head;
+            hd->head = 0;
+        }
+        else if ( hd->tail - hd->head >= need )
+            break;                  /* free from head to tail */
+        else
+            evict();
+    }
+    off = hd->head;
+    hd->head += need;
+    hd->used += need;
+    if ( hd->head == hd->size )
+        hd->head = 0;
+    return off;
+}
+
+/*
+ * with the lock held: free the record at the tail, clearing its
+ * slot if the slot still points at it
+ */
+static void
+evict()
+{
+    struct smrec *r = (struct smrec *) (arena + hd->tail);
+
+    if ( hd->size - hd->tail < (long) sizeof(struct smrec) )
+    {                               /* a gap too small for a record */
+        hd->used -= hd->size - hd->tail;
+        hd->tail = 0;
+        return;
+    }
+    if ( r->slot >= 0 && slots[r->slot].off == hd->tail )
+    {
+        clear_slot(&slots[r->slot]);
+        COUNT(evicted);
+    }
+    hd->tail += r->size;
+    hd->used -= r->size;
+    if ( hd->tail == hd->size )
+        hd->tail = 0;
+}
+
+/*
+ * empty the slot, leaving its number even and moved on, so a reader
+ * that was copying its record throws the copy away
+ */
+static void
+clear_slot(struct smslot *sp)
+{
+    unsigned odd = LOAD(sp->seq) | 1;
+
+    STORE(sp->seq, odd);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    STORE(sp->off, -1L);
+    __atomic_store_n(&sp->seq, odd + 1, __ATOMIC_RELEASE);
+}
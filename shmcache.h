@@ -0,0 +1,28 @@
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+/*
+ * header for shmcache.c package
+ */
+
+#include    <stdio.h>
+
+struct stat;
+
+struct smhit {                      /* a private copy; free() it */
+    char            *type;          /* Content-Type             */
+    char            *data;
+    long            len;
+    int             stale;          /* past its time; see SMput() */
+};
+
+int             SMinit(long);
+struct smhit    *SMlookup(unsigned, char *);
+struct smhit    *SMpeek(unsigned, char *);
+char            *SMstore(unsigned, char *, char *, int, struct stat *);
+int             SMkeeps(char *, char *, struct stat *);
+void            SMput(unsigned, char *, char *, char *, long, int, int);
+int             SMclaim(unsigned, char *);
+void            SMunclaim(unsigned, char *);
+void            SMstats(FILE *);
+
+#endif
@@ -6,6 +6,9 @@
 #include	<netdb.h>
 #include	<unistd.h>
 #include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<poll.h>
 
 /*
  *	socklib.c
@@ -16,16 +19,41 @@
  *	make_server_socket( portnum )	returns a server socket
  *					or -1 if error
  *
- *	connect_to_server(char *hostname, int portnum)
+ *	connect_to_server(char *hostname, int portnum, int ms)
  *					returns a connected socket
- *					or -1 if error
+ *					or -1 if error (or ms passed)
+ *
+ *	resolve_server() and connect_to_addr() are its two halves,
+ *	for callers that look a name up once and call it often.
  *
+ *	make_shared_socket( portnum ) is make_server_socket() with
+ *	SO_REUSEPORT, so several sockets can listen on one port.
+ *
+ *	history: 2026-10-18 connect_to_addr() keeps poll()'s errno on error
+ *	history: 2026-10-18 make_shared_socket(), for SO_REUSEPORT groups
+ *	history: 2026-10-18 make_server_socket() queues SOMAXCONN calls
+ *	history: 2026-10-18 connect_to_server() connects with a timeout,
+ *			and looks a name up once, not per call
  *	history: 2010-04-16 replaced bcopy/bzero with memcpy/memset
  *	history: 2005-05-09 added SO_REUSEADDR to make_server_socket
  */ 
 
+static int make_socket( int, int );
+
 int
 make_server_socket( int portnum )
+{
+	return make_socket( portnum, 0 );
+}
+
+int
+make_shared_socket( int portnum )
+{
+	return make_socket( portnum, 1 );
+}
+
+static int
+make_socket( int portnum, int shared )
 {
         struct  sockaddr_in   saddr;   /* build our address here */
 	int	sock_id;	       /* line id, file desc     */
@@ -51,44 +79,103 @@ make_server_socket( int portnum )
 	if ( sock_id == -1 ) return -1;
 	if ( setsockopt(sock_id,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)) == -1 )
 		return -1;
+	if ( shared
+	  && setsockopt(sock_id,SOL_SOCKET,SO_REUSEPORT,&on,sizeof(on)) == -1 )
+		return -1;
 	if ( bind(sock_id,(struct sockaddr*)&saddr, sizeof(saddr)) ==  -1 )
 	       return -1;
 
 	/*
-	 *      step 3: tell kernel we want to listen for calls
+	 *      step 3: tell kernel we want to listen for calls; a
+	 *      queue of 1 dropped the SYNs of calls made at once
 	 */
-	if ( listen(sock_id, 1) != 0 ) return -1;
+	if ( listen(sock_id, SOMAXCONN) != 0 ) return -1;
 	return sock_id;
 }
 
 
+/*
+ *	resolve_server( hostname, portnum, addrp )
+ *	looks hostname up once (getaddrinfo, IPv4) into *addrp;
+ *	0 if ok, -1 if not
+ */
+int
+resolve_server( char *hostname, int portnum, struct sockaddr_in *addrp )
+{
+	struct addrinfo	hints, *res;
+
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo( hostname, NULL, &hints, &res ) != 0 )
+		return -1;
+	memcpy( addrp, res->ai_addr, sizeof( *addrp ) );
+	addrp->sin_port = htons(portnum);
+	freeaddrinfo( res );
+	return 0;
+}
+
+/*
+ *	connect_to_addr( addrp, ms )
+ *	calls addrp without blocking, and gives up after ms
+ *	milliseconds (ms < 0: the kernel's own timeout). The
+ *	socket is returned blocking again, or -1 if error
+ */
+int
+connect_to_addr( struct sockaddr_in *addrp, int ms )
+{
+	struct pollfd	pfd;
+	int	sock_id, err = 0, rc;
+	socklen_t len = sizeof( err );
+
+	sock_id = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+	if ( sock_id == -1 ) return -1;
+	rc = connect( sock_id, (struct sockaddr *) addrp, sizeof( *addrp ) );
+	if ( rc == -1 && errno == EINPROGRESS )
+	{
+		pfd.fd = sock_id;
+		pfd.events = POLLOUT;
+		while ( (rc = poll( &pfd, 1, ms )) == -1 && errno == EINTR )
+			;
+		if ( rc == 1
+		  && getsockopt( sock_id, SOL_SOCKET, SO_ERROR, &err, &len ) == 0
+		  && err == 0 )
+			rc = 0;
+		else
+		{
+			if ( rc == 0 )
+				errno = ETIMEDOUT;
+			else if ( err != 0 )	/* else poll()'s or getsockopt()'s */
+				errno = err;
+			rc = -1;
+		}
+	}
+	if ( rc == -1 )
+	{
+		close( sock_id );
+		return -1;
+	}
+	fcntl( sock_id, F_SETFL, 0 );
+	return sock_id;
+}
+
+/*
+ *	connect_to_server( hostname, portnum, ms )
+ *	the last name looked up is remembered
+ */
 int
-connect_to_server( char *hostname, int portnum )
+connect_to_server( char *hostname, int portnum, int ms )
 {
-	struct sockaddr_in  servadd;        /* the number to call */
-	struct hostent      *hp;            /* used to get number */
-	int    sock_id;			    /* returned to caller */
-
-        /*
-         *  build the network address of where we want to call
-         */
-
-       memset( &servadd, 0, sizeof( servadd ) );   /* 0. zero the address   */
-       servadd.sin_family = AF_INET ;              /* 1. fill in addr type  */
-
-       hp = gethostbyname( hostname );		   /* 2. and host addr      */
-       if ( hp == NULL ) return -1;
-       memcpy( &servadd.sin_addr, hp->h_addr, hp->h_length);
-       servadd.sin_port = htons(portnum);          /* 3. and port number    */
-
-       /*
-        *        make the connection
-        */
-
-       sock_id = socket( PF_INET, SOCK_STREAM, 0 );    /* get a line   */
-       if ( sock_id == -1 ) return -1;                 /* or fail      */
-                                                       /* now dial     */
-       if ( connect(sock_id,(struct sockaddr*)&servadd, sizeof(servadd)) !=0 )  
-               return -1;
-       return sock_id;
+	static char	lastname[256];
+	static struct sockaddr_in lastaddr;
+
+	if ( strcmp( hostname, lastname ) != 0 )
+	{
+		if ( strlen( hostname ) >= sizeof( lastname )
+		  || resolve_server( hostname, portnum, &lastaddr ) == -1 )
+			return -1;
+		strcpy( lastname, hostname );
+	}
+	lastaddr.sin_port = htons(portnum);
+	return connect_to_addr( &lastaddr, ms );
 }
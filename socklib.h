@@ -7,10 +7,18 @@
  *	make_server_socket( portnum )	returns a server socket
  *					or -1 if error
  *
- *	connect_to_server(char *hostname, int portnum)
+ *	connect_to_server(char *hostname, int portnum, int ms)
  *					returns a connected socket
- *					or -1 if error
+ *					or -1 if error (or ms passed)
+ *
+ *	make_shared_socket( portnum )	the same as make_server_socket,
+ *					with SO_REUSEPORT
  */ 
 
+struct sockaddr_in;
+
 int make_server_socket( int );
-int connect_to_server( char *, int );
+int make_shared_socket( int );
+int connect_to_server( char *, int, int );
+int resolve_server( char *, int, struct sockaddr_in * );
+int connect_to_addr( struct sockaddr_in *, int );
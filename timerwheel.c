@@ -0,0 +1,218 @@
+/* timerwheel.c
+ *
+ * a hierarchical timing wheel: O(1) timer start and cancel
+ *
+ * interface:
+ *     TWnew( tick_ms )          returns a new wheel, or NULL
+ *     TWadd( w, t, ms, fn, arg ) start timer t to call fn(t, arg) in
+ *                               ms milliseconds (t must not be running)
+ *     TWcancel( t )             stop t; harmless if it is not running
+ *     TWpending( t )            returns 1 if t is running
+ *     TWadvance( w )            run every timer that is due by now
+ *     TWtimeout( w )            returns ms until the wheel next needs
+ *                               TWadvance(), or -1 if it is empty
+ *
+ * details:
+ *      The wheel has TW_LEVELS rings of TW_SLOTS lists. Ring 0 holds
+ *      timers due in the next TW_SLOTS ticks, one list per tick;
+ *      ring 1 holds those due within TW_SLOTS^2 ticks, one list per
+ *      TW_SLOTS ticks, and so on. Starting a timer is one shift to
+ *      pick the ring and one list insert; cancelling is one unlink.
+ *      Each time ring 0 wraps, the next list of ring 1 is emptied
+ *      back into the wheel (and so on up), so a timer is moved at
+ *      most TW_LEVELS-1 times on its way down. Nothing ever scans
+ *      the whole set of timers.
+ *
+ *      With 6 bits per ring and 4 rings, 100ms ticks reach 19 days;
+ *      longer timers are parked in the last list of the top ring.
+ *
+ *      Timers are fields in the caller's own structs, so the wheel
+ *      never allocates after TWnew().
+ */
+
+#include    <stdlib.h>
+#include    <time.h>
+#include    "timerwheel.h"
+
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_LEVELS   4
+
+struct twheel {
+    long            tick_ms;
+    unsigned long   now;            /* next tick to be run      */
+    long            start;          /* ms clock at tick 0       */
+    int             count;          /* timers running           */
+    struct twtimer  ring[TW_LEVELS][TW_SLOTS];  /* list heads   */
+};
+
+static long now_ms(void);
+static void place(struct twheel *, struct twtimer *);
+static void cascade(struct twheel *, int, int);
+static void unlink_timer(struct twtimer *);
+
+struct twheel *
+TWnew(long tick_ms)
+{
+    struct twheel *w = calloc(1, sizeof(struct twheel));
+    int     l, s;
+
+    if ( w == NULL )
+        return NULL;
+    for ( l = 0 ; l < TW_LEVELS ; l++ )
+        for ( s = 0 ; s < TW_SLOTS ; s++ )
+            w->ring[l][s].next = w->ring[l][s].prev = &w->ring[l][s];
+    w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    w->start = now_ms();
+    return w;
+}
+
+void
+TWadd(struct twheel *w, struct twtimer *t, long ms,
+      void (*fn)(struct twtimer *, void *), void *arg)
+{
+    unsigned long ticks = (ms + w->tick_ms - 1) / w->tick_ms;
+
+    t->wheel   = w;
+    t->fn      = fn;
+    t->arg     = arg;
+    t->expires = (unsigned long) ((now_ms() - w->start) / w->tick_ms)
+                 + (ticks ? ticks : 1);
+    if ( t->expires < w->now )
+        t->expires = w->now;
+    place(w, t);
+    w->count++;
+}
+
+void
+TWcancel(struct twtimer *t)
+{
+    if ( t->next == NULL )
+        return;
+    unlink_timer(t);
+    t->wheel->count--;
+}
+
+int
+TWpending(struct twtimer *t)
+{
+    return t->next != NULL;
+}
+
+void
+TWadvance(struct twheel *w)
+{
+    unsigned long target = (now_ms() - w->start) / w->tick_ms;
+    struct twtimer *head, *t;
+    int     idx;
+
+    while ( w->now <= target )
+    {
+        idx = w->now & TW_MASK;
+
+        /* ring 0 wrapped: pull the next lists down */
+        if ( idx == 0 )
+        {
+            int l;
+            for ( l = 1 ; l < TW_LEVELS ; l++ )
+            {
+                int i = (w->now >> (l * TW_BITS)) & TW_MASK;
+                cascade(w, l, i);
+                if ( i != 0 )
+                    break;
+            }
+        }
+
+        head = &w->ring[0][idx];
+        while ( (t = head->next) != head )
+        {
+            unlink_timer(t);
+            w->count--;
+            t->fn(t, t->arg);       /* may start t again */
+        }
+        w->now++;
+    }
+}
+
+long
+TWtimeout(struct twheel *w)
+{
+    unsigned long tick, elapsed;
+    int     i;
+
+    if ( w->count == 0 )
+        return -1;
+
+    /* the next non-empty list in ring 0, else the next wrap, */
+    /* which may be the very next tick, to cascade the rings    */
+    for ( i = 0 ; i < TW_SLOTS ; i++ )
+    {
+        tick = w->now + i;
+        if ( (tick & TW_MASK) == 0 )
+            break;
+        if ( w->ring[0][tick & TW_MASK].next != &w->ring[0][tick & TW_MASK] )
+            break;
+    }
+    tick = w->now + i;
+    elapsed = now_ms() - w->start;
+    if ( tick * w->tick_ms <= elapsed )
+        return 0;
+    return tick * w->tick_ms - elapsed;
+}
+
+static long
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * put t on the list for its expiry time, relative to w->now
+ */
+static void
+place(struct twheel *w, struct twtimer *t)
+{
+    unsigned long delta = t->expires - w->now;
+    struct twtimer *head;
+    int     l;
+
+    for ( l = 0 ; l < TW_LEVELS - 1 ; l++ )
+        if ( delta < (1UL << ((l + 1) * TW_BITS)) )
+            break;
+    if ( delta >= (1UL << (TW_LEVELS * TW_BITS)) )     /* too far out */
+        t->expires = w->now + (1UL << (TW_LEVELS * TW_BITS)) - 1;
+
+    head = &w->ring[l][(t->expires >> (l * TW_BITS)) & TW_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/*
+ * empty list i of ring l back into the wheel at finer rings
+ */
+static void
+cascade(struct twheel *w, int l, int i)
+{
+    struct twtimer *head = &w->ring[l][i];
+    struct twtimer *t;
+
+    while ( (t = head->next) != head )
+    {
+        unlink_timer(t);
+        place(w, t);
+    }
+}
+
+static void
+unlink_timer(struct twtimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
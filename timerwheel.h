@@ -0,0 +1,25 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+/*
+ * header for timerwheel.c package
+ */
+
+struct twheel;
+
+struct twtimer {                    /* embed one in your struct */
+    struct twtimer  *next, *prev;   /* NULL when not running    */
+    unsigned long   expires;        /* in ticks                 */
+    struct twheel   *wheel;
+    void            (*fn)(struct twtimer *, void *);
+    void            *arg;
+};
+
+struct twheel   *TWnew(long);
+void            TWadd(struct twheel *, struct twtimer *, long,
+                      void (*)(struct twtimer *, void *), void *);
+void            TWcancel(struct twtimer *);
+int             TWpending(struct twtimer *);
+void            TWadvance(struct twheel *);
+long            TWtimeout(struct twheel *);
+
+#endif
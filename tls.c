@@ -0,0 +1,484 @@
+/* tls.c
+ *
+ * HTTPS for the forking server: OpenSSL does the handshake, and the
+ * kernel (kTLS) does the records after it where it can
+ *
+ * interface:
+ *     TLinit( conf )                make the TLS context from conf's
+ *                                   tls_ settings, before any fork;
+ *                                   0 ok, -1 (and why, on stderr) and
+ *                                   the old context is kept
+ *     TLaccept( fd, h2 )            the handshake on the accepted fd;
+ *                                   returns the fd to serve the request
+ *                                   on, or -1. h2 offers HTTP/2 by
+ *                                   ALPN. It may return in a new child
+ *                                   of the caller; see below
+ *     TLktls( fd )                  1 if fd is the socket this process
+ *                                   serves its call on and the kernel
+ *                                   does its TLS, so sendfile() works
+ *     TLstats( fp )                 print the shared figures
+ *
+ * details:
+ *      Each call is a child of its own, as with plain HTTP, and the
+ *      child does the handshake. After it OpenSSL hands the keys to
+ *      the kernel if the "tls" module is loaded (SSL_OP_ENABLE_KTLS).
+ *      When the kernel has taken both directions the socket is, to
+ *      its user, a plain one again: TLaccept() returns fd itself and
+ *      the request is served exactly as over HTTP, a CGI writes
+ *      straight to its stdout, and the kernel encrypts on the way out.
+ *      The one change is that do_cat() asks TLktls() and then uses
+ *      sendfile() rather than writev() of a mapping: that way the
+ *      kernel encrypts straight from the page cache, where writev()
+ *      would first copy the pages into the socket. At exit,
+ *      close_notify is sent.
+ *
+ *      Without kTLS (no module, a cipher it lacks, or only one
+ *      direction) the bytes have to pass through SSL_read() and
+ *      SSL_write(). Rather than teach every writer in the server
+ *      about SSL, TLaccept() makes a socketpair and forks: the new
+ *      child gets the plain end and returns to serve the request,
+ *      and the caller stays behind to relay between it and the
+ *      client until the child is done, then exits. The relay is the
+ *      process the server tracks, and the child is in its process
+ *      group, so the request timeout stops both. TLstats() says how
+ *      many calls went each way.
+ *
+ *      Resumption saves the full handshake on a client's next call,
+ *      which with a connection per request is most calls. Tickets
+ *      work across children as they are: the context is made in the
+ *      parent, so every child has the same ticket keys. Sessions by
+ *      id (TLS 1.2, or TLS 1.3 with "tls_tickets off") need a cache
+ *      that outlives the child, so it is in memory mapped MAP_SHARED
+ *      before the first fork: tls_cache slots, direct-mapped by a
+ *      hash of the session id, each holding the DER-encoded session.
+ *      One robust process-shared mutex guards it, as in shmcache.c;
+ *      a child that dies holding it costs the cache its contents.
+ *
+ *      HTTP/2 over TLS is picked by ALPN ("h2"). The client then
+ *      sends the preface at once, and h2.c takes it from there.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <time.h>
+#include    <signal.h>
+#include    <poll.h>
+#include    <pthread.h>
+#include    <sys/types.h>
+#include    <sys/socket.h>
+#include    <sys/mman.h>
+#include    <sys/wait.h>
+#include    <openssl/ssl.h>
+#include    <openssl/err.h>
+#include    "config.h"
+#include    "tls.h"
+
+#define TL_ID       SSL_MAX_SSL_SESSION_ID_LENGTH
+#define TL_DER      2048            /* an encoded session, at most */
+#define TL_BUF      16384           /* a record's worth         */
+
+struct tlslot {
+    time_t          expires;        /* 0: empty                 */
+    unsigned        idlen, derlen;
+    unsigned char   id[TL_ID];
+    unsigned char   der[TL_DER];
+};
+
+struct tlhead {
+    pthread_mutex_t lock;           /* robust                   */
+    unsigned        nslots;
+    unsigned long   full, resumed, failed, ktls, relayed, stored, resets;
+};
+
+static SSL_CTX      *ctx = NULL;
+static struct tlhead *hd = NULL;
+static struct tlslot *slots;
+static int          offer_h2;       /* for this call's ALPN     */
+static SSL          *live = NULL;   /* kTLS: to close at exit   */
+static pid_t        owner;          /* by the child it is for   */
+
+#define COUNT(x)    __atomic_add_fetch(&hd->x, 1, __ATOMIC_RELAXED)
+
+static int      make_cache(int);
+static int      lock(void);
+static struct tlslot *slot_of(const unsigned char *, unsigned);
+static int      new_session(SSL *, SSL_SESSION *);
+static SSL_SESSION *get_session(SSL *, const unsigned char *, int, int *);
+static void     remove_session(SSL_CTX *, SSL_SESSION *);
+static int      pick_alpn(SSL *, const unsigned char **, unsigned char *,
+                          const unsigned char *, unsigned int, void *);
+static void     relay(SSL *, int, int, pid_t);
+static int      write_all(int, char *, int);
+static void     close_notify(void);
+
+int
+TLinit(struct config *conf)
+{
+    SSL_CTX *new;
+    long    opts = SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION
+                 | SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+    if ( hd == NULL && make_cache(conf->tls_cache) != 0 )
+    {
+        perror("tls session cache");
+        return -1;
+    }
+    if ( conf->tls_cert == NULL )
+    {
+        fprintf(stderr, "tls_port needs a tls_cert\n");
+        return -1;
+    }
+    if ( (new = SSL_CTX_new(TLS_server_method())) == NULL )
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    if ( ! conf->tls_tickets )
+        opts |= SSL_OP_NO_TICKET;
+    SSL_CTX_set_options(new, opts);
+    SSL_CTX_set_min_proto_version(new, TLS1_2_VERSION);
+    if ( SSL_CTX_use_certificate_chain_file(new, conf->tls_cert) != 1
+      || SSL_CTX_use_PrivateKey_file(new, conf->tls_key ? conf->tls_key
+                                     : conf->tls_cert, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(new) != 1
+      || ( conf->tls_ciphers != NULL
+        && SSL_CTX_set_cipher_list(new, conf->tls_ciphers) != 1 )
+      || ( conf->tls_suites != NULL
+        && SSL_CTX_set_ciphersuites(new, conf->tls_suites) != 1 ) )
+    {
+        fprintf(stderr, "tls: cannot use %s\n", conf->tls_cert);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(new);
+        return -1;
+    }
+    SSL_CTX_set_session_id_context(new, (unsigned char *) "wsng", 4);
+    SSL_CTX_set_num_tickets(new, 1);    /* one call per connection */
+    SSL_CTX_set_alpn_select_cb(new, pick_alpn, NULL);
+    if ( hd->nslots > 0 )
+    {
+        SSL_CTX_set_session_cache_mode(new, SSL_SESS_CACHE_SERVER
+                                          | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(new, new_session);
+        SSL_CTX_sess_set_get_cb(new, get_session);
+        SSL_CTX_sess_set_remove_cb(new, remove_session);
+    }
+    else
+        SSL_CTX_set_session_cache_mode(new, SSL_SESS_CACHE_OFF);
+
+    SSL_CTX_free(ctx);
+    ctx = new;
+    return 0;
+}
+
+int
+TLaccept(int fd, int h2)
+{
+    SSL     *ssl;
+    int     sv[2];
+    pid_t   pid;
+
+    offer_h2 = h2;
+    if ( ctx == NULL || (ssl = SSL_new(ctx)) == NULL )
+        return -1;
+    if ( SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1 )
+    {
+        COUNT(failed);
+        SSL_free(ssl);
+        return -1;
+    }
+    if ( SSL_session_reused(ssl) )
+        COUNT(resumed);
+    else
+        COUNT(full);
+
+    /* the kernel has the keys both ways: serve on fd as it is */
+    if ( BIO_get_ktls_send(SSL_get_wbio(ssl))
+      && BIO_get_ktls_recv(SSL_get_rbio(ssl)) )
+    {
+        COUNT(ktls);
+        live = ssl;
+        owner = getpid();
+        atexit(close_notify);
+        return fd;
+    }
+
+    /* or relay for a child that serves on a socketpair */
+    if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 )
+        return -1;
+    if ( (pid = fork()) == -1 )
+        return -1;
+    if ( pid == 0 )
+    {
+        close(fd);                  /* ssl is the relay's: freeing it */
+                                    /* here would drop its session    */
+        close(sv[0]);
+        return sv[1];
+    }
+    close(sv[1]);
+    signal(SIGCHLD, SIG_DFL);       /* relay() waits for it itself */
+    COUNT(relayed);
+    relay(ssl, fd, sv[0], pid);
+    exit(0);
+}
+
+void
+TLstats(FILE *fp)
+{
+    if ( hd == NULL )
+        return;
+    fprintf(fp, "tls: %lu full handshakes, %lu resumed, %lu failed; "
+                "%lu kTLS, %lu relayed; %u session slots, %lu stored, "
+                "%lu resets\n", hd->full, hd->resumed, hd->failed,
+                hd->ktls, hd->relayed, hd->nslots, hd->stored, hd->resets);
+}
+
+/*
+ * the shared session cache of n slots (and the figures), before the
+ * first fork; 0 ok, -1 no
+ */
+static int
+make_cache(int n)
+{
+    size_t  total = sizeof(struct tlhead) + (size_t) n * sizeof(struct tlslot);
+    void    *base;
+    pthread_mutexattr_t attr;
+
+    if ( n < 0 )
+        n = 0;
+    base = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+                -1, 0);
+    if ( base == MAP_FAILED )
+        return -1;
+    hd = base;
+    slots = (struct tlslot *) (hd + 1);
+    hd->nslots = n;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if ( pthread_mutex_init(&hd->lock, &attr) != 0 )
+    {
+        munmap(base, total);
+        hd = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * take the cache's lock; if its holder died with it, empty the cache
+ */
+static int
+lock()
+{
+    int     rc = pthread_mutex_lock(&hd->lock);
+
+    if ( rc != EOWNERDEAD )
+        return rc;
+    memset(slots, 0, hd->nslots * sizeof(struct tlslot));
+    COUNT(resets);
+    return pthread_mutex_consistent(&hd->lock);
+}
+
+/*
+ * the slot for a session id (FNV-1a)
+ */
+static struct tlslot *
+slot_of(const unsigned char *id, unsigned len)
+{
+    unsigned long h = 14695981039346656037UL;
+    unsigned    i;
+
+    for ( i = 0 ; i < len ; i++ )
+        h = (h ^ id[i]) * 1099511628211UL;
+    return &slots[h % hd->nslots];
+}
+
+/*
+ * OpenSSL made a session: store it, over whatever had its slot
+ */
+static int
+new_session(SSL *ssl, SSL_SESSION *s)
+{
+    unsigned char der[TL_DER], *p = der;
+    unsigned    idlen;
+    const unsigned char *id = SSL_SESSION_get_id(s, &idlen);
+    int     len = i2d_SSL_SESSION(s, NULL);
+    struct tlslot *sl;
+
+    if ( idlen == 0 || len <= 0 || len > TL_DER )
+        return 0;
+    i2d_SSL_SESSION(s, &p);
+    if ( lock() != 0 )
+        return 0;
+    sl = slot_of(id, idlen);
+    memcpy(sl->id, id, idlen);
+    sl->idlen = idlen;
+    memcpy(sl->der, der, len);
+    sl->derlen = len;
+    sl->expires = SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s);
+    hd->stored++;
+    pthread_mutex_unlock(&hd->lock);
+    return 0;                       /* we kept no reference     */
+}
+
+/*
+ * a client offers session id: decode our copy, if we have one
+ */
+static SSL_SESSION *
+get_session(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+{
+    unsigned char der[TL_DER];
+    const unsigned char *p = der;
+    struct tlslot *sl;
+    unsigned    len = 0;
+
+    *copy = 0;
+    if ( idlen <= 0 || idlen > TL_ID || lock() != 0 )
+        return NULL;
+    sl = slot_of(id, idlen);
+    if ( sl->idlen == (unsigned) idlen && memcmp(sl->id, id, idlen) == 0
+      && sl->expires > time(NULL) )
+    {
+        len = sl->derlen;
+        memcpy(der, sl->der, len);
+    }
+    pthread_mutex_unlock(&hd->lock);
+    return len > 0 ? d2i_SSL_SESSION(NULL, &p, len) : NULL;
+}
+
+/*
+ * OpenSSL gave up on a session
+ */
+static void
+remove_session(SSL_CTX *c, SSL_SESSION *s)
+{
+    unsigned    idlen;
+    const unsigned char *id = SSL_SESSION_get_id(s, &idlen);
+    struct tlslot *sl;
+
+    if ( idlen == 0 || lock() != 0 )
+        return;
+    sl = slot_of(id, idlen);
+    if ( sl->idlen == idlen && memcmp(sl->id, id, idlen) == 0 )
+        sl->expires = sl->idlen = 0;
+    pthread_mutex_unlock(&hd->lock);
+}
+
+/*
+ * ALPN: h2 if this call may have it, else http/1.1; a client that
+ * offers neither gets no answer and is served as HTTP/1.x
+ */
+static int
+pick_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+          const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static unsigned char ours[] = "\2h2\10http/1.1";
+    unsigned char *mine = offer_h2 ? ours : ours + 3;
+
+    if ( SSL_select_next_proto((unsigned char **) out, outlen, mine,
+                               offer_h2 ? 12 : 9, in, inlen)
+         != OPENSSL_NPN_NEGOTIATED )
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * pass bytes between the client (through ssl on fd) and the child
+ * pid serving it on plain, until the child is done. A client that
+ * stops sending gets the child's reply all the same
+ */
+static void
+relay(SSL *ssl, int fd, int plain, pid_t pid)
+{
+    struct pollfd pfd[2];
+    char    buf[TL_BUF];
+    int     n, in = 1, ok = 0;
+
+    alarm(0);               /* the handshake's; the child has its own */
+    pfd[0].fd = fd;
+    pfd[1].fd = plain;
+    while ( 1 )
+    {
+        pfd[0].events = in ? POLLIN : 0;
+        pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        if ( in && SSL_pending(ssl) > 0 )
+            pfd[0].revents = POLLIN;        /* a record already read */
+        else if ( poll(pfd, 2, -1) == -1 )
+        {
+            if ( errno == EINTR )
+                continue;
+            break;
+        }
+        if ( in && pfd[0].revents != 0 )
+        {
+            if ( (n = SSL_read(ssl, buf, sizeof(buf))) > 0 )
+            {
+                if ( write_all(plain, buf, n) == -1 )
+                    break;
+            }
+            else
+            {
+                in = 0;
+                shutdown(plain, SHUT_WR);
+            }
+        }
+        if ( pfd[1].revents != 0 )
+        {
+            if ( (n = read(plain, buf, sizeof(buf))) <= 0 )
+            {
+                ok = (n == 0);
+                break;
+            }
+            if ( SSL_write(ssl, buf, n) <= 0 )
+                break;
+        }
+    }
+    if ( ok )
+        SSL_shutdown(ssl);
+    else
+        kill(pid, SIGKILL);
+    close(plain);
+    while ( waitpid(pid, NULL, 0) == -1 && errno == EINTR )
+        ;
+}
+
+static int
+write_all(int fd, char *buf, int len)
+{
+    int     n;
+
+    while ( len > 0 )
+    {
+        if ( (n = write(fd, buf, len)) == -1 )
+        {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int
+TLktls(int fd)
+{
+    return live != NULL && getpid() == owner && SSL_get_fd(live) == fd;
+}
+
+/*
+ * at exit, on a kTLS connection: tell the client the reply is whole.
+ * Not from children of ours that share the socket (h2.c's streams)
+ */
+static void
+close_notify()
+{
+    if ( live != NULL && getpid() == owner )
+        SSL_shutdown(live);
+}
@@ -0,0 +1,18 @@
+#ifndef TLS_H
+#define TLS_H
+/*
+ * header for tls.c package
+ */
+
+#include    <stdio.h>
+
+#define TL_CACHE    1024            /* shared sessions, by default */
+
+struct config;
+
+int     TLinit(struct config *);
+int     TLaccept(int, int);
+int     TLktls(int);
+void    TLstats(FILE *);
+
+#endif
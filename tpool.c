@@ -0,0 +1,331 @@
+/* tpool.c
+ *
+ * a fixed set of threads that run blocking filesystem work for an
+ * event loop, and hand the results back through an eventfd
+ *
+ * interface:
+ *     TPnew( nthreads, limit )      returns a pool whose queue holds at
+ *                                   most limit jobs, or NULL
+ *     TPqueue()                     returns a completion queue, or NULL
+ *     TPqfd( q )                    q's eventfd, to poll for POLLIN
+ *     TPsubmit( p, q, job )         queue job; its done() will run from
+ *                                   TPcomplete(q). 0 ok, -1 queue full
+ *     TPcomplete( q )               run done() for each finished job,
+ *                                   returns how many
+ *     TPpost( q, job )              put a job finished elsewhere on q,
+ *                                   so its done() runs from TPcomplete()
+ *     TPstats( p, fp )              print queue and latency figures
+ *     TPfree( p )                   finish queued jobs, stop the threads
+ *
+ * details:
+ *      An event loop must never wait on the disk: a stat() or open()
+ *      of a cold file on network storage can take milliseconds, and
+ *      every connection in the loop would wait with it. So the loop
+ *      fills in a struct tpjob (what to do in work(), what to do after
+ *      in done()) and submits it. A pool thread runs work(); the job
+ *      then goes on the completion queue it was submitted with and
+ *      that queue's eventfd is bumped. The loop sees the eventfd
+ *      readable and calls TPcomplete(), which runs done() in the loop
+ *      thread, where the connection's state lives.
+ *
+ *      The threads start with every signal blocked, so signals are
+ *      still taken by the main thread, as the server expects.
+ *
+ *      The queue is bounded. When it is full TPsubmit() says so and
+ *      the caller does the work itself; a pile of jobs behind a slow
+ *      disk would only add waiting to each of them.
+ *
+ *      Each job has an op (TP_STAT, TP_OPEN, ...) and the pool keeps,
+ *      per op, a count and two log2 histograms in microseconds: time
+ *      spent queued, and time spent in work(). The queue depth and its
+ *      high-water mark are kept too. The counters are bumped with
+ *      atomic adds, so reading them never stops the workers.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <stdint.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <signal.h>
+#include    <sys/eventfd.h>
+#include    "tpool.h"
+
+#define TP_BUCKETS  24              /* 1us .. 8s, log2          */
+
+struct tpqueue {                    /* completions for one loop */
+    pthread_mutex_t lock;
+    struct tpjob    *head, *tail;
+    int             efd;
+};
+
+struct opstats {
+    unsigned long   count;
+    unsigned long   wait[TP_BUCKETS];
+    unsigned long   run[TP_BUCKETS];
+};
+
+struct tpool {
+    pthread_mutex_t lock;
+    pthread_cond_t  more;           /* queue not empty, or stop */
+    struct tpjob    *head, *tail;
+    int             depth, limit;
+    int             stopping;
+    int             nthreads;
+    pthread_t       *threads;
+
+    int             maxdepth;       /* metrics */
+    unsigned long   rejected;
+    struct opstats  ops[TP_NOPS];
+};
+
+static char *opnames[TP_NOPS] = { "stat", "open", "scan", "fill" };
+
+static void     *worker(void *);
+static long     now_ns(void);
+static int      bucket(long);
+
+struct tpool *
+TPnew(int nthreads, int limit)
+{
+    struct tpool *p = calloc(1, sizeof(struct tpool));
+    sigset_t all, old;
+    int     i;
+
+    if ( p == NULL )
+        return NULL;
+    if ( (p->threads = calloc(nthreads, sizeof(pthread_t))) == NULL )
+    {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->more, NULL);
+    p->limit = limit;
+
+    sigfillset(&all);               /* signals are for the main thread */
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for ( i = 0 ; i < nthreads ; i++ )
+        if ( pthread_create(&p->threads[i], NULL, worker, p) != 0 )
+            break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    p->nthreads = i;
+    if ( i == 0 )
+    {
+        TPfree(p);
+        return NULL;
+    }
+    return p;
+}
+
+struct tpqueue *
+TPqueue()
+{
+    struct tpqueue *q = calloc(1, sizeof(struct tpqueue));
+
+    if ( q == NULL )
+        return NULL;
+    if ( (q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 )
+    {
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+int
+TPqfd(struct tpqueue *q)
+{
+    return q->efd;
+}
+
+int
+TPsubmit(struct tpool *p, struct tpqueue *q, struct tpjob *job)
+{
+    pthread_mutex_lock(&p->lock);
+    if ( p->depth >= p->limit || p->stopping )
+    {
+        p->rejected++;
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    job->queue  = q;
+    job->next   = NULL;
+    job->queued = now_ns();
+    if ( p->tail )
+        p->tail->next = job;
+    else
+        p->head = job;
+    p->tail = job;
+    if ( ++p->depth > p->maxdepth )
+        p->maxdepth = p->depth;
+    pthread_cond_signal(&p->more);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int
+TPcomplete(struct tpqueue *q)
+{
+    struct tpjob *job, *next;
+    uint64_t    n;
+    int         count = 0;
+
+    if ( read(q->efd, &n, sizeof(n)) == -1 )
+        ;                           /* nothing posted; list is empty */
+
+    pthread_mutex_lock(&q->lock);   /* take the whole list at once */
+    job = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    for ( ; job != NULL ; job = next )
+    {
+        next = job->next;           /* done() may free the job */
+        job->done(job);
+        count++;
+    }
+    return count;
+}
+
+void
+TPpost(struct tpqueue *q, struct tpjob *job)
+{
+    uint64_t one = 1;
+
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if ( q->tail )
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+    if ( write(q->efd, &one, sizeof(one)) == -1 )
+        ;                           /* counter full: already readable */
+}
+
+void
+TPstats(struct tpool *p, FILE *fp)
+{
+    struct opstats *os;
+    int     i, b, depth, maxdepth;
+
+    pthread_mutex_lock(&p->lock);
+    depth = p->depth;
+    maxdepth = p->maxdepth;
+    pthread_mutex_unlock(&p->lock);
+
+    fprintf(fp, "fs pool: %d threads, queue %d/%d (max %d), %lu rejected\n",
+            p->nthreads, depth, p->limit, maxdepth,
+            __atomic_load_n(&p->rejected, __ATOMIC_RELAXED));
+    for ( i = 0 ; i < TP_NOPS ; i++ )
+    {
+        os = &p->ops[i];
+        fprintf(fp, "  %-5s %8lu jobs\n", opnames[i],
+                __atomic_load_n(&os->count, __ATOMIC_RELAXED));
+        if ( os->count == 0 )
+            continue;
+        fprintf(fp, "    usec <");
+        for ( b = 0 ; b < TP_BUCKETS ; b++ )
+            if ( os->wait[b] || os->run[b] )
+                fprintf(fp, " %8lu", 1UL << b);
+        fprintf(fp, "\n    queued ");
+        for ( b = 0 ; b < TP_BUCKETS ; b++ )
+            if ( os->wait[b] || os->run[b] )
+                fprintf(fp, " %8lu", __atomic_load_n(&os->wait[b],
+                                                     __ATOMIC_RELAXED));
+        fprintf(fp, "\n    ran    ");
+        for ( b = 0 ; b < TP_BUCKETS ; b++ )
+            if ( os->wait[b] || os->run[b] )
+                fprintf(fp, " %8lu", __atomic_load_n(&os->run[b],
+                                                     __ATOMIC_RELAXED));
+        fprintf(fp, "\n");
+    }
+}
+
+void
+TPfree(struct tpool *p)
+{
+    int     i;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->more);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0 ; i < p->nthreads ; i++ )
+        pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->more);
+    free(p->threads);
+    free(p);
+}
+
+/*
+ * take jobs off the queue until told to stop and the queue is empty
+ */
+static void *
+worker(void *arg)
+{
+    struct tpool    *p = arg;
+    struct tpjob    *job;
+    struct opstats  *os;
+    long    start, end;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock(&p->lock);
+        while ( p->head == NULL && ! p->stopping )
+            pthread_cond_wait(&p->more, &p->lock);
+        if ( (job = p->head) == NULL )
+        {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;            /* stopping, and nothing left */
+        }
+        if ( (p->head = job->next) == NULL )
+            p->tail = NULL;
+        p->depth--;
+        pthread_mutex_unlock(&p->lock);
+
+        start = now_ns();
+        job->work(job);
+        end = now_ns();
+
+        os = &p->ops[job->op < TP_NOPS ? job->op : 0];
+        __atomic_add_fetch(&os->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&os->wait[bucket(start - job->queued)], 1,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&os->run[bucket(end - start)], 1,
+                           __ATOMIC_RELAXED);
+
+        TPpost(job->queue, job);
+    }
+}
+
+static long
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * histogram bucket for a time in ns: bucket b counts times
+ * under 2^b microseconds
+ */
+static int
+bucket(long ns)
+{
+    long    us = ns / 1000;
+    int     b = 0;
+
+    while ( b < TP_BUCKETS - 1 && us >= (1L << b) )
+        b++;
+    return b;
+}
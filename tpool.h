@@ -0,0 +1,33 @@
+#ifndef TPOOL_H
+#define TPOOL_H
+/*
+ * header for tpool.c package
+ */
+
+#include    <stdio.h>
+
+enum { TP_STAT, TP_OPEN, TP_SCAN, TP_FILL, TP_NOPS };
+
+struct tpool;
+struct tpqueue;
+
+struct tpjob {                      /* embed one in your struct */
+    int             op;             /* TP_STAT etc, for stats   */
+    void            (*work)(struct tpjob *);   /* on a pool thread */
+    void            (*done)(struct tpjob *);   /* in TPcomplete()  */
+    void            *arg;
+    long            queued;         /* ns, set by TPsubmit()    */
+    struct tpqueue  *queue;
+    struct tpjob    *next;
+};
+
+struct tpool    *TPnew(int, int);
+struct tpqueue  *TPqueue(void);
+int             TPqfd(struct tpqueue *);
+int             TPsubmit(struct tpool *, struct tpqueue *, struct tpjob *);
+int             TPcomplete(struct tpqueue *);
+void            TPpost(struct tpqueue *, struct tpjob *);
+void            TPstats(struct tpool *, FILE *);
+void            TPfree(struct tpool *);
+
+#endif
@@ -0,0 +1,274 @@
+/* trace.c
+ *
+ * when each request got to each phase, for the access log, the slow
+ * log and tracing tools
+ *
+ * interface:
+ *     TRstart( tr, addr )           a new request from addr: clear tr
+ *                                   and mark TR_ACCEPT
+ *     TRmark( tr, phase )           the request is at phase now; only
+ *                                   the first mark of a phase counts.
+ *                                   tr may be NULL
+ *     TRfirst( tr, buf, len )       the reply's first len bytes, buf,
+ *                                   are going out: mark TR_FIRST and
+ *                                   take the status from them
+ *     TRopen( conf )                open (or open again, after a log
+ *                                   is rotated) conf's access_log and
+ *                                   slow_log; 0 ok, -1 (said why)
+ *     TRlogging()                   is either log on
+ *     TRlog( tr, head, end, bytes ) the request head..end is done, with
+ *                                   bytes sent: log it
+ *     TRclose_above( fd, keep )     close every fd above fd but the
+ *                                   logs' and keep (-1 for none), in a
+ *                                   child that is not to hold its
+ *                                   parent's sockets open
+ *
+ * details:
+ *      The phases are TR_ACCEPT (the call came in), TR_FORK (its
+ *      child is running; fork mode only), TR_HEAD (the head is read),
+ *      TR_HANDLER (the path is checked and the handler starts: do_cat,
+ *      do_exec, do_dir and so on), TR_FIRST (the first byte of the
+ *      reply is written) and TR_LAST (the last one is). Times are
+ *      CLOCK_MONOTONIC, which the vDSO reads without a system call.
+ *
+ *      A log line is the common log format followed by the time from
+ *      each phase to the next, in ms, named for what happened in it:
+ *
+ *        ... "GET /a.txt HTTP/1.1" 200 1432 ms fork=0.180 read=0.041
+ *            check=0.022 handler=0.095 send=0.010 total=0.348
+ *
+ *      A phase not reached is "-", and the next one counts from the
+ *      last phase that was. The slow log gets the same line for a
+ *      request whose total is slow_log's ms or more. Each line is one
+ *      write() to a file opened O_APPEND, so the children's lines do
+ *      not mix. A reload opens the logs again, which is how a rotated
+ *      log is let go; the new file takes the old one's fd number by
+ *      dup3(), so a thread in the middle of a write is not hurt. A
+ *      log turned off keeps its fd, for the same reason.
+ *
+ *      Built where <sys/sdt.h> is (the Makefile checks), each mark
+ *      is also a USDT probe, provider wsng, named for the phase
+ *      (accept, fork, head, handler, first, last), with the trace's
+ *      address as the request's id and the time in ns. TRlog() fires
+ *      "done" with the id, the status and the bytes. A probe is a nop
+ *      until bpftrace or perf attaches to it:
+ *
+ *        bpftrace -e 'usdt:./wsng:wsng:head { @t[arg0] = arg1 }
+ *                     usdt:./wsng:wsng:first /@t[arg0]/ {
+ *                         @ms = hist((arg1 - @t[arg0]) / 1000000);
+ *                         delete(@t[arg0]) }'
+ *
+ *      Without it the probes compile to nothing.
+ */
+
+#define     _GNU_SOURCE             /* dup3() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <netinet/in.h>
+#include    <arpa/inet.h>
+#include    "config.h"
+#include    "trace.h"
+
+#ifdef HAVE_SDT
+#include    <sys/sdt.h>
+#define PROBE2(name, a, b)      DTRACE_PROBE2(wsng, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(wsng, name, a, b, c)
+#else
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#define MAX_LINE    2048            /* of the request line, logged */
+#define TR_LINE     (MAX_LINE + 256)
+
+static int      logfd = -1, slowfd = -1;
+static int      logon = 0, slowon = 0;
+static long     slow_us;
+
+static char     *names[TR_PHASES] = { NULL, "fork", "read", "check",
+                                      "handler", "send" };
+
+static int      reopen(int *, char *);
+static long     usecs(struct trace *, int, int);
+
+void
+TRstart(struct trace *tr, unsigned addr)
+{
+    memset(tr, 0, sizeof(struct trace));
+    tr->addr = addr;
+    TRmark(tr, TR_ACCEPT);
+}
+
+void
+TRmark(struct trace *tr, int phase)
+{
+    struct timespec *t;
+    unsigned long ns;
+
+    if ( tr == NULL )
+        return;
+    t = &tr->t[phase];
+    if ( t->tv_sec != 0 || t->tv_nsec != 0 )
+        return;
+    clock_gettime(CLOCK_MONOTONIC, t);
+    ns = t->tv_sec * 1000000000UL + t->tv_nsec;
+    switch ( phase )
+    {
+    case TR_ACCEPT:     PROBE2(accept, tr, ns);     break;
+    case TR_FORK:       PROBE2(fork, tr, ns);       break;
+    case TR_HEAD:       PROBE2(head, tr, ns);       break;
+    case TR_HANDLER:    PROBE2(handler, tr, ns);    break;
+    case TR_FIRST:      PROBE2(first, tr, ns);      break;
+    case TR_LAST:       PROBE2(last, tr, ns);       break;
+    }
+    (void) ns;
+}
+
+void
+TRfirst(struct trace *tr, char *buf, size_t len)
+{
+    if ( tr == NULL )
+        return;
+    TRmark(tr, TR_FIRST);
+    if ( len >= 12 && strncmp(buf, "HTTP/", 5) == 0 && buf[8] == ' ' )
+        tr->status = atoi(buf + 9);
+}
+
+int
+TRopen(struct config *conf)
+{
+    int     rc = 0;
+
+    if ( conf->access_log != NULL )
+        rc |= reopen(&logfd, conf->access_log);
+    if ( conf->slow_log != NULL )
+        rc |= reopen(&slowfd, conf->slow_log);
+    logon = (logfd != -1 && conf->access_log != NULL);
+    slowon = (slowfd != -1 && conf->slow_log != NULL);
+    slow_us = conf->slow_ms * 1000L;
+    return rc ? -1 : 0;
+}
+
+int
+TRlogging()
+{
+    return logon || slowon;
+}
+
+void
+TRlog(struct trace *tr, char *head, char *end, size_t bytes)
+{
+    char    line[TR_LINE], date[64], from[INET_ADDRSTRLEN];
+    struct in_addr a;
+    struct tm tm;
+    time_t  now;
+    long    us, total;
+    int     n, i, prev;
+
+    PROBE3(done, tr, tr->status, bytes);
+    total = usecs(tr, TR_ACCEPT, TR_LAST);
+    if ( ! logon && ! (slowon && total >= slow_us) )
+        return;
+
+    a.s_addr = tr->addr;
+    if ( tr->addr == 0 || inet_ntop(AF_INET, &a, from, sizeof(from)) == NULL )
+        strcpy(from, "-");
+    now = time(NULL);
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    n = snprintf(line, sizeof(line), "%s - - [%s] \"", from, date);
+    for ( ; head != NULL && head < end && *head != '\r' && *head != '\n'
+            && n < MAX_LINE ; head++ )     /* the request line, quotable */
+        line[n++] = (*head == '"' || *head < ' ') ? '?' : *head;
+    if ( tr->status == 0 )          /* a proxied answer, say */
+        n += snprintf(line + n, sizeof(line) - n, "\" - %zu ms", bytes);
+    else
+        n += snprintf(line + n, sizeof(line) - n, "\" %d %zu ms", tr->status,
+                      bytes);
+    for ( prev = TR_ACCEPT, i = TR_FORK ; i < TR_PHASES ; i++ )
+    {
+        if ( (us = usecs(tr, prev, i)) < 0 )
+        {
+            n += snprintf(line + n, sizeof(line) - n, " %s=-", names[i]);
+            continue;
+        }
+        n += snprintf(line + n, sizeof(line) - n, " %s=%ld.%03ld", names[i],
+                      us / 1000, us % 1000);
+        prev = i;
+    }
+    if ( total < 0 )
+        n += snprintf(line + n, sizeof(line) - n, " total=-\n");
+    else
+        n += snprintf(line + n, sizeof(line) - n, " total=%ld.%03ld\n",
+                      total / 1000, total % 1000);
+    if ( n > (int) sizeof(line) - 1 )
+        n = sizeof(line) - 1;
+    if ( logon )
+        write(logfd, line, n);
+    if ( slowon && total >= slow_us )
+        write(slowfd, line, n);
+}
+
+void
+TRclose_above(int fd, int keep)
+{
+    int     kept[3] = { logfd, slowfd, keep };
+    int     i, j, t;
+
+    for ( i = 1 ; i < 3 ; i++ )     /* in order, lowest first */
+        for ( j = i ; j > 0 && kept[j - 1] > kept[j] ; j-- )
+        {
+            t = kept[j];
+            kept[j] = kept[j - 1];
+            kept[j - 1] = t;
+        }
+    for ( i = 0 ; i < 3 ; i++ )
+        if ( kept[i] > fd )
+        {
+            close_range(fd + 1, kept[i] - 1, 0);
+            fd = kept[i];
+        }
+    close_range(fd + 1, ~0U, 0);
+}
+
+/*
+ * open path as the log on *fdp, at the same fd number if it has one
+ */
+static int
+reopen(int *fdp, char *path)
+{
+    int     fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if ( fd == -1 )
+    {
+        perror(path);
+        return -1;
+    }
+    if ( *fdp == -1 )
+        *fdp = fd;
+    else
+    {
+        dup3(fd, *fdp, O_CLOEXEC);
+        close(fd);
+    }
+    return 0;
+}
+
+/*
+ * microseconds from phase a to phase b, or -1 if either is not marked
+ */
+static long
+usecs(struct trace *tr, int a, int b)
+{
+    struct timespec *x = &tr->t[a], *y = &tr->t[b];
+
+    if ( (x->tv_sec == 0 && x->tv_nsec == 0)
+      || (y->tv_sec == 0 && y->tv_nsec == 0) )
+        return -1;
+    return (y->tv_sec - x->tv_sec) * 1000000L
+           + (y->tv_nsec - x->tv_nsec) / 1000;
+}
@@ -0,0 +1,31 @@
+#ifndef TRACE_H
+#define TRACE_H
+/*
+ * header for trace.c package
+ */
+
+#include    <stddef.h>
+#include    <time.h>
+
+#define TR_SLOW     1000            /* slow_log ms, by default  */
+
+enum { TR_ACCEPT, TR_FORK, TR_HEAD, TR_HANDLER, TR_FIRST, TR_LAST,
+       TR_PHASES };
+
+struct config;
+
+struct trace {                      /* one request's phases     */
+    unsigned        addr;           /* the client               */
+    int             status;         /* of the reply, 0 unknown  */
+    struct timespec t[TR_PHASES];   /* 0 if it did not get there */
+};
+
+void    TRstart(struct trace *, unsigned);
+void    TRmark(struct trace *, int);
+void    TRfirst(struct trace *, char *, size_t);
+int     TRopen(struct config *);
+int     TRlogging(void);
+void    TRlog(struct trace *, char *, char *, size_t);
+void    TRclose_above(int, int);
+
+#endif
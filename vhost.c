@@ -0,0 +1,347 @@
+/* vhost.c
+ *
+ * a table of name-based virtual hosts, looked up by the Host: header
+ *
+ * interface:
+ *     VHtable()                 returns a new table holding just a
+ *                               default host, or NULL
+ *     VHnew( t, name )          returns a new, empty vhost stored under name
+ *     VHalias( t, vh, name )    also find vh under name, 0 ok, 1 no
+ *     VHlookup( t, host )       returns vhost for a Host: value, or the
+ *                               default host if there is no such name
+ *     VHdefault( t )            returns the default host
+ *     VHtype( vh, ext, type )   store a Content-Type for ext on vh
+ *     VHcontent_type( vh, ext ) returns vh's type, else the default's
+ *     VHindex( vh, name )       append name to the host's index list
+ *     VHopen_roots( t )         open every host's root, and map its
+ *                               bundle if it has one; 0 ok, 1 no
+ *     VHfree( t )               close the roots and free the table
+ *
+ * details:
+ *      Hosts live in a chained hash keyed on the lower-case host name.
+ *      The table doubles when it gets as many entries as buckets, so a
+ *      lookup is one hash and one short chain no matter how many
+ *      hosts are configured. Aliases are extra chain entries that
+ *      point at the same vhost.
+ *
+ *      Content-Types are kept on a short list per host. The default
+ *      host's list is the global "type" table; other hosts list only
+ *      their overrides and fall back to it through vh->parent.
+ *
+ *      A table is built once from the config file and not changed
+ *      after that, so a reload builds a new table beside the old one.
+ *      Host ids keep counting up across tables, so a result cached
+ *      under an old table's id can never match a new one.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <ctype.h>
+#include    <unistd.h>
+#include    "rootfs.h"
+#include    "pack.h"
+#include    "proxy.h"
+#include    "vhost.h"
+
+#define INITIAL_BUCKETS 64
+
+struct vname {                      /* one hash chain entry     */
+    char            *name;
+    struct vhost    *vh;
+    struct vname    *next;
+};
+
+struct vtype {                      /* one Content-Type override */
+    char            *ext;
+    char            *type;
+    struct vtype    *next;
+};
+
+struct vhtable {
+    struct vname    **buckets;
+    unsigned        nbuckets;
+    unsigned        nnames;
+    struct vhost    *dflt;          /* answers unknown names    */
+    struct vhost    *all;           /* every vhost, for VHopen_roots */
+};
+
+static unsigned     next_id = 1;
+
+static struct vhost *new_host(struct vhtable *, char *);
+static unsigned hash_name(char *, int);
+static int      add_name(struct vhtable *, char *, struct vhost *);
+static void     grow_table(struct vhtable *);
+
+struct vhtable *
+VHtable()
+{
+    struct vhtable *t = calloc(1, sizeof(struct vhtable));
+
+    if ( t != NULL && (t->dflt = new_host(t, "")) == NULL )
+    {
+        free(t);
+        t = NULL;
+    }
+    return t;
+}
+
+struct vhost *
+VHnew(struct vhtable *t, char *name)
+/*
+ * allocate a vhost and file it under name
+ * returns NULL if out of memory or the name is already taken
+ */
+{
+    struct vhost *vh;
+
+    if ( (vh = new_host(t, name)) != NULL && add_name(t, name, vh) != 0 )
+    {
+        t->all = vh->next;          /* it was put first, take it off */
+        free(vh->name);
+        free(vh);
+        vh = NULL;
+    }
+    return vh;
+}
+
+int
+VHalias(struct vhtable *t, struct vhost *vh, char *name)
+{
+    return add_name(t, name, vh);
+}
+
+struct vhost *
+VHdefault(struct vhtable *t)
+{
+    return t->dflt;
+}
+
+struct vhost *
+VHlookup(struct vhtable *t, char *host)
+/*
+ * host is the Host: header value, maybe with a ":port" on the end
+ */
+{
+    struct vname *np;
+    unsigned    h;
+    int         len;
+
+    if ( host == NULL || t->nbuckets == 0 )
+        return t->dflt;
+
+    for ( len = 0 ; host[len] != '\0' && host[len] != ':' ; len++ )
+        ;
+    h = hash_name(host, len) & (t->nbuckets - 1);
+    for ( np = t->buckets[h] ; np != NULL ; np = np->next )
+        if ( strncasecmp(np->name, host, len) == 0 && np->name[len] == '\0' )
+            return np->vh;
+    return t->dflt;
+}
+
+int
+VHtype(struct vhost *vh, char *ext, char *type)
+/*
+ * store an override; a later one for the same ext wins
+ */
+{
+    struct vtype *tp = malloc(sizeof(struct vtype));
+
+    if ( tp == NULL )
+        return 1;
+    tp->ext  = strdup(ext);
+    tp->type = strdup(type);
+    tp->next = vh->types;
+    vh->types = tp;
+    return 0;
+}
+
+char *
+VHcontent_type(struct vhost *vh, char *ext)
+/*
+ * returns the Content-Type for ext, or "" if none is known
+ */
+{
+    struct vtype *tp;
+
+    for ( ; vh != NULL ; vh = vh->parent )
+        for ( tp = vh->types ; tp != NULL ; tp = tp->next )
+            if ( strcmp(tp->ext, ext) == 0 )
+                return tp->type;
+    return "";
+}
+
+int
+VHindex(struct vhost *vh, char *name)
+{
+    if ( vh->nindex == VH_MAXINDEX )
+        return 1;
+    vh->index[vh->nindex++] = strdup(name);
+    return 0;
+}
+
+int
+VHopen_roots(struct vhtable *t)
+/*
+ * open each vhost's server_root relative to the current directory
+ * prints a message and returns 1 at the first one that fails
+ */
+{
+    struct vhost *vh;
+
+    for ( vh = t->all ; vh != NULL ; vh = vh->next )
+    {
+        if ( vh->packfile != NULL && (vh->pack = PKopen(vh->packfile)) == NULL )
+        {
+            perror(vh->packfile);
+            return 1;
+        }
+        if ( vh->root == NULL && vh->pack != NULL )
+            continue;               /* the bundle is all it serves */
+        if ( vh->root == NULL )
+        {
+            fprintf(stderr, "vhost %s has no server_root\n", vh->name);
+            return 1;
+        }
+        if ( (vh->rootfd = RFopenroot(vh->root)) == -1 )
+        {
+            perror(vh->root);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+VHfree(struct vhtable *t)
+{
+    struct vhost *vh, *nextvh;
+    struct vtype *tp, *nexttp;
+    struct vname *np, *nextnp;
+    unsigned    i;
+    int         j;
+
+    for ( vh = t->all ; vh != NULL ; vh = nextvh )
+    {
+        nextvh = vh->next;
+        if ( vh->rootfd != -1 )
+            close(vh->rootfd);
+        PKclose(vh->pack);
+        free(vh->packfile);
+        PXfree_routes(vh->proxy);
+        for ( tp = vh->types ; tp != NULL ; tp = nexttp )
+        {
+            nexttp = tp->next;
+            free(tp->ext);
+            free(tp->type);
+            free(tp);
+        }
+        for ( j = 0 ; j < vh->nindex ; j++ )
+            free(vh->index[j]);
+        free(vh->name);
+        free(vh->root);
+        free(vh);
+    }
+    for ( i = 0 ; i < t->nbuckets ; i++ )
+        for ( np = t->buckets[i] ; np != NULL ; np = nextnp )
+        {
+            nextnp = np->next;
+            free(np->name);
+            free(np);
+        }
+    free(t->buckets);
+    free(t);
+}
+
+/*
+ * make a host and put it on t's list; every host but the
+ * default inherits from the default
+ */
+static struct vhost *
+new_host(struct vhtable *t, char *name)
+{
+    struct vhost *vh = calloc(1, sizeof(struct vhost));
+
+    if ( vh == NULL )
+        return NULL;
+    if ( (vh->name = strdup(name)) == NULL )
+    {
+        free(vh);
+        return NULL;
+    }
+    vh->rootfd = -1;
+    vh->id = next_id++;
+    vh->parent = t->dflt;
+    vh->next = t->all;
+    t->all = vh;
+    return vh;
+}
+
+/*
+ * FNV-1a over the first len chars, folded to lower case
+ */
+static unsigned
+hash_name(char *s, int len)
+{
+    unsigned h = 2166136261u;
+
+    while ( len-- > 0 )
+    {
+        h ^= (unsigned char) tolower((unsigned char) *s++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int
+add_name(struct vhtable *t, char *name, struct vhost *vh)
+{
+    struct vname *np;
+    unsigned    h;
+
+    if ( t->nnames >= t->nbuckets )
+        grow_table(t);
+    if ( t->buckets == NULL )
+        return 1;
+    if ( VHlookup(t, name) != t->dflt )
+    {
+        fprintf(stderr, "duplicate vhost name %s\n", name);
+        return 1;
+    }
+    if ( (np = malloc(sizeof(struct vname))) == NULL )
+        return 1;
+
+    h = hash_name(name, strlen(name)) & (t->nbuckets - 1);
+    np->name = strdup(name);
+    np->vh   = vh;
+    np->next = t->buckets[h];
+    t->buckets[h] = np;
+    t->nnames++;
+    return 0;
+}
+
+/*
+ * double the bucket array (or make the first one) and rehash
+ */
+static void
+grow_table(struct vhtable *t)
+{
+    unsigned    newn = t->nbuckets ? t->nbuckets * 2 : INITIAL_BUCKETS;
+    struct vname **newb = calloc(newn, sizeof(struct vname *));
+    struct vname *np, *next;
+    unsigned    i, h;
+
+    if ( newb == NULL )
+        return;                     /* keep the old, longer chains */
+    for ( i = 0 ; i < t->nbuckets ; i++ )
+        for ( np = t->buckets[i] ; np != NULL ; np = next )
+        {
+            next = np->next;
+            h = hash_name(np->name, strlen(np->name)) & (newn - 1);
+            np->next = newb[h];
+            newb[h] = np;
+        }
+    free(t->buckets);
+    t->buckets  = newb;
+    t->nbuckets = newn;
+}
@@ -0,0 +1,42 @@
+#ifndef VHOST_H
+#define VHOST_H
+/*
+ * header for vhost.c package
+ */
+
+#define VH_MAXINDEX 8               /* index names per host    */
+
+struct vtype;
+struct vhtable;
+struct pack;
+struct pxroute;
+
+struct vhost {
+    char            *name;          /* "" for the default host  */
+    unsigned        id;             /* small unique number      */
+    char            *root;          /* server_root as configured */
+    int             rootfd;         /* O_PATH fd on root        */
+    struct vtype    *types;         /* Content-Type overrides   */
+    char            *index[VH_MAXINDEX];   /* index names, in order */
+    int             nindex;
+    long            cache_size;     /* cache budget in bytes    */
+    long            cache_used;     /* of it, by fcache.c       */
+    char            *packfile;      /* serve from this bundle   */
+    struct pack     *pack;          /* it, mapped; see pack.c   */
+    struct pxroute  *proxy;         /* proxy_pass prefixes      */
+    struct vhost    *parent;        /* default host, or NULL    */
+    struct vhost    *next;          /* list of all hosts        */
+};
+
+struct vhtable  *VHtable();
+struct vhost    *VHnew(struct vhtable *, char *);
+int             VHalias(struct vhtable *, struct vhost *, char *);
+struct vhost    *VHlookup(struct vhtable *, char *);
+struct vhost    *VHdefault(struct vhtable *);
+int             VHtype(struct vhost *, char *, char *);
+char            *VHcontent_type(struct vhost *, char *);
+int             VHindex(struct vhost *, char *);
+int             VHopen_roots(struct vhtable *);
+void            VHfree(struct vhtable *);
+
+#endif
@@ -6,7 +6,7 @@
  *  function    rfc822_time()
  *  purpose     return a string suitable for web servers
  *  details     Sun, 06 Nov 1994 08:49:37 GMT
- *  method      use gmtime() to get struct
+ *  method      use gmtime_r() to get struct
  *          then use strftime() to format data to spec
  *  arg     a time_t value
  *  returns     a pointer to a static buffer (be careful)
@@ -15,10 +15,10 @@
 char *
 rfc822_time(time_t thetime)
 {
-    struct tm *t ;
-    static  char retval[36];
+    struct tm tm, *t ;
+    static __thread char retval[36];    /* one per thread */
 
-    t = gmtime( &thetime );     /* break into parts */
+    t = gmtime_r( &thetime, &tm );      /* break into parts */
                                 /* format to spec   */
     strftime(retval, 36, "%a, %d %b %Y %H:%M:%S GMT", t);
     return retval;
@@ -28,7 +28,7 @@ rfc822_time(time_t thetime)
  *  function    table_time()
  *  purpose     return a string suitable for web servers
  *  details     01-May-2019 19:18
- *  method      use localtime() to get struct
+ *  method      use localtime_r() to get struct
  *          then use strftime() to format data to spec
  *  arg     a time_t value
  *  returns     a pointer to a static buffer (be careful)
@@ -37,10 +37,10 @@ rfc822_time(time_t thetime)
 char *
 table_time(time_t thetime)
 {
-    struct tm *t ;
-    static char retval[36];
+    struct tm tm, *t ;
+    static __thread char retval[36];    /* one per thread */
 
-    t = localtime( &thetime );
+    t = localtime_r( &thetime, &tm );
 
     strftime(retval, 36, "%d-%b-%Y %H:%M", t);
     return retval;
@@ -5,6 +5,9 @@
  * features: supports the GET command only
  *           runs in the current directory
  *           forks a new child to handle each request
+ *           rereads the config file on SIGHUP
+ *           SIGTERM drains requests, SIGUSR2 execs a new binary
+ *           HTTPS on tls_port, HTTP/2 on either
  *           needs many additional features
  *
  *  compile: cc ws.c socklib.c -o ws
@@ -15,6 +18,7 @@
  *  history: 2008-05-01 removed extra fclose that was causing double free
  */
 
+#define     _GNU_SOURCE             /* O_PATH, fdopendir() */
 #include    <stdio.h>
 #include    <stdlib.h>
 #include    <strings.h>
@@ -27,10 +31,39 @@
 #include    <sys/param.h>
 #include        <sys/wait.h>
 #include    <signal.h>
+#include    <poll.h>
+#include    <sys/socket.h>
+#include    <sys/sendfile.h>
+#include    <sys/time.h>
+#include    <netinet/in.h>
 #include    "socklib.h"
-#include    "varlib.h"
+#include    "rootfs.h"
+#include    "vhost.h"
+#include    "config.h"
+#include    "dircache.h"
+#include    "fcache.h"
+#include    "shmcache.h"
+#include    "cgicache.h"
+#include    "pack.h"
+#include    "h2.h"
+#include    "tls.h"
+#include    "proxy.h"
+#include    "trace.h"
+#include    "cpu.h"
+#include    "preload.h"
+#include    "child.h"
+#include    "ratelimit.h"
+#include    "timerwheel.h"
+#include    "filemap.h"
+#include    "reply.h"
+#include    "listing.h"
+#include    "tpool.h"
+#include    "events.h"
+#include    "scan.h"
+#include    "wsng.h"
 #include    <time.h>
 #include    <dirent.h>
+#include    <fcntl.h>
 
 #define PORTNUM 80
 #define SERVER_ROOT "."
@@ -39,11 +72,23 @@
 #define SERVER_NAME "WSNG"
 #define CONTENT_DEFAULT "text/plain"
 
-#define MAX_RQ_LEN  4096
-#define LINELEN     1024
 #define PARAM_LEN   128
 #define VALUE_LEN   512
 #define CONTENT_LEN 64
+#define INDEX_CACHE 1024        /* dircache slots */
+#define DRAIN_TIMEOUT 30        /* seconds to finish requests on SIGTERM */
+#define MAX_CONNS   1024        /* children at once; more get a 503 */
+#define MAX_PER_IP  32          /* children at once for one client */
+#define HEADER_TIMEOUT 10       /* seconds to send the request headers */
+#define SEND_TIMEOUT 60         /* seconds a reply may stall sending */
+#define REQUEST_TIMEOUT 300     /* seconds for a whole request, CGI too */
+#define TICK_MS     100         /* timer wheel resolution */
+#define FS_THREADS  4           /* blocking fs work, in events mode */
+#define FS_QUEUE    1024        /* fs jobs waiting, at most */
+#define LOOP_THREADS 1          /* event loops, in events mode */
+#define MAX_LOOPS   64          /* config.c has this many reader slots */
+#define H2_STREAMS  32          /* requests at once on an HTTP/2 connection */
+#define SM_POLL_US  1000        /* between looks for a file another child reads */
 
 char    myhost[MAXHOSTNAMELEN];
 int     myport;
@@ -55,71 +100,165 @@ char    *full_hostname();
  * prototypes
  */
 int     startup(int, char *a[], char [], int *);
-void    read_til_crnl(FILE *);
-void    process_rq( char *, FILE *);
-void    bad_request(FILE *);
-void    cannot_do(FILE *fp);
-void    do_404(char *item, FILE *fp);
-void    do_403(char *item, FILE *fp);
-void    do_cat(char *f, FILE *fpsock);
-void    do_exec( char *prog, FILE *fp);
-void    do_ls(char *dir, FILE *fp);
-void    do_dir(char *dir, FILE *fp);
+int     inherited_sockets(char *, int *, int);
+int     listen_sockets(struct config *, int *, int);
+struct config *process_config_file(char *);
+void    reload_config(void);
+void    start_upgrade(void);
+void    drain_and_exit(void);
+void    sighup_handler(int s);
+void    sigterm_handler(int s);
+void    sigusr2_handler(int s);
+void    sigusr1_handler(int s);
+void    print_stats(void);
+void    process_rq( char *, char *, char *, char *, struct vhost *,
+                    struct reply *);
+void    bad_request(struct reply *);
+void    cannot_do(struct reply *rp);
+void    do_404(char *item, struct reply *rp);
+void    do_proxy(struct pxroute *, char *, char *, char *, struct reply *);
+void    proxy_error(int, struct reply *);
+void    do_403(char *item, struct reply *rp);
+void    do_cat(char *f, int fd, struct stat *info,
+                struct vhost *vh, struct reply *rp);
+int     send_cached(char *item, struct vhost *vh, struct reply *rp);
+void    store_cat(char *key, char *f, int fd, struct stat *info,
+                  struct vhost *vh, struct reply *rp);
+void    ktls_cat(char *f, int fd, struct stat *info, struct reply *rp);
+void    do_exec( char *prog, int fd, struct vhost *vh, struct reply *rp);
+void    do_ls(int dirfd, struct reply *rp);
+void    do_dir(char *dir, int dirfd, struct stat *info,
+               struct vhost *vh, struct reply *rp);
+int     open_index(int, char *, int *, struct stat *);
 void    output_listing(FILE * pp, FILE * fp, char *dir);
 char    *get_content_type(char *ext);
 int     ends_in_cgi(char *f);
 char    *file_type(char *f);
-void    header( FILE *fp, int code, char *msg, char *content_type );
-int     isadir(char *f);
+void    header( struct reply *rp, int code, char *msg, char *content_type );
 char    *modify_argument(char *arg, int len);
-int     not_exist(char *f);
-int     no_access(char *f);
+int     no_access(struct stat *info);
 void    fatal(char *, char *);
-void    handle_call(int);
-int     read_request(FILE *, char *, int);
-char    *readline(char *, int, FILE *);
+void    admit_call(int, unsigned, int);
+void    refuse_call(int, int);
+int     handle_call(int, unsigned, int);
+void    sigalrm_handler(int s);
+struct reqtimer *new_reqtimer(void);
+void    request_expired(struct twtimer *, void *);
+void    track_child(pid_t, unsigned, struct config *);
+int     read_request(int, char *, char **, int *, char *, int, char *, int);
+void    copy_field(char *, int, char *, char *);
 void    sigchld_handler(int s);
 char    *parse_query(char *line);
 void    process_config_type(char [PARAM_LEN],
                             char [VALUE_LEN],
                             char [CONTENT_LEN],
-                            int *);
-void    table_header(FILE *fp);
-void    table_close(FILE *fp);
-void    print_rows(FILE *fp, char *dir);
-void    table_row(FILE *fp, struct dirent * dp, struct stat *info);
+                            int *,
+                            struct vhost *);
+int     process_config_vhost(char [VALUE_LEN],
+                             char [CONTENT_LEN],
+                             int *,
+                             struct config *,
+                             struct vhost **);
 
 //from web-time.c
 char * rfc822_time(time_t thetime);
-char * table_time(time_t thetime);
 
 int mysocket = -1;      /* for SIGINT handler */
+int lsocks[MAX_LOOPS];  /* with cpu_steer, a socket per loop; */
+int nlsocks = 0;        /*   mysocket is lsocks[0]            */
+int tlssocket = -1;     /* HTTPS, if tls_port is set */
+volatile sig_atomic_t reload_pending = 0;   /* set by SIGHUP */
+volatile sig_atomic_t shutdown_pending = 0; /* set by SIGTERM */
+volatile sig_atomic_t upgrade_pending = 0;  /* set by SIGUSR2 */
+volatile sig_atomic_t stats_pending = 0;    /* set by SIGUSR1 */
+pid_t   upgrade_pid = 0;        /* new binary, while it starts up */
+char    **saved_av;             /* to exec ourselves on upgrade */
+sigset_t wait_mask;     /* mask while waiting; children get it too */
+struct twheel *timers;  /* deadlines for the children */
+struct tpool *fspool = NULL;    /* "mode events": fs threads ... */
+struct evloop *loop = NULL;     /* ... and the event loop */
+
+/*
+ * a deadline for one child; kept on a free list once the child is
+ * gone, since they are released in the SIGCHLD handler
+ */
+struct reqtimer {
+    struct twtimer  t;
+    pid_t           pid;
+    struct reqtimer *nextfree;
+};
+struct reqtimer *free_timers = NULL;
 
 int
 main(int ac, char *av[])
 {
-    int     sock, fd;
+    int     fd, i, npfd;
+    struct pollfd pfd[2];
+    struct sockaddr_in caddr;
+    socklen_t clen;
+    struct timespec ts;
+    long    ms;
 
     /* set up */
-    sock = startup(ac, av, myhost, &myport);
-    mysocket = sock;
+    saved_av = av;
+    mysocket = startup(ac, av, myhost, &myport);
 
     /* sign on */
     printf("wsng%s started.  host=%s port=%d\n", VERSION, myhost, myport);
 
     /* main loop here */
+    while ( loop != NULL )              /* mode events: see events.c */
+    {
+        EVwait(loop, &wait_mask, -1);
+        CFreclaim();                    /* configs the loops are done with */
+        FCreclaim();                    /* and file cache entries */
+        if ( shutdown_pending )
+            drain_and_exit();
+        if ( reload_pending )
+            reload_config();
+        if ( upgrade_pending )
+            start_upgrade();
+        if ( stats_pending )
+            print_stats();
+    }
     while(1)
     {
-        fd    = accept( sock, NULL, NULL ); /* take a call  */
-        if ( fd == -1 )
+        /* our signals are only let in while we wait here, so one */
+        /* cannot land between the checks below and the wait      */
+        pfd[0].fd = mysocket;
+        pfd[1].fd = tlssocket;
+        pfd[0].events = pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        npfd = tlssocket != -1 ? 2 : 1;
+        ms = TWtimeout(timers);             /* wake for the next deadline */
+        ts.tv_sec  = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        if ( ppoll(pfd, npfd, ms < 0 ? NULL : &ts, &wait_mask) == -1 )
         {
-            if( errno == EINTR)             /* check if intr from sigchld */
-                continue;
-                
-            perror("accept");
+            if ( errno != EINTR )           /* a signal came in */
+                perror("poll");
         }
-        else
-            handle_call(fd);                /* handle call  */
+        for ( i = 0 ; i < npfd ; i++ )      /* [1] is HTTPS */
+        {
+            if ( pfd[i].revents == 0 )
+                continue;                   /* a timer tick, or the other */
+            clen = sizeof(caddr);
+            if ( (fd = accept( pfd[i].fd, (struct sockaddr *) &caddr,
+                                    &clen )) != -1 )
+                admit_call(fd, caddr.sin_addr.s_addr, i);   /* handle call */
+            else if ( errno != EAGAIN && errno != ECONNABORTED )
+                perror("accept");
+        }
+
+        TWadvance(timers);                  /* kill overdue children */
+        if ( shutdown_pending )
+            drain_and_exit();
+        if ( reload_pending )
+            reload_config();
+        if ( upgrade_pending )
+            start_upgrade();
+        if ( stats_pending )
+            print_stats();
     }
     return 0;
     /* never end */
@@ -129,101 +268,643 @@ main(int ac, char *av[])
  *  sigchld_handler()
  *  Purpose: Handle exit statuses from child process to prevent zombies
  *  Note: taken from the 'zombierace' page provided with the assignment
- *        materials for the assignment.
+ *        materials for the assignment. It also crosses the child off
+ *        the table in child.c; SIGCHLD is blocked outside the ppoll()
+ *        in main(), so the table is never caught half updated.
  */
 void
 sigchld_handler(int s)
 {
     int old_errno = errno;
+    pid_t pid;
+    unsigned addr;
+    struct reqtimer *rt;
     
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-        ;
+    while ( (pid = waitpid(-1, NULL, WNOHANG)) > 0 )
+    {
+        if ( pid == upgrade_pid )       /* new binary did not make it */
+        {
+            upgrade_pid = 0;
+            write(2, "upgrade failed\n", 15);
+        }
+        if ( CHremove(pid, &addr, (void **) &rt) )
+        {
+            RLrelease(addr);
+            if ( rt != NULL )
+            {
+                TWcancel(&rt->t);
+                rt->nextfree = free_timers;
+                free_timers = rt;
+            }
+        }
+    }
     errno = old_errno;
 }
 
 /*
- * handle_call(fd) - serve the request arriving on fd
- * summary: fork, then get request, then process request
+ *  sigterm_handler(), sigusr2_handler()
+ *  Purpose: ask main() to drain and exit, or to start a new binary
+ */
+void
+sigterm_handler(int s)
+{
+    shutdown_pending = 1;
+}
+
+void
+sigusr2_handler(int s)
+{
+    upgrade_pending = 1;
+}
+
+/*
+ *  sigusr1_handler(), print_stats()
+ *  Purpose: on SIGUSR1, write the load figures to stderr: requests
+ *           running, and in events mode the fs thread pool's queue
+ *           and latency histograms; and how far the preload has got
+ */
+void
+sigusr1_handler(int s)
+{
+    stats_pending = 1;
+}
+
+void
+print_stats()
+{
+    stats_pending = 0;
+    fprintf(stderr, "%d child(ren), request scan: %s\n", CHcount(), SNkernel());
+    if ( loop != NULL )
+        EVstats(loop, stderr);
+    if ( fspool != NULL )
+        TPstats(fspool, stderr);
+    SMstats(stderr);
+    TLstats(stderr);
+    PXstats(stderr);
+    PLstats(stderr);
+}
+
+/*
+ *  drain_and_exit()
+ *  Purpose: graceful shutdown. Stop accepting, then give the children
+ *           up to drain_timeout seconds to finish their requests.
+ *           Any still running after that are sent SIGTERM.
+ *     Note: connections already queued on the socket but not yet
+ *           accepted are lost, unless a new binary shares the socket
+ */
+void
+drain_and_exit()
+{
+    struct config *conf = CFcurrent();
+    time_t  deadline = time(NULL) + conf->drain_timeout;
+    struct timespec ts;
+
+    CFrelease(conf);
+    if ( loop != NULL )
+        EVsockets(loop, NULL, 0);   /* stop accepting before the close */
+    while ( nlsocks > 0 )
+        close(lsocks[--nlsocks]);
+    mysocket = -1;
+    if ( tlssocket != -1 )
+        close(tlssocket);
+
+    if ( loop != NULL )
+    {
+        fprintf(stderr, "draining %d connection(s)\n", EVcount(loop));
+        while ( EVcount(loop) > 0 && time(NULL) < deadline )
+            EVwait(loop, &wait_mask, (deadline - time(NULL)) * 1000L);
+    }
+    fprintf(stderr, "draining %d request(s)\n", CHcount());
+    while ( CHcount() > 0 && time(NULL) < deadline )
+    {
+        ts.tv_sec = deadline - time(NULL);
+        ts.tv_nsec = 0;
+        ppoll(NULL, 0, &ts, &wait_mask);    /* sigchld ends the wait */
+    }
+    if ( CHcount() > 0 )
+    {
+        fprintf(stderr, "stopping %d request(s)\n", CHcount());
+        CHsignal_all(SIGTERM);
+    }
+    exit(0);
+}
+
+/*
+ *  start_upgrade()
+ *  Purpose: zero-downtime binary upgrade. Fork and exec the wsng
+ *           binary again, with the same args, handing it the
+ *           listening socket by number in WSNG_LISTEN_FD (and the
+ *           HTTPS one in WSNG_TLS_FD); with cpu_steer, every loop's
+ *           socket, in order, as "5,9,10"; and our pid in
+ *           WSNG_OLD_PID. Once the new
+ *           server is up it sends us SIGTERM and we drain as usual;
+ *           until then we keep accepting, so no call is refused.
+ *           If it dies first, sigchld_handler() reports it and we
+ *           carry on.
+ */
+void
+start_upgrade()
+{
+    char    fdstr[MAX_LOOPS * 12];
+    pid_t   pid;
+    int     i, n;
+
+    upgrade_pending = 0;
+    if ( upgrade_pid != 0 )
+    {
+        fprintf(stderr, "upgrade already in progress\n");
+        return;
+    }
+    if ( (pid = fork()) == -1 )
+    {
+        perror("upgrade: fork");
+        return;
+    }
+    if ( pid == 0 )
+    {
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        for ( i = n = 0 ; i < nlsocks ; i++ )
+            n += snprintf(fdstr + n, sizeof(fdstr) - n, "%s%d",
+                          i > 0 ? "," : "", lsocks[i]);
+        setenv("WSNG_LISTEN_FD", fdstr, 1);
+        if ( tlssocket != -1 )
+        {
+            snprintf(fdstr, sizeof(fdstr), "%d", tlssocket);
+            setenv("WSNG_TLS_FD", fdstr, 1);
+        }
+        snprintf(fdstr, sizeof(fdstr), "%d", (int) getppid());
+        setenv("WSNG_OLD_PID", fdstr, 1);
+        execvp(saved_av[0], saved_av);
+        perror(saved_av[0]);
+        _exit(1);
+    }
+    upgrade_pid = pid;
+    fprintf(stderr, "upgrade: started %s as pid %d\n", saved_av[0], pid);
+}
+
+/*
+ *  sighup_handler()
+ *  Purpose: note that the config file should be read again; the
+ *           main loop does the work once the wait is over
+ */
+void
+sighup_handler(int s)
+{
+    reload_pending = 1;
+}
+
+/*
+ *  reload_config()
+ *  Purpose: read the config file into a new snapshot and switch new
+ *           requests over to it. Children already running keep the
+ *           snapshot they were forked with.
+ *     Note: a listening socket is only remade if its port changed.
+ *           The TLS context is made again, for a new certificate.
+ *           Any error keeps the old config and socket as they were.
+ */
+void
+reload_config()
+{
+    struct config *old = CFcurrent();
+    struct config *new;
+    int     sock, socks[MAX_LOOPS], n;
+
+    reload_pending = 0;
+    if ( (new = process_config_file(old->file)) == NULL )
+    {
+        fprintf(stderr, "reload of %s failed, config unchanged\n",
+                old->file);
+        CFrelease(old);
+        return;
+    }
+    if ( loop == NULL && new->tls_port > 0 && TLinit(new) != 0 )
+    {
+        fprintf(stderr, "reload: tls settings rejected, config unchanged\n");
+        CFrelease(new);
+        CFrelease(old);
+        return;
+    }
+    if ( PXinit(new) != 0 )         /* the first upstreams, maybe */
+        perror("reload: proxy");
+    TRopen(new);                    /* and let a rotated log go */
+    if ( loop == NULL && new->tls_port != old->tls_port )
+    {
+        sock = -1;
+        if ( new->tls_port > 0
+          && (sock = make_server_socket(new->tls_port)) == -1 )
+        {
+            perror("reload: making tls socket");
+            CFrelease(new);
+            CFrelease(old);
+            return;
+        }
+        if ( sock != -1 )
+            fcntl(sock, F_SETFL, O_NONBLOCK);
+        if ( tlssocket != -1 )
+            close(tlssocket);
+        tlssocket = sock;
+    }
+    if ( new->port != old->port )
+    {
+        if ( (n = listen_sockets(new, socks, 0)) == -1 )
+        {
+            perror("reload: making socket");
+            CFrelease(new);
+            CFrelease(old);
+            return;
+        }
+        if ( loop != NULL )
+            EVsockets(loop, socks, n);
+        while ( nlsocks > 0 )
+            close(lsocks[--nlsocks]);
+        memcpy(lsocks, socks, n * sizeof(int));
+        nlsocks = n;
+        mysocket = lsocks[0];
+        myport = new->port;
+    }
+    if ( new->events != old->events || new->loop_threads != old->loop_threads
+      || new->shm_cache != old->shm_cache || new->tls_cache != old->tls_cache )
+        fprintf(stderr, "reload: mode, loop_threads, shm_cache and tls_cache "
+                        "take effect on restart\n");
+    if ( new->ncpus != old->ncpus || new->cpu_steer != old->cpu_steer
+      || new->busy_poll != old->busy_poll
+      || (new->ncpus > 0
+          && memcmp(new->cpus, old->cpus, new->ncpus * sizeof(int)) != 0) )
+        fprintf(stderr, "reload: cpu_affinity, cpu_steer and busy_poll "
+                        "take effect on restart\n");
+    RLinit(new->max_per_ip, new->rate_limit, new->rate_burst);
+    CFinstall(new);
+    CFrelease(old);
+    fprintf(stderr, "reloaded %s, port=%d\n", new->file, myport);
+}
+
+/*
+ *  admit_call()
+ *  Purpose: apply the connection limits to a call from addr before
+ *           forking for it: max_conns children in all, then the
+ *           per-client limits in ratelimit.c. A refused call gets a
+ *           short error reply from the parent, with no fork. tls is
+ *           1 for a call on the HTTPS socket
+ */
+void
+admit_call(int fd, unsigned addr, int tls)
+{
+    struct config *conf = CFcurrent();
+    int     code;
+
+    if ( conf->max_conns > 0 && CHcount() >= conf->max_conns )
+        code = 503;
+    else
+        code = RLadmit(addr);
+    CFrelease(conf);
+
+    if ( code != 0 && ! tls )
+        refuse_call(fd, code);
+    else if ( code != 0 )
+        close(fd);                  /* no plain text reply to give */
+    else if ( handle_call(fd, addr, tls) == -1 )
+        RLrelease(addr);
+}
+
+/*
+ *  refuse_call()
+ *  Purpose: shed a call with a canned reply, never blocking the
+ *           parent. The request is read first (as far as it has
+ *           arrived) so that closing does not reset the connection
+ *           before the client sees the reply.
+ */
+void
+refuse_call(int fd, int code)
+{
+    char    buf[MAX_RQ_LEN];
+    char    *reply;
+
+    if ( code == 429 )
+        reply = "HTTP/1.0 429 Too Many Requests\r\n"
+                "Retry-After: 1\r\nContent-Type: text/plain\r\n\r\n"
+                "Too many requests, slow down\r\n";
+    else
+        reply = "HTTP/1.0 503 Service Unavailable\r\n"
+                "Retry-After: 1\r\nContent-Type: text/plain\r\n\r\n"
+                "The server is busy, try again\r\n";
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    while ( read(fd, buf, sizeof(buf)) > 0 )
+        ;
+    if ( write(fd, reply, strlen(reply)) == -1 )
+        ;                           /* nothing more we can do */
+    close(fd);
+}
+
+/*
+ *  sigalrm_handler()
+ *  Purpose: the client did not send its headers in time; tell it so
+ *           and end the child. Only async-signal-safe calls here.
+ */
+int client_fd = -1;     /* the child's connection, for the handler */
+
+void
+sigalrm_handler(int s)
+{
+    static char reply[] = "HTTP/1.0 408 Request Timeout\r\n"
+                          "Content-Type: text/plain\r\n\r\n"
+                          "Request headers took too long\r\n";
+
+    if ( write(client_fd, reply, sizeof(reply) - 1) == -1 )
+        ;
+    _exit(1);
+}
+
+/*
+ *  new_reqtimer()
+ *  Purpose: get a child deadline off the free list, or a new one
+ */
+struct reqtimer *
+new_reqtimer()
+{
+    struct reqtimer *rt = free_timers;
+
+    if ( rt != NULL )
+        free_timers = rt->nextfree;
+    else if ( (rt = calloc(1, sizeof(struct reqtimer))) == NULL )
+        return NULL;
+    return rt;
+}
+
+/*
+ *  request_expired()
+ *  Purpose: a child ran past request_timeout; stop it and anything it
+ *           started. Its timer goes back when the SIGCHLD comes in.
+ */
+void
+request_expired(struct twtimer *t, void *arg)
+{
+    struct reqtimer *rt = arg;
+
+    fprintf(stderr, "request %d timed out\n", rt->pid);
+    kill(-rt->pid, SIGKILL);
+}
+
+/*
+ * handle_call(fd, addr, tls) - serve the request arriving on fd
+ * summary: fork, then get request, then process request; for tls,
+ *          the handshake comes first (tls.c)
  *    rets: child exits with 1 for error, 0 for ok
+ *          parent returns -1 if it could not fork, else 0
  *    note: closes fd in parent
+ *    note: the child has header_timeout seconds to read the whole
+ *          request, so a client trickling bytes cannot hold it;
+ *          a send that stalls for send_timeout fails; and the parent
+ *          kills the child (and its CGI) after request_timeout
  */
-void handle_call(int fd)
+int handle_call(int fd, unsigned addr, int tls)
 {
-    int     pid = fork();
-    FILE    *fpin, *fpout;
+    int     pid;
+    struct reply rp;
     char    request[MAX_RQ_LEN];
-
+    char    host[HOST_LEN];
+    char    head[MAX_RQ_LEN], *hend;
+    int     hlen, how;
+    struct vhost *vh;
+    struct config *conf = CFcurrent();  /* the child's copy stays valid */
+    struct timeval tv;
+    struct trace tr;
+
+    TRstart(&tr, addr);             /* for the log: the fork and on */
+    pid = fork();
     if ( pid == -1 ){
         perror("fork");
-        return;
+        CFrelease(conf);
+        close(fd);
+        return -1;
     }
 
     /* child: buffer socket and talk with client */
     if ( pid == 0 )
     {
-        fpin  = fdopen(fd, "r");
-        fpout = fdopen(fd, "w");
-        if ( fpin == NULL || fpout == NULL )
+        /* a reload is the parent's business; don't let a */
+        /* SIGHUP to the process group cut this request    */
+        signal(SIGHUP, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        setpgid(0, 0);      /* so a stop reaches any CGI children */
+        TRmark(&tr, TR_FORK);
+        CPincoming(fd, conf);   /* cpu_affinity: where it came in */
+
+        tv.tv_sec  = conf->send_timeout;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        signal(SIGALRM, sigalrm_handler);
+        alarm(conf->header_timeout);    /* for the handshake too */
+        if ( tls && (fd = TLaccept(fd, conf->h2_streams > 0)) == -1 )
+            exit(1);
+        alarm(conf->header_timeout);    /* maybe in a new child */
+        RPinit(&rp, fd);
+        rp.trace = &tr;
+        client_fd = fd;
+        switch ( read_request(fd, head, &hend, &hlen, request, MAX_RQ_LEN,
+                              host, HOST_LEN) )
+        {
+        case -1:
+            exit(1);
+        case 1:
+            bad_request(&rp);       /* headers too big */
+            RPflush(&rp);
+            TRmark(&tr, TR_LAST);
+            TRlog(&tr, head, head + MAX_RQ_LEN, rp.sent);
             exit(1);
+        }
+        alarm(0);
+        TRmark(&tr, TR_HEAD);
+        printf("got a call: request = %s\n", request);
+
+        /* HTTP/2, if the client starts it or asks for it (h2.c) */
+        how = H2wants(request, head, hend);
+        if ( how != 0 && conf->h2_streams > 0 )
+        {
+            H2serve(fd, how, head, hend, hlen, addr, conf);
+            exit(0);
+        }
+        if ( how == H2_PRIOR )
+        {
+            H2refuse(&rp);
+            RPflush(&rp);
+            exit(0);
+        }
 
-        if ( read_request(fpin, request, MAX_RQ_LEN) == -1 )
+        /* pick the site by Host:, and run CGIs from its root */
+        vh = VHlookup(conf->hosts, host[0] ? host : NULL);
+        if ( vh->rootfd != -1 && fchdir(vh->rootfd) == -1 )
             exit(1);
-        printf("got a call: request = %s", request);
 
-        process_rq(request, fpout);
-        fflush(fpout);      /* send data to client  */
+        process_rq(request, head, hend, head + hlen, vh, &rp);
+        RPflush(&rp);       /* send data to client  */
+        TRmark(&tr, TR_LAST);
+        TRlog(&tr, head, hend, rp.sent);
         exit(0);            /* child is done    */
                             /* exit closes files    */
     }
     /* parent: close fd and return to take next call    */
+    track_child(pid, addr, conf);
+    CFrelease(conf);
     close(fd);
+    return 0;
+}
+
+/*
+ *  track_child()
+ *  Purpose: the parent's side of a new child serving addr: put it in
+ *           its own process group, start its request_timeout, and
+ *           enter it in the child table. Its SIGCHLD undoes all this
+ *           and frees addr's place in the connection limits.
+ */
+void
+track_child(pid_t pid, unsigned addr, struct config *conf)
+{
+    struct reqtimer *rt = NULL;
+
+    setpgid(pid, pid);      /* both sides set it, to win the race */
+    if ( conf->request_timeout > 0 && (rt = new_reqtimer()) != NULL )
+    {
+        rt->pid = pid;
+        TWadd(timers, &rt->t, conf->request_timeout * 1000L,
+              request_expired, rt);
+    }
+    if ( CHadd(pid, addr, rt) != 0 )
+        fprintf(stderr, "child table full, cannot track %d\n", pid);
 }
 
 /*
- * read the http request into rq not to exceed rqlen
- * return -1 for error, 0 for success
+ * read the request head from fd into buf (MAX_RQ_LEN bytes), up to
+ * the blank line, and pick out the request line (into rq) and the
+ * Host: value (into host, or ""); *endp is set to the head's end,
+ * and *lenp to the bytes read, which may go past it
+ * return -1 for EOF or error, 1 if the head is more than MAX_RQ_LEN,
+ * 0 for success
  */
-int read_request(FILE *fp, char rq[], int rqlen)
+int read_request(int fd, char buf[], char **endp, int *lenp, char rq[],
+                 int rqlen, char host[], int hostlen)
 {
-    /* null means EOF or error. Either way there is no request */
-    if ( readline(rq, rqlen, fp) == NULL )
+    char    *end = NULL;
+    int     len = 0, from, n;
+
+    while ( end == NULL )
+    {
+        if ( len == MAX_RQ_LEN )
+            return 1;
+        n = read(fd, buf + len, MAX_RQ_LEN - len);
+        if ( n == -1 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            break;                  /* EOF: take what came */
+        from = len > 3 ? len - 3 : 0;   /* the blank line may straddle */
+        len += n;
+        end = SNhead_end(buf + from, buf + len);
+    }
+    if ( len == 0 )
         return -1;
-    read_til_crnl(fp);
+    *endp = end ? end : buf + len;
+    *lenp = len;
+    parse_head(buf, *endp, rq, rqlen, host, hostlen);
     return 0;
 }
 
-void read_til_crnl(FILE *fp)
+/*
+ * parse_head -- pick the request line and the Host: value out of the
+ *   request head in buf..end. Every delimiter (line end, ':', blanks)
+ *   is found with SNany(), which scans a vector at a time
+ *   rq gets the request line without its line end; a second Host:
+ *   line wins, as before
+ */
+void parse_head(char *buf, char *end, char rq[], int rqlen,
+                char host[], int hostlen)
 {
-        char    buf[MAX_RQ_LEN];
-        while( readline(buf,MAX_RQ_LEN,fp) != NULL 
-            && strcmp(buf,"\r\n") != 0 )
-                ;
+    char    *line, *eol, *colon, *val, *stop;
+
+    host[0] = '\0';
+    if ( (eol = SNany(buf, end, "\n")) == NULL )
+        eol = end;
+    copy_field(rq, rqlen, buf, eol);
+    for ( line = eol + 1 ; line < end ; line = eol + 1 )
+    {
+        if ( (eol = SNany(line, end, "\n")) == NULL )
+            eol = end;
+        if ( (colon = SNany(line, eol, ":")) == NULL
+          || colon - line != 4 || strncasecmp(line, "Host", 4) != 0 )
+            continue;
+        for ( val = colon + 1 ; val < eol && (*val == ' ' || *val == '\t') ; val++ )
+            ;
+        if ( (stop = SNany(val, eol, " \t\r")) == NULL )
+            stop = eol;
+        copy_field(host, hostlen, val, stop);
+    }
 }
 
 /*
- * readline -- read in a line from fp, stop at \n 
- *    args: buf - place to store line
- *          len - size of buffer
- *          fp  - input stream
- *    rets: NULL at EOF else the buffer
- *    note: will not overflow buffer, but will read until \n or EOF
- *          thus will lose data if line exceeds len-2 chars
- *    note: like fgets but will always read until \n even if it loses data
+ * head_field -- the value of the header name in the request head
+ *   buf..end, into dst (size len); "" if there is none. The last
+ *   one wins, as with Host:
  */
-char *readline(char *buf, int len, FILE *fp)
+void head_field(char *buf, char *end, char *name, char dst[], int len)
 {
-        int     space = len - 2;
-        char    *cp = buf;
-        int     c;
+    char    *line, *eol, *colon, *val;
+    int     nlen = strlen(name);
 
-        while( ( c = getc(fp) ) != '\n' && c != EOF ){
-            if ( space-- > 0 )
-                *cp++ = c;
-        }
-        if ( c == '\n' )
-            *cp++ = c;
-        *cp = '\0';
-        return ( c == EOF && cp == buf ? NULL : buf );
+    dst[0] = '\0';
+    if ( (eol = SNany(buf, end, "\n")) == NULL )
+        return;
+    for ( line = eol + 1 ; line < end ; line = eol + 1 )
+    {
+        if ( (eol = SNany(line, end, "\n")) == NULL )
+            eol = end;
+        if ( (colon = SNany(line, eol, ":")) == NULL
+          || colon - line != nlen || strncasecmp(line, name, nlen) != 0 )
+            continue;
+        for ( val = colon + 1 ; val < eol && (*val == ' ' || *val == '\t') ; val++ )
+            ;
+        copy_field(dst, len, val, eol);
+    }
+}
+
+/*
+ * split_request -- the first two words of the request line, as
+ *   sscanf("%s%s") would find them; either is cut to fit its buffer
+ *   returns how many words were found
+ */
+int split_request(char *rq, char method[], int mlen, char arg[], int alen)
+{
+    char    *end = rq + strlen(rq);
+    char    *p = rq, *q;
+
+    for ( ; p < end && (*p == ' ' || *p == '\t') ; p++ )
+        ;
+    if ( p == end )
+        return 0;
+    if ( (q = SNany(p, end, " \t")) == NULL )
+        q = end;
+    copy_field(method, mlen, p, q);
+    for ( p = q ; p < end && (*p == ' ' || *p == '\t') ; p++ )
+        ;
+    if ( p == end )
+        return 1;
+    if ( (q = SNany(p, end, " \t")) == NULL )
+        q = end;
+    copy_field(arg, alen, p, q);
+    return 2;
+}
+
+/*
+ * copy_field -- copy from..to into dst (size len) as a string,
+ *   leaving off a trailing \r and whatever does not fit
+ */
+void copy_field(char *dst, int len, char *from, char *to)
+{
+    if ( to > from && to[-1] == '\r' )
+        to--;
+    if ( to - from > len - 1 )
+        to = from + len - 1;
+    memcpy(dst, from, to - from);
+    dst[to - from] = '\0';
 }
 /*
  * initialization function
@@ -231,7 +912,7 @@ char *readline(char *buf, int len, FILE *fp)
  *      handles -c configfile
  *  2. open config file
  *      read rootdir, port
- *  3. chdir to rootdir
+ *  3. open the rootdirs
  *  4. open a socket on port
  *  5. gets the hostname
  *  6. return the socket
@@ -241,14 +922,22 @@ char *readline(char *buf, int len, FILE *fp)
  *  returns: socket as the return value
  *       the host by writing it into host[]
  *       the port by writing it into *portnump
+ *       and sets wait_mask, the signal mask to wait for calls with
+ *
+ *  if WSNG_LISTEN_FD is set, we are a new binary taking over from
+ *  the old one: use those sockets, and tell our parent to drain,
+ *  if it is the old server named in WSNG_OLD_PID (the variable may
+ *  have been inherited, or set by hand, by whatever started us).
  */
 int startup(int ac, char *av[], char host[], int *portnump)
 {
     int sock;
-    int portnum = PORTNUM;
     char *configfile = CONFIG_FILE ;
+    char *fullpath;
     int pos;
-    void process_config_file(char *, int *);
+    struct config *conf;
+    struct sigaction sa;
+    sigset_t ours;
     void done(int);
 
     signal(SIGINT, done);
@@ -260,42 +949,241 @@ int startup(int ac, char *av[], char host[], int *portnump)
                 fatal("missing arg for -c",NULL);
         }
     }
-    process_config_file(configfile, &portnum);
+    /* remember the full path, so a reload finds the same file */
+    if ( (fullpath = realpath(configfile, NULL)) == NULL )
+        fatal("Cannot open config file %s\n", configfile);
+    if ( (conf = process_config_file(fullpath)) == NULL )
+        exit(1);
+    free(fullpath);
+    if ( DCinit(conf->index_cache) != 0 )   /* shared by all children */
+        perror("index cache");
+    SNinit();                           /* SIMD request scanning */
+    if ( FCinit() != 0 )                /* event loops' file cache */
+        perror("file cache");
+    if ( ! conf->events && SMinit(conf->shm_cache) != 0 )
+        perror("shm cache");            /* shared by all children */
+    if ( conf->cgi_ttl > 0 && (conf->events || conf->shm_cache <= 0) )
+        fprintf(stderr, "cgi_cache is kept in shm_cache, in fork mode only\n");
+    if ( PXinit(conf) != 0 )            /* before the loops' threads */
+        perror("proxy");
+    TRopen(conf);                       /* access_log, slow_log */
+    CPpin_all(conf);                    /* cpu_affinity: what we start */
+    PLstart(conf);                      /* warm the caches, meanwhile */
             
-    sock = make_server_socket( portnum );
-    if ( sock == -1 ) 
+    nlsocks = inherited_sockets("WSNG_LISTEN_FD", lsocks, MAX_LOOPS);
+    if ( (nlsocks = listen_sockets(conf, lsocks, nlsocks)) == -1 )
         oops("making socket",2);
+    sock = lsocks[0];
+    if ( conf->tls_port > 0 && conf->events )
+        fprintf(stderr, "tls_port is served in fork mode only\n");
+    else if ( conf->tls_port > 0 )      /* HTTPS, see tls.c */
+    {
+        if ( TLinit(conf) != 0 )
+            exit(1);
+        if ( inherited_sockets("WSNG_TLS_FD", &tlssocket, 1) == 0 )
+            tlssocket = make_server_socket( conf->tls_port );
+        if ( tlssocket == -1 )
+            oops("making tls socket",2);
+        fcntl(tlssocket, F_SETFL, O_NONBLOCK);
+    }
     strcpy(myhost, full_hostname());
-    *portnump = portnum;
-    
-    signal(SIGCHLD, sigchld_handler);   /* handler for zombies */
+    *portnump = conf->port;
+    if ( RLinit(conf->max_per_ip, conf->rate_limit, conf->rate_burst) != 0 )
+        oops("client table", 1);
+    if ( (timers = TWnew(TICK_MS)) == NULL )
+        oops("timer wheel", 1);
+    CFinstall(conf);
+
+    /* our signals stay blocked except while main() waits for calls */
+    sigemptyset(&ours);
+    sigaddset(&ours, SIGCHLD);
+    sigaddset(&ours, SIGHUP);
+    sigaddset(&ours, SIGTERM);
+    sigaddset(&ours, SIGUSR2);
+    sigaddset(&ours, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &ours, &wait_mask);
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sigchld_handler;    /* handler for zombies */
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_flags = 0;
+    sa.sa_handler = sighup_handler;     /* reload */
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigterm_handler;    /* drain and exit */
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = sigusr2_handler;    /* binary upgrade */
+    sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_handler = sigusr1_handler;    /* print load figures */
+    sigaction(SIGUSR1, &sa, NULL);
+
+    /* mode events: one process, an event loop, and fs threads */
+    if ( conf->events )
+    {
+        if ( conf->fs_threads > 0
+          && (fspool = TPnew(conf->fs_threads, conf->fs_queue)) == NULL )
+            perror("fs threads");       /* the loop does it all then */
+        if ( (loop = EVnew(sock, fspool, timers)) == NULL )
+            oops("event loop", 1);
+        if ( conf->loop_threads > 1
+          && EVthreads(loop, conf->loop_threads, TICK_MS) < conf->loop_threads )
+            perror("loop threads");     /* serve with what started */
+        if ( nlsocks > 1 )              /* cpu_steer: a socket each */
+            EVsockets(loop, lsocks, nlsocks);
+    }
+
+    /* taking over from an old binary: it can stop accepting now */
+    if ( getenv("WSNG_LISTEN_FD") != NULL )
+    {
+        char    *old = getenv("WSNG_OLD_PID");
+
+        if ( old != NULL && atoi(old) == getppid() )
+            kill(getppid(), SIGTERM);
+        else
+            fprintf(stderr, "upgrade: parent is not the old server, "
+                            "not stopping it\n");
+        unsetenv("WSNG_LISTEN_FD");
+        unsetenv("WSNG_TLS_FD");
+        unsetenv("WSNG_OLD_PID");
+    }
     
     return sock;
 }
 
+/*
+ * inherited_sockets(var, socks, max)
+ * puts the listening sockets named by var (WSNG_LISTEN_FD, "5" or
+ * "5,9,10") in socks, up to max of them; returns how many, 0 if there
+ * are none or the first is not a socket
+ */
+int
+inherited_sockets(char *var, int *socks, int max)
+{
+    char    *s = getenv(var);
+    int     n = 0, type;
+    socklen_t len = sizeof(type);
+
+    while ( s != NULL && n < max )
+    {
+        socks[n] = atoi(s);
+        if ( getsockopt(socks[n], SOL_SOCKET, SO_TYPE, &type, &len) == -1 )
+        {
+            perror(var);
+            break;
+        }
+        n++;
+        if ( (s = strchr(s, ',')) != NULL )
+            s++;
+    }
+    return n;
+}
 
 /*
- * opens file or dies
+ * listen_sockets(conf, socks, n)
+ * makes the listening sockets conf asks for, after the n in socks
+ * already (inherited, in order): one, or with cpu_steer in events
+ * mode a SO_REUSEPORT socket per loop, steered by CPU (cpu.c). Any
+ * inherited beyond that are closed. They are left non-blocking, and
+ * busy polled with busy_poll.
+ * returns how many are in socks, or -1
+ */
+int
+listen_sockets(struct config *conf, int *socks, int n)
+{
+    int     want = 1, i, s;
+
+    if ( conf->events && conf->cpu_steer && conf->loop_threads > 1 )
+        want = conf->loop_threads;
+    if ( n == 0 )
+    {
+        if ( want > 1 )
+            s = make_shared_socket( conf->port );
+        else
+            s = make_server_socket( conf->port );
+        if ( s == -1 )
+            return -1;
+        socks[n++] = s;
+    }
+    while ( n < want )
+    {
+        if ( (s = make_shared_socket( conf->port )) == -1 )
+        {
+            perror("cpu_steer: a socket per loop");   /* one shared, then */
+            break;
+        }
+        socks[n++] = s;
+    }
+    while ( n > want )
+        close(socks[--n]);
+    if ( n == want && n > 1 )
+        CPsteer(socks, n, conf);
+    for ( i = 0 ; i < n ; i++ )
+    {
+        fcntl(socks[i], F_SETFL, O_NONBLOCK);   /* poll says when to accept */
+        CPbusy_poll(socks[i], conf->busy_poll);
+    }
+    return n;
+}
+
+
+/*
+ * opens file and builds a new config snapshot from it
  * reads file for lines with the format
  *   port ###
  *   server_root path
- * at the end, return the portnum by loading *portnump
- * and chdir to the rootdir
+ *   vhost name [alias]
+ * lines after a vhost line, up to the next one, set up that vhost
+ * at the end, open every vhost root (relative paths are taken
+ * from the directory wsng was started in)
+ * returns the snapshot, or NULL after printing why not
  */
-void process_config_file(char *conf_file, int *portnump)
+struct config *process_config_file(char *conf_file)
 {
     FILE *fp;
     char rootdir[VALUE_LEN] = SERVER_ROOT;
     char param[PARAM_LEN];
     char value[VALUE_LEN];
     char type[CONTENT_LEN];
-    int port;
     int read_param(FILE *, char *, int, char *, int, char *, int, int* );
     int params_read;
+    int bad = 0;
+    struct config *conf = CFnew(conf_file);
+    struct vhost *dflt;
+    struct vhost *vh = NULL;        /* NULL outside a vhost section */
+
+    if ( conf == NULL )
+    {
+        perror("config");
+        return NULL;
+    }
+    conf->port = PORTNUM;
+    conf->index_cache = INDEX_CACHE;
+    conf->drain_timeout = DRAIN_TIMEOUT;
+    conf->max_conns = MAX_CONNS;
+    conf->max_per_ip = MAX_PER_IP;
+    conf->header_timeout = HEADER_TIMEOUT;
+    conf->send_timeout = SEND_TIMEOUT;
+    conf->request_timeout = REQUEST_TIMEOUT;
+    conf->fs_threads = FS_THREADS;
+    conf->fs_queue = FS_QUEUE;
+    conf->loop_threads = LOOP_THREADS;
+    conf->h2_streams = H2_STREAMS;
+    conf->tls_cache = TL_CACHE;
+    conf->tls_tickets = 1;
+    conf->proxy_keepalive = PX_KEEPALIVE;
+    conf->proxy_fails = PX_FAILS;
+    conf->proxy_fail_time = PX_FAILTIME;
+    conf->proxy_connect = PX_CONNECT;
+    conf->slow_ms = TR_SLOW;
+    dflt = VHdefault(conf->hosts);
 
     /* open the file */
     if ( (fp = fopen(conf_file,"r")) == NULL )
-        fatal("Cannot open config file %s", conf_file);
+    {
+        fprintf(stderr, "Cannot open config file %s\n", conf_file);
+        CFrelease(conf);
+        return NULL;
+    }
 
     /* extract the settings */
     while( read_param(fp, param, PARAM_LEN,
@@ -303,32 +1191,152 @@ void process_config_file(char *conf_file, int *portnump)
                           type, CONTENT_LEN,
                           &params_read) != EOF )
     {
-        if ( strcasecmp(param,"server_root") == 0 )
+        if ( strcasecmp(param,"vhost") == 0 )
+            bad |= process_config_vhost(value, type, &params_read,
+                                        conf, &vh);
+        else if ( strcasecmp(param,"server_root") == 0 && vh != NULL )
+            vh->root = strdup(value);
+        else if ( strcasecmp(param,"server_root") == 0 )
             strcpy(rootdir, value);
         if ( strcasecmp(param,"port") == 0 )
-            port = atoi(value);
+            conf->port = atoi(value);
         if ( strcasecmp(param,"type") == 0)
-            process_config_type(param, value, type, &params_read);
+            process_config_type(param, value, type, &params_read,
+                                vh ? vh : dflt);
+        if ( strcasecmp(param,"index") == 0 )
+            VHindex(vh ? vh : dflt, value);
+        if ( strcasecmp(param,"pack") == 0 )
+            (vh ? vh : dflt)->packfile = strdup(value);
+        if ( strcasecmp(param,"cache_size") == 0 )
+            (vh ? vh : dflt)->cache_size = atol(value);
+        if ( strcasecmp(param,"index_cache") == 0 )
+            conf->index_cache = atoi(value);
+        if ( strcasecmp(param,"shm_cache") == 0 )
+            conf->shm_cache = atol(value);
+        if ( strcasecmp(param,"drain_timeout") == 0 )
+            conf->drain_timeout = atoi(value);
+        if ( strcasecmp(param,"max_conns") == 0 )
+            conf->max_conns = atoi(value);
+        if ( strcasecmp(param,"max_per_ip") == 0 )
+            conf->max_per_ip = atoi(value);
+        if ( strcasecmp(param,"header_timeout") == 0 )
+            conf->header_timeout = atoi(value);
+        if ( strcasecmp(param,"send_timeout") == 0 )
+            conf->send_timeout = atoi(value);
+        if ( strcasecmp(param,"request_timeout") == 0 )
+            conf->request_timeout = atoi(value);
+        if ( strcasecmp(param,"mode") == 0 )
+            conf->events = strcasecmp(value, "events") == 0;
+        if ( strcasecmp(param,"fs_threads") == 0 )
+            conf->fs_threads = atoi(value);
+        if ( strcasecmp(param,"fs_queue") == 0 )
+            conf->fs_queue = atoi(value);
+        if ( strcasecmp(param,"loop_threads") == 0 )
+        {
+            conf->loop_threads = atoi(value);
+            if ( conf->loop_threads > MAX_LOOPS )
+                conf->loop_threads = MAX_LOOPS;
+        }
+        if ( strcasecmp(param,"http2_streams") == 0 )
+            conf->h2_streams = atoi(value);
+        if ( strcasecmp(param,"tls_port") == 0 )
+            conf->tls_port = atoi(value);
+        if ( strcasecmp(param,"tls_cert") == 0 )
+            conf->tls_cert = strdup(value);
+        if ( strcasecmp(param,"tls_key") == 0 )
+            conf->tls_key = strdup(value);
+        if ( strcasecmp(param,"tls_ciphers") == 0 )
+            conf->tls_ciphers = strdup(value);
+        if ( strcasecmp(param,"tls_ciphersuites") == 0 )
+            conf->tls_suites = strdup(value);
+        if ( strcasecmp(param,"tls_cache") == 0 )
+            conf->tls_cache = atoi(value);
+        if ( strcasecmp(param,"tls_tickets") == 0 )
+            conf->tls_tickets = strcasecmp(value, "off") != 0;
+        if ( strcasecmp(param,"upstream") == 0 )
+            bad |= PXupstream(&conf->upstreams, value,
+                              params_read == 3 ? type : NULL);
+        if ( strcasecmp(param,"proxy_pass") == 0 )
+            bad |= PXroute(&(vh ? vh : dflt)->proxy, conf->upstreams, value,
+                           params_read == 3 ? type : NULL);
+        if ( strcasecmp(param,"proxy_balance") == 0 )
+            bad |= PXbalance(conf->upstreams, value,
+                             params_read == 3 ? type : NULL);
+        if ( strcasecmp(param,"proxy_keepalive") == 0 )
+            conf->proxy_keepalive = atoi(value);
+        if ( strcasecmp(param,"proxy_connect_timeout") == 0 )
+            conf->proxy_connect = atoi(value);
+        if ( strcasecmp(param,"proxy_fails") == 0 )
+        {
+            conf->proxy_fails = atoi(value);
+            if ( params_read == 3 )
+                conf->proxy_fail_time = atoi(type);
+        }
+        if ( strcasecmp(param,"access_log") == 0 )
+            conf->access_log = strdup(value);
+        if ( strcasecmp(param,"slow_log") == 0 )
+        {
+            conf->slow_log = strdup(value);
+            if ( params_read == 3 )
+                conf->slow_ms = atoi(type);
+        }
+        if ( strcasecmp(param,"cpu_affinity") == 0 )
+            bad |= CPparse(conf, value);
+        if ( strcasecmp(param,"cpu_steer") == 0 )
+            conf->cpu_steer = strcasecmp(value, "on") == 0;
+        if ( strcasecmp(param,"busy_poll") == 0 )
+            conf->busy_poll = atoi(value);
+        if ( strcasecmp(param,"preload") == 0 )
+            conf->preload = strdup(value);
+        if ( strcasecmp(param,"preload_log") == 0 )
+            conf->preload_log = strdup(value);
+        if ( strcasecmp(param,"preload_top") == 0 )
+        {
+            conf->preload_top = atoi(value);
+            if ( conf->preload_top > PL_MAX )
+                conf->preload_top = PL_MAX;
+        }
+        if ( strcasecmp(param,"cgi_cache") == 0 )
+        {
+            conf->cgi_ttl = atoi(value);
+            conf->cgi_stale = (params_read == 3) ? atoi(type) : 0;
+        }
+        if ( strcasecmp(param,"rate_limit") == 0 )
+        {
+            conf->rate_limit = atoi(value);
+            conf->rate_burst = (params_read == 3) ? atoi(type) : 0;
+        }
     }
     fclose(fp);
 
     /* act on the settings */
-    if (chdir(rootdir) == -1)
-        oops("cannot change to rootdir", 2);
-    *portnump = port;
-    return;
+    dflt->root = strdup(rootdir);
+    if ( dflt->nindex == 0 )        // the traditional pair
+    {
+        VHindex(dflt, "index.html");
+        VHindex(dflt, "index.cgi");
+    }
+    if ( bad || VHopen_roots(conf->hosts) != 0 )
+    {
+        fprintf(stderr, "Cannot use config file %s\n", conf_file);
+        CFrelease(conf);
+        return NULL;
+    }
+    return conf;
 }
 
 /*
  *  process_config_type()
  *  Purpose: Store a name=value pair of extension=Content-Type
+ *           for vh; the default host's types are the global table
  *   Errors: If the num is not equal to three, the config file was
  *           setup wrong, or there was an error with read_param.
  */
 void process_config_type(char param[PARAM_LEN],
                          char val[VALUE_LEN],
                          char type[CONTENT_LEN],
-                         int *num)
+                         int *num,
+                         struct vhost *vh)
 {
     if (*num != 3)
     {
@@ -336,7 +1344,35 @@ void process_config_type(char param[PARAM_LEN],
         return;
     }
 
-    VLstore(val, type);
+    VHtype(vh, val, type);
+}
+
+/*
+ *  process_config_vhost()
+ *  Purpose: Start a new vhost section named val, with an optional
+ *           alias in the third column. *vhp is set to the new host
+ *           so that the lines that follow configure it.
+ *   Return: 0 if ok, 1 for a duplicate or unstorable name, which
+ *           makes process_config_file() reject the whole file.
+ */
+int process_config_vhost(char val[VALUE_LEN],
+                         char alias[CONTENT_LEN],
+                         int *num,
+                         struct config *conf,
+                         struct vhost **vhp)
+{
+    if ( (*vhp = VHnew(conf->hosts, val)) == NULL )
+    {
+        fprintf(stderr, "Cannot add vhost %s\n", val);
+        *vhp = VHdefault(conf->hosts);
+        return 1;
+    }
+    if ( *num == 3 && VHalias(conf->hosts, *vhp, alias) != 0 )
+    {
+        fprintf(stderr, "Cannot add vhost alias %s\n", alias);
+        return 1;
+    }
+    return 0;
 }
 
 /*
@@ -360,7 +1396,7 @@ read_param (FILE *fp,
     int c;
     char fmt[100] ;
 
-    sprintf(fmt, "%%%ds%%%ds%%%ds", nlen, vlen, clen);
+    sprintf(fmt, "%%%ds%%%ds%%%ds", nlen - 1, vlen - 1, clen - 1);
 
     /* read in next line and if the line is too long, read until \n */
     while( fgets(line, LINELEN, fp) != NULL )
@@ -383,18 +1419,33 @@ read_param (FILE *fp,
 
 
 /* ------------------------------------------------------ *
-   process_rq( char *rq, FILE *fpout)
-   do what the request asks for and write reply to fp
+   process_rq( char *rq, char *head, char *end, char *last,
+               struct vhost *vh, struct reply *rp)
+   do what the request asks for and queue the reply on rp
    rq is HTTP command:  GET /foo/bar.html HTTP/1.0
+   head..end is the whole request head, end..last any body
+   read with it
    ------------------------------------------------------ */
 
-void process_rq(char *rq, FILE *fp)
+void process_rq(char *rq, char *head, char *end, char *last,
+                struct vhost *vh, struct reply *rp)
 {
     char    cmd[MAX_RQ_LEN], arg[MAX_RQ_LEN];
     char    *item, *modify_argument();
+    struct stat info;
+    struct pxroute *route;
+    int     fd;
 
-    if ( sscanf(rq, "%s%s", cmd, arg) != 2 ){
-        bad_request(fp);
+    if ( split_request(rq, cmd, sizeof(cmd), arg, sizeof(arg)) != 2 ){
+        bad_request(rp);
+        return;
+    }
+
+    // a proxy_pass prefix goes upstream, whatever the method
+    if ( (route = PXmatch(vh, arg)) != NULL )
+    {
+        TRmark(rp->trace, TR_HANDLER);
+        do_proxy(route, head, end, last, rp);
         return;
     }
 
@@ -408,20 +1459,47 @@ void process_rq(char *rq, FILE *fp)
         setenv("REQUEST_METHOD", "HEAD", 1);
     else
     {
-        cannot_do(fp);      // only supports GET or HEAD
+        cannot_do(rp);      // only supports GET or HEAD
+        return;
+    }
+
+    // a packed site is all in memory
+    if ( vh->pack != NULL )
+    {
+        TRmark(rp->trace, TR_HANDLER);
+        do_pack(item, head, end, vh, rp);
         return;
     }
 
-    if ( not_exist( item ) )
-        do_404(item, fp );
-    else if ( no_access( item) )
-        do_403(item, fp);
-    else if ( isadir( item ) )
-        do_dir( item, fp );
+    // another child may have read it for us
+    if ( ! ends_in_cgi(item) && send_cached(item, vh, rp) )
+        return;
+
+    // one path walk, rooted at server_root; the fd answers the rest
+    fd = open_served(vh->rootfd, item);
+    TRmark(rp->trace, TR_HANDLER);
+    if ( fd == -1 )
+    {
+        if ( errno == EACCES || errno == EXDEV || errno == ELOOP )
+            do_403(item, rp);       // unreadable, or escapes the root
+        else
+            do_404(item, rp );
+        return;
+    }
+
+    if ( fstat(fd, &info) == -1 )
+        do_404(item, rp );
+    else if ( no_access( &info ) )
+        do_403(item, rp);
+    else if ( S_ISDIR( info.st_mode ) )
+        do_dir( item, fd, &info, vh, rp );
+    else if ( ends_in_cgi( item ) && ! cgi_runnable( fd, &info ) )
+        do_403(item, rp);
     else if ( ends_in_cgi( item ) )
-        do_exec( item, fp );
+        do_exec( item, fd, vh, rp );
     else
-        do_cat( item, fp );
+        store_cat( item, item, fd, &info, vh, rp );
+    close(fd);
 }
 
 /*
@@ -460,7 +1538,7 @@ parse_query(char *line)
 char *
 modify_argument(char *arg, int len)
 {
-    char    *nexttoken;
+    char    *nexttoken, *pos;
     char    *copy = malloc(len);
 
     if ( copy == NULL )
@@ -472,7 +1550,7 @@ modify_argument(char *arg, int len)
 
     *copy = '\0';
 
-    nexttoken = strtok(arg, "/");
+    nexttoken = strtok_r(arg, "/", &pos);   /* loop threads share this */
     while( nexttoken != NULL )
     {
         if ( strcmp(nexttoken,"..") != 0 )
@@ -481,7 +1559,7 @@ modify_argument(char *arg, int len)
                 strcat(copy, "/");
             strcat(copy, nexttoken);
         }
-        nexttoken = strtok(NULL, "/");
+        nexttoken = strtok_r(NULL, "/", &pos);
     }
     strcpy(arg, copy);
     free(copy);
@@ -499,306 +1577,267 @@ modify_argument(char *arg, int len)
    ------------------------------------------------------ */
 
 void
-header( FILE *fp, int code, char *msg, char *content_type )
+header( struct reply *rp, int code, char *msg, char *content_type )
 {
-    fprintf(fp, "HTTP/1.0 %d %s\r\n", code, msg);
-    fprintf(fp, "Date: %s\r\n", rfc822_time(time(0L)));
-    fprintf(fp, "Server: %s/%s\r\n", SERVER_NAME, VERSION);
+    RPprintf(rp, "HTTP/1.0 %d %s\r\n", code, msg);
+    RPprintf(rp, "Date: %s\r\n", rfc822_time(time(0L)));
+    RPprintf(rp, "Server: %s/%s\r\n", SERVER_NAME, VERSION);
     
     // do not include if NULL
     if (content_type == NULL)
         return;
     // the content_type wasn't found, return the DEFAULT
     else if ( strcmp(content_type, "") == 0 )
-        fprintf(fp, "Content-Type: %s\r\n", CONTENT_DEFAULT);
+        RPprintf(rp, "Content-Type: %s\r\n", CONTENT_DEFAULT);
     // print as-is
     else
-        fprintf(fp, "Content-Type: %s\r\n", content_type );
+        RPprintf(rp, "Content-Type: %s\r\n", content_type );
 }
 
 /* ------------------------------------------------------ *
    simple functions first:
-   bad_request(fp)     bad request syntax
-     cannot_do(fp)     unimplemented HTTP command
-   do_404(item,fp)     no such object
-   do_403(item,fp)     wrong permissions (added by MT)
+   bad_request(rp)     bad request syntax
+     cannot_do(rp)     unimplemented HTTP command
+   do_404(item,rp)     no such object
+   do_403(item,rp)     wrong permissions (added by MT)
    ------------------------------------------------------ */
 
 void
-bad_request(FILE *fp)
+bad_request(struct reply *rp)
 {
-    header(fp, 400, "Bad Request", "text/plain");
-    fprintf(fp, "\r\nI cannot understand your request\r\n");
+    header(rp, 400, "Bad Request", "text/plain");
+    RPprintf(rp, "\r\nI cannot understand your request\r\n");
 }
 
 void
-cannot_do(FILE *fp)
+cannot_do(struct reply *rp)
 {
-    header(fp, 501, "Not Implemented", "text/plain");
-    fprintf(fp, "\r\n");
+    header(rp, 501, "Not Implemented", "text/plain");
+    RPprintf(rp, "\r\n");
 
-    fprintf(fp, "That command is not yet implemented\r\n");
+    RPprintf(rp, "That command is not yet implemented\r\n");
 }
 
+/*
+ *  do_proxy()
+ *  Purpose: pass the request on to the upstream of route r (proxy.c),
+ *           which answers on the reply's fd itself; if it could not,
+ *           queue the error on rp
+ */
 void
-do_404(char *item, FILE *fp)
+do_proxy(struct pxroute *r, char *head, char *end, char *last,
+         struct reply *rp)
 {
-    header(fp, 404, "Not Found", "text/plain");
-    fprintf(fp, "\r\n");
+    struct config *conf = CFcurrent();
+    int     code;
 
-    fprintf(fp, "The item you requested: %s\r\nis not found\r\n", 
-            item);
+    code = PXpass(r, rp, head, end, last, conf);
+    CFrelease(conf);
+    if ( code != 0 )
+        proxy_error(code, rp);
 }
 
 void
-do_403(char *item, FILE *fp)
+proxy_error(int code, struct reply *rp)
 {
-    header(fp, 403, "Forbidden", "text/plain");
-    fprintf(fp, "\r\n");
-
-    fprintf(fp, "You do not have permission to access %s on this server\r\n",
-                item);
+    switch ( code )
+    {
+    case 400:
+        bad_request(rp);
+        break;
+    case 411:
+        header(rp, 411, "Length Required", "text/plain");
+        RPprintf(rp, "\r\nA request body needs a Content-Length here\r\n");
+        break;
+    case 504:
+        header(rp, 504, "Gateway Timeout", "text/plain");
+        RPprintf(rp, "\r\nThe upstream server did not answer in time\r\n");
+        break;
+    default:
+        header(rp, 502, "Bad Gateway", "text/plain");
+        RPprintf(rp, "\r\nThe upstream server could not be reached\r\n");
+        break;
+    }
 }
 
-/* ------------------------------------------------------ *
-   the directory listing section
-   isadir() uses stat, not_exist() uses stat
-   no_access() checks permissions of dir using stat
-   do_dir() checks if an 'index.html' or 'index.cgi'
-        file exists. If yes, it outputs that, otherwise
-        calls do_ls().
-   do_ls() opens a pipe to a listing of the directory.
-        For each entry, it formats the line with a link
-        to that file.
-   ------------------------------------------------------ */
-
-int
-isadir(char *f)
+void
+do_404(char *item, struct reply *rp)
 {
-    struct stat info;
-    return ( stat(f, &info) != -1 && S_ISDIR(info.st_mode) );
+    header(rp, 404, "Not Found", "text/plain");
+    RPprintf(rp, "\r\n");
+
+    RPprintf(rp, "The item you requested: %s\r\nis not found\r\n", 
+            item);
 }
 
-int
-not_exist(char *f)
+void
+do_403(char *item, struct reply *rp)
 {
-    struct stat info;
+    header(rp, 403, "Forbidden", "text/plain");
+    RPprintf(rp, "\r\n");
 
-    return( stat(f,&info) == -1 && errno == ENOENT );
+    RPprintf(rp, "You do not have permission to access %s on this server\r\n",
+                item);
 }
 
+/* ------------------------------------------------------ *
+   the directory listing section
+   process_rq() opens the item once beneath the vhost root and
+        passes the fd down; everything here works on it
+   no_access() checks permissions of dir using its stat
+   do_dir() checks the vhost's index names ('index.html'
+        then 'index.cgi' by default) in order. If one
+        exists, it outputs that, otherwise calls do_ls().
+        The outcome is kept in dircache.c until the
+        directory's mtime changes.
+   do_ls() has listing.c read the open directory. For each
+        entry, it formats the line with a link to that file.
+   ------------------------------------------------------ */
+
 /*
  *  no_access()
  *  Purpose: check permissions of page/file trying to be loaded
- *    Input: f, the name of the file
+ *    Input: info, the fstat() of the opened item
  *   Return: 1, if not allowed to access; 0 otherwise
- *     Note: added by MT, used to detect 403 error
+ *     Note: added by MT, used to detect 403 error. Only directories
+ *           are checked here; an unreadable file already failed to
+ *           open in process_rq().
  */
 int
-no_access(char *f)
+no_access(struct stat *info)
 {
-    struct stat info;
-    char path[LINELEN];
-
-    // construct the path to the file
-    strcpy(path, "./");
-    snprintf(path, LINELEN, "%s/", f);
+    if ( ! S_ISDIR(info->st_mode) )
+        return 0;
 
-    // get the permissions info
-    if( stat(path, &info) != -1 )
-    {
-        // there is no access allowed, return 1 to direct to a 403
-        if(! (S_IRUSR & info.st_mode) || ! (S_IXUSR & info.st_mode) )
-            return 1;
-    }
+    // there is no access allowed, return 1 to direct to a 403
+    if(! (S_IRUSR & info->st_mode) || ! (S_IXUSR & info->st_mode) )
+        return 1;
     return 0;
-
 }
 
 /*
  *  do_dir()
- *  Purpose: check the current directory to see if an index file exists
+ *  Purpose: serve the directory's index file if it has one, else
+ *           a listing of it
  */
 void
-do_dir(char *dir, FILE *fp)
+do_dir(char *dir, int dirfd, struct stat *info, struct vhost *vh, struct reply *rp)
 {
-    struct stat info;
-    char html[LINELEN];
     char cgi[LINELEN];
-    
-    // create a path to check HTML index
-    strcpy(html, dir);
-    strcat(html, "/index.html");
-    
-    // create a path to check CGI index
-    strcpy(cgi, dir);
-    strcat(cgi, "/index.cgi");
-
-    if(stat(html, &info) == 0 )     // html exists
-        do_cat(html, fp);
-    else if (stat(cgi, &info) == 0) // cgi exists
-        do_exec(cgi, fp);
-    else                            // no index, output listing
-        do_ls(dir, fp);
-    
-    return;
-}
+    char *name;
+    int  fd;
+    struct stat finfo;
 
-/*
- * lists the directory named by 'dir' 
- * sends the listing to the stream at fp
- *
- * Note: Modified for the assignment. 
- */
-void
-do_ls(char *dir, FILE *fp)
-{
-    header(fp, 200, "OK", "text/html");
-    fprintf(fp,"\r\n");
-    
-    table_header(fp);
-    
-    print_rows(fp, dir);
-    
-    table_close(fp);
-}
-
-/*
- *  construct_path()
- *  Purpose: concatenate a parent and child into a full path name
- *    Input: parent, current path to the open directory
- *           child, name of the last entry read by readdir()
- *   Return: pointer to full path string allocated by malloc()
- *   Errors: if malloc() or sprintf() fail, return NULL. This will
- *           cause lstat() to output an error back in process_file or
- *           process_dir().
- *   Method: Start by malloc()ing enough memory to store the combined
- *           path. If sucessful, call sprintf() to copy into "newstr":
- *           1) just the parent, if parent and child are the same;
- *           2) if parent or child has trailing or leading '/',
- *              respectively, do not copy an extra '/'; or
- *           3) concatenate "parent/child"
- *     Note: This function was copied from my pfind.c assignment as-is.
- */
-char * construct_path(char *parent, char *child)
-{
-    int rv;
-    int path_size = 1 + strlen(parent) + 1 + strlen(child);
-    char *newstr = malloc(path_size);
-
-    //Check malloc() returned memory. If no, lstat() will output error
-    if (newstr == NULL)
-        return NULL;
-
-    //Concatenate "parent/child", see Method above for how
-    if (strcmp(parent, child) == 0)
-        rv = sprintf(newstr, "%s", parent);
-    else if (parent[strlen(parent) - 1] == '/' || child[0] == '/')
-        rv = sprintf(newstr, "%s%s", parent, child);
+    if ( (name = find_index(dirfd, info, vh, &fd, &finfo)) == NULL )
+        do_ls(dirfd, rp);                       // no index, output listing
+    else if ( ends_in_cgi(name) )
+    {
+        snprintf(cgi, LINELEN, "%s/%s", dir, name);
+        if ( cgi_runnable(fd, &finfo) )
+            do_exec(cgi, fd, vh, rp);
+        else
+            do_403(cgi, rp);
+        close(fd);
+    }
     else
-        rv = sprintf(newstr, "%s/%s", parent, child);
-
-    //check for sprintf error --or-- overflow error
-    if ( rv < 0 || rv > (path_size - 1) )
     {
-        free(newstr);       //failed to construct path
-        return NULL;        //return will cause lstat() error
+        store_cat(dir, name, fd, &finfo, vh, rp);   // html exists
+        close(fd);
     }
-
-    return newstr;
 }
 
 /*
- *  print_rows() -- open the directory specified by "dir", and call on
- *      table_row() for each file it finds.
- *  Note: This code was copied from my pfind assignment. The while loop
- *      processing was altered to fit the webserver requirements.
+ *  find_index()
+ *  Purpose: find the first of the vhost's index names that is in the
+ *           directory open on dirfd (info is its fstat)
+ *   Return: the name, or NULL if there is none. *fdp is left open
+ *           on it and *finfo is its fstat; for a cgi *fdp is O_PATH,
+ *           to run it by (exec_cgi()).
+ *     Note: the index names are opened relative to dirfd, so the
+ *           probe does not walk the request path again. A vhost
+ *           with no index lines uses the default host's list.
+ *           A cached result for this directory skips the probe;
+ *           with no index at all that means no failed opens, and a
+ *           cached hit that has since gone away falls back to
+ *           probing the whole list.
  */
-void
-print_rows(FILE *fp, char *dir)
+char *
+find_index(int dirfd, struct stat *info, struct vhost *vh,
+           int *fdp, struct stat *finfo)
 {
-    DIR* list = opendir(dir);
-    
-    if(list == NULL)
+    int  i, which;
+
+    if ( vh->nindex == 0 )
+        vh = vh->parent;
+
+    if ( DClookup(info, vh->id, &which) )
     {
-        fprintf(stderr, "Couldn't open directory\n");
-        return;
+        if ( which == -1 )
+            return NULL;
+        if ( which < vh->nindex
+          && open_index(dirfd, vh->index[which], fdp, finfo) == 0 )
+            return vh->index[which];
     }
-    
-    struct dirent *dp = NULL;
-    struct stat info;
-    char *path = NULL;
-    
-    // output a row for each file
-    while( (dp = readdir(list)) != NULL)
-    {
-        path = construct_path(dir, dp->d_name);
-        
-        if (lstat(path, &info) == -1)
+
+    for ( i = 0 ; i < vh->nindex ; i++ )
+        if ( open_index(dirfd, vh->index[i], fdp, finfo) == 0 )
         {
-            fprintf(stderr, "error with %s\n", path);
-            continue;
+            DCstore(info, vh->id, i);
+            return vh->index[i];
         }
-        
-        // format the row data
-        table_row(fp, dp, &info);
-        
-        // prevent memory leaks
-        if(path != NULL)
-            free(path);
-    }
+    DCstore(info, vh->id, -1);
+    return NULL;
 }
 
 /*
- *  table_row() -- output an HTML formatted table row containing:
- *          Name (with link to file), Last Modified time, and file size
+ *  open_index()
+ *  Purpose: see if the index file name is in the directory
+ *   Return: 0 if it is there, -1 if it could not be opened
  */
-void
-table_row(FILE *fp, struct dirent * dp, struct stat *info)
+int
+open_index(int dirfd, char *name, int *fdp, struct stat *finfo)
 {
-    fprintf(fp, "<tr><td>");
-    
-    // add a trailing '/' if the file is a directory
-    if(S_ISDIR(info->st_mode))
-        fprintf(fp, "<a href='%s/'>%s</a>", dp->d_name, dp->d_name);
-    else
-        fprintf(fp, "<a href='%s'>%s</a>", dp->d_name, dp->d_name);
-    
-    fprintf(fp, "</td>");
-    
-    // output Last Modified time
-    fprintf(fp, "<td>");
-    fprintf(fp, "%s", table_time(info->st_mtime));
-    fprintf(fp, "</td>");
-    
-    // out file size
-    fprintf(fp, "<td>");
-    fprintf(fp, "%d", (int) info->st_size);
-    fprintf(fp, "</td></tr>");
-    
-}
+    int  fd;
 
-/*
- *  table_header() -- Output opening tags for an HTML table and header row
- *      containing: Name, Last Modified, and Size
- */
-void
-table_header(FILE *fp)
-{
-    fprintf(fp, "<table>\n<tbody>\n<tr>");
-    fprintf(fp, "<th>Name</th>");
-    fprintf(fp, "<th>Last Modified</th>");
-    fprintf(fp, "<th>Size</th>");
-    fprintf(fp, "</tr>\n");
+    fd = RFopen(dirfd, name, ends_in_cgi(name) ? O_PATH : O_RDONLY|O_NONBLOCK);
+    if ( fd == -1 )
+        return -1;
+    if ( fstat(fd, finfo) == -1 )
+    {
+        close(fd);
+        return -1;
+    }
+    *fdp = fd;
+    return 0;
 }
 
 /*
- *  table_close() -- output closing HTML table tags
+ * lists the open directory 'dirfd'
+ * sends the listing on the reply rp, a piece at a time
+ *
+ * Note: Modified for the assignment. The rows are made by listing.c
+ *       into one fixed buffer that is sent and reused, so any size
+ *       of directory takes the same memory.
  */
 void
-table_close(FILE *fp)
+do_ls(int dirfd, struct reply *rp)
 {
-    fprintf(fp, "</tbody></table>\n");
+    struct listing *ls = LSopen(dirfd);
+    int     more;
+
+    if ( ls == NULL )
+    {
+        fprintf(stderr, "Couldn't open directory\n");
+        do_404(".", rp);
+        return;
+    }
+    header(rp, 200, "OK", "text/html");
+    RPprintf(rp,"\r\n");
+
+    do
+        more = LSfill(ls, rp);
+    while ( RPflush(rp) == 0 && more == 1 );
+    LSclose(ls);
 }
 
 /* ------------------------------------------------------ *
@@ -822,46 +1861,497 @@ ends_in_cgi(char *f)
     return ( strcmp( file_type(f), "cgi" ) == 0 );
 }
 
+/*
+ *  open_served()
+ *  Purpose: open item beneath rootfd to serve it. A CGI needs only
+ *           to be run, so one that cannot be read (mode 0711, say)
+ *           is opened O_PATH instead, to check and exec by the fd
+ *   Return: the fd, or -1 with errno set
+ */
+int
+open_served(int rootfd, char *item)
+{
+    int     fd = RFopen(rootfd, item, O_RDONLY | O_NONBLOCK);
+
+    if ( fd == -1 && errno == EACCES && ends_in_cgi(item) )
+        fd = RFopen(rootfd, item, O_PATH);
+    return fd;
+}
+
+/*
+ *  cgi_runnable()
+ *  Purpose: may we run the CGI open on fd (info is its fstat)? It
+ *           must be a regular file we can execute
+ */
+int
+cgi_runnable(int fd, struct stat *info)
+{
+    if ( ! S_ISREG(info->st_mode) )
+        return 0;
+    if ( faccessat(fd, "", X_OK, AT_EMPTY_PATH | AT_EACCESS) == 0 )
+        return 1;
+    /* no faccessat2() (before 5.8): the mode bits have to do */
+    return (errno == ENOSYS || errno == EINVAL) && (info->st_mode & 0111);
+}
+
+/*
+ *  exec_cgi()
+ *  Purpose: run the CGI open on fd, which RFopen() found beneath the
+ *           root, with argv and env, by the fd rather than the path,
+ *           so nothing swapped in since can be run instead. fd stays
+ *           open across the exec: a script's interpreter reads the
+ *           script as /dev/fd/N. Returns only if the exec fails
+ */
+void
+exec_cgi(int fd, char **argv, char **env)
+{
+    fcntl(fd, F_SETFD, 0);
+    execveat(fd, "", argv, env, AT_EMPTY_PATH);
+}
+
+/*
+ *  do_exec()
+ *  Purpose: run the CGI prog, open on fd, with the socket as its
+ *           stdout and stderr, after the 200 header. With "cgi_cache" set, a GET
+ *           may be answered from, or fill, the shared cache instead
+ *           (cgicache.c). With a log on, the CGI is a child of its
+ *           own, writing to a pipe that this process copies to the
+ *           socket (run_logged()), so the log has its bytes and end
+ */
 void
-do_exec( char *prog, FILE *fp)
+do_exec( char *prog, int fd, struct vhost *vh, struct reply *rp)
 {
-    int fd = fileno(fp);
+    extern char **environ;
+    struct config *conf = CFcurrent();
+    int     ttl = conf->cgi_ttl, stale = conf->cgi_stale;
+    char    *argv[2];
+
+    CFrelease(conf);
+    if ( ttl > 0 && CCserve(prog, fd, vh->id, rp, ttl, stale) )
+        return;
 
-    header(fp, 200, "OK", NULL);
-    fflush(fp);
+    header(rp, 200, "OK", NULL);
+    if ( RPflush(rp) != 0 )         /* the CGI writes after this */
+        return;
 
-    dup2(fd, 1);
-    dup2(fd, 2);
-    execl(prog,prog,NULL);
+    argv[0] = prog;
+    argv[1] = NULL;
+    if ( TRlogging() )
+    {
+        run_logged(fd, argv, environ, rp);
+        return;
+    }
+    dup2(rp->fd, 1);
+    dup2(rp->fd, 2);
+    exec_cgi(fd, argv, environ);
     perror(prog);
 }
+
+/*
+ *  run_logged()
+ *  Purpose: run the CGI open on fd with argv and env (exec_cgi()), its
+ *           stdout and stderr a pipe,
+ *           and send what it writes on rp, counted in rp->sent; wait
+ *           for it. A client that goes away closes the pipe, so the
+ *           CGI gets SIGPIPE as it would writing to the socket
+ */
+void
+run_logged(int fd, char **argv, char **env, struct reply *rp)
+{
+    char    buf[BUFSIZ];
+    int     p[2];
+    ssize_t n;
+    pid_t   pid;
+
+    signal(SIGCHLD, SIG_DFL);       /* the parent's reaper is not ours */
+    if ( pipe(p) == -1 )
+        return;
+    if ( (pid = fork()) == -1 )
+    {
+        close(p[0]);
+        close(p[1]);
+        return;
+    }
+    if ( pid == 0 )
+    {
+        close(p[0]);
+        dup2(p[1], 1);
+        dup2(p[1], 2);
+        if ( p[1] > 2 )
+            close(p[1]);
+        exec_cgi(fd, argv, env);
+        _exit(1);
+    }
+    close(p[1]);
+    signal(SIGPIPE, SIG_IGN);       /* a client gone is an error return */
+    while ( (n = read(p[0], buf, sizeof(buf))) != 0 )
+    {
+        if ( n == -1 && errno == EINTR )
+            continue;
+        if ( n == -1 || RPref(rp, buf, n) != 0 || RPflush(rp) != 0 )
+            break;
+    }
+    close(p[0]);
+    while ( waitpid(pid, NULL, 0) == -1 && errno == EINTR )
+        ;
+}
+/*
+ *  spawn_cgi()
+ *  Purpose: run prog for the event loop (events.c), with the client
+ *           socket fd as its stdout and stderr, from the vhost's root.
+ *           The 200 header has already been sent on rp. The child is
+ *           then tracked like a forked request, and it frees addr's
+ *           place in the connection limits when it exits. With a log
+ *           on, the CGI writes to a pipe that the child copies to fd
+ *           (run_logged()), and the child logs head..end with rp's
+ *           trace and bytes; the loop does not.
+ *     Note: the server has threads in this mode, so between fork()
+ *           and exec the child makes only async-signal-safe calls.
+ *           REQUEST_METHOD and QUERY_STRING go into an environment
+ *           built before the fork, not through setenv().
+ *   Return: the child's pid, or -1
+ */
+pid_t
+spawn_cgi(char *prog, int cgifd, struct reply *rp, struct vhost *vh,
+          char *method, char *query, char *head, char *end, unsigned addr,
+          struct config *conf)
+{
+    int     fd = rp->fd;
+    extern char **environ;
+    char    **env;
+    char    *argv[2];
+    char    meth[32], qs[MAX_RQ_LEN + 16];
+    int     i, n;
+    pid_t   pid;
+
+    for ( n = 0 ; environ[n] != NULL ; n++ )
+        ;
+    if ( (env = malloc((n + 3) * sizeof(char *))) == NULL )
+        return -1;
+    for ( i = n = 0 ; environ[i] != NULL ; i++ )
+        if ( strncmp(environ[i], "REQUEST_METHOD=", 15) != 0
+          && strncmp(environ[i], "QUERY_STRING=", 13) != 0 )
+            env[n++] = environ[i];
+    snprintf(meth, sizeof(meth), "REQUEST_METHOD=%s", method);
+    env[n++] = meth;
+    if ( query != NULL )
+    {
+        snprintf(qs, sizeof(qs), "QUERY_STRING=%s", query);
+        env[n++] = qs;
+    }
+    env[n] = NULL;
+    argv[0] = prog;
+    argv[1] = NULL;
+
+    if ( (pid = fork()) == 0 )
+    {
+        signal(SIGHUP, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        setpgid(0, 0);
+        CPpin_all(conf);            /* not just the main loop's CPU */
+        fcntl(fd, F_SETFL, 0);      /* the CGI expects blocking writes */
+        if ( fchdir(vh->rootfd) != 0 )
+            _exit(1);
+        if ( TRlogging() )
+        {
+            run_logged(cgifd, argv, env, rp);
+            TRmark(rp->trace, TR_LAST);
+            TRlog(rp->trace, head, end, rp->sent);
+            _exit(0);
+        }
+        dup2(fd, 1);
+        dup2(fd, 2);
+        exec_cgi(cgifd, argv, env);
+        _exit(1);
+    }
+    free(env);
+    if ( pid == -1 )
+        perror("fork");
+    else
+        track_child(pid, addr, conf);
+    return pid;
+}
+
+/*
+ *  spawn_proxy()
+ *  Purpose: for the event loop (events.c), fork a child that passes
+ *           the request head..end (and end..last, body read with it)
+ *           on the client socket fd to route r's upstream, as a
+ *           forked request's child would, and answers fd itself. It
+ *           is tracked as spawn_cgi() tracks a CGI, and logs the
+ *           request with the phases in tr when it is done.
+ *     Note: the child keeps only fd, so it cannot hold the loops'
+ *           other connections open.
+ *   Return: the child's pid, or -1
+ */
+pid_t
+spawn_proxy(struct pxroute *r, int fd, char *head, char *end, char *last,
+            unsigned addr, struct trace *tr, struct config *conf)
+{
+    struct reply rp;
+    struct timeval tv;
+    pid_t   pid;
+    int     code;
+
+    if ( (pid = fork()) == 0 )
+    {
+        signal(SIGHUP, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        setpgid(0, 0);
+        CPpin_all(conf);
+        if ( dup2(fd, 3) == -1 )
+            _exit(1);
+        TRclose_above(3, PXsocket());   /* but the keeper's */
+        fcntl(3, F_SETFL, 0);       /* blocking, under send_timeout */
+        tv.tv_sec = conf->send_timeout;
+        tv.tv_usec = 0;
+        setsockopt(3, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        RPinit(&rp, 3);
+        rp.trace = tr;
+        if ( (code = PXpass(r, &rp, head, end, last, conf)) != 0 )
+        {
+            proxy_error(code, &rp);
+            RPflush(&rp);
+        }
+        TRmark(tr, TR_LAST);
+        TRlog(tr, head, end, rp.sent);
+        _exit(0);
+    }
+    if ( pid == -1 )
+        perror("fork");
+    else
+        track_child(pid, addr, conf);
+    return pid;
+}
+
 /* ------------------------------------------------------ *
-   do_cat(filename,fp)
-   sends back contents after a header
+   do_cat(filename,fd,info,vh,rp)
+   sends back contents of the open file fd after a header
    ------------------------------------------------------ */
 
 /*
  *  Modified from starter code. Moved Content-Type from if/else
- *  switch, to a table-driven design. See varlib.c for more.
+ *  switch, to a table-driven design: see VHcontent_type() in vhost.c.
+ *
+ *  Regular files are mapped (see filemap.c) and queued on the reply
+ *  by reference a window at a time, so the header and the first
+ *  window leave in one writev(). On a kTLS socket they go by
+ *  sendfile() instead (ktls_cat()). Anything that can't be mapped is
+ *  copied through a buffer.
  */
 void
-do_cat(char *f, FILE *fpsock)
+do_cat(char *f, int fd, struct stat *info, struct vhost *vh, struct reply *rp)
 {
     char    *extension = file_type(f);
-    char    *content = VLlookup(extension);
+    char    *content = VHcontent_type(vh, extension);
+    struct fmap *m;
+    char    buf[BUFSIZ];
+    size_t  off, chunk;
+    ssize_t n;
 
-    FILE    *fpfile;
-    int c;
+    header( rp, 200, "OK", content );
+    RPprintf(rp, "\r\n");
 
-    fpfile = fopen( f , "r");
-    if ( fpfile != NULL )
+    if ( S_ISREG(info->st_mode) && TLktls(rp->fd) )
     {
-        header( fpsock, 200, "OK", content );
-        fprintf(fpsock, "\r\n");
-        while( (c = getc(fpfile) ) != EOF )
-            putc(c, fpsock);
-        fclose(fpfile);
+        ktls_cat(f, fd, info, rp);
+        return;
+    }
+    if ( (m = FMopen(fd, info)) != NULL )
+    {
+        for ( off = 0 ; off < m->len ; off += chunk )
+        {
+            chunk = m->len - off < FM_WINDOW ? m->len - off : FM_WINDOW;
+            FMadvise(m, off, chunk);
+            RPref(rp, (char *) m->addr + off, chunk);
+            if ( RPflush(rp) != 0 )
+            {
+                fprintf(stderr, "%s: send cut short\n", f);
+                break;
+            }
+        }
+        FMrelease(m);               /* nothing queued points at it */
+        return;
+    }
+    while ( (n = read(fd, buf, sizeof(buf))) > 0 )
+    {
+        RPref(rp, buf, n);
+        if ( RPflush(rp) != 0 )
+            break;
+    }
+}
+
+/*
+ *  ktls_cat()
+ *  Purpose: send what rp holds, then the regular file open on fd with
+ *           sendfile(). On a kTLS socket the kernel encrypts straight
+ *           from the page cache; writev() of a mapping would copy the
+ *           pages into the socket first, and then encrypt them
+ */
+void
+ktls_cat(char *f, int fd, struct stat *info, struct reply *rp)
+{
+    off_t   off = 0;
+    ssize_t n;
+
+    if ( RPflush(rp) != 0 )
+        return;
+    while ( off < info->st_size )
+    {
+        n = sendfile(rp->fd, fd, &off, info->st_size - off);
+        if ( n == -1 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+        {
+            fprintf(stderr, "%s: send cut short\n", f);
+            return;
+        }
+        rp->sent += n;              /* for the log */
+    }
+}
+
+/*
+ *  send_cached()
+ *  Purpose: queue item from the cache the children share (shmcache.c)
+ *           if another child stored it lately
+ *   Return: 1 if the reply is queued, 0 if item has to be opened
+ *     Note: the reply points at the copy, which lasts until the child
+ *           exits
+ */
+int
+send_cached(char *item, struct vhost *vh, struct reply *rp)
+{
+    struct smhit *hit = SMlookup(vh->id, item);
+
+    if ( hit == NULL )
+        return 0;
+    TRmark(rp->trace, TR_HANDLER);
+    header(rp, 200, "OK", hit->type);
+    RPprintf(rp, "\r\n");
+    RPref(rp, hit->data, hit->len);
+    return 1;
+}
+
+/*
+ *  store_cat()
+ *  Purpose: store the file open on fd in the cache the children share,
+ *           under key, and send it from the bytes that read; if the
+ *           cache is off or will not take it, do_cat() sends it
+ *  Details: a crowd of children missing one key coalesces: the first
+ *           claims it (SMclaim()) and reads the file, and the rest
+ *           look for its entry every SM_POLL_US until it is there or
+ *           the claim is given up or dies with its child
+ *     Note: f names the file for its type; the reply points at the
+ *           copy, which lasts until the child exits
+ */
+void
+store_cat(char *key, char *f, int fd, struct stat *info, struct vhost *vh,
+          struct reply *rp)
+{
+    char    *type = VHcontent_type(vh, file_type(f));
+    char    *data;
+    struct smhit *hit;
+    struct timespec pause = { 0, SM_POLL_US * 1000L };
+    int     held;
+
+    if ( ! SMkeeps(key, type, info) )
+    {
+        do_cat(f, fd, info, vh, rp);
+        return;
+    }
+    while ( (held = SMclaim(vh->id, key)) == 0 )
+    {
+        nanosleep(&pause, NULL);    /* another child is reading it */
+        if ( (hit = SMpeek(vh->id, key)) != NULL )
+        {
+            header(rp, 200, "OK", hit->type);
+            RPprintf(rp, "\r\n");
+            RPref(rp, hit->data, hit->len);
+            return;
+        }
+    }
+    if ( (data = SMstore(vh->id, key, type, fd, info)) == NULL )
+    {
+        if ( held == 1 )
+            SMunclaim(vh->id, key);
+        do_cat(f, fd, info, vh, rp);
+        return;
+    }
+    header(rp, 200, "OK", type);
+    RPprintf(rp, "\r\n");
+    RPref(rp, data, info->st_size);
+}
+
+/*
+ *  do_pack()
+ *  Purpose: answer for item from vh's bundle (pack.c) with no call
+ *           on the filesystem: a file (gzip'd if it has such a copy
+ *           and the client takes gzip), a directory's index page or
+ *           its listing, or a 304 if If-None-Match has the ETag. A
+ *           CGI cannot be run from a bundle, so it is a 403.
+ *           head..end is the request head
+ *     Note: the reply points into the mapping, which lasts as long
+ *           as the config that has vh
+ */
+void
+do_pack(char *item, char *head, char *end, struct vhost *vh,
+        struct reply *rp)
+{
+    struct pack *pk = vh->pack;
+    struct pkentry *e = PKlookup(pk, item), *ix = NULL;
+    struct vhost *ivh = vh->nindex > 0 ? vh : vh->parent;
+    char    want[LINELEN], *path, *type, *etag, *data;
+    uint64_t len;
+    int     i, gzip;
+
+    if ( e == NULL )
+    {
+        do_404(item, rp);
+        return;
+    }
+    for ( i = 0 ; e->dir && ix == NULL && i < ivh->nindex ; i++ )
+        if ( ! ends_in_cgi(ivh->index[i])
+          && (ix = PKchild(pk, e, ivh->index[i])) != NULL && ix->dir )
+            ix = NULL;
+    if ( e->dir && ix == NULL )
+    {
+        header(rp, 200, "OK", "text/html");
+        RPprintf(rp, "\r\n");
+        PKlist(pk, e, rp);
+        return;
+    }
+    if ( ix != NULL )
+        e = ix;
+    path = PKstr(pk, e->path);
+    if ( ends_in_cgi(path) )
+    {
+        do_403(item, rp);
+        return;
+    }
+
+    etag = PKstr(pk, e->etag);
+    head_field(head, end, "If-None-Match", want, sizeof(want));
+    if ( want[0] != '\0' && (strstr(want, etag) != NULL
+                            || strcmp(want, "*") == 0) )
+    {
+        header(rp, 304, "Not Modified", NULL);
+        RPprintf(rp, "ETag: %s\r\n\r\n", etag);
+        return;
     }
+    head_field(head, end, "Accept-Encoding", want, sizeof(want));
+    gzip = e->gzlen > 0 && strcasestr(want, "gzip") != NULL;
+    data = PKbytes(pk, e, gzip, &len);
+
+    type = PKstr(pk, e->type);
+    header(rp, 200, "OK", *type ? type : VHcontent_type(vh, file_type(path)));
+    RPprintf(rp, "ETag: %s\r\nContent-Length: %llu\r\n", etag,
+             (unsigned long long) len);
+    if ( e->gzlen > 0 )
+        RPprintf(rp, "Vary: Accept-Encoding\r\n");
+    if ( gzip )
+        RPprintf(rp, "Content-Encoding: gzip\r\n");
+    RPprintf(rp, "\r\n");
+    RPref(rp, data, len);
 }
 
 char *
@@ -899,7 +2389,8 @@ void done(int n)
 {
     if ( mysocket != -1 ){
         fprintf(stderr, "closing socket\n");
-        close(mysocket);
+        while ( nlsocks > 0 )
+            close(lsocks[--nlsocks]);
     }
     exit(0);
 }
@@ -0,0 +1,47 @@
+#ifndef WSNG_H
+#define WSNG_H
+/*
+ * header for the parts of wsng.c that the event loop in events.c
+ * shares with the forking server
+ */
+
+#include    <sys/types.h>
+
+#define MAX_RQ_LEN  4096
+#define LINELEN     1024
+#define HOST_LEN    256
+
+struct stat;
+struct vhost;
+struct config;
+struct reply;
+struct pxroute;
+struct trace;
+
+void    header(struct reply *, int, char *, char *);
+void    bad_request(struct reply *);
+void    cannot_do(struct reply *);
+void    do_404(char *, struct reply *);
+void    do_403(char *, struct reply *);
+char    *modify_argument(char *, int);
+void    parse_head(char *, char *, char *, int, char *, int);
+void    head_field(char *, char *, char *, char *, int);
+int     split_request(char *, char *, int, char *, int);
+int     no_access(struct stat *);
+int     ends_in_cgi(char *);
+int     open_served(int, char *);
+int     cgi_runnable(int, struct stat *);
+void    exec_cgi(int, char **, char **);
+void    run_logged(int, char **, char **, struct reply *);
+char    *file_type(char *);
+char    *find_index(int, struct stat *, struct vhost *, int *, struct stat *);
+void    refuse_call(int, int);
+void    do_pack(char *, char *, char *, struct vhost *, struct reply *);
+void    process_rq(char *, char *, char *, char *, struct vhost *,
+                   struct reply *);
+pid_t   spawn_cgi(char *, int, struct reply *, struct vhost *, char *,
+                  char *, char *, char *, unsigned, struct config *);
+pid_t   spawn_proxy(struct pxroute *, int, char *, char *, char *, unsigned,
+                    struct trace *, struct config *);
+
+#endif
@@ -0,0 +1,419 @@
+/* wsngpack.c
+ *
+ * packs a server_root into one bundle file for the "pack" directive
+ *
+ * usage: wsng-pack [-z] [-c configfile] root bundle
+ *
+ * details:
+ *      Walks root and writes every directory and regular file under
+ *      it into bundle, in the format pack.h describes: the bytes of
+ *      the files first, then the entries sorted by path, the hash
+ *      chains, each directory's entries and the strings. Symlinks,
+ *      devices and the like are left out, as are directories we may
+ *      not read.
+ *
+ *      Each file gets an ETag from a 64-bit FNV-1a of its bytes, so
+ *      rebuilding an unchanged site keeps the tags. With -c the
+ *      Content-Types come from the config file's "type" lines (those
+ *      before the first vhost), found by extension as wsng finds
+ *      them; without it they are left for the server to work out.
+ *      With -z a file that gzip makes at least 10% smaller also gets
+ *      a gzip'd copy, sent to clients that accept one.
+ *
+ *      The bundle is written under a temporary name and renamed into
+ *      place, so a server never maps a half-written one.
+ */
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <dirent.h>
+#include    <sys/types.h>
+#include    <sys/stat.h>
+#include    <zlib.h>
+#include    "pack.h"
+
+#define MAX_TYPES   256
+#define LINE_LEN    1024
+
+struct item {
+    char            *path;
+    char            *type;
+    char            etag[24];
+    struct stat     info;
+    uint64_t        off, gzoff, gzlen;
+    uint32_t        parent, kids, nkids;
+};
+
+static struct item *items;
+static uint32_t nitems, maxitems;
+static char     *exts[MAX_TYPES], *types[MAX_TYPES];
+static int      ntypes;
+static int      gzip_too;
+static int      out;
+static uint64_t at;                 /* where the next bytes go  */
+
+static void     read_types(char *);
+static char     *type_of(char *);
+static int      walk(int, char *);
+static int      add(char *, int, struct stat *);
+static int      put_file(struct item *, int);
+static int      put(void *, uint64_t);
+static int      by_path(const void *, const void *);
+static int      find(char *);
+static int      write_tables(void);
+
+int
+main(int ac, char *av[])
+{
+    char    tmp[LINE_LEN];
+    int     c, rootfd;
+
+    while ( (c = getopt(ac, av, "zc:")) != -1 )
+        switch ( c )
+        {
+        case 'z':
+            gzip_too = 1;
+            break;
+        case 'c':
+            read_types(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-z] [-c configfile] root bundle\n",
+                    av[0]);
+            return 1;
+        }
+    if ( ac - optind != 2 )
+    {
+        fprintf(stderr, "usage: %s [-z] [-c configfile] root bundle\n", av[0]);
+        return 1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", av[optind + 1]);
+    if ( (rootfd = open(av[optind], O_RDONLY | O_DIRECTORY)) == -1 )
+    {
+        perror(av[optind]);
+        return 1;
+    }
+    if ( (out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 )
+    {
+        perror(tmp);
+        return 1;
+    }
+    at = PK_ALIGN(sizeof(struct pkhead));   /* the header goes in last */
+
+    if ( walk(rootfd, ".") != 0 || write_tables() != 0 || close(out) != 0
+      || rename(tmp, av[optind + 1]) != 0 )
+    {
+        perror(av[optind + 1]);
+        unlink(tmp);
+        return 1;
+    }
+    printf("%s: %u entries, %llu bytes\n", av[optind + 1], nitems,
+           (unsigned long long) at);
+    return 0;
+}
+
+/*
+ * the default host's "type ext mime" lines from the config file
+ */
+static void
+read_types(char *file)
+{
+    FILE    *fp = fopen(file, "r");
+    char    line[LINE_LEN], word[LINE_LEN], ext[LINE_LEN], type[LINE_LEN];
+
+    if ( fp == NULL )
+    {
+        perror(file);
+        exit(1);
+    }
+    while ( fgets(line, sizeof(line), fp) != NULL )
+    {
+        if ( sscanf(line, "%s", word) == 1 && strcasecmp(word, "vhost") == 0 )
+            break;
+        if ( sscanf(line, "%s %s %s", word, ext, type) == 3
+          && strcasecmp(word, "type") == 0 && ntypes < MAX_TYPES )
+        {
+            exts[ntypes] = strdup(ext);
+            types[ntypes++] = strdup(type);
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * the Content-Type for path, by the same extension wsng takes
+ * (file_type()): after the last '.', or "" if none is known
+ */
+static char *
+type_of(char *path)
+{
+    char    *ext = strrchr(path, '.');
+    int     i;
+
+    ext = ext != NULL ? ext + 1 : "";
+    for ( i = 0 ; i < ntypes ; i++ )
+        if ( strcmp(exts[i], ext) == 0 )
+            return types[i];
+    return "";
+}
+
+/*
+ * add the directory open on dirfd, named path, and all beneath it
+ */
+static int
+walk(int dirfd, char *path)
+{
+    DIR     *dp;
+    struct dirent *de;
+    struct stat info;
+    char    sub[LINE_LEN];
+    int     fd, rc = 0;
+
+    if ( fstat(dirfd, &info) == -1 || add(path, -1, &info) != 0 )
+        return 1;
+    if ( (dp = fdopendir(dirfd)) == NULL )
+        return 1;
+    while ( rc == 0 && (de = readdir(dp)) != NULL )
+    {
+        if ( strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 )
+            continue;
+        if ( strcmp(path, ".") == 0 )
+            snprintf(sub, sizeof(sub), "%s", de->d_name);
+        else
+            snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        if ( fstatat(dirfd, de->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1 )
+            continue;
+        if ( S_ISDIR(info.st_mode) )
+        {
+            if ( (fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY)) == -1 )
+                fprintf(stderr, "%s: left out, cannot be read\n", sub);
+            else
+                rc = walk(fd, sub);
+        }
+        else if ( S_ISREG(info.st_mode) )
+        {
+            if ( (fd = openat(dirfd, de->d_name, O_RDONLY)) == -1 )
+                fprintf(stderr, "%s: left out, cannot be read\n", sub);
+            else
+            {
+                rc = add(sub, fd, &info);
+                close(fd);
+            }
+        }
+    }
+    closedir(dp);                   /* closes dirfd too */
+    return rc;
+}
+
+/*
+ * a new item for path; fd is the open file, -1 for a directory
+ */
+static int
+add(char *path, int fd, struct stat *info)
+{
+    struct item *it;
+
+    if ( nitems == maxitems )
+    {
+        maxitems = maxitems ? maxitems * 2 : 1024;
+        if ( (items = realloc(items, maxitems * sizeof(struct item))) == NULL )
+            return 1;
+    }
+    it = &items[nitems++];
+    memset(it, 0, sizeof(*it));
+    it->path = strdup(path);
+    it->type = type_of(path);
+    it->info = *info;
+    return fd == -1 ? 0 : put_file(it, fd);
+}
+
+/*
+ * copy the file's bytes (and a gzip'd copy) out, and tag them
+ */
+static int
+put_file(struct item *it, int fd)
+{
+    uint64_t h = 14695981039346656037UL, len = it->info.st_size, i;
+    unsigned char *buf = malloc(len ? len : 1), *gz = NULL;
+    uLongf  gzlen;
+    z_stream zs;
+    ssize_t n;
+    int     rc;
+
+    if ( buf == NULL )
+        return 1;
+    for ( i = 0 ; i < len ; i += n )
+        if ( (n = read(fd, buf + i, len - i)) <= 0 )
+        {
+            fprintf(stderr, "%s: changed while being read\n", it->path);
+            free(buf);
+            return 1;
+        }
+    for ( i = 0 ; i < len ; i++ )
+        h = (h ^ buf[i]) * 1099511628211UL;
+    snprintf(it->etag, sizeof(it->etag), "\"%016llx\"", (unsigned long long) h);
+
+    it->off = at;
+    rc = put(buf, len);
+    memset(&zs, 0, sizeof(zs));
+    if ( rc == 0 && gzip_too && len > 0
+      && (gz = malloc(gzlen = compressBound(len) + 32)) != NULL
+      && deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK )
+    {
+        zs.next_in = buf;
+        zs.avail_in = len;
+        zs.next_out = gz;
+        zs.avail_out = gzlen;
+        if ( deflate(&zs, Z_FINISH) == Z_STREAM_END
+          && zs.total_out < len - len / 10 )
+        {
+            it->gzoff = at;
+            it->gzlen = zs.total_out;
+            rc = put(gz, zs.total_out);
+        }
+        deflateEnd(&zs);
+    }
+    free(gz);
+    free(buf);
+    return rc;
+}
+
+/*
+ * write len bytes at the next place, leaving it 8-aligned
+ */
+static int
+put(void *buf, uint64_t len)
+{
+    if ( len > 0 && pwrite(out, buf, len, at) != (ssize_t) len )
+        return 1;
+    at = PK_ALIGN(at + len);
+    return 0;
+}
+
+static int
+by_path(const void *a, const void *b)
+{
+    return strcmp(((struct item *) a)->path, ((struct item *) b)->path);
+}
+
+/*
+ * index of path among the sorted items, or -1
+ */
+static int
+find(char *path)
+{
+    int     lo = 0, hi = nitems - 1, mid, c;
+
+    while ( lo <= hi )
+    {
+        mid = (lo + hi) / 2;
+        if ( (c = strcmp(path, items[mid].path)) == 0 )
+            return mid;
+        if ( c < 0 )
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+/*
+ * sort, link the directories and chains, and write the tables, the
+ * strings and the header after the bytes
+ */
+static int
+write_tables()
+{
+    struct pkhead hd;
+    struct pkentry *ents = calloc(nitems, sizeof(struct pkentry));
+    uint32_t nbuckets = 1, *buckets, *children, *fill, i, b;
+    uint64_t strings;
+    char    parent[LINE_LEN], *slash, *sbuf, *sp;
+    int     p, rc = 0;
+
+    qsort(items, nitems, sizeof(struct item), by_path);
+    for ( i = 0 ; i < nitems ; i++ )
+    {
+        items[i].parent = PK_NONE;
+        if ( strcmp(items[i].path, ".") == 0 )
+            continue;
+        snprintf(parent, sizeof(parent), "%s", items[i].path);
+        if ( (slash = strrchr(parent, '/')) != NULL )
+            *slash = '\0';
+        else
+            strcpy(parent, ".");
+        if ( (p = find(parent)) != -1 )
+        {
+            items[i].parent = p;
+            items[p].nkids++;
+        }
+    }
+    for ( i = b = 0 ; i < nitems ; b += items[i++].nkids )
+        items[i].kids = b;          /* b ends as the number of kids */
+    children = calloc(b ? b : 1, sizeof(uint32_t));
+    fill = calloc(nitems, sizeof(uint32_t));
+    for ( i = 0 ; i < nitems ; i++ )    /* in path order: name order */
+        if ( (p = items[i].parent) != PK_NONE )
+            children[items[p].kids + fill[p]++] = i;
+
+    while ( nbuckets < nitems )
+        nbuckets *= 2;
+    buckets = malloc(nbuckets * sizeof(uint32_t));
+    memset(buckets, 0xff, nbuckets * sizeof(uint32_t));
+    for ( i = nitems ; i-- > 0 ; )  /* so each chain runs upward */
+    {
+        ents[i].hash = PKhash(items[i].path);
+        ents[i].next = buckets[ents[i].hash & (nbuckets - 1)];
+        buckets[ents[i].hash & (nbuckets - 1)] = i;
+    }
+
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, PK_MAGIC, sizeof(hd.magic));
+    hd.nentries = nitems;
+    hd.nbuckets = nbuckets;
+    hd.nchildren = b;
+    hd.entries = at;
+    hd.buckets = hd.entries + PK_ALIGN(nitems * sizeof(struct pkentry));
+    hd.children = hd.buckets + PK_ALIGN(nbuckets * sizeof(uint32_t));
+    strings = hd.children + PK_ALIGN(b * sizeof(uint32_t));
+
+    for ( i = 0, at = strings ; i < nitems ; i++ )
+        at += strlen(items[i].path) + strlen(items[i].type)
+            + strlen(items[i].etag) + 3;
+    sp = sbuf = malloc(at - strings);
+    for ( i = 0 ; i < nitems ; i++ )
+    {
+        ents[i].path = strings + (sp - sbuf);
+        sp = stpcpy(sp, items[i].path) + 1;
+        ents[i].type = strings + (sp - sbuf);
+        sp = stpcpy(sp, items[i].type) + 1;
+        ents[i].etag = strings + (sp - sbuf);
+        sp = stpcpy(sp, items[i].etag) + 1;
+        ents[i].dir = S_ISDIR(items[i].info.st_mode);
+        ents[i].off = items[i].off;
+        ents[i].len = items[i].info.st_size;
+        ents[i].gzoff = items[i].gzoff;
+        ents[i].gzlen = items[i].gzlen;
+        ents[i].mtime = items[i].info.st_mtime;
+        ents[i].kids = items[i].kids;
+        ents[i].nkids = items[i].nkids;
+    }
+    hd.size = at;
+
+    if ( pwrite(out, ents, nitems * sizeof(struct pkentry), hd.entries) == -1
+      || pwrite(out, buckets, nbuckets * sizeof(uint32_t), hd.buckets) == -1
+      || pwrite(out, children, b * sizeof(uint32_t), hd.children) == -1
+      || pwrite(out, sbuf, hd.size - strings, strings) == -1
+      || pwrite(out, &hd, sizeof(hd), 0) != sizeof(hd) )
+        rc = 1;
+    free(sbuf);
+    free(ents);
+    free(buckets);
+    free(children);
+    free(fill);
+    return rc;
+}
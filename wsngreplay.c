@@ -0,0 +1,520 @@
+/* wsngreplay.c
+ *
+ * replays an access log against a running wsng, to benchmark it with
+ * the traffic it really gets
+ *
+ * usage: wsng-replay [-s speed] [-c conns] [-n max] [-H host]
+ *                    [-x prefix]... log host:port [host:port]
+ *
+ * details:
+ *      Reads log, in the common log format wsng's access_log writes
+ *      (other servers' will do), and sends each GET and HEAD in it to
+ *      host:port at the time it first came in, relative to the first
+ *      one. The log gives only the second a request ended in, so the
+ *      requests that ended in one second are spread evenly over it,
+ *      and wsng's total= (the ms it took) is taken off to find when
+ *      each started. Other methods are left out, as the log does not
+ *      have their bodies.
+ *
+ *      -s runs the clock speed times as fast (1 by default; 0 sends
+ *      each as soon as a connection is free). -c is how many requests
+ *      may be out at once (16), each on a connection of its own with
+ *      "Connection: close". A request due while all of them are busy
+ *      goes when one is free and counts as late; many late ones mean
+ *      -c, not the server, set the pace. -n stops after max requests.
+ *      -H sets the Host header (the target's name by default).
+ *
+ *      The times, from connect() to the last byte, are printed per
+ *      kind of request: static, listing (a path ending in '/'), cgi
+ *      (a .cgi file), proxy (under a -x prefix) and error (the log
+ *      had 400 or more for it; those seldom reach their handler). A
+ *      request that could not connect, or got no answer in
+ *      RP_TIMEOUT seconds, is failed and left out of the times.
+ *
+ *      With a second host:port, say a new build on another port, the
+ *      same schedule is replayed against it once the first run is
+ *      done, and the change in each kind's p50 and p99 is printed,
+ *      with the requests whose status or length differ between them.
+ */
+
+#define     _GNU_SOURCE             /* strptime(), timegm() */
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <unistd.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/socket.h>
+#include    <sys/time.h>
+#include    <netinet/in.h>
+#include    "socklib.h"
+
+#define LINE_LEN    4096
+#define MAX_CONNS   1024
+#define MAX_PREFIX  16
+#define RP_TIMEOUT  10              /* seconds, for an answer   */
+#define RP_CONNECT  3000            /* ms, to connect           */
+#define RP_LATE     10              /* ms behind, and it is late */
+
+enum { K_STATIC, K_LISTING, K_CGI, K_PROXY, K_ERROR, NKINDS };
+
+struct request {
+    char        *method;
+    char        *path;
+    int         kind;
+    long        at;                 /* us after the first one   */
+    long        sec;                /* from the log: ended then */
+    long        ms;                 /* from the log: took that  */
+};
+
+struct result {
+    long        us;                 /* -1: failed               */
+    int         status;
+    long        bytes;
+};
+
+struct target {
+    char                *name;
+    struct sockaddr_in  addr;
+    struct result       *res;
+    double              secs;       /* the run took             */
+    int                 late;
+};
+
+static char     *kinds[NKINDS] = { "static", "listing", "cgi", "proxy",
+                                   "error" };
+static struct request *rqs;
+static int      nrqs, maxrqs;
+static char     *prefix[MAX_PREFIX];
+static int      nprefix;
+static double   speed = 1;
+static char     *host;
+static struct target *cur;          /* the run going on         */
+static int      next;               /* the next request to send */
+static struct timespec t0;
+
+static void     read_log(char *, int);
+static int      parse(char *, struct request *);
+static int      kind_of(char *, int);
+static void     schedule(void);
+static int      target(char *, struct target *);
+static void     run(struct target *, int);
+static void     *sender(void *);
+static void     fetch(struct request *, struct result *);
+static void     report(struct target *);
+static long     pct(struct target *, int, double);
+static void     compare(struct target *, struct target *);
+static int      by_at(const void *, const void *);
+static int      by_long(const void *, const void *);
+static long     since(struct timespec *);
+
+int
+main(int ac, char *av[])
+{
+    struct target t[2];
+    int     c, conns = 16, max = 0, i, ntargets;
+
+    while ( (c = getopt(ac, av, "s:c:n:H:x:")) != -1 )
+        switch ( c )
+        {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'n':
+            max = atoi(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'x':
+            if ( nprefix < MAX_PREFIX )
+                prefix[nprefix++] = optarg;
+            break;
+        default:
+            conns = 0;
+        }
+    ntargets = ac - optind - 1;
+    if ( conns < 1 || conns > MAX_CONNS || speed < 0
+      || ntargets < 1 || ntargets > 2 )
+    {
+        fprintf(stderr, "usage: %s [-s speed] [-c conns] [-n max] [-H host] "
+                "[-x prefix]... log host:port [host:port]\n", av[0]);
+        return 1;
+    }
+    for ( i = 0 ; i < ntargets ; i++ )
+        if ( target(av[optind + 1 + i], &t[i]) != 0 )
+            return 1;
+    read_log(av[optind], max);
+    if ( nrqs == 0 )
+    {
+        fprintf(stderr, "%s: no GET or HEAD requests\n", av[optind]);
+        return 1;
+    }
+    schedule();
+    printf("%d requests over %.1f s of log; %s, %d connections\n", nrqs,
+           rqs[nrqs - 1].at / 1e6, speed > 0 ? "timed" : "flat out", conns);
+    if ( speed > 0 && speed != 1 )
+        printf("clock runs %gx\n", speed);
+
+    for ( i = 0 ; i < ntargets ; i++ )
+    {
+        run(&t[i], conns);
+        report(&t[i]);
+    }
+    if ( ntargets == 2 )
+        compare(&t[0], &t[1]);
+    return 0;
+}
+
+/*
+ * the GETs and HEADs in file, up to max of them (0: all)
+ */
+static void
+read_log(char *file, int max)
+{
+    FILE    *fp = fopen(file, "r");
+    char    line[LINE_LEN];
+    struct request r;
+
+    if ( fp == NULL )
+    {
+        perror(file);
+        exit(1);
+    }
+    while ( fgets(line, sizeof(line), fp) != NULL && (max == 0 || nrqs < max) )
+    {
+        if ( parse(line, &r) != 0 )
+            continue;
+        if ( nrqs == maxrqs )
+        {
+            maxrqs = maxrqs ? maxrqs * 2 : 1024;
+            if ( (rqs = realloc(rqs, maxrqs * sizeof(struct request))) == NULL )
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        rqs[nrqs++] = r;
+    }
+    fclose(fp);
+}
+
+/*
+ * one log line:
+ *   addr ident user [10/Oct/2026:13:55:36 +0000] "GET /x HTTP/1.1" 200 5 ...
+ * 0 and r filled in, or -1 if it is not a request we can send
+ */
+static int
+parse(char *line, struct request *r)
+{
+    char    date[64], method[16], path[LINE_LEN], *q, *rest, *tot;
+    struct tm tm;
+    int     zone, status = 0;
+
+    if ( sscanf(line, "%*s %*s %*s [%63[^]]] \"%15s %4095s", date, method,
+                path) != 3 )
+        return -1;
+    if ( strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 )
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if ( (rest = strptime(date, "%d/%b/%Y:%H:%M:%S", &tm)) == NULL )
+        return -1;
+    if ( sscanf(rest, "%d", &zone) != 1 )
+        zone = 0;
+    if ( (q = strchr(strchr(line, '"') + 1, '"')) != NULL )
+        sscanf(q + 1, "%d", &status);
+    tot = strstr(line, " total=");
+
+    r->method = strdup(method);
+    r->path = strdup(path);
+    r->kind = kind_of(path, status);
+    r->sec = timegm(&tm) - (zone / 100 * 3600 + zone % 100 * 60);
+    r->ms = tot ? atol(tot + 7) : 0;
+    return 0;
+}
+
+/*
+ * which kind of handler the path would go to
+ */
+static int
+kind_of(char *path, int status)
+{
+    char    *end = strchr(path, '?');
+    int     len = end ? end - path : (int) strlen(path), i;
+
+    if ( status >= 400 )
+        return K_ERROR;
+    for ( i = 0 ; i < nprefix ; i++ )
+        if ( strncmp(path, prefix[i], strlen(prefix[i])) == 0 )
+            return K_PROXY;
+    if ( len > 0 && path[len - 1] == '/' )
+        return K_LISTING;
+    if ( len > 4 && strncasecmp(path + len - 4, ".cgi", 4) == 0 )
+        return K_CGI;
+    return K_STATIC;
+}
+
+/*
+ * when each request starts: spread the ones that ended in the same
+ * second over it, take off the time each took, and sort
+ */
+static void
+schedule()
+{
+    long    first = rqs[0].sec;
+    int     i, j, k;
+
+    for ( i = 0 ; i < nrqs ; i = j )
+    {
+        for ( j = i ; j < nrqs && rqs[j].sec == rqs[i].sec ; j++ )
+            ;
+        for ( k = i ; k < j ; k++ )
+            rqs[k].at = (rqs[k].sec - first) * 1000000
+                        + (k - i) * 1000000L / (j - i) - rqs[k].ms * 1000;
+    }
+    qsort(rqs, nrqs, sizeof(struct request), by_at);
+    for ( i = nrqs - 1 ; i >= 0 ; i-- )
+        rqs[i].at -= rqs[0].at;
+}
+
+/*
+ * host:port into t
+ */
+static int
+target(char *arg, struct target *t)
+{
+    char    name[256];
+    int     port;
+
+    memset(t, 0, sizeof(struct target));
+    t->name = arg;
+    if ( sscanf(arg, "%255[^:]:%d", name, &port) != 2
+      || resolve_server(name, port, &t->addr) != 0 )
+    {
+        fprintf(stderr, "%s: not a host:port we can find\n", arg);
+        return -1;
+    }
+    if ( host == NULL )
+        host = strdup(name);
+    return 0;
+}
+
+/*
+ * replay every request against t, conns at a time
+ */
+static void
+run(struct target *t, int conns)
+{
+    pthread_t tids[MAX_CONNS];
+    int     i;
+
+    if ( (t->res = calloc(nrqs, sizeof(struct result))) == NULL )
+    {
+        perror("calloc");
+        exit(1);
+    }
+    cur = t;
+    next = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0 ; i < conns ; i++ )
+        if ( pthread_create(&tids[i], NULL, sender, NULL) != 0 )
+            break;
+    conns = i;
+    for ( i = 0 ; i < conns ; i++ )
+        pthread_join(tids[i], NULL);
+    t->secs = since(&t0) / 1e6;
+}
+
+/*
+ * one connection's worth: take the next request, wait for its time,
+ * send it
+ */
+static void *
+sender(void *arg)
+{
+    struct timespec due;
+    long    us;
+    int     i;
+
+    while ( (i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < nrqs )
+    {
+        if ( speed > 0 )
+        {
+            us = rqs[i].at / speed;
+            due.tv_sec = t0.tv_sec + us / 1000000;
+            due.tv_nsec = t0.tv_nsec + us % 1000000 * 1000;
+            if ( due.tv_nsec >= 1000000000 )
+            {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+            while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+                    != 0 )
+                ;
+            if ( since(&due) > RP_LATE * 1000 )
+                __atomic_add_fetch(&cur->late, 1, __ATOMIC_RELAXED);
+        }
+        fetch(&rqs[i], &cur->res[i]);
+    }
+    return arg;
+}
+
+/*
+ * send r and read the answer to the end
+ */
+static void
+fetch(struct request *r, struct result *res)
+{
+    struct timeval tv = { RP_TIMEOUT, 0 };
+    struct timespec start;
+    char    buf[65536];
+    int     fd, n, len;
+
+    res->us = -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( (fd = connect_to_addr(&cur->addr, RP_CONNECT)) == -1 )
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    len = snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                   "User-Agent: wsng-replay\r\nConnection: close\r\n\r\n",
+                   r->method, r->path, host);
+    if ( len >= (int) sizeof(buf) || write(fd, buf, len) != len )
+    {
+        close(fd);
+        return;
+    }
+    while ( (n = read(fd, buf, sizeof(buf))) > 0 )
+    {
+        if ( res->bytes == 0 && n >= 12 && strncmp(buf, "HTTP/", 5) == 0 )
+            res->status = atoi(buf + 9);
+        res->bytes += n;
+    }
+    close(fd);
+    if ( n == 0 && res->status != 0 )
+        res->us = since(&start);
+}
+
+/*
+ * t's times, by kind, in ms
+ */
+static void
+report(struct target *t)
+{
+    long    sum[NKINDS] = { 0 };
+    int     n[NKINDS] = { 0 }, failed = 0, i, k;
+
+    for ( i = 0 ; i < nrqs ; i++ )
+        if ( t->res[i].us < 0 )
+            failed++;
+        else
+        {
+            n[rqs[i].kind]++;
+            sum[rqs[i].kind] += t->res[i].us;
+        }
+    printf("\n%s: %d requests in %.2f s (%.1f/s), %d failed, %d late\n",
+           t->name, nrqs, t->secs, nrqs / t->secs, failed, t->late);
+    printf("%-8s %7s %9s %9s %9s %9s %9s  (ms)\n", "kind", "n", "mean", "p50",
+           "p90", "p99", "max");
+    for ( k = 0 ; k < NKINDS ; k++ )
+        if ( n[k] > 0 )
+            printf("%-8s %7d %9.3f %9.3f %9.3f %9.3f %9.3f\n", kinds[k], n[k],
+                   sum[k] / 1e3 / n[k], pct(t, k, .5) / 1e3,
+                   pct(t, k, .9) / 1e3, pct(t, k, .99) / 1e3,
+                   pct(t, k, 1) / 1e3);
+}
+
+/*
+ * the p'th fraction of t's times for kind, in us, by nearest rank:
+ * the smallest time at least p of them are no more than; -1 if none
+ */
+static long
+pct(struct target *t, int kind, double p)
+{
+    long    *v = malloc(nrqs * sizeof(long)), x = -1;
+    int     i, n = 0, rank;
+
+    if ( v == NULL )
+        return -1;
+    for ( i = 0 ; i < nrqs ; i++ )
+        if ( rqs[i].kind == kind && t->res[i].us >= 0 )
+            v[n++] = t->res[i].us;
+    if ( n > 0 )
+    {
+        qsort(v, n, sizeof(long), by_long);
+        rank = (int) (n * p);
+        if ( rank < n * p )         /* rounded up: ceil(n * p) */
+            rank++;
+        x = v[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+    }
+    free(v);
+    return x;
+}
+
+/*
+ * how b did against a
+ */
+static void
+compare(struct target *a, struct target *b)
+{
+    long    x, y;
+    int     k, i, status = 0, bytes = 0;
+
+    printf("\n%s against %s:\n", b->name, a->name);
+    printf("%-8s %9s %9s\n", "kind", "p50", "p99");
+    for ( k = 0 ; k < NKINDS ; k++ )
+    {
+        if ( (x = pct(a, k, .5)) <= 0 || (y = pct(b, k, .5)) < 0 )
+            continue;
+        printf("%-8s %+8.1f%%", kinds[k], (y - x) * 100.0 / x);
+        x = pct(a, k, .99);
+        y = pct(b, k, .99);
+        printf(" %+8.1f%%\n", x > 0 ? (y - x) * 100.0 / x : 0);
+    }
+    for ( i = 0 ; i < nrqs ; i++ )
+    {
+        if ( a->res[i].status != b->res[i].status )
+        {
+            if ( status++ < 5 )
+                printf("  %s %s: %d, then %d\n", rqs[i].method, rqs[i].path,
+                       a->res[i].status, b->res[i].status);
+        }
+        else if ( a->res[i].bytes != b->res[i].bytes )
+            bytes++;
+    }
+    printf("status differs on %d requests, length on %d more\n", status,
+           bytes);
+}
+
+static int
+by_at(const void *a, const void *b)
+{
+    long    x = ((struct request *) a)->at, y = ((struct request *) b)->at;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+by_long(const void *a, const void *b)
+{
+    long    x = *(long *) a, y = *(long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * microseconds since *t
+ */
+static long
+since(struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000000L
+           + (now.tv_nsec - t->tv_nsec) / 1000;
+}